@@ -0,0 +1,351 @@
+/*
+ * API load generation harness. Drives a configurable command mix at a
+ * configurable concurrency against a running cgminer API and reports
+ * response latency percentiles, so the number of concurrent pollers a
+ * rig can sustain before the API perturbs mining can be measured. A low
+ * rate probe samples the miner's reported 5s hashrate throughout the
+ * run, so driving a sim-driver workload (e.g. make bench-e2e in another
+ * terminal) shows the mining impact directly alongside the latencies.
+ *
+ * Builds on api-example.c's protocol handling but is unix only - it is
+ * a farm sizing tool, not a user utility.
+ *
+ * Usage: api-bench [-c threads] [-t secs] [-m mix] [host [port]]
+ *   -m takes a weighted mix like "summary:5,devs:3,stats:1"
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#define RECVSIZE 65500
+#define MAX_MIX 16
+#define MAX_THREADS 256
+/* Latency samples kept per thread - plenty for percentile resolution */
+#define MAX_SAMPLES 65536
+
+static char *host = "127.0.0.1";
+static short int port = 4028;
+static int threads = 4;
+static int duration = 10;
+
+static struct mix_entry {
+	char *command;
+	int weight;
+} mix[MAX_MIX];
+static int mix_count;
+static int mix_total_weight;
+
+static volatile bool bench_stop;
+
+struct bench_thread {
+	pthread_t pth;
+	int id;
+	double *samples;
+	int nsamples;
+	long requests;
+	long errors;
+};
+
+/* Hashrate probe results, MHS as reported by summary */
+static double probe_first = -1, probe_last, probe_min;
+static int probe_count;
+
+static double elapsed_ms(struct timeval *start, struct timeval *finish)
+{
+	return (finish->tv_sec - start->tv_sec) * 1000.0 +
+	       (finish->tv_usec - start->tv_usec) / 1000.0;
+}
+
+/* Send one command and read the complete reply. Returns the reply length
+ * or -1 on any failure. The reply is left in buf if it is not NULL. */
+static int callapi(const char *command, char *buf, int bufsiz)
+{
+	char discard[4096];
+	struct sockaddr_in serv;
+	struct hostent *ip;
+	int sock, n, p = 0;
+
+	ip = gethostbyname(host);
+	if (!ip)
+		return -1;
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -1;
+
+	memset(&serv, 0, sizeof(serv));
+	serv.sin_family = AF_INET;
+	serv.sin_addr = *((struct in_addr *)ip->h_addr);
+	serv.sin_port = htons(port);
+
+	if (connect(sock, (struct sockaddr *)&serv, sizeof(struct sockaddr)) < 0) {
+		close(sock);
+		return -1;
+	}
+	if (send(sock, command, strlen(command), 0) < 0) {
+		close(sock);
+		return -1;
+	}
+	while (42) {
+		if (buf && p < bufsiz - 1)
+			n = recv(sock, buf + p, bufsiz - 1 - p, 0);
+		else
+			n = recv(sock, discard, sizeof(discard), 0);
+		if (n < 0) {
+			close(sock);
+			return -1;
+		}
+		if (n == 0)
+			break;
+		p += n;
+	}
+	if (buf)
+		buf[p < bufsiz ? p : bufsiz - 1] = '\0';
+	close(sock);
+	return p;
+}
+
+static const char *pick_command(unsigned int *seed)
+{
+	int r, i;
+
+	if (mix_count == 1)
+		return mix[0].command;
+	r = rand_r(seed) % mix_total_weight;
+	for (i = 0; i < mix_count; i++) {
+		r -= mix[i].weight;
+		if (r < 0)
+			break;
+	}
+	return mix[i].command;
+}
+
+static void *bench_thread(void *arg)
+{
+	struct bench_thread *bt = arg;
+	unsigned int seed = bt->id * 2654435761U + 1;
+	struct timeval tv_start, tv_finish;
+
+	while (!bench_stop) {
+		const char *command = pick_command(&seed);
+
+		gettimeofday(&tv_start, NULL);
+		if (callapi(command, NULL, 0) < 0) {
+			bt->errors++;
+			continue;
+		}
+		gettimeofday(&tv_finish, NULL);
+		bt->requests++;
+		if (bt->nsamples < MAX_SAMPLES)
+			bt->samples[bt->nsamples++] = elapsed_ms(&tv_start, &tv_finish);
+	}
+	return NULL;
+}
+
+/* Sample the miner's reported 5s hashrate once a second so the impact of
+ * the load on a simultaneously mining instance shows up in the report */
+static void *probe_thread(__attribute__((unused)) void *arg)
+{
+	char buf[RECVSIZE + 1];
+	char *mhs;
+
+	while (!bench_stop) {
+		if (callapi("summary", buf, sizeof(buf)) > 0 &&
+		    (mhs = strstr(buf, "MHS 5s="))) {
+			double val = atof(mhs + 7);
+
+			if (probe_first < 0)
+				probe_first = probe_min = val;
+			else if (val < probe_min)
+				probe_min = val;
+			probe_last = val;
+			probe_count++;
+		}
+		sleep(1);
+	}
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+static double percentile(double *samples, int n, double pct)
+{
+	int i = (int)(pct / 100.0 * n);
+
+	if (i >= n)
+		i = n - 1;
+	return samples[i];
+}
+
+static void parse_mix(char *arg)
+{
+	char *entry, *saveptr = NULL, *colon;
+
+	for (entry = strtok_r(arg, ",", &saveptr); entry;
+	     entry = strtok_r(NULL, ",", &saveptr)) {
+		if (mix_count == MAX_MIX) {
+			fprintf(stderr, "Too many mix entries (max %d)\n", MAX_MIX);
+			exit(1);
+		}
+		colon = strchr(entry, ':');
+		if (colon) {
+			*(colon++) = '\0';
+			mix[mix_count].weight = atoi(colon);
+		} else
+			mix[mix_count].weight = 1;
+		if (mix[mix_count].weight < 1) {
+			fprintf(stderr, "Invalid weight for command %s\n", entry);
+			exit(1);
+		}
+		mix[mix_count].command = entry;
+		mix_total_weight += mix[mix_count].weight;
+		mix_count++;
+	}
+	if (!mix_count) {
+		fprintf(stderr, "Empty command mix\n");
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_thread *bts;
+	double *all, total_ms = 0;
+	long requests = 0, errors = 0;
+	struct timeval tv_start, tv_finish;
+	pthread_t probe_pth;
+	int i, c, nall = 0;
+
+	while ((c = getopt(argc, argv, "c:t:m:h")) != -1) {
+		switch (c) {
+		case 'c':
+			threads = atoi(optarg);
+			if (threads < 1 || threads > MAX_THREADS) {
+				fprintf(stderr, "Threads must be 1-%d\n", MAX_THREADS);
+				return 1;
+			}
+			break;
+		case 't':
+			duration = atoi(optarg);
+			if (duration < 1) {
+				fprintf(stderr, "Duration must be at least 1s\n");
+				return 1;
+			}
+			break;
+		case 'm':
+			parse_mix(optarg);
+			break;
+		case 'h':
+		default:
+			fprintf(stderr, "Usage: %s [-c threads] [-t secs] [-m cmd:weight,...] [host [port]]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc)
+		host = argv[optind++];
+	if (optind < argc)
+		port = atoi(argv[optind]);
+
+	if (!mix_count) {
+		mix[0].command = "summary";
+		mix[0].weight = mix_total_weight = 1;
+		mix_count = 1;
+	}
+
+	/* Fail early and clearly if no API is listening */
+	if (callapi("summary", NULL, 0) < 0) {
+		fprintf(stderr, "No API reply from %s:%d - is cgminer running with --api-listen?\n",
+			host, (int)port);
+		return 1;
+	}
+
+	printf("Driving %s:%d with %d threads for %ds, mix:", host, (int)port,
+	       threads, duration);
+	for (i = 0; i < mix_count; i++)
+		printf(" %s:%d", mix[i].command, mix[i].weight);
+	printf("\n");
+
+	bts = calloc(threads, sizeof(*bts));
+	if (!bts) {
+		fprintf(stderr, "Failed to calloc threads\n");
+		return 1;
+	}
+	for (i = 0; i < threads; i++) {
+		bts[i].id = i;
+		bts[i].samples = malloc(MAX_SAMPLES * sizeof(double));
+		if (!bts[i].samples) {
+			fprintf(stderr, "Failed to malloc samples\n");
+			return 1;
+		}
+	}
+
+	gettimeofday(&tv_start, NULL);
+	pthread_create(&probe_pth, NULL, probe_thread, NULL);
+	for (i = 0; i < threads; i++)
+		pthread_create(&bts[i].pth, NULL, bench_thread, &bts[i]);
+
+	sleep(duration);
+	bench_stop = true;
+
+	for (i = 0; i < threads; i++)
+		pthread_join(bts[i].pth, NULL);
+	pthread_join(probe_pth, NULL);
+	gettimeofday(&tv_finish, NULL);
+	total_ms = elapsed_ms(&tv_start, &tv_finish);
+
+	for (i = 0; i < threads; i++) {
+		requests += bts[i].requests;
+		errors += bts[i].errors;
+		nall += bts[i].nsamples;
+	}
+	if (!nall) {
+		fprintf(stderr, "No successful requests (%ld errors)\n", errors);
+		return 1;
+	}
+	all = malloc(nall * sizeof(double));
+	if (!all) {
+		fprintf(stderr, "Failed to malloc samples\n");
+		return 1;
+	}
+	nall = 0;
+	for (i = 0; i < threads; i++) {
+		memcpy(all + nall, bts[i].samples, bts[i].nsamples * sizeof(double));
+		nall += bts[i].nsamples;
+	}
+	qsort(all, nall, sizeof(double), cmp_double);
+
+	printf("\n%ld requests in %.1fs (%.0f req/s), %ld errors\n",
+	       requests, total_ms / 1000.0, requests / (total_ms / 1000.0), errors);
+	printf("Latency ms: min %.2f  p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n",
+	       all[0], percentile(all, nall, 50), percentile(all, nall, 90),
+	       percentile(all, nall, 99), all[nall - 1]);
+	if (probe_count) {
+		printf("Miner MHS 5s: first %.2f  min %.2f  last %.2f (%d probes)\n",
+		       probe_first, probe_min, probe_last, probe_count);
+	} else
+		printf("Miner hashrate probe got no summary replies\n");
+
+	return 0;
+}
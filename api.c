@@ -21,10 +21,20 @@
 #include <limits.h>
 #include <sys/types.h>
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#endif
+
 #include "compat.h"
 #include "miner.h"
 #include "util.h"
 
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
 #if defined(USE_BFLSC) || defined(USE_AVALON) || defined(USE_HASHFAST) || defined(USE_BITFURY) || defined(USE_KLONDIKE) || defined(USE_KNC) || defined(USE_BAB) || defined(USE_DRILLBIT)
 #define HAVE_AN_ASIC 1
 #endif
@@ -234,8 +244,18 @@ static const char *OSINFO =
 #define _DEBUGSET	"DEBUG"
 #define _SETCONFIG	"SETCONFIG"
 #define _USBSTATS	"USBSTATS"
+#define _POOLLAT	"POOLLAT"
+#define _EVENTLOG	"EVENTLOG"
+#define _HISTORY	"HISTORY"
+#define _MEMSTATS	"MEMSTATS"
+#define _CHIPSTATS	"CHIPSTATS"
 
 static const char ISJSON = '{';
+// Leading byte requesting the compact binary reply format
+static const char ISBIN = '\x01';
+// Binary reply record tags
+#define BIN_TAG_TEXT	0x01
+#define BIN_TAG_FIELDS	0x02
 #define JSON0		"{"
 #define JSON1		"\""
 #define JSON2		"\":["
@@ -274,11 +294,19 @@ static const char ISJSON = '{';
 #define JSON_DEBUGSET	JSON1 _DEBUGSET JSON2
 #define JSON_SETCONFIG	JSON1 _SETCONFIG JSON2
 #define JSON_USBSTATS	JSON1 _USBSTATS JSON2
+#define JSON_POOLLAT	JSON1 _POOLLAT JSON2
+#define JSON_EVENTLOG	JSON1 _EVENTLOG JSON2
+#define JSON_HISTORY	JSON1 _HISTORY JSON2
+#define JSON_MEMSTATS	JSON1 _MEMSTATS JSON2
+#define JSON_CHIPSTATS	JSON1 _CHIPSTATS JSON2
 #define JSON_END	JSON4 JSON5
 #define JSON_END_TRUNCATED	JSON4_TRUNCATED JSON5
 
 static const char *JSON_COMMAND = "command";
 static const char *JSON_PARAMETER = "parameter";
+#ifdef HAVE_LIBZ
+static const char *JSON_ZLIB = "zlib";
+#endif
 
 #define MSG_POOL 7
 #define MSG_NOPOOL 8
@@ -400,6 +428,14 @@ static const char *JSON_PARAMETER = "parameter";
 #define MSG_SETQUOTA 122
 #define MSG_LOCKOK 123
 #define MSG_LOCKDIS 124
+#define MSG_POOLLAT 125
+#define MSG_SUB 126
+#define MSG_NOSUB 127
+#define MSG_EVENTLOG 128
+#define MSG_HISTORY 129
+#define MSG_MEMSTATS 130
+#define MSG_CHIPSTATS 131
+#define MSG_NOCHIPS 132
 
 enum code_severity {
 	SEVERITY_ERR,
@@ -567,6 +603,14 @@ struct CODES {
 #endif
  { SEVERITY_SUCC,  MSG_LOCKOK,	PARAM_NONE,	"Lock stats created" },
  { SEVERITY_WARN,  MSG_LOCKDIS,	PARAM_NONE,	"Lock stats not enabled" },
+ { SEVERITY_SUCC,  MSG_POOLLAT,	PARAM_PMAX,	"%d Pool(s)" },
+ { SEVERITY_SUCC,  MSG_SUB,	PARAM_NONE,	"Subscribed to event stream" },
+ { SEVERITY_ERR,   MSG_NOSUB,	PARAM_NONE,	"Event subscription not available" },
+ { SEVERITY_SUCC,  MSG_EVENTLOG, PARAM_NONE,	"Event log" },
+ { SEVERITY_SUCC,  MSG_HISTORY,	PARAM_NONE,	"History" },
+ { SEVERITY_SUCC,  MSG_MEMSTATS, PARAM_NONE,	"Memory stats" },
+ { SEVERITY_SUCC,  MSG_CHIPSTATS, PARAM_NONE,	"Chip stats" },
+ { SEVERITY_ERR,   MSG_NOCHIPS,	PARAM_NONE,	"No devices with per chip stats" },
  { SEVERITY_FAIL, 0, 0, NULL }
 };
 
@@ -597,22 +641,37 @@ struct IP4ACCESS {
 #define VALIDGROUP(g) (GROUP(g) >= GROUP('A') && GROUP(g) <= GROUP('Z'))
 #define COMMANDS(g) (apigroups[GROUPOFFSET(g)].commands)
 #define DEFINEDGROUP(g) (ISPRIVGROUP(g) || COMMANDS(g) != NULL)
+#define CMDALLOWED(g, i) (apigroups[GROUPOFFSET(g)].allowed != NULL && apigroups[GROUPOFFSET(g)].allowed[i])
 
 struct APIGROUPS {
 	// This becomes a string like: "|cmd1|cmd2|cmd3|" so it's quick to search
 	char *commands;
+	// and this one bool per cmds[] entry so dispatch needn't search at all
+	bool *allowed;
 } apigroups['Z' - 'A' + 1]; // only A=0 to Z=25 (R: noprivs, W: allprivs)
 
 static struct IP4ACCESS *ipaccess = NULL;
 static int ips = 0;
 
+/* The rules that can match each first octet, in rule order, so a lookup
+ * only walks the (usually one entry) slice of the list that could apply
+ * instead of every rule */
+static int *ipaccess_idx[256];
+static int ipaccess_cnt[256];
+
 struct io_data {
 	size_t siz;
+	// the size the buffer started at, shrunk back to in lowmem mode
+	size_t initsiz;
 	char *ptr;
 	char *cur;
 	bool sock;
 	bool full;
 	bool close;
+	// reply in the compact binary format rather than text/JSON
+	bool bin;
+	// compress the reply before sending it
+	bool zlib;
 };
 
 struct io_list {
@@ -624,10 +683,23 @@ struct io_list {
 static struct io_list *io_head = NULL;
 
 #define io_new(init) _io_new(init, false)
-#define sock_io_new() _io_new(SOCKBUFSIZ, true)
+// Socket reply buffers are sized once for the full reply plus one record of
+// overrun room so building a reply never reallocs - see print_data()
+#define sock_io_new() _io_new(SOCKBUFSIZ + TMPBUFSIZ, true)
 
 static void io_reinit(struct io_data *io_data)
 {
+	// in lowmem mode hand back growth from a burst reply
+	if (opt_lowmem && io_data->siz > io_data->initsiz) {
+		char *p = realloc(io_data->ptr, io_data->initsiz);
+
+		if (p) {
+			mem_account(MEM_APIIO, (int64_t)io_data->initsiz -
+				    (int64_t)io_data->siz);
+			io_data->ptr = p;
+			io_data->siz = io_data->initsiz;
+		}
+	}
 	io_data->cur = io_data->ptr;
 	*(io_data->ptr) = '\0';
 	io_data->full = false;
@@ -641,8 +713,12 @@ static struct io_data *_io_new(size_t initial, bool socket_buf)
 
 	io_data = malloc(sizeof(*io_data));
 	io_data->ptr = malloc(initial);
+	mem_account(MEM_APIIO, sizeof(*io_data) + initial);
 	io_data->siz = initial;
+	io_data->initsiz = initial;
 	io_data->sock = socket_buf;
+	io_data->bin = false;
+	io_data->zlib = false;
 	io_reinit(io_data);
 
 	io_list = malloc(sizeof(*io_list));
@@ -663,39 +739,123 @@ static struct io_data *_io_new(size_t initial, bool socket_buf)
 	return io_data;
 }
 
-static bool io_add(struct io_data *io_data, char *buf)
+// Ensure at least len bytes are free after the append cursor
+static void io_reserve(struct io_data *io_data, size_t len)
 {
-	size_t len, dif, tot;
+	size_t dif = io_data->cur - io_data->ptr;
+
+	if (dif + len > io_data->siz) {
+		size_t new = io_data->siz * 2;
+
+		if (new < dif + len)
+			new = (dif + len) * 2;
+
+		io_data->ptr = realloc(io_data->ptr, new);
+		io_data->cur = io_data->ptr + dif;
+		mem_account(MEM_APIIO, (int64_t)new - (int64_t)io_data->siz);
+		io_data->siz = new;
+	}
+}
+
+// Append len raw bytes - may include NULs for the binary reply format
+static bool io_add_bin(struct io_data *io_data, const void *data, size_t len)
+{
+	size_t dif, tot;
 
 	if (io_data->full)
 		return false;
 
-	len = strlen(buf);
 	dif = io_data->cur - io_data->ptr;
 	tot = len + 1 + dif;
 
-	if (tot > io_data->siz) {
-		size_t new = io_data->siz * 2;
+	if (io_data->sock && tot > SOCKBUFSIZ) {
+		io_data->full = true;
+		return false;
+	}
 
-		if (new < tot)
-			new = tot * 2;
+	io_reserve(io_data, len + 1);
 
-		if (io_data->sock) {
-			if (new > SOCKBUFSIZ) {
-				if (tot > SOCKBUFSIZ) {
-					io_data->full = true;
-					return false;
-				}
+	memcpy(io_data->cur, data, len);
+	io_data->cur += len;
+	*(io_data->cur) = '\0';
 
-				new = SOCKBUFSIZ;
-			}
-		}
+	return true;
+}
 
-		io_data->ptr = realloc(io_data->ptr, new);
-		io_data->cur = io_data->ptr + dif;
-		io_data->siz = new;
+// Little endian scalar encoders for the binary reply format
+static char *bin_u16(char *p, uint16_t v)
+{
+	*(p++) = v & 0xff;
+	*(p++) = (v >> 8) & 0xff;
+	return p;
+}
+
+static char *bin_u32(char *p, uint32_t v)
+{
+	p = bin_u16(p, v & 0xffff);
+	return bin_u16(p, v >> 16);
+}
+
+static char *bin_u64(char *p, uint64_t v)
+{
+	p = bin_u32(p, v & 0xffffffff);
+	return bin_u32(p, v >> 32);
+}
+
+static char *bin_f64(char *p, double v)
+{
+	uint64_t u;
+
+	memcpy(&u, &v, sizeof(u));
+	return bin_u64(p, u);
+}
+
+static char *bin_f32(char *p, float v)
+{
+	uint32_t u;
+
+	memcpy(&u, &v, sizeof(u));
+	return bin_u32(p, u);
+}
+
+// In binary mode the text framing the handlers io_add() between records is
+// carried as a length prefixed text record so the stream stays parseable
+static bool io_add_text_record(struct io_data *io_data, char *buf)
+{
+	char head[3];
+	size_t len = strlen(buf);
+
+	if (len > 0xffff)
+		len = 0xffff;
+
+	head[0] = BIN_TAG_TEXT;
+	bin_u16(head + 1, len);
+	if (!io_add_bin(io_data, head, sizeof(head)))
+		return false;
+	return io_add_bin(io_data, buf, len);
+}
+
+static bool io_add(struct io_data *io_data, char *buf)
+{
+	size_t len, dif, tot;
+
+	if (io_data->bin)
+		return io_add_text_record(io_data, buf);
+
+	if (io_data->full)
+		return false;
+
+	len = strlen(buf);
+	dif = io_data->cur - io_data->ptr;
+	tot = len + 1 + dif;
+
+	if (io_data->sock && tot > SOCKBUFSIZ) {
+		io_data->full = true;
+		return false;
 	}
 
+	io_reserve(io_data, len + 1);
+
 	memcpy(io_data->cur, buf, len + 1);
 	io_data->cur += len;
 
@@ -722,6 +882,8 @@ static void io_free()
 		do {
 			io_next = io_list->next;
 
+			mem_account(MEM_APIIO, -(int64_t)(sizeof(*(io_list->io_data)) +
+				    io_list->io_data->siz));
 			free(io_list->io_data->ptr);
 			free(io_list->io_data);
 			free(io_list);
@@ -733,68 +895,210 @@ static void io_free()
 	}
 }
 
+/* 16 byte stride scan for bytes that need escaping, written with the GCC
+ * vector extensions so the same code compiles to SSE2 on x86 and NEON on
+ * ARM without separate kernels per instruction set */
+typedef char v16qi __attribute__((vector_size(16)));
+
+#define V16_SPLAT(c) ((v16qi){c, c, c, c, c, c, c, c, c, c, c, c, c, c, c, c})
+
+static inline bool v16_has_escape(const char *p, bool isjson)
+{
+	uint64_t lo, hi;
+	v16qi v, m;
+
+	memcpy(&v, p, 16);
+	m = (v == V16_SPLAT('\\'));
+	if (isjson)
+		m |= (v == V16_SPLAT('"'));
+	else
+		m |= (v == V16_SPLAT(',')) | (v == V16_SPLAT('|')) | (v == V16_SPLAT('='));
+	memcpy(&lo, &m, 8);
+	memcpy(&hi, (char *)&m + 8, 8);
+	return (lo | hi) != 0;
+}
+
+static inline bool escape_char(char c, bool isjson)
+{
+	if (c == '\\')
+		return true;
+	if (isjson)
+		return c == '"';
+	return c == ',' || c == '|' || c == '=';
+}
+
 // This is only called when expected to be needed (rarely)
 // i.e. strings outside of the codes control (input from the user)
 static char *escape_string(char *str, bool isjson)
 {
+	size_t len, i, n;
 	char *buf, *ptr;
 	int count;
 
+	len = strlen(str);
+
+	/* Scan in 16 byte strides, only dropping to per character work for
+	 * strides that contain something to escape. Almost every field is
+	 * clean so most calls never leave the stride loop. */
 	count = 0;
-	for (ptr = str; *ptr; ptr++) {
-		switch (*ptr) {
-			case ',':
-			case '|':
-			case '=':
-				if (!isjson)
-					count++;
-				break;
-			case '"':
-				if (isjson)
-					count++;
-				break;
-			case '\\':
-				count++;
-				break;
-		}
+	for (i = 0; i + 16 <= len; i += 16) {
+		if (!v16_has_escape(str + i, isjson))
+			continue;
+		for (n = i; n < i + 16; n++)
+			count += escape_char(str[n], isjson);
 	}
+	for (; i < len; i++)
+		count += escape_char(str[i], isjson);
 
 	if (count == 0)
 		return str;
 
-	buf = malloc(strlen(str) + count + 1);
+	buf = malloc(len + count + 1);
 	if (unlikely(!buf))
 		quit(1, "Failed to malloc escape buf");
 
 	ptr = buf;
-	while (*str)
-		switch (*str) {
-			case ',':
-			case '|':
-			case '=':
-				if (!isjson)
-					*(ptr++) = '\\';
-				*(ptr++) = *(str++);
-				break;
-			case '"':
-				if (isjson)
-					*(ptr++) = '\\';
-				*(ptr++) = *(str++);
-				break;
-			case '\\':
+	for (i = 0; i + 16 <= len; i += 16) {
+		if (!v16_has_escape(str + i, isjson)) {
+			/* Clean span copies straight through */
+			memcpy(ptr, str + i, 16);
+			ptr += 16;
+			continue;
+		}
+		for (n = i; n < i + 16; n++) {
+			if (escape_char(str[n], isjson))
 				*(ptr++) = '\\';
-				*(ptr++) = *(str++);
-				break;
-			default:
-				*(ptr++) = *(str++);
-				break;
+			*(ptr++) = str[n];
 		}
-
+	}
+	for (; i < len; i++) {
+		if (escape_char(str[i], isjson))
+			*(ptr++) = '\\';
+		*(ptr++) = str[i];
+	}
 	*ptr = '\0';
 
 	return buf;
 }
 
+// Event stream for subscribed API clients
+//  mining-path threads queue short JSON event lines via api_event() and the
+//  API thread pushes them to subscribers - with no subscriber connected
+//  events are discarded immediately so the mining path pays nothing
+#define EVENTS_MAX 128
+
+struct api_event {
+	char *line;
+	struct api_event *next;
+};
+
+static pthread_mutex_t events_lock;
+static struct api_event *events_head;
+static struct api_event *events_tail;
+static int events_count;
+static volatile int api_subscribers;
+
+// Always-on binary flight recorder - every api_event() is also appended to
+//  this fixed size ring, regardless of subscribers, timestamped on the
+//  monotonic cgtimer clock, so the recent event history is available for
+//  post-incident analysis via the 'eventlog' command
+#define EVENTLOG_RECORDS 4096
+
+struct eventlog_rec {
+	uint32_t seq;		// record number + 1, 0 = slot never written
+	uint32_t ms;		// ms since the first event
+	char type[12];
+	char details[44];
+};
+
+static struct eventlog_rec eventlog_ring[EVENTLOG_RECORDS];
+static unsigned int eventlog_seq;
+static cgtimer_t eventlog_start;
+
+static void eventlog_append(const char *type, const char *details)
+{
+	static volatile int started;
+	struct eventlog_rec *rec;
+	cgtimer_t now, diff;
+	unsigned int seq;
+
+	// competing first callers would only skew the epoch by the race
+	//  window so last writer wins is fine
+	if (unlikely(!started)) {
+		cgtimer_time(&eventlog_start);
+		started = 1;
+	}
+	cgtimer_time(&now);
+	cgtimer_sub(&now, &eventlog_start, &diff);
+	seq = __sync_fetch_and_add(&eventlog_seq, 1);
+	rec = &eventlog_ring[seq & (EVENTLOG_RECORDS - 1)];
+	rec->seq = 0;
+	__sync_synchronize();
+	rec->ms = cgtimer_to_ms(&diff);
+	snprintf(rec->type, sizeof(rec->type), "%s", type);
+	snprintf(rec->details, sizeof(rec->details), "%s", details ? details : "");
+	// publish seq last so the dump can spot slots mid overwrite
+	__sync_synchronize();
+	rec->seq = seq + 1;
+}
+
+void api_event(const char *type, const char *details)
+{
+	struct api_event *event;
+	char buf[TMPBUFSIZ];
+	char *escape;
+
+	eventlog_append(type, details);
+
+	if (!api_subscribers)
+		return;
+
+	escape = escape_string((char *)details, true);
+	snprintf(buf, sizeof(buf),
+		"{\"event\":\"%s\",\"when\":%ld,\"details\":\"%s\"}\n",
+		type, (long)time(NULL), escape);
+	if (escape != details)
+		free(escape);
+
+	event = malloc(sizeof(*event));
+	if (unlikely(!event))
+		quit(1, "Failed to malloc api event");
+	event->line = strdup(buf);
+	event->next = NULL;
+
+	mutex_lock(&events_lock);
+	if (events_count < EVENTS_MAX) {
+		if (events_tail)
+			events_tail->next = event;
+		else
+			events_head = event;
+		events_tail = event;
+		events_count++;
+		event = NULL;
+	}
+	mutex_unlock(&events_lock);
+
+	// full queue means the subscribers are being drowned - drop the event
+	if (event) {
+		free(event->line);
+		free(event);
+	}
+}
+
+// Take the whole queued event list for pushing to subscribers
+static struct api_event *events_take(void)
+{
+	struct api_event *events;
+
+	mutex_lock(&events_lock);
+	events = events_head;
+	events_head = events_tail = NULL;
+	events_count = 0;
+	mutex_unlock(&events_lock);
+
+	return events;
+}
+
 static struct api_data *api_add_extra(struct api_data *root, struct api_data *extra)
 {
 	struct api_data *tmp;
@@ -1043,13 +1347,145 @@ struct api_data *api_add_percent(struct api_data *root, char *name, double *data
 	return api_add_data_full(root, name, API_PERCENT, (void *)data, copy_data);
 }
 
-static struct api_data *print_data(struct api_data *root, char *buf, bool isjson, bool precom)
+// Binary mode counterpart of print_data() below: the api_data list becomes
+// one field record of fixed width little endian values keyed by the
+// api_data_type ids, consuming and freeing the list the same way
+static struct api_data *print_data_bin(struct io_data *io_data, struct api_data *root)
+{
+	struct api_data *tmp;
+	char rec[TMPBUFSIZ];
+	char *p, *count;
+	size_t namelen, vallen;
+	int nfields = 0;
+
+	rec[0] = BIN_TAG_FIELDS;
+	count = rec + 1;
+	p = rec + 2;
+
+	while (root && nfields < 0xff) {
+		namelen = strlen(root->name);
+		if (namelen > 0xff)
+			namelen = 0xff;
+
+		// worst case encoding of this field
+		vallen = 16;
+		if (root->type == API_STRING || root->type == API_CONST || root->type == API_ESCAPE)
+			vallen += strlen((char *)(root->data));
+		if ((size_t)(p - rec) + 2 + namelen + 2 + vallen > sizeof(rec))
+			break; // record full - drop the remaining fields
+
+		*(p++) = root->type;
+		*(p++) = namelen;
+		memcpy(p, root->name, namelen);
+		p += namelen;
+
+		switch(root->type) {
+			case API_STRING:
+			case API_CONST:
+			case API_ESCAPE:
+				vallen = strlen((char *)(root->data));
+				if (vallen > 0xffff)
+					vallen = 0xffff;
+				p = bin_u16(p, vallen);
+				memcpy(p, root->data, vallen);
+				p += vallen;
+				break;
+			case API_UINT8:
+			case API_BOOL:
+				*(p++) = *(uint8_t *)(root->data);
+				break;
+			case API_UINT16:
+				p = bin_u16(p, *(uint16_t *)(root->data));
+				break;
+			case API_INT:
+			case API_UINT:
+			case API_UINT32:
+				p = bin_u32(p, *(uint32_t *)(root->data));
+				break;
+			case API_UINT64:
+				p = bin_u64(p, *(uint64_t *)(root->data));
+				break;
+			case API_TIME:
+				p = bin_u64(p, *(unsigned long *)(root->data));
+				break;
+			case API_VOLTS:
+			case API_TEMP:
+				p = bin_f32(p, *(float *)(root->data));
+				break;
+			case API_TIMEVAL:
+				p = bin_u64(p, ((struct timeval *)(root->data))->tv_sec);
+				p = bin_u64(p, ((struct timeval *)(root->data))->tv_usec);
+				break;
+			case API_PERCENT:
+				// same scaling as the text rendering
+				p = bin_f64(p, *(double *)(root->data) * 100.0);
+				break;
+			default:
+				// all the remaining double based types
+				p = bin_f64(p, *(double *)(root->data));
+				break;
+		}
+
+		nfields++;
+
+		free(root->name);
+		if (root->data_was_malloc)
+			free(root->data);
+
+		if (root->next == root) {
+			free(root);
+			root = NULL;
+		} else {
+			tmp = root;
+			root = tmp->next;
+			root->prev = tmp->prev;
+			root->prev->next = root;
+			free(tmp);
+		}
+	}
+
+	*count = nfields;
+	io_add_bin(io_data, rec, p - rec);
+
+	// free any fields that didn't fit
+	while (root) {
+		free(root->name);
+		if (root->data_was_malloc)
+			free(root->data);
+
+		if (root->next == root) {
+			free(root);
+			root = NULL;
+		} else {
+			tmp = root;
+			root = tmp->next;
+			root->prev = tmp->prev;
+			root->prev->next = root;
+			free(tmp);
+		}
+	}
+
+	return root;
+}
+
+// Render the api_data list directly into io_data at the append cursor,
+// consuming the list
+// One record is assumed to fit in the TMPBUFSIZ of spare room io_reserve()
+// guarantees; if the reply would then exceed SOCKBUFSIZ the record is
+// dropped and the reply marked full, i.e. the reply is still truncated at
+// the end of the last record that fits
+static struct api_data *print_data(struct io_data *io_data, struct api_data *root, bool isjson, bool precom)
 {
 	struct api_data *tmp;
 	bool first = true;
 	char *original, *escape;
-	char *quote;
+	char *quote, *buf;
+
+	if (io_data->bin)
+		return print_data_bin(io_data, root);
 
+	io_reserve(io_data, TMPBUFSIZ);
+	buf = io_data->cur;
 	*buf = '\0';
 
 	if (precom) {
@@ -1169,6 +1605,13 @@ static struct api_data *print_data(struct api_data *root, char *buf, bool isjson
 	}
 
 	strcpy(buf, isjson ? JSON5 : SEPSTR);
+	buf = strchr(buf, '\0');
+
+	if (io_data->full || (io_data->sock && (size_t)(buf - io_data->ptr) + 1 > SOCKBUFSIZ))
+		io_data->full = true;
+	else
+		io_data->cur = buf;
+	*(io_data->cur) = '\0';
 
 	return root;
 }
@@ -1255,7 +1698,6 @@ static void message(struct io_data *io_data, int messageid, int paramid, char *p
 {
 	struct api_data *root = NULL;
 	char buf[TMPBUFSIZ];
-	char buf2[TMPBUFSIZ];
 	char severity[2];
 #ifdef HAVE_AN_ASIC
 	int asc;
@@ -1360,8 +1802,7 @@ static void message(struct io_data *io_data, int messageid, int paramid, char *p
 			root = api_add_escape(root, "Msg", buf, false);
 			root = api_add_escape(root, "Description", opt_api_description, false);
 
-			root = print_data(root, buf2, isjson, false);
-			io_add(io_data, buf2);
+			root = print_data(io_data, root, isjson, false);
 			if (isjson)
 				io_add(io_data, JSON_CLOSE);
 			return;
@@ -1376,8 +1817,7 @@ static void message(struct io_data *io_data, int messageid, int paramid, char *p
 	root = api_add_escape(root, "Msg", buf, false);
 	root = api_add_escape(root, "Description", opt_api_description, false);
 
-	root = print_data(root, buf2, isjson, false);
-	io_add(io_data, buf2);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson)
 		io_add(io_data, JSON_CLOSE);
 }
@@ -1782,7 +2222,6 @@ static void lockstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __ma
 static void apiversion(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 
 	message(io_data, MSG_VERSION, 0, NULL, isjson);
@@ -1791,8 +2230,7 @@ static void apiversion(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 	root = api_add_string(root, "CGMiner", VERSION, false);
 	root = api_add_const(root, "API", APIVERSION, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -1800,7 +2238,6 @@ static void apiversion(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 static void minerconfig(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	int asccount = 0;
 	int pgacount = 0;
@@ -1836,8 +2273,7 @@ static void minerconfig(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __
 	root = api_add_const(root, "Hotplug", NONE, false);
 #endif
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -1860,11 +2296,43 @@ static const char *status2str(enum alive status)
 	}
 }
 
+/* Append the summary fields of one latency histogram with the stage name
+ * prefixed, so several pipeline stages can share a single reply row */
+static struct api_data *lat_fields(struct api_data *root, const char *stage, struct lat_hist *h)
+{
+	uint64_t p50, p95, p99, p999, mean;
+	char name[40];
+
+	p50 = lat_hist_pct(h, 50.0);
+	p95 = lat_hist_pct(h, 95.0);
+	p99 = lat_hist_pct(h, 99.0);
+	p999 = lat_hist_pct(h, 99.9);
+	mean = h->count ? h->sum_us / h->count : 0;
+
+	snprintf(name, sizeof(name), "%s Samples", stage);
+	root = api_add_uint64(root, name, &h->count, true);
+	snprintf(name, sizeof(name), "%s Min uS", stage);
+	root = api_add_uint64(root, name, &h->min_us, true);
+	snprintf(name, sizeof(name), "%s Max uS", stage);
+	root = api_add_uint64(root, name, &h->max_us, true);
+	snprintf(name, sizeof(name), "%s Mean uS", stage);
+	root = api_add_uint64(root, name, &mean, true);
+	snprintf(name, sizeof(name), "%s P50 uS", stage);
+	root = api_add_uint64(root, name, &p50, true);
+	snprintf(name, sizeof(name), "%s P95 uS", stage);
+	root = api_add_uint64(root, name, &p95, true);
+	snprintf(name, sizeof(name), "%s P99 uS", stage);
+	root = api_add_uint64(root, name, &p99, true);
+	snprintf(name, sizeof(name), "%s P999 uS", stage);
+	root = api_add_uint64(root, name, &p999, true);
+
+	return root;
+}
+
 #ifdef HAVE_AN_ASIC
 static void ascstatus(struct io_data *io_data, int asc, bool isjson, bool precom)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	char *enabled;
 	char *status;
 	int numasc = numascs();
@@ -1933,9 +2401,13 @@ static void ascstatus(struct io_data *io_data, int asc, bool isjson, bool precom
 				(double)(cgpu->diff_rejected) / (double)(cgpu->diff1) : 0;
 		root = api_add_percent(root, "Device Rejected%", &rejp, false);
 		root = api_add_elapsed(root, "Device Elapsed", &(dev_runtime), false);
+		root = api_add_double(root, "Last Flush Time", &(cgpu->last_flush_ms), false);
+		double avgflush = cgpu->flush_count ?
+				cgpu->total_flush_ms / cgpu->flush_count : 0;
+		root = api_add_double(root, "Avg Flush Time", &avgflush, false);
+		root = lat_fields(root, "Verify", &cgpu->verify_lat);
 
-		root = print_data(root, buf, isjson, precom);
-		io_add(io_data, buf);
+		root = print_data(io_data, root, isjson, precom);
 	}
 }
 #endif
@@ -1944,7 +2416,6 @@ static void ascstatus(struct io_data *io_data, int asc, bool isjson, bool precom
 static void pgastatus(struct io_data *io_data, int pga, bool isjson, bool precom)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	char *enabled;
 	char *status;
 	int numpga = numpgas();
@@ -2020,9 +2491,14 @@ static void pgastatus(struct io_data *io_data, int pga, bool isjson, bool precom
 				(double)(cgpu->diff_rejected) / (double)(cgpu->diff1) : 0;
 		root = api_add_percent(root, "Device Rejected%", &rejp, false);
 		root = api_add_elapsed(root, "Device Elapsed", &(dev_runtime), false);
+		root = api_add_double(root, "Last Flush Time", &(cgpu->last_flush_ms), false);
+		double avgflush = cgpu->flush_count ?
+				cgpu->total_flush_ms / cgpu->flush_count : 0;
+		root = api_add_double(root, "Avg Flush Time", &avgflush, false);
+		root = api_add_int(root, "Flash Progress", &(cgpu->flash_progress), false);
+		root = lat_fields(root, "Verify", &cgpu->verify_lat);
 
-		root = print_data(root, buf, isjson, precom);
-		io_add(io_data, buf);
+		root = print_data(io_data, root, isjson, precom);
 	}
 }
 #endif
@@ -2266,7 +2742,6 @@ static void pgaidentify(struct io_data *io_data, __maybe_unused SOCKETTYPE c, ch
 static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open = false;
 	char *status, *lp;
 	int i;
@@ -2353,93 +2828,446 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 				(double)(pool->diff_stale) / (double)(pool->diff_accepted + pool->diff_rejected + pool->diff_stale) : 0;
 		root = api_add_percent(root, "Pool Stale%", &stalep, false);
 
-		root = print_data(root, buf, isjson, isjson && (i > 0));
-		io_add(io_data, buf);
+		root = print_data(io_data, root, isjson, isjson && (i > 0));
 	}
 
 	if (isjson && io_open)
 		io_close(io_data);
 }
 
-static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+static void poollat(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
-	bool io_open;
-	double utility, mhs, work_utility;
+	bool io_open = false;
+	int i;
 
-	message(io_data, MSG_SUMM, 0, NULL, isjson);
-	io_open = io_add(io_data, isjson ? COMSTR JSON_SUMMARY : _SUMMARY COMSTR);
+	if (total_pools == 0) {
+		message(io_data, MSG_NOPOOL, 0, NULL, isjson);
+		return;
+	}
 
-	// stop hashmeter() changing some while copying
-	mutex_lock(&hash_lock);
+	message(io_data, MSG_POOLLAT, 0, NULL, isjson);
 
-	utility = total_accepted / ( total_secs ? total_secs : 1 ) * 60;
-	mhs = total_mhashes_done / total_secs;
-	work_utility = total_diff1 / ( total_secs ? total_secs : 1 ) * 60;
+	if (isjson)
+		io_open = io_add(io_data, COMSTR JSON_POOLLAT);
 
-	root = api_add_elapsed(root, "Elapsed", &(total_secs), true);
-	root = api_add_mhs(root, "MHS av", &(mhs), false);
-	char mhsname[27];
-	sprintf(mhsname, "MHS %ds", opt_log_interval);
-	root = api_add_mhs(root, mhsname, &(total_rolling), false);
-	root = api_add_uint(root, "Found Blocks", &(found_blocks), true);
-	root = api_add_int(root, "Getworks", &(total_getworks), true);
-	root = api_add_int(root, "Accepted", &(total_accepted), true);
-	root = api_add_int(root, "Rejected", &(total_rejected), true);
-	root = api_add_int(root, "Hardware Errors", &(hw_errors), true);
-	root = api_add_utility(root, "Utility", &(utility), false);
-	root = api_add_int(root, "Discarded", &(total_discarded), true);
-	root = api_add_int(root, "Stale", &(total_stale), true);
-	root = api_add_uint(root, "Get Failures", &(total_go), true);
-	root = api_add_uint(root, "Local Work", &(local_work), true);
-	root = api_add_uint(root, "Remote Failures", &(total_ro), true);
-	root = api_add_uint(root, "Network Blocks", &(new_blocks), true);
-	root = api_add_mhtotal(root, "Total MH", &(total_mhashes_done), true);
-	root = api_add_utility(root, "Work Utility", &(work_utility), false);
-	root = api_add_diff(root, "Difficulty Accepted", &(total_diff_accepted), true);
-	root = api_add_diff(root, "Difficulty Rejected", &(total_diff_rejected), true);
-	root = api_add_diff(root, "Difficulty Stale", &(total_diff_stale), true);
-	root = api_add_uint64(root, "Best Share", &(best_diff), true);
-	double hwp = (hw_errors + total_diff1) ?
-			(double)(hw_errors) / (double)(hw_errors + total_diff1) : 0;
-	root = api_add_percent(root, "Device Hardware%", &hwp, false);
-	double rejp = total_diff1 ?
-			(double)(total_diff_rejected) / (double)(total_diff1) : 0;
-	root = api_add_percent(root, "Device Rejected%", &rejp, false);
-	double prejp = (total_diff_accepted + total_diff_rejected + total_diff_stale) ?
-			(double)(total_diff_rejected) / (double)(total_diff_accepted + total_diff_rejected + total_diff_stale) : 0;
-	root = api_add_percent(root, "Pool Rejected%", &prejp, false);
-	double stalep = (total_diff_accepted + total_diff_rejected + total_diff_stale) ?
-			(double)(total_diff_stale) / (double)(total_diff_accepted + total_diff_rejected + total_diff_stale) : 0;
-	root = api_add_percent(root, "Pool Stale%", &stalep, false);
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+		struct lat_hist *h = &pool->sub_lat;
+		uint64_t p50, p95, p99, p999, mean;
 
-	mutex_unlock(&hash_lock);
+		if (pool->removed)
+			continue;
+
+		p50 = lat_hist_pct(h, 50.0);
+		p95 = lat_hist_pct(h, 95.0);
+		p99 = lat_hist_pct(h, 99.0);
+		p999 = lat_hist_pct(h, 99.9);
+		mean = h->count ? h->sum_us / h->count : 0;
+
+		root = api_add_int(root, "POOL", &i, false);
+		root = api_add_escape(root, "URL", pool->rpc_url, false);
+		root = api_add_uint64(root, "Share Samples", &h->count, true);
+		root = api_add_uint64(root, "Min uS", &h->min_us, true);
+		root = api_add_uint64(root, "Max uS", &h->max_us, true);
+		root = api_add_uint64(root, "Mean uS", &mean, true);
+		root = api_add_uint64(root, "P50 uS", &p50, true);
+		root = api_add_uint64(root, "P95 uS", &p95, true);
+		root = api_add_uint64(root, "P99 uS", &p99, true);
+		root = api_add_uint64(root, "P999 uS", &p999, true);
+		root = lat_fields(root, "Queue", &pool->queue_lat);
+		root = lat_fields(root, "Send", &pool->send_lat);
+
+		root = print_data(io_data, root, isjson, isjson && (i > 0));
+	}
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
 	if (isjson && io_open)
 		io_close(io_data);
 }
 
-static void pgacount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+// Report where the growable buffers have their memory so lowmem users can
+// see which subsystem is eating a small controller
+static void memstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
-	bool io_open;
-	int count = 0;
+	struct io_list *io_list;
+	uint64_t api_bytes = 0, total_bytes = 0;
+	bool io_open = false;
+	int i, rows = 0;
 
-#ifdef HAVE_AN_FPGA
-	count = numpgas();
-#endif
+	message(io_data, MSG_MEMSTATS, 0, NULL, isjson);
 
-	message(io_data, MSG_NUMPGA, 0, NULL, isjson);
+	if (isjson)
+		io_open = io_add(io_data, COMSTR JSON_MEMSTATS);
+
+	io_list = io_head;
+	if (io_list) {
+		do {
+			api_bytes += io_list->io_data->siz;
+			io_list = io_list->next;
+		} while (io_list != io_head);
+	}
+
+	root = api_add_bool(root, "LowMem", &opt_lowmem, false);
+	root = api_add_uint64(root, "API Buffers", &api_bytes, true);
+	/* The counted subsystem totals, maintained by mem_account at the
+	 * allocation sites, localizing which subsystem RSS growth is in */
+	for (i = 0; i < MEM_MEMSYS; i++) {
+		char name[32];
+
+		snprintf(name, sizeof(name), "%s Bytes", memsys_names[i]);
+		total_bytes += memsys_bytes[i];
+		root = api_add_uint64(root, name, &memsys_bytes[i], true);
+	}
+	root = api_add_uint64(root, "Tracked Bytes", &total_bytes, true);
+	root = api_add_bool(root, "Mem Locked", &mem_locked, false);
+#ifdef __linux__
+	if (mem_locked) {
+		/* The kernel's own count of what mlockall pinned */
+		uint64_t locked_bytes = 0;
+		char vmline[128];
+		FILE *f;
+
+		f = fopen("/proc/self/status", "r");
+		if (f) {
+			while (fgets(vmline, sizeof(vmline), f)) {
+				if (strncmp(vmline, "VmLck:", 6) == 0) {
+					locked_bytes = (uint64_t)atoll(vmline + 6) * 1024;
+					break;
+				}
+			}
+			fclose(f);
+		}
+		root = api_add_uint64(root, "Locked Bytes", &locked_bytes, true);
+	}
+#endif
+	root = print_data(io_data, root, isjson, false);
+	rows++;
+
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+		uint64_t sockbuf_bytes, gbt_bytes;
+		int sshares;
+
+		if (pool->removed)
+			continue;
+
+		sockbuf_bytes = pool->sockbuf_size;
+		sshares = pool->sshares;
+		cg_rlock(&pool->gbt_lock);
+		gbt_bytes = pool->coinbase_len + pool->submit_tmpl_len;
+		if (pool->merklebin)
+			gbt_bytes += 32 * 33;
+		cg_runlock(&pool->gbt_lock);
+
+		root = api_add_int(root, "POOL", &i, false);
+		root = api_add_uint64(root, "Sockbuf Bytes", &sockbuf_bytes, true);
+		root = api_add_int(root, "Unacked Shares", &sshares, true);
+		root = api_add_uint64(root, "GBT Bytes", &gbt_bytes, true);
+		root = print_data(io_data, root, isjson, isjson && rows > 0);
+		rows++;
+	}
+
+	if (isjson && io_open)
+		io_close(io_data);
+}
+
+// Per chip nonce counters registered by the multichip drivers, with the
+//  expected per chip count alongside so a single dead core shows up within
+//  hours instead of as missing hashrate at month end reconciliation
+static void chipstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+	bool io_open = false;
+	int dev, rows = 0;
+
+	for (dev = 0; dev < total_devices; dev++) {
+		if (get_devices(dev)->chip_results)
+			rows++;
+	}
+
+	if (rows == 0) {
+		message(io_data, MSG_NOCHIPS, 0, NULL, isjson);
+		return;
+	}
+
+	message(io_data, MSG_CHIPSTATS, 0, NULL, isjson);
+
+	if (isjson)
+		io_open = io_add(io_data, COMSTR JSON_CHIPSTATS);
+
+	rows = 0;
+	for (dev = 0; dev < total_devices; dev++) {
+		struct cgpu_info *cgpu = get_devices(dev);
+		struct api_data *root = NULL;
+		uint64_t total = 0, min, max;
+		double expected;
+		int i, weak = 0;
+		char *counts;
+		size_t off;
+
+		if (!cgpu->chip_results)
+			continue;
+
+		min = max = cgpu->chip_results[0];
+		for (i = 0; i < cgpu->chip_count; i++) {
+			uint64_t n = cgpu->chip_results[i];
+
+			total += n;
+			if (n < min)
+				min = n;
+			if (n > max)
+				max = n;
+		}
+		expected = (double)total / cgpu->chip_count;
+		/* Nonce returns are poisson spread around the mean, so once a
+		 * reasonable sample has accumulated a chip at under half its
+		 * expected count is weak or dead rather than unlucky */
+		if (expected >= 30.0) {
+			for (i = 0; i < cgpu->chip_count; i++) {
+				if ((double)cgpu->chip_results[i] < expected / 2)
+					weak++;
+			}
+		}
+
+		counts = malloc(cgpu->chip_count * 21 + 1);
+		if (unlikely(!counts))
+			quit(1, "Failed to malloc chipstats counts");
+		off = 0;
+		for (i = 0; i < cgpu->chip_count; i++) {
+			off += sprintf(counts + off, "%s%"PRIu64,
+					i ? "," : "", cgpu->chip_results[i]);
+		}
+
+		root = api_add_int(root, "DEV", &dev, false);
+		root = api_add_string(root, "Name", cgpu->drv->name, false);
+		root = api_add_int(root, "ID", &(cgpu->device_id), false);
+		root = api_add_int(root, "Chips", &(cgpu->chip_count), false);
+		root = api_add_uint64(root, "Total Nonces", &total, true);
+		root = api_add_double(root, "Expected Per Chip", &expected, true);
+		root = api_add_uint64(root, "Min Chip", &min, true);
+		root = api_add_uint64(root, "Max Chip", &max, true);
+		root = api_add_int(root, "Weak Chips", &weak, true);
+		root = api_add_escape(root, "Chip Nonces", counts, true);
+
+		root = print_data(io_data, root, isjson, isjson && rows > 0);
+		rows++;
+		free(counts);
+	}
+
+	if (isjson && io_open)
+		io_close(io_data);
+}
+
+// Dump the flight recorder ring, oldest record first. Records overwritten
+//  while we copy them out are simply skipped
+static void doeventlog(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+	unsigned int seq, first, i;
+	struct eventlog_rec rec;
+	bool io_open = false;
+	int n = 0;
+
+	message(io_data, MSG_EVENTLOG, 0, NULL, isjson);
+
+	if (isjson)
+		io_open = io_add(io_data, COMSTR JSON_EVENTLOG);
+
+	seq = eventlog_seq;
+	first = seq > EVENTLOG_RECORDS ? seq - EVENTLOG_RECORDS : 0;
+	for (i = first; i < seq; i++) {
+		struct api_data *root = NULL;
+
+		memcpy(&rec, &eventlog_ring[i & (EVENTLOG_RECORDS - 1)], sizeof(rec));
+		if (rec.seq != i + 1)
+			continue;
+
+		root = api_add_int(root, "EVENTLOG", &n, true);
+		root = api_add_uint(root, "Seq", &i, true);
+		root = api_add_uint(root, "Ms", &rec.ms, true);
+		root = api_add_string(root, "Type", rec.type, true);
+		root = api_add_escape(root, "Details", rec.details, true);
+
+		root = print_data(io_data, root, isjson, isjson && (n > 0));
+		n++;
+	}
+
+	if (isjson && io_open)
+		io_close(io_data);
+}
+
+// Join the last HISTORY_MINUTES bucket values for one field into buf,
+//  oldest first, zero filling minutes with no bucket. Buckets are written
+//  by the watchdog stats pass; a torn read only garbles the live minute
+static void history_join(char *buf, size_t siz, struct hash_history *hist,
+			 time_t minute, char field)
+{
+	size_t off = 0;
+	int i;
+
+	buf[0] = '\0';
+	for (i = HISTORY_MINUTES - 1; i >= 0 && off < siz - 1; i--) {
+		time_t m = minute - i;
+		struct hash_bucket *b = &hist->buckets[m % HISTORY_MINUTES];
+
+		if (b->minute != m)
+			b = NULL;
+		switch (field) {
+			case 'm':
+				off += snprintf(buf + off, siz - off, "%s%.2f",
+						off ? "," : "", b ? b->mhashes : 0.0);
+				break;
+			case 'a':
+				off += snprintf(buf + off, siz - off, "%s%d",
+						off ? "," : "", b ? b->accepted : 0);
+				break;
+			case 'r':
+				off += snprintf(buf + off, siz - off, "%s%d",
+						off ? "," : "", b ? b->rejected : 0);
+				break;
+		}
+	}
+}
+
+static void dohistory(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+	time_t minute = time(NULL) / 60;
+	int minutes = HISTORY_MINUTES;
+	char mbuf[1024], abuf[512], rbuf[512];
+	bool io_open = false;
+	int i, n = 0;
+
+	message(io_data, MSG_HISTORY, 0, NULL, isjson);
+
+	if (isjson)
+		io_open = io_add(io_data, COMSTR JSON_HISTORY);
+
+	for (i = 0; i < total_devices; i++) {
+		struct cgpu_info *cgpu = get_devices(i);
+		struct api_data *root = NULL;
+
+		if (!cgpu)
+			continue;
+
+		history_join(mbuf, sizeof(mbuf), &cgpu->history, minute, 'm');
+		history_join(abuf, sizeof(abuf), &cgpu->history, minute, 'a');
+		history_join(rbuf, sizeof(rbuf), &cgpu->history, minute, 'r');
+
+		root = api_add_int(root, "HISTORY", &n, true);
+		root = api_add_string(root, "Type", "dev", false);
+		root = api_add_string(root, "Name", cgpu->drv->name, false);
+		root = api_add_int(root, "ID", &(cgpu->device_id), false);
+		root = api_add_int(root, "Minutes", &minutes, false);
+		root = api_add_string(root, "MHS", mbuf, true);
+		root = api_add_string(root, "Accepted", abuf, true);
+		root = api_add_string(root, "Rejected", rbuf, true);
+
+		root = print_data(io_data, root, isjson, isjson && (n > 0));
+		n++;
+	}
+
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+		struct api_data *root = NULL;
+
+		if (pool->removed)
+			continue;
+
+		history_join(mbuf, sizeof(mbuf), &pool->history, minute, 'm');
+		history_join(abuf, sizeof(abuf), &pool->history, minute, 'a');
+		history_join(rbuf, sizeof(rbuf), &pool->history, minute, 'r');
+
+		root = api_add_int(root, "HISTORY", &n, true);
+		root = api_add_string(root, "Type", "pool", false);
+		root = api_add_escape(root, "URL", pool->rpc_url, false);
+		root = api_add_int(root, "ID", &(pool->pool_no), false);
+		root = api_add_int(root, "Minutes", &minutes, false);
+		root = api_add_string(root, "Diff Accepted", mbuf, true);
+		root = api_add_string(root, "Accepted", abuf, true);
+		root = api_add_string(root, "Rejected", rbuf, true);
+
+		root = print_data(io_data, root, isjson, isjson && (n > 0));
+		n++;
+	}
+
+	if (isjson && io_open)
+		io_close(io_data);
+}
+
+static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+	struct api_data *root = NULL;
+	struct stats_snapshot snap;
+	bool io_open;
+	double utility, mhs, work_utility;
+
+	message(io_data, MSG_SUMM, 0, NULL, isjson);
+	io_open = io_add(io_data, isjson ? COMSTR JSON_SUMMARY : _SUMMARY COMSTR);
+
+	// use the coherent snapshot hashmeter() last published rather than
+	// taking hash_lock against the mining path
+	snap = *stats_snapshot();
+
+	utility = snap.total_accepted / ( snap.total_secs ? snap.total_secs : 1 ) * 60;
+	mhs = snap.total_mhashes_done / ( snap.total_secs ? snap.total_secs : 1 );
+	work_utility = snap.total_diff1 / ( snap.total_secs ? snap.total_secs : 1 ) * 60;
+
+	root = api_add_elapsed(root, "Elapsed", &(snap.total_secs), true);
+	root = api_add_mhs(root, "MHS av", &(mhs), false);
+	char mhsname[27];
+	sprintf(mhsname, "MHS %ds", opt_log_interval);
+	root = api_add_mhs(root, mhsname, &(snap.total_rolling), true);
+	root = api_add_uint(root, "Found Blocks", &(snap.found_blocks), true);
+	root = api_add_int(root, "Getworks", &(snap.total_getworks), true);
+	root = api_add_int(root, "Accepted", &(snap.total_accepted), true);
+	root = api_add_int(root, "Rejected", &(snap.total_rejected), true);
+	root = api_add_int(root, "Hardware Errors", &(snap.hw_errors), true);
+	root = api_add_utility(root, "Utility", &(utility), false);
+	root = api_add_int(root, "Discarded", &(snap.total_discarded), true);
+	root = api_add_int(root, "Stale", &(snap.total_stale), true);
+	root = api_add_uint(root, "Get Failures", &(snap.total_go), true);
+	root = api_add_uint(root, "Local Work", &(snap.local_work), true);
+	root = api_add_uint(root, "Remote Failures", &(snap.total_ro), true);
+	root = api_add_uint(root, "Network Blocks", &(snap.new_blocks), true);
+	root = api_add_mhtotal(root, "Total MH", &(snap.total_mhashes_done), true);
+	root = api_add_utility(root, "Work Utility", &(work_utility), false);
+	root = api_add_diff(root, "Difficulty Accepted", &(snap.total_diff_accepted), true);
+	root = api_add_diff(root, "Difficulty Rejected", &(snap.total_diff_rejected), true);
+	root = api_add_diff(root, "Difficulty Stale", &(snap.total_diff_stale), true);
+	root = api_add_uint64(root, "Best Share", &(snap.best_diff), true);
+	double hwp = (snap.hw_errors + snap.total_diff1) ?
+			(double)(snap.hw_errors) / (double)(snap.hw_errors + snap.total_diff1) : 0;
+	root = api_add_percent(root, "Device Hardware%", &hwp, false);
+	double rejp = snap.total_diff1 ?
+			(double)(snap.total_diff_rejected) / (double)(snap.total_diff1) : 0;
+	root = api_add_percent(root, "Device Rejected%", &rejp, false);
+	double prejp = (snap.total_diff_accepted + snap.total_diff_rejected + snap.total_diff_stale) ?
+			(double)(snap.total_diff_rejected) / (double)(snap.total_diff_accepted + snap.total_diff_rejected + snap.total_diff_stale) : 0;
+	root = api_add_percent(root, "Pool Rejected%", &prejp, false);
+	double stalep = (snap.total_diff_accepted + snap.total_diff_rejected + snap.total_diff_stale) ?
+			(double)(snap.total_diff_stale) / (double)(snap.total_diff_accepted + snap.total_diff_rejected + snap.total_diff_stale) : 0;
+	root = api_add_percent(root, "Pool Stale%", &stalep, false);
+
+	root = print_data(io_data, root, isjson, false);
+	if (isjson && io_open)
+		io_close(io_data);
+}
+
+static void pgacount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+	struct api_data *root = NULL;
+	bool io_open;
+	int count = 0;
+
+#ifdef HAVE_AN_FPGA
+	count = numpgas();
+#endif
+
+	message(io_data, MSG_NUMPGA, 0, NULL, isjson);
 	io_open = io_add(io_data, isjson ? COMSTR JSON_PGAS : _PGAS COMSTR);
 
 	root = api_add_int(root, "Count", &count, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -2470,6 +3298,9 @@ static void switchpool(struct io_data *io_data, __maybe_unused SOCKETTYPE c, cha
 	pool = pools[id];
 	pool->enabled = POOL_ENABLED;
 	cg_runlock(&control_lock);
+	/* An explicit switch request overrides any retest backoff */
+	if (pool->idle)
+		pool_probe_now(pool);
 	switch_pools(pool);
 
 	message(io_data, MSG_SWITCHP, id, NULL, isjson);
@@ -2587,6 +3418,10 @@ static void enablepool(struct io_data *io_data, __maybe_unused SOCKETTYPE c, cha
 	}
 
 	pool->enabled = POOL_ENABLED;
+	/* Re-enabling a pool implies the operator expects it back - retest
+	 * it now rather than waiting out any accumulated backoff */
+	if (pool->idle)
+		pool_probe_now(pool);
 	if (pool->prio < current_pool()->prio)
 		switch_pools(pool);
 
@@ -2699,6 +3534,8 @@ static void poolquota(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char
 	}
 
 	pool->quota = quota;
+	pool->quota_eff = 0;
+	pool->quota_perf = 0;
 	adjust_quota_gcd();
 	message(io_data, MSG_SETQUOTA, quota, pool->rpc_url, isjson);
 }
@@ -2823,7 +3660,6 @@ void privileged(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_un
 void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	char *reason;
 
 	if (cgpu->device_last_not_well == 0)
@@ -2881,8 +3717,7 @@ void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, b
 	root = api_add_int(root, "*Dev Comms Error", &(cgpu->dev_comms_error_count), false);
 	root = api_add_int(root, "*Dev Throttle", &(cgpu->dev_throttle_count), false);
 
-	root = print_data(root, buf, isjson, isjson && (device > 0));
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, isjson && (device > 0));
 }
 
 static void notify(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, char group)
@@ -2906,6 +3741,22 @@ static void notify(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe
 		notifystatus(io_data, i, cgpu, isjson, group);
 	}
 
+	/* Log dedup suppression counters are global so report them as a
+	 * single extra row after the devices */
+	if (opt_log_dedup) {
+		struct api_data *root = NULL;
+		unsigned int suppressed, summaries;
+		int id = 0;
+
+		suppressed = applog_dedup_counts(&summaries);
+		root = api_add_int(root, "NOTIFY", &i, false);
+		root = api_add_string(root, "Name", "Log", false);
+		root = api_add_int(root, "ID", &id, false);
+		root = api_add_uint(root, "*Dedup Suppressed", &suppressed, true);
+		root = api_add_uint(root, "*Dedup Summaries", &summaries, true);
+		root = print_data(io_data, root, isjson, isjson && (i > 0));
+	}
+
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -2913,7 +3764,6 @@ static void notify(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe
 static void devdetails(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open = false;
 	struct cgpu_info *cgpu;
 	int i;
@@ -2939,8 +3789,7 @@ static void devdetails(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		root = api_add_const(root, "Model", cgpu->name ? : BLANK, false);
 		root = api_add_const(root, "Device Path", cgpu->device_path ? : BLANK, false);
 
-		root = print_data(root, buf, isjson, isjson && (i > 0));
-		io_add(io_data, buf);
+		root = print_data(io_data, root, isjson, isjson && (i > 0));
 	}
 
 	if (isjson && io_open)
@@ -2981,7 +3830,6 @@ void dosave(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, b
 static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_stats *stats, struct cgminer_pool_stats *pool_stats, struct api_data *extra, struct cgpu_info *cgpu, bool isjson)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 
 	root = api_add_int(root, "STATS", &i, false);
 	root = api_add_string(root, "ID", id, false);
@@ -3076,8 +3924,7 @@ static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_st
 #endif
 	}
 
-	root = print_data(root, buf, isjson, isjson && (i > 0));
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, isjson && (i > 0));
 
 	return ++i;
 }
@@ -3145,7 +3992,6 @@ static void failoveronly(struct io_data *io_data, __maybe_unused SOCKETTYPE c, c
 static void minecoin(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 
 	message(io_data, MSG_MINECOIN, 0, NULL, isjson);
@@ -3161,8 +4007,7 @@ static void minecoin(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 	root = api_add_bool(root, "LP", &have_longpoll, false);
 	root = api_add_diff(root, "Network Difficulty", &current_diff, true);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -3170,7 +4015,6 @@ static void minecoin(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 static void debugstate(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 
 	if (param == NULL)
@@ -3240,8 +4084,7 @@ static void debugstate(struct io_data *io_data, __maybe_unused SOCKETTYPE c, cha
 	root = api_add_bool(root, "PerDevice", &want_per_device_stats, false);
 	root = api_add_bool(root, "WorkTime", &opt_worktime, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -3288,7 +4131,6 @@ static void usbstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 	struct api_data *root = NULL;
 
 #ifdef USE_USBUTILS
-	char buf[TMPBUFSIZ];
 	bool io_open = false;
 	int count = 0;
 
@@ -3306,16 +4148,14 @@ static void usbstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 	if (isjson)
 		io_open = io_add(io_data, COMSTR JSON_USBSTATS);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 
 	while (42) {
 		root = api_usb_stats(&count);
 		if (!root)
 			break;
 
-		root = print_data(root, buf, isjson, isjson);
-		io_add(io_data, buf);
+		root = print_data(io_data, root, isjson, isjson);
 	}
 
 	if (isjson && io_open)
@@ -3648,7 +4488,6 @@ static void ascidentify(struct io_data *io_data, __maybe_unused SOCKETTYPE c, ch
 static void asccount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	int count = 0;
 
@@ -3661,8 +4500,7 @@ static void asccount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 
 	root = api_add_int(root, "Count", &count, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -3729,6 +4567,113 @@ static void ascset(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe
 
 static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, char group);
 
+// Emit all the stock counters in Prometheus text exposition format in one
+// pass - reachable as the 'metrics' command and, on epoll platforms, as a
+// plain HTTP GET /metrics on the API port
+static void metrics_text(struct io_data *io_data)
+{
+	struct stats_snapshot snap = *stats_snapshot();
+	struct cgpu_info *cgpu;
+	struct pool *pool;
+	char buf[TMPBUFSIZ];
+	int i;
+
+	snprintf(buf, sizeof(buf),
+		"# TYPE cgminer_elapsed_seconds counter\n"
+		"cgminer_elapsed_seconds %.0f\n"
+		"# TYPE cgminer_total_mhashes counter\n"
+		"cgminer_total_mhashes %.4f\n"
+		"# TYPE cgminer_hashrate_rolling_mhs gauge\n"
+		"cgminer_hashrate_rolling_mhs %.2f\n"
+		"# TYPE cgminer_accepted_total counter\n"
+		"cgminer_accepted_total %d\n"
+		"# TYPE cgminer_rejected_total counter\n"
+		"cgminer_rejected_total %d\n"
+		"# TYPE cgminer_stale_total counter\n"
+		"cgminer_stale_total %d\n"
+		"# TYPE cgminer_hw_errors_total counter\n"
+		"cgminer_hw_errors_total %d\n"
+		"# TYPE cgminer_best_share gauge\n"
+		"cgminer_best_share %"PRIu64"\n",
+		snap.total_secs, snap.total_mhashes_done, snap.total_rolling,
+		snap.total_accepted, snap.total_rejected, snap.total_stale,
+		snap.hw_errors, snap.best_diff);
+	io_add(io_data, buf);
+
+	io_add(io_data,
+		"# TYPE cgminer_device_rolling_mhs gauge\n"
+		"# TYPE cgminer_device_mhashes counter\n"
+		"# TYPE cgminer_device_accepted_total counter\n"
+		"# TYPE cgminer_device_rejected_total counter\n"
+		"# TYPE cgminer_device_hw_errors_total counter\n");
+	for (i = 0; i < total_devices; i++) {
+		cgpu = get_devices(i);
+		snprintf(buf, sizeof(buf),
+			"cgminer_device_rolling_mhs{device=\"%s%d\"} %.2f\n"
+			"cgminer_device_mhashes{device=\"%s%d\"} %.4f\n"
+			"cgminer_device_accepted_total{device=\"%s%d\"} %d\n"
+			"cgminer_device_rejected_total{device=\"%s%d\"} %d\n"
+			"cgminer_device_hw_errors_total{device=\"%s%d\"} %d\n",
+			cgpu->drv->name, cgpu->device_id, cgpu->rolling,
+			cgpu->drv->name, cgpu->device_id, cgpu->total_mhashes,
+			cgpu->drv->name, cgpu->device_id, cgpu->accepted,
+			cgpu->drv->name, cgpu->device_id, cgpu->rejected,
+			cgpu->drv->name, cgpu->device_id, cgpu->hw_errors);
+		io_add(io_data, buf);
+	}
+
+	io_add(io_data,
+		"# TYPE cgminer_pool_getworks_total counter\n"
+		"# TYPE cgminer_pool_accepted_total counter\n"
+		"# TYPE cgminer_pool_rejected_total counter\n"
+		"# TYPE cgminer_pool_stale_total counter\n"
+		"# TYPE cgminer_pool_diff_accepted counter\n"
+		"# TYPE cgminer_pool_diff_rejected counter\n"
+		"# TYPE cgminer_pool_alive gauge\n");
+	for (i = 0; i < total_pools; i++) {
+		pool = pools[i];
+		snprintf(buf, sizeof(buf),
+			"cgminer_pool_getworks_total{pool=\"%d\"} %u\n"
+			"cgminer_pool_accepted_total{pool=\"%d\"} %d\n"
+			"cgminer_pool_rejected_total{pool=\"%d\"} %d\n"
+			"cgminer_pool_stale_total{pool=\"%d\"} %u\n"
+			"cgminer_pool_diff_accepted{pool=\"%d\"} %.8f\n"
+			"cgminer_pool_diff_rejected{pool=\"%d\"} %.8f\n"
+			"cgminer_pool_alive{pool=\"%d\"} %d\n",
+			i, pool->getwork_requested,
+			i, pool->accepted,
+			i, pool->rejected,
+			i, pool->stale_shares,
+			i, pool->diff_accepted,
+			i, pool->diff_rejected,
+			i, pool->enabled == POOL_ENABLED && !pool->idle ? 1 : 0);
+		io_add(io_data, buf);
+	}
+}
+
+// Raw Prometheus exposition with no API framing
+static void dometrics(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, __maybe_unused bool isjson, __maybe_unused char group)
+{
+	metrics_text(io_data);
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+// Flags the epoll loop to keep this client open and stream events to it -
+// the bookkeeping happens in api_client_recv() once the ack has been queued
+static bool subscribe_request;
+
+static void subscribe(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+	subscribe_request = true;
+	message(io_data, MSG_SUB, 0, NULL, isjson);
+}
+#else
+static void subscribe(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+	message(io_data, MSG_NOSUB, 0, NULL, isjson);
+}
+#endif
+
 struct CMDS {
 	char *name;
 	void (*func)(struct io_data *, SOCKETTYPE, char *, bool, char);
@@ -3779,6 +4724,13 @@ struct CMDS {
 	{ "ascset",		ascset,		true },
 #endif
 	{ "asccount",		asccount,	false },
+	{ "poollat",		poollat,	false },
+	{ "eventlog",		doeventlog,	false },
+	{ "history",		dohistory,	false },
+	{ "subscribe",		subscribe,	false },
+	{ "metrics",		dometrics,	false },
+	{ "memstats",		memstats,	false },
+	{ "chipstats",		chipstats,	false },
 	{ "lockstats",		lockstats,	true },
 	{ NULL,			NULL,		false }
 };
@@ -3786,9 +4738,7 @@ struct CMDS {
 static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
-	char cmdbuf[100];
 	bool found, access;
 	int i;
 
@@ -3803,8 +4753,7 @@ static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, c
 		if (strcmp(cmds[i].name, param) == 0) {
 			found = true;
 
-			sprintf(cmdbuf, "|%s|", param);
-			if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
+			if (ISPRIVGROUP(group) || CMDALLOWED(group, i))
 				access = true;
 
 			break;
@@ -3817,17 +4766,16 @@ static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, c
 	root = api_add_const(root, "Exists", found ? YES : NO, false);
 	root = api_add_const(root, "Access", access ? YES : NO, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
 
-static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
+// Render the reply (including any needed JSON closure) into buf,
+// which must be at least SOCKBUFSIZ + sizeof(JSON_CLOSE) + sizeof(JSON_END)
+// Returns the number of bytes to send, including the terminating '\0'
+static int render_result(struct io_data *io_data, bool isjson, char *buf)
 {
-	char buf[SOCKBUFSIZ + sizeof(JSON_CLOSE) + sizeof(JSON_END)];
-	int count, res, tosend, len, n;
-
 	strcpy(buf, io_data->ptr);
 
 	if (io_data->close)
@@ -3840,10 +4788,71 @@ static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
 			strcat(buf, JSON_END);
 	}
 
-	len = strlen(buf);
-	tosend = len+1;
+	return strlen(buf) + 1;
+}
+
+#ifdef HAVE_LIBZ
+// Compress a reply payload in one pass into a malloc'd frame of u32le
+// compressed length, u32le raw length, then the zlib stream
+// Returns NULL if zlib fails or the payload grew, so the caller can fall
+// back to sending it uncompressed
+static char *api_compress(const char *payload, int len, int *framelen)
+{
+	uLongf clen = compressBound(len);
+	char *frame = malloc(clen + 8);
+
+	if (!frame)
+		return NULL;
+	if (compress2((Bytef *)(frame + 8), &clen, (const Bytef *)payload, len,
+		      Z_DEFAULT_COMPRESSION) != Z_OK || clen >= (uLongf)len) {
+		free(frame);
+		return NULL;
+	}
+	bin_u32(frame, clen);
+	bin_u32(frame + 4, len);
+	*framelen = (int)clen + 8;
+	return frame;
+}
+#endif
+
+#ifndef HAVE_SYS_EPOLL_H
+static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
+{
+	char buf[SOCKBUFSIZ + sizeof(JSON_CLOSE) + sizeof(JSON_END)];
+	int count, res, tosend, len, n;
+	char *sendbuf = buf;
+#ifdef HAVE_LIBZ
+	char *zbuf = NULL;
+#endif
+
+	if (io_data->bin) {
+		// u32le length prefix then the raw record stream
+		len = io_data->cur - io_data->ptr;
+		bin_u32(buf, len);
+		memcpy(buf + 4, io_data->ptr, len);
+		tosend = len + 4;
+		io_data->bin = false;
+#ifdef HAVE_LIBZ
+		if (io_data->zlib)
+			zbuf = api_compress(buf + 4, len, &tosend);
+#endif
+	} else {
+		tosend = render_result(io_data, isjson, buf);
+		len = tosend - 1;
+#ifdef HAVE_LIBZ
+		if (io_data->zlib)
+			zbuf = api_compress(buf, len, &tosend);
+#endif
+	}
+#ifdef HAVE_LIBZ
+	io_data->zlib = false;
+	if (zbuf) {
+		applog(LOG_DEBUG, "API: compressed reply %d to %d", len, tosend - 8);
+		sendbuf = zbuf;
+	}
+#endif
 
-	applog(LOG_DEBUG, "API: send reply: (%d) '%.10s%s'", tosend, buf, len > 10 ? "..." : BLANK);
+	applog(LOG_DEBUG, "API: send reply: (%d) '%.10s%s'", tosend, sendbuf, len > 10 ? "..." : BLANK);
 
 	count = 0;
 	while (count++ < 5 && tosend > 0) {
@@ -3855,10 +4864,10 @@ static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
 		FD_SET(c, &wd);
 		if ((res = select(c + 1, NULL, &wd, NULL, &timeout)) < 1) {
 			applog(LOG_WARNING, "API: send select failed (%d)", res);
-			return;
+			break;
 		}
 
-		n = send(c, buf, tosend, 0);
+		n = send(c, sendbuf, tosend, 0);
 
 		if (SOCKETFAIL(n)) {
 			if (sock_blocks())
@@ -3866,7 +4875,7 @@ static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
 
 			applog(LOG_WARNING, "API: send (%d) failed: %s", tosend, SOCKERRMSG);
 
-			return;
+			break;
 		} else {
 			if (count <= 1) {
 				if (n == tosend)
@@ -3883,28 +4892,136 @@ static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
 			tosend -= n;
 		}
 	}
+#ifdef HAVE_LIBZ
+	if (zbuf)
+		free(zbuf);
+#endif
 }
+#endif
 
-static void tidyup(__maybe_unused void *arg)
+// Parse one received command and run it, leaving the reply in io_data
+// Returns whether the request (and so the reply) is JSON
+static bool api_dispatch(struct io_data *io_data, SOCKETTYPE c, char *buf, int n, char group, char *connectaddr)
 {
-	mutex_lock(&quit_restart_lock);
+	char param_buf[TMPBUFSIZ];
+	char *cmd = NULL;
+	char *param = NULL;
+	json_error_t json_err;
+	json_t *json_config = NULL;
+	json_t *json_val;
+	bool isjson = false;
+	bool did = false;
+	int i;
 
-	SOCKETTYPE *apisock = (SOCKETTYPE *)arg;
+	// the time of the request in now
+	when = time(NULL);
+	io_reinit(io_data);
 
-	bye = true;
+	// a leading ISBIN byte asks for the compact binary reply format
+	if (*buf == ISBIN) {
+		io_data->bin = true;
+		buf++;
+		n--;
+	} else
+		io_data->bin = false;
+	io_data->zlib = false;
 
-	if (*apisock != INVSOCK) {
-		shutdown(*apisock, SHUT_RDWR);
-		CLOSESOCKET(*apisock);
-		*apisock = INVSOCK;
-	}
+	if (*buf != ISJSON) {
+		param = strchr(buf, SEPARATOR);
+		if (param != NULL)
+			*(param++) = '\0';
 
-	if (ipaccess != NULL) {
-		free(ipaccess);
-		ipaccess = NULL;
+		cmd = buf;
 	}
+	else {
+		isjson = true;
 
-	io_free();
+#if JANSSON_MAJOR_VERSION > 2 || (JANSSON_MAJOR_VERSION == 2 && JANSSON_MINOR_VERSION > 0)
+		json_config = json_loadb(buf, n, 0, &json_err);
+#elif JANSSON_MAJOR_VERSION > 1
+		json_config = json_loads(buf, 0, &json_err);
+#else
+		json_config = json_loads(buf, &json_err);
+#endif
+
+		if (!json_is_object(json_config)) {
+			message(io_data, MSG_INVJSON, 0, NULL, isjson);
+			did = true;
+		} else {
+			json_val = json_object_get(json_config, JSON_COMMAND);
+			if (json_val == NULL) {
+				message(io_data, MSG_MISCMD, 0, NULL, isjson);
+				did = true;
+			} else {
+				if (!json_is_string(json_val)) {
+					message(io_data, MSG_INVCMD, 0, NULL, isjson);
+					did = true;
+				} else {
+					cmd = (char *)json_string_value(json_val);
+					json_val = json_object_get(json_config, JSON_PARAMETER);
+					if (json_is_string(json_val))
+						param = (char *)json_string_value(json_val);
+					else if (json_is_integer(json_val)) {
+						sprintf(param_buf, "%d", (int)json_integer_value(json_val));
+						param = param_buf;
+					} else if (json_is_real(json_val)) {
+						sprintf(param_buf, "%f", (double)json_real_value(json_val));
+						param = param_buf;
+					}
+#ifdef HAVE_LIBZ
+					if (json_is_true(json_object_get(json_config, JSON_ZLIB)))
+						io_data->zlib = true;
+#endif
+				}
+			}
+		}
+	}
+
+	if (!did) {
+		for (i = 0; cmds[i].name != NULL; i++) {
+			if (strcmp(cmd, cmds[i].name) == 0) {
+				if (ISPRIVGROUP(group) || CMDALLOWED(group, i))
+					(cmds[i].func)(io_data, c, param, isjson, group);
+				else {
+					message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
+					applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", connectaddr, cmds[i].name);
+				}
+
+				did = true;
+				break;
+			}
+		}
+	}
+
+	if (!did)
+		message(io_data, MSG_INVCMD, 0, NULL, isjson);
+
+	if (isjson && json_is_object(json_config))
+		json_decref(json_config);
+
+	return isjson;
+}
+
+static void tidyup(__maybe_unused void *arg)
+{
+	mutex_lock(&quit_restart_lock);
+
+	SOCKETTYPE *apisock = (SOCKETTYPE *)arg;
+
+	bye = true;
+
+	if (*apisock != INVSOCK) {
+		shutdown(*apisock, SHUT_RDWR);
+		CLOSESOCKET(*apisock);
+		*apisock = INVSOCK;
+	}
+
+	if (ipaccess != NULL) {
+		free(ipaccess);
+		ipaccess = NULL;
+	}
+
+	io_free();
 
 	mutex_unlock(&quit_restart_lock);
 }
@@ -3921,7 +5038,7 @@ static void setup_groups()
 	char cmdbuf[100];
 	char *cmd;
 	bool addstar, did;
-	int i;
+	int numcmds, i;
 
 	buf = malloc(strlen(api_groups) + 1);
 	if (unlikely(!buf))
@@ -4041,6 +5158,24 @@ static void setup_groups()
 
 	// W (PRIVGROUP) is handled as a special case since it simply means all commands
 
+	// Precompute the per command access of each group so dispatch doesn't
+	// search the command string on every request
+	for (numcmds = 0; cmds[numcmds].name != NULL; numcmds++)
+		;
+	for (i = 0; i < (int)(sizeof(apigroups) / sizeof(apigroups[0])); i++) {
+		int j;
+
+		if (apigroups[i].commands == NULL)
+			continue;
+		apigroups[i].allowed = malloc(numcmds * sizeof(bool));
+		if (unlikely(!apigroups[i].allowed))
+			quit(1, "Failed to malloc group allowed buf");
+		for (j = 0; j < numcmds; j++) {
+			sprintf(cmdbuf, "|%s|", cmds[j].name);
+			apigroups[i].allowed[j] = strstr(apigroups[i].commands, cmdbuf) != NULL;
+		}
+	}
+
 	free(buf);
 	return;
 }
@@ -4145,6 +5280,30 @@ popipo:
 	}
 
 	free(buf);
+
+	// Index the rules by first octet for O(1) lookups in check_connect
+	for (i = 0; i < 256; i++) {
+		in_addr_t octet = (in_addr_t)i << 24;
+		int j, n = 0;
+
+		free(ipaccess_idx[i]);
+		ipaccess_idx[i] = NULL;
+		for (j = 0; j < ips; j++) {
+			if ((octet & ipaccess[j].mask) == (ipaccess[j].ip & 0xff000000))
+				n++;
+		}
+		ipaccess_cnt[i] = n;
+		if (!n)
+			continue;
+		ipaccess_idx[i] = malloc(n * sizeof(int));
+		if (unlikely(!ipaccess_idx[i]))
+			quit(1, "Failed to malloc ipaccess idx");
+		n = 0;
+		for (j = 0; j < ips; j++) {
+			if ((octet & ipaccess[j].mask) == (ipaccess[j].ip & 0xff000000))
+				ipaccess_idx[i][n++] = j;
+		}
+	}
 }
 
 static void *quit_thread(__maybe_unused void *userdata)
@@ -4184,11 +5343,15 @@ static bool check_connect(struct sockaddr_in *cli, char **connectaddr, char *gro
 
 	*group = NOPRIVGROUP;
 	if (opt_api_allow) {
-		int client_ip = htonl(cli->sin_addr.s_addr);
-		for (i = 0; i < ips; i++) {
-			if ((client_ip & ipaccess[i].mask) == ipaccess[i].ip) {
+		in_addr_t client_ip = htonl(cli->sin_addr.s_addr);
+		int octet = (client_ip >> 24) & 0xff;
+
+		for (i = 0; i < ipaccess_cnt[octet]; i++) {
+			struct IP4ACCESS *ipa = &ipaccess[ipaccess_idx[octet][i]];
+
+			if ((client_ip & ipa->mask) == ipa->ip) {
 				addrok = true;
-				*group = ipaccess[i].group;
+				*group = ipa->group;
 				break;
 			}
 		}
@@ -4202,29 +5365,81 @@ static bool check_connect(struct sockaddr_in *cli, char **connectaddr, char *gro
 	return addrok;
 }
 
-static void mcast()
+static SOCKETTYPE mcast_sock = INVSOCK;
+static SOCKETTYPE mcast_reply_sock = INVSOCK;
+static char *expect_code;
+static size_t expect_code_len;
+static char mcast_replybuf[1024];
+
+struct token_bucket {
+	in_addr_t addr;
+	time_t last;
+	int tokens;
+};
+
+// Take a token from addr's per source bucket, refilling at rate tokens a
+// second up to burst - a new (or aged out) source takes over the stalest
+// slot with a full bucket
+static bool take_token(struct token_bucket *buckets, int nbuckets, int burst, int rate, in_addr_t addr)
+{
+	struct token_bucket *bucket = NULL;
+	struct token_bucket *victim = &buckets[0];
+	time_t now = time(NULL);
+	int i;
+
+	for (i = 0; i < nbuckets; i++) {
+		if (buckets[i].addr == addr) {
+			bucket = &buckets[i];
+			break;
+		}
+		if (buckets[i].last < victim->last)
+			victim = &buckets[i];
+	}
+
+	if (bucket == NULL) {
+		bucket = victim;
+		bucket->addr = addr;
+		bucket->tokens = burst;
+	} else {
+		bucket->tokens += (now - bucket->last) * rate;
+		if (bucket->tokens > burst)
+			bucket->tokens = burst;
+	}
+	bucket->last = now;
+
+	if (bucket->tokens <= 0)
+		return false;
+
+	bucket->tokens--;
+	return true;
+}
+
+// An aggressive discovery scanner can't make every rig burn CPU answering
+// it - MCAST_BURST probes then one a second
+#define MCAST_BUCKETS 16
+#define MCAST_BURST 5
+static struct token_bucket mcast_buckets[MCAST_BUCKETS];
+
+// Broken or abusive API clients reconnecting in a tight loop are turned
+// away at accept, before any reply buffer work is done for them
+#define API_BUCKETS 32
+#define API_CONN_BURST 30
+#define API_CONN_RATE 10
+static struct token_bucket api_buckets[API_BUCKETS];
+
+// Create and bind the mcast listen socket, the reply socket and the
+// precomputed expect/reply strings - neither port nor description change
+// after startup so the reply never needs reformatting
+static SOCKETTYPE mcast_setup(void)
 {
 	struct sockaddr_in listen;
 	struct ip_mreq grp;
-	struct sockaddr_in came_from;
 	time_t bindstart;
 	char *binderror;
-	SOCKETTYPE mcast_sock;
-	SOCKETTYPE reply_sock;
-	socklen_t came_from_siz;
-	char *connectaddr;
-	ssize_t rep;
+	SOCKETTYPE sock;
 	int bound;
-	int count;
-	int reply_port;
-	bool addrok;
-	char group;
 
 	char expect[] = "cgminer-"; // first 8 bytes constant
-	char *expect_code;
-	size_t expect_code_len;
-	char buf[1024];
-	char replybuf[1024];
 
 	memset(&grp, 0, sizeof(grp));
 	grp.imr_multiaddr.s_addr = inet_addr(opt_api_mcast_addr);
@@ -4232,10 +5447,10 @@ static void mcast()
 		quit(1, "Invalid Multicast Address");
 	grp.imr_interface.s_addr = INADDR_ANY;
 
-	mcast_sock = socket(AF_INET, SOCK_DGRAM, 0);
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
 
 	int optval = 1;
-	if (SOCKETFAIL(setsockopt(mcast_sock, SOL_SOCKET, SO_REUSEADDR, (void *)(&optval), sizeof(optval)))) {
+	if (SOCKETFAIL(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *)(&optval), sizeof(optval)))) {
 		applog(LOG_ERR, "API mcast setsockopt SO_REUSEADDR failed (%s)%s", SOCKERRMSG, MUNAVAILABLE);
 		goto die;
 	}
@@ -4249,7 +5464,7 @@ static void mcast()
 	bound = 0;
 	bindstart = time(NULL);
 	while (bound == 0) {
-		if (SOCKETFAIL(bind(mcast_sock, (struct sockaddr *)(&listen), sizeof(listen)))) {
+		if (SOCKETFAIL(bind(sock, (struct sockaddr *)(&listen), sizeof(listen)))) {
 			binderror = SOCKERRMSG;
 			if ((time(NULL) - bindstart) > 61)
 				break;
@@ -4264,7 +5479,7 @@ static void mcast()
 		goto die;
 	}
 
-	if (SOCKETFAIL(setsockopt(mcast_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (void *)(&grp), sizeof(grp)))) {
+	if (SOCKETFAIL(setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (void *)(&grp), sizeof(grp)))) {
 		applog(LOG_ERR, "API mcast join failed (%s)%s", SOCKERRMSG, MUNAVAILABLE);
 		goto die;
 	}
@@ -4275,17 +5490,45 @@ static void mcast()
 		quit(1, "Failed to malloc mcast expect_code");
 	snprintf(expect_code, expect_code_len+1, "%s%s-", expect, opt_api_mcast_code);
 
-	count = 0;
-	while (80085) {
-		cgsleep_ms(1000);
+	snprintf(mcast_replybuf, sizeof(mcast_replybuf),
+			"cgm-" API_MCAST_CODE "-%d-%s",
+			opt_api_port, opt_api_mcast_des);
+
+	mcast_reply_sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (SOCKETFAIL(mcast_reply_sock)) {
+		applog(LOG_ERR, "API mcast reply socket failed (%s)%s", SOCKERRMSG, MUNAVAILABLE);
+		goto die;
+	}
+
+	return sock;
+
+die:
+	CLOSESOCKET(sock);
+	return INVSOCK;
+}
+
+// Drain the mcast socket, answering valid probes with the precomputed reply
+// Shared between the epoll loop (non-blocking socket) and the fallback
+// thread (blocking socket, so this only returns on a receive error there)
+static void mcast_request(void)
+{
+	struct sockaddr_in came_from;
+	socklen_t came_from_siz;
+	char *connectaddr;
+	char buf[1024];
+	ssize_t rep;
+	int reply_port;
+	bool addrok;
+	char group;
 
-		count++;
+	while (42) {
 		came_from_siz = sizeof(came_from);
 		if (SOCKETFAIL(rep = recvfrom(mcast_sock, buf, sizeof(buf) - 1,
 						0, (struct sockaddr *)(&came_from), &came_from_siz))) {
-			applog(LOG_DEBUG, "API mcast failed count=%d (%s) (%d)",
-					count, SOCKERRMSG, (int)mcast_sock);
-			continue;
+			if (!sock_blocks())
+				applog(LOG_DEBUG, "API mcast failed (%s) (%d)",
+						SOCKERRMSG, (int)mcast_sock);
+			return;
 		}
 
 		addrok = check_connect(&came_from, &connectaddr, &group);
@@ -4294,6 +5537,11 @@ static void mcast()
 		if (!addrok)
 			continue;
 
+		if (!take_token(mcast_buckets, MCAST_BUCKETS, MCAST_BURST, 1, came_from.sin_addr.s_addr)) {
+			applog(LOG_DEBUG, "API mcast from %s rate limited", connectaddr);
+			continue;
+		}
+
 		buf[rep] = '\0';
 		if (rep > 0 && buf[rep-1] == '\n')
 			buf[--rep] = '\0';
@@ -4313,32 +5561,43 @@ static void mcast()
 							&buf[expect_code_len], reply_port);
 
 				came_from.sin_port = htons(reply_port);
-				reply_sock = socket(AF_INET, SOCK_DGRAM, 0);
-
-				snprintf(replybuf, sizeof(replybuf),
-							"cgm-" API_MCAST_CODE "-%d-%s",
-							opt_api_port, opt_api_mcast_des);
 
-				rep = sendto(reply_sock, replybuf, strlen(replybuf)+1,
+				rep = sendto(mcast_reply_sock, mcast_replybuf, strlen(mcast_replybuf)+1,
 						0, (struct sockaddr *)(&came_from),
 						sizeof(came_from));
 				if (SOCKETFAIL(rep)) {
 					applog(LOG_DEBUG, "API mcast send reply failed (%s) (%d)",
-								SOCKERRMSG, (int)reply_sock);
+								SOCKERRMSG, (int)mcast_reply_sock);
 				} else {
 					applog(LOG_DEBUG, "API mcast send reply (%s) succeeded (%d) (%d)",
-								replybuf, (int)rep, (int)reply_sock);
+								mcast_replybuf, (int)rep, (int)mcast_reply_sock);
 				}
-
-				CLOSESOCKET(reply_sock);
 			}
 		} else
 			applog(LOG_DEBUG, "API mcast request was no good");
 	}
+}
 
-die:
+#ifdef HAVE_SYS_EPOLL_H
+// The socket is drained by the API epoll loop rather than its own thread
+void mcast_init()
+{
+	mcast_sock = mcast_setup();
+	if (mcast_sock != INVSOCK)
+		fcntl(mcast_sock, F_SETFL, fcntl(mcast_sock, F_GETFL, 0) | O_NONBLOCK);
+}
+#else
+static void mcast(void)
+{
+	mcast_sock = mcast_setup();
+	if (mcast_sock == INVSOCK)
+		return;
 
-	CLOSESOCKET(mcast_sock);
+	while (80085) {
+		mcast_request();
+		// only gets here on a receive error - don't spin
+		cgsleep_ms(1000);
+	}
 }
 
 static void *mcast_thread(void *userdata)
@@ -4368,33 +5627,564 @@ void mcast_init()
 	if (thr_info_create(thr, NULL, mcast_thread, thr))
 		quit(1, "API mcast thread create failed");
 }
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+/* Non-blocking API socket handling: clients are multiplexed onto an epoll
+ * instance with a per-client buffered reply, so a stalled monitoring client
+ * can no longer hold up every other client the way the old blocking
+ * accept/recv/send loop could. Command handling itself is unchanged and
+ * still runs one command at a time on the API thread. */
+
+// Drop a client that hasn't completed its request/reply within this long
+#define API_CLIENT_TIMEOUT 20
+
+struct api_client {
+	SOCKETTYPE fd;
+	char group;
+	bool subscribed;
+	bool persist;
+	char addr[INET_ADDRSTRLEN];
+	char recvbuf[TMPBUFSIZ];
+	int recvlen;
+	char *reply;
+	int replysiz;
+	int replylen;
+	int replysent;
+	time_t deadline;
+	struct api_client *prev;
+	struct api_client *next;
+};
+
+static struct api_client *api_clients;
+
+static void api_client_close(int epfd, struct api_client *client)
+{
+	if (client->subscribed)
+		api_subscribers--;
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, client->fd, NULL);
+	CLOSESOCKET(client->fd);
+
+	if (client->prev)
+		client->prev->next = client->next;
+	else
+		api_clients = client->next;
+	if (client->next)
+		client->next->prev = client->prev;
+
+	if (client->reply) {
+		mem_account(MEM_APIIO, -(int64_t)client->replysiz);
+		free(client->reply);
+	}
+	free(client);
+}
+
+static void api_client_accept(int epfd, SOCKETTYPE sock)
+{
+	struct api_client *client;
+	struct epoll_event ev;
+	struct sockaddr_in cli;
+	socklen_t clisiz;
+	char *connectaddr;
+	bool addrok;
+	SOCKETTYPE c;
+	char group;
+
+	while (true) {
+		clisiz = sizeof(cli);
+		c = accept(sock, (struct sockaddr *)(&cli), &clisiz);
+		if (SOCKETFAIL(c)) {
+			if (!sock_blocks())
+				applog(LOG_ERR, "API failed (%s)%s (%d)", SOCKERRMSG, UNAVAILABLE, (int)sock);
+			return;
+		}
+
+		addrok = check_connect(&cli, &connectaddr, &group);
+		applog(LOG_DEBUG, "API: connection from %s - %s",
+					connectaddr, addrok ? "Accepted" : "Ignored");
+
+		if (!addrok) {
+			CLOSESOCKET(c);
+			continue;
+		}
+
+		if (!take_token(api_buckets, API_BUCKETS, API_CONN_BURST, API_CONN_RATE, cli.sin_addr.s_addr)) {
+			applog(LOG_DEBUG, "API: rate limiting connections from %s", connectaddr);
+			CLOSESOCKET(c);
+			continue;
+		}
+
+		fcntl(c, F_SETFL, fcntl(c, F_GETFL, 0) | O_NONBLOCK);
+
+		client = calloc(1, sizeof(*client));
+		if (unlikely(!client))
+			quit(1, "Failed to calloc api client");
+
+		client->fd = c;
+		client->group = group;
+		snprintf(client->addr, sizeof(client->addr), "%s", connectaddr);
+		client->deadline = time(NULL) + API_CLIENT_TIMEOUT;
+
+		client->next = api_clients;
+		if (client->next)
+			client->next->prev = client;
+		api_clients = client;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = client;
+		if (unlikely(epoll_ctl(epfd, EPOLL_CTL_ADD, c, &ev) == -1)) {
+			applog(LOG_ERR, "API: failed to epoll_ctl add client (%s)", SOCKERRMSG);
+			api_client_close(epfd, client);
+		}
+	}
+}
+
+// Queue len bytes for sending to the client, growing its buffer as needed
+// A client that falls more than SOCKBUFSIZ behind is dropped as stalled
+static bool api_client_queue(int epfd, struct api_client *client, const char *buf, int len)
+{
+	struct epoll_event ev;
+	int pending;
+
+	pending = client->replylen - client->replysent;
+	if (pending > 0 && client->replysent > 0) {
+		memmove(client->reply, client->reply + client->replysent, pending);
+		client->replylen = pending;
+		client->replysent = 0;
+	} else if (pending <= 0)
+		client->replylen = client->replysent = 0;
+
+	if (client->replylen + len > SOCKBUFSIZ) {
+		applog(LOG_DEBUG, "API: dropping stalled client %s", client->addr);
+		api_client_close(epfd, client);
+		return false;
+	}
+
+	if (client->replylen + len > client->replysiz) {
+		int new = client->replysiz ? client->replysiz * 2 : TMPBUFSIZ;
+
+		if (new < client->replylen + len)
+			new = client->replylen + len;
+
+		client->reply = realloc(client->reply, new);
+		if (unlikely(!client->reply))
+			quit(1, "Failed to realloc api client reply");
+		mem_account(MEM_APIIO, (int64_t)new - (int64_t)client->replysiz);
+		client->replysiz = new;
+	}
+
+	memcpy(client->reply + client->replylen, buf, len);
+	client->replylen += len;
+
+	ev.events = EPOLLOUT | (client->subscribed ? EPOLLIN : 0);
+	ev.data.ptr = client;
+	if (unlikely(epoll_ctl(epfd, EPOLL_CTL_MOD, client->fd, &ev) == -1)) {
+		applog(LOG_ERR, "API: failed to epoll_ctl mod client (%s)", SOCKERRMSG);
+		api_client_close(epfd, client);
+		return false;
+	}
+
+	return true;
+}
+
+// Push an event line to every subscribed client
+static void api_broadcast(int epfd, const char *line, int len)
+{
+	struct api_client *client = api_clients;
+	struct api_client *next;
+
+	while (client) {
+		next = client->next;
+		if (client->subscribed)
+			api_client_queue(epfd, client, line, len);
+		client = next;
+	}
+}
+
+// Stream the reply segments to the client with writev straight from the
+// buffers they were built in, copying only whatever does not fit in the
+// socket buffer into the client's pending buffer for the loop to drain
+// Returns false if the client was closed along the way
+static bool api_client_sendv(int epfd, struct api_client *client, struct iovec *iov, int niov)
+{
+	size_t skip;
+	bool queued = false;
+	ssize_t n;
+	int i;
+
+	// never overtake data already buffered for this client
+	if (client->replylen > client->replysent)
+		n = 0;
+	else {
+		n = writev(client->fd, iov, niov);
+		if (n < 0) {
+			if (!sock_blocks()) {
+				applog(LOG_DEBUG, "API: writev failed: %s", SOCKERRMSG);
+				api_client_close(epfd, client);
+				return false;
+			}
+			n = 0;
+		}
+	}
+
+	skip = n;
+	for (i = 0; i < niov; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		if (!api_client_queue(epfd, client, (char *)iov[i].iov_base + skip,
+				      iov[i].iov_len - skip))
+			return false;
+		queued = true;
+		skip = 0;
+	}
+
+	// everything went out inline - plain clients are done, subscribers
+	// and persistent sessions stay open waiting for more
+	if (!queued && !client->subscribed && !client->persist) {
+		api_client_close(epfd, client);
+		return false;
+	}
+	return true;
+}
+
+// Run one command and stream the reply, returning false if the client was
+// closed along the way
+static bool api_client_command(struct io_data *io_data, int epfd, struct api_client *client, char *buf, int n)
+{
+	struct iovec iov[4];
+	char lenbuf[4];
+	bool isjson;
+	int niov;
+
+	isjson = api_dispatch(io_data, client->fd, buf, n, client->group, client->addr);
+
+	if (subscribe_request) {
+		subscribe_request = false;
+		if (!client->subscribed) {
+			client->subscribed = true;
+			api_subscribers++;
+		}
+	}
+
+#ifdef HAVE_LIBZ
+	if (io_data->zlib) {
+		char rbuf[SOCKBUFSIZ + sizeof(JSON_CLOSE) + sizeof(JSON_END)];
+		char *frame, *payload;
+		int len, framelen;
+
+		io_data->zlib = false;
+		if (io_data->bin) {
+			payload = io_data->ptr;
+			len = io_data->cur - io_data->ptr;
+		} else {
+			payload = rbuf;
+			len = render_result(io_data, isjson, rbuf) - 1;
+		}
+		frame = api_compress(payload, len, &framelen);
+		if (frame) {
+			bool ret;
+
+			io_data->bin = false;
+			applog(LOG_DEBUG, "API: send compressed reply: %d of %d", framelen - 8, len);
+			iov[0].iov_base = frame;
+			iov[0].iov_len = framelen;
+			// sendv copies whatever it has to queue, so the frame
+			// can be freed as soon as it returns
+			ret = api_client_sendv(epfd, client, iov, 1);
+			free(frame);
+			return ret;
+		}
+	}
+#endif
+
+	niov = 0;
+	if (io_data->bin) {
+		// u32le length prefix then the raw record stream
+		io_data->bin = false;
+		bin_u32(lenbuf, io_data->cur - io_data->ptr);
+		iov[niov].iov_base = lenbuf;
+		iov[niov++].iov_len = sizeof(lenbuf);
+		iov[niov].iov_base = io_data->ptr;
+		iov[niov++].iov_len = io_data->cur - io_data->ptr;
+	} else {
+		iov[niov].iov_base = io_data->ptr;
+		iov[niov++].iov_len = io_data->cur - io_data->ptr;
+		if (io_data->close) {
+			iov[niov].iov_base = JSON_CLOSE;
+			iov[niov++].iov_len = sizeof(JSON_CLOSE) - 1;
+		}
+		if (isjson) {
+			iov[niov].iov_base = io_data->full ? JSON_END_TRUNCATED : JSON_END;
+			iov[niov++].iov_len = strlen(io_data->full ? JSON_END_TRUNCATED : JSON_END);
+		}
+		// subscriber stream frames are newline delimited rather than
+		// NUL terminated
+		iov[niov].iov_base = client->subscribed ? "\n" : "";
+		iov[niov++].iov_len = 1;
+	}
+
+	applog(LOG_DEBUG, "API: send reply: (%d) '%.10s%s'",
+			(int)(io_data->cur - io_data->ptr), io_data->ptr,
+			io_data->cur - io_data->ptr > 10 ? "..." : BLANK);
+
+	return api_client_sendv(epfd, client, iov, niov);
+}
+
+// Read the client's command(s), run them and stream the replies
+static void api_client_recv(struct io_data *io_data, int epfd, struct api_client *client)
+{
+	char *start, *nl;
+	int n, rem;
+
+	n = recv(client->fd, client->recvbuf + client->recvlen,
+		 sizeof(client->recvbuf) - 1 - client->recvlen, 0);
+	if (SOCKETFAIL(n)) {
+		if (sock_blocks())
+			return;
+		applog(LOG_DEBUG, "API: recv failed: %s", SOCKERRMSG);
+		api_client_close(epfd, client);
+		return;
+	}
+	if (n == 0) {
+		api_client_close(epfd, client);
+		return;
+	}
+	client->recvlen += n;
+	client->recvbuf[client->recvlen] = '\0';
+
+	applog(LOG_DEBUG, "API: recv command: (%d) '%s'", n, client->recvbuf);
+
+	// a plain HTTP GET means a Prometheus style scrape of /metrics
+	if (strncmp(client->recvbuf, "GET ", 4) == 0) {
+		struct iovec iov[2];
+		char header[128];
+		int bodylen, hdrlen, niov;
+
+		io_reinit(io_data);
+		io_data->bin = false;
+		if (strncmp(client->recvbuf, "GET /metrics", 12) == 0) {
+			metrics_text(io_data);
+			bodylen = io_data->cur - io_data->ptr;
+			hdrlen = snprintf(header, sizeof(header),
+				"HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: %d\r\n\r\n", bodylen);
+		} else {
+			bodylen = 0;
+			hdrlen = snprintf(header, sizeof(header),
+				"HTTP/1.0 404 Not Found\r\n"
+				"Content-Length: 0\r\n\r\n");
+		}
+
+		niov = 0;
+		iov[niov].iov_base = header;
+		iov[niov++].iov_len = hdrlen;
+		if (bodylen) {
+			iov[niov].iov_base = io_data->ptr;
+			iov[niov++].iov_len = bodylen;
+		}
+		client->recvlen = 0;
+		api_client_sendv(epfd, client, iov, niov);
+		return;
+	}
+
+	/* Newline terminated commands mark a persistent session: the
+	 * connection stays open between commands and any number of them may
+	 * be pipelined in a single read. Without a newline the classic one
+	 * command per connection behaviour is kept. */
+	start = client->recvbuf;
+	while ((nl = strchr(start, '\n'))) {
+		char *end = nl;
+
+		*nl = '\0';
+		if (end > start && *(end - 1) == '\r')
+			*(--end) = '\0';
+		client->persist = true;
+		client->deadline = time(NULL) + API_CLIENT_TIMEOUT;
+		if (end > start) {
+			if (!api_client_command(io_data, epfd, client, start, end - start))
+				return;
+		}
+		start = nl + 1;
+	}
+
+	rem = client->recvbuf + client->recvlen - start;
+	if (!client->persist) {
+		client->recvlen = 0;
+		api_client_command(io_data, epfd, client, start, rem);
+		return;
+	}
+
+	// keep any partial trailing command for the next read
+	if (rem && start != client->recvbuf)
+		memmove(client->recvbuf, start, rem);
+	client->recvlen = rem;
+	if (client->recvlen >= (int)sizeof(client->recvbuf) - 1) {
+		applog(LOG_DEBUG, "API: dropping client %s with oversized command", client->addr);
+		api_client_close(epfd, client);
+	}
+}
+
+static void api_client_send(int epfd, struct api_client *client)
+{
+	struct epoll_event ev;
+	int n;
+
+	while (client->replysent < client->replylen) {
+		n = send(client->fd, client->reply + client->replysent,
+			 client->replylen - client->replysent, 0);
+		if (SOCKETFAIL(n)) {
+			if (sock_blocks())
+				return;
+			applog(LOG_DEBUG, "API: send (%d) failed: %s",
+					client->replylen - client->replysent, SOCKERRMSG);
+			api_client_close(epfd, client);
+			return;
+		}
+		client->replysent += n;
+	}
+
+	if (!client->subscribed && !client->persist) {
+		api_client_close(epfd, client);
+		return;
+	}
+
+	// subscribers and persistent sessions stay open waiting for more
+	client->replylen = client->replysent = 0;
+	ev.events = EPOLLIN;
+	ev.data.ptr = client;
+	if (unlikely(epoll_ctl(epfd, EPOLL_CTL_MOD, client->fd, &ev) == -1)) {
+		applog(LOG_ERR, "API: failed to epoll_ctl mod client (%s)", SOCKERRMSG);
+		api_client_close(epfd, client);
+	}
+}
+
+static void api_event_loop(struct io_data *io_data, SOCKETTYPE sock)
+{
+	struct epoll_event events[QUEUE];
+	struct api_client *client;
+	struct api_event *event, *evnext;
+	time_t now, last_stats;
+	int epfd, n, i;
+
+	epfd = epoll_create(QUEUE);
+	if (unlikely(epfd == -1))
+		quit(1, "Failed to create API epoll fd");
+
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+	events[0].events = EPOLLIN;
+	events[0].data.ptr = NULL;
+	if (unlikely(epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &events[0]) == -1))
+		quit(1, "Failed to epoll_ctl add API listen socket");
+
+	if (mcast_sock != INVSOCK) {
+		events[0].events = EPOLLIN;
+		events[0].data.ptr = (void *)(&mcast_sock);
+		if (unlikely(epoll_ctl(epfd, EPOLL_CTL_ADD, mcast_sock, &events[0]) == -1))
+			applog(LOG_ERR, "Failed to epoll_ctl add API mcast socket (%s)", SOCKERRMSG);
+	}
+
+	last_stats = time(NULL);
+
+	while (!bye) {
+		n = epoll_wait(epfd, events, QUEUE, 1000);
+
+		for (i = 0; i < n && !bye; i++) {
+			client = events[i].data.ptr;
+			if (client == NULL)
+				api_client_accept(epfd, sock);
+			else if (events[i].data.ptr == (void *)(&mcast_sock))
+				mcast_request();
+			else if (events[i].events & (EPOLLERR | EPOLLHUP))
+				api_client_close(epfd, client);
+			else if (events[i].events & EPOLLOUT)
+				api_client_send(epfd, client);
+			else
+				api_client_recv(io_data, epfd, client);
+		}
+
+		now = time(NULL);
+
+		// push queued events and a periodic stat frame to subscribers
+		event = events_take();
+		while (event) {
+			evnext = event->next;
+			if (api_subscribers)
+				api_broadcast(epfd, event->line, strlen(event->line));
+			free(event->line);
+			free(event);
+			event = evnext;
+		}
+
+		if (api_subscribers && now - last_stats >= opt_log_interval) {
+			struct stats_snapshot snap = *stats_snapshot();
+			char sbuf[TMPBUFSIZ];
+			int slen;
+
+			slen = snprintf(sbuf, sizeof(sbuf),
+				"{\"event\":\"stats\",\"when\":%ld,\"elapsed\":%.0f,"
+				"\"mhs_av\":%.2f,\"mhs_rolling\":%.2f,"
+				"\"accepted\":%d,\"rejected\":%d,\"hw_errors\":%d,"
+				"\"best_share\":%"PRIu64"}\n",
+				(long)now, snap.total_secs,
+				snap.total_mhashes_done / (snap.total_secs ? snap.total_secs : 1),
+				snap.total_rolling,
+				snap.total_accepted, snap.total_rejected, snap.hw_errors,
+				snap.best_diff);
+			api_broadcast(epfd, sbuf, slen);
+			last_stats = now;
+		}
+
+		client = api_clients;
+		while (client) {
+			struct api_client *next = client->next;
+
+			if (!client->subscribed && now > client->deadline) {
+				applog(LOG_DEBUG, "API: dropping stalled client %s", client->addr);
+				api_client_close(epfd, client);
+			}
+			client = next;
+		}
+	}
+
+	while (api_clients)
+		api_client_close(epfd, api_clients);
+	if (mcast_sock != INVSOCK) {
+		CLOSESOCKET(mcast_sock);
+		mcast_sock = INVSOCK;
+	}
+	if (mcast_reply_sock != INVSOCK) {
+		CLOSESOCKET(mcast_reply_sock);
+		mcast_reply_sock = INVSOCK;
+	}
+	close(epfd);
+}
+#endif /* HAVE_SYS_EPOLL_H */
 
 void api(int api_thr_id)
 {
 	struct io_data *io_data;
 	struct thr_info bye_thr;
-	char buf[TMPBUFSIZ];
-	char param_buf[TMPBUFSIZ];
-	SOCKETTYPE c;
-	int n, bound;
-	char *connectaddr;
+	int bound;
 	char *binderror;
 	time_t bindstart;
 	short int port = opt_api_port;
 	struct sockaddr_in serv;
+#ifndef HAVE_SYS_EPOLL_H
+	char buf[TMPBUFSIZ];
+	SOCKETTYPE c;
+	int n;
+	char *connectaddr;
 	struct sockaddr_in cli;
 	socklen_t clisiz;
-	char cmdbuf[100];
-	char *cmd = NULL;
-	char *param;
 	bool addrok;
 	char group;
-	json_error_t json_err;
-	json_t *json_config = NULL;
-	json_t *json_val;
 	bool isjson;
-	bool did;
-	int i;
+#endif
 
 	SOCKETTYPE *apisock;
 
@@ -4410,6 +6200,7 @@ void api(int api_thr_id)
 	io_data = sock_io_new();
 
 	mutex_init(&quit_restart_lock);
+	mutex_init(&events_lock);
 
 	pthread_cleanup_push(tidyup, (void *)apisock);
 	my_thr_id = api_thr_id;
@@ -4507,6 +6298,10 @@ void api(int api_thr_id)
 	if (opt_api_mcast)
 		mcast_init();
 
+#ifdef HAVE_SYS_EPOLL_H
+	api_event_loop(io_data, *apisock);
+	goto die;
+#else
 	while (!bye) {
 		clisiz = sizeof(cli);
 		if (SOCKETFAIL(c = accept(*apisock, (struct sockaddr *)(&cli), &clisiz))) {
@@ -4518,6 +6313,11 @@ void api(int api_thr_id)
 		applog(LOG_DEBUG, "API: connection from %s - %s",
 					connectaddr, addrok ? "Accepted" : "Ignored");
 
+		if (addrok && !take_token(api_buckets, API_BUCKETS, API_CONN_BURST, API_CONN_RATE, cli.sin_addr.s_addr)) {
+			applog(LOG_DEBUG, "API: rate limiting connections from %s", connectaddr);
+			addrok = false;
+		}
+
 		if (addrok) {
 			n = recv(c, &buf[0], TMPBUFSIZ-1, 0);
 			if (SOCKETFAIL(n))
@@ -4533,94 +6333,13 @@ void api(int api_thr_id)
 			}
 
 			if (!SOCKETFAIL(n)) {
-				// the time of the request in now
-				when = time(NULL);
-				io_reinit(io_data);
-
-				did = false;
-
-				if (*buf != ISJSON) {
-					isjson = false;
-
-					param = strchr(buf, SEPARATOR);
-					if (param != NULL)
-						*(param++) = '\0';
-
-					cmd = buf;
-				}
-				else {
-					isjson = true;
-
-					param = NULL;
-
-#if JANSSON_MAJOR_VERSION > 2 || (JANSSON_MAJOR_VERSION == 2 && JANSSON_MINOR_VERSION > 0)
-					json_config = json_loadb(buf, n, 0, &json_err);
-#elif JANSSON_MAJOR_VERSION > 1
-					json_config = json_loads(buf, 0, &json_err);
-#else
-					json_config = json_loads(buf, &json_err);
-#endif
-
-					if (!json_is_object(json_config)) {
-						message(io_data, MSG_INVJSON, 0, NULL, isjson);
-						send_result(io_data, c, isjson);
-						did = true;
-					} else {
-						json_val = json_object_get(json_config, JSON_COMMAND);
-						if (json_val == NULL) {
-							message(io_data, MSG_MISCMD, 0, NULL, isjson);
-							send_result(io_data, c, isjson);
-							did = true;
-						} else {
-							if (!json_is_string(json_val)) {
-								message(io_data, MSG_INVCMD, 0, NULL, isjson);
-								send_result(io_data, c, isjson);
-								did = true;
-							} else {
-								cmd = (char *)json_string_value(json_val);
-								json_val = json_object_get(json_config, JSON_PARAMETER);
-								if (json_is_string(json_val))
-									param = (char *)json_string_value(json_val);
-								else if (json_is_integer(json_val)) {
-									sprintf(param_buf, "%d", (int)json_integer_value(json_val));
-									param = param_buf;
-								} else if (json_is_real(json_val)) {
-									sprintf(param_buf, "%f", (double)json_real_value(json_val));
-									param = param_buf;
-								}
-							}
-						}
-					}
-				}
-
-				if (!did) {
-					for (i = 0; cmds[i].name != NULL; i++) {
-						if (strcmp(cmd, cmds[i].name) == 0) {
-							sprintf(cmdbuf, "|%s|", cmd);
-							if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
-								(cmds[i].func)(io_data, c, param, isjson, group);
-							else {
-								message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
-								applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", connectaddr, cmds[i].name);
-							}
-
-							send_result(io_data, c, isjson);
-							did = true;
-							break;
-						}
-					}
-				}
-
-				if (!did) {
-					message(io_data, MSG_INVCMD, 0, NULL, isjson);
-					send_result(io_data, c, isjson);
-				}
-				if (isjson && json_is_object(json_config))
-					json_decref(json_config);
+				isjson = api_dispatch(io_data, c, buf, n, group, connectaddr);
+				send_result(io_data, c, isjson);
 			}
 		}
 		CLOSESOCKET(c);
 	}
+#endif
 die:
 	/* Blank line fix for older compilers since pthread_cleanup_pop is a
 	 * macro that gets confused by a label existing immediately before it
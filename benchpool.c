@@ -0,0 +1,371 @@
+/*
+ * Loopback stratum pool for end to end benchmarking. When started with
+ * --bench-pool a minimal in-process stratum server is spun up on an
+ * ephemeral localhost port and a pool pointing at it is added, so the
+ * full pipeline - stratum receive, work generation, the simulated
+ * devices, share submission - can be benchmarked reproducibly with no
+ * external pool. Jobs come from a built in template or from recorded
+ * mining.notify fixture lines, and every share is acknowledged after a
+ * configurable latency.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <jansson.h>
+
+#include "miner.h"
+#include "util.h"
+
+bool opt_bench_pool;
+int opt_bench_pool_latency = 10;
+char *opt_bench_pool_notify;
+
+#define BENCH_BUFSIZ 8192
+#define BENCH_MAX_CLIENTS 4
+#define BENCH_MAX_ACKS 512
+#define BENCH_NOTIFY_INTERVAL 10
+#define BENCH_MAX_FIXTURES 1024
+
+/* Coinbase halves of the built in job template, from the classic stratum
+ * protocol example - any valid hex works, the sim devices never hash it */
+#define BENCH_CB1 "01000000010000000000000000000000000000000000000000000000" \
+	"000000000000000000ffffffff20020862062f503253482f04b8864e5008"
+#define BENCH_CB2 "072f736c7573682f000000000100f2052a010000001976a914d23fcd" \
+	"f86f7e756a64a7a9688ef9903327048ed988ac00000000"
+
+struct bench_ack {
+	int64_t id;
+	struct timeval due;
+};
+
+struct bench_client {
+	SOCKETTYPE fd;
+	char buf[BENCH_BUFSIZ];
+	int len;
+	bool subscribed;
+	struct bench_ack acks[BENCH_MAX_ACKS];
+	int nacks;
+};
+
+static SOCKETTYPE bench_listen = INVSOCK;
+static struct bench_client bench_clients[BENCH_MAX_CLIENTS];
+
+static char *bench_fixtures[BENCH_MAX_FIXTURES];
+static int bench_nfixtures;
+static int bench_fixture_idx;
+
+/* Current built in job, the notify params array less the clean flag */
+static char bench_job[512];
+static unsigned int bench_jobno;
+
+static int bench_shares_total;
+static int bench_shares_last;
+
+static void bench_drop(struct bench_client *client)
+{
+	CLOSESOCKET(client->fd);
+	client->fd = INVSOCK;
+	client->len = 0;
+	client->nacks = 0;
+	client->subscribed = false;
+}
+
+static void bench_send(struct bench_client *client, const char *fmt, ...)
+{
+	char buf[BENCH_BUFSIZ];
+	int len, ofs = 0;
+	va_list ap;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
+	va_end(ap);
+	buf[len++] = '\n';
+
+	while (ofs < len) {
+		int sent = send(client->fd, buf + ofs, len - ofs, 0);
+
+		if (sent < 0) {
+			bench_drop(client);
+			return;
+		}
+		ofs += sent;
+	}
+}
+
+static void bench_new_job(void)
+{
+	if (bench_nfixtures) {
+		bench_fixture_idx = (bench_fixture_idx + 1) % bench_nfixtures;
+		return;
+	}
+	bench_jobno++;
+	snprintf(bench_job, sizeof(bench_job),
+		 "\"b%x\",\"%064x\",\"%s\",\"%s\",[],\"00000002\",\"1d00ffff\",\"%08x\"",
+		 bench_jobno, bench_jobno, BENCH_CB1, BENCH_CB2,
+		 (unsigned int)time(NULL));
+}
+
+static void bench_notify(struct bench_client *client, bool clean)
+{
+	if (bench_nfixtures) {
+		bench_send(client, "{\"id\":null,\"method\":\"mining.notify\",\"params\":%s}",
+			   bench_fixtures[bench_fixture_idx]);
+		return;
+	}
+	bench_send(client, "{\"id\":null,\"method\":\"mining.notify\",\"params\":[%s,%s]}",
+		   bench_job, clean ? "true" : "false");
+}
+
+static void bench_line(struct bench_client *client, const char *line)
+{
+	json_t *val, *id_val, *method;
+	const char *method_str;
+	json_error_t err;
+	int64_t id = 0;
+
+	val = JSON_LOADS(line, &err);
+	if (!val)
+		return;
+	id_val = json_object_get(val, "id");
+	if (id_val && json_is_integer(id_val))
+		id = json_integer_value(id_val);
+	method = json_object_get(val, "method");
+	method_str = method ? json_string_value(method) : NULL;
+	if (!method_str) {
+		json_decref(val);
+		return;
+	}
+
+	if (!strcasecmp(method_str, "mining.subscribe")) {
+		bench_send(client, "{\"id\":%"PRId64",\"error\":null,\"result\":"
+			   "[[[\"mining.notify\",\"bench\"]],\"deadbeef\",4]}", id);
+		bench_send(client, "{\"id\":null,\"method\":\"mining.set_difficulty\",\"params\":[1]}");
+		bench_notify(client, true);
+		client->subscribed = true;
+	} else if (!strcasecmp(method_str, "mining.submit")) {
+		bench_shares_total++;
+		bench_shares_last++;
+		if (opt_bench_pool_latency && client->nacks < BENCH_MAX_ACKS) {
+			struct bench_ack *ack = &client->acks[client->nacks++];
+			struct timeval lat;
+
+			ack->id = id;
+			cgtime(&ack->due);
+			us_to_timeval(&lat, (int64_t)opt_bench_pool_latency * 1000);
+			addtime(&lat, &ack->due);
+		} else
+			bench_send(client, "{\"id\":%"PRId64",\"error\":null,\"result\":true}", id);
+	} else if (id_val && !json_is_null(id_val)) {
+		/* authorize, extranonce.subscribe and anything else that
+		 * expects an answer just succeeds */
+		bench_send(client, "{\"id\":%"PRId64",\"error\":null,\"result\":true}", id);
+	}
+	json_decref(val);
+}
+
+static void bench_recv(struct bench_client *client)
+{
+	int n;
+
+	n = recv(client->fd, client->buf + client->len,
+		 sizeof(client->buf) - 1 - client->len, 0);
+	if (n <= 0) {
+		bench_drop(client);
+		return;
+	}
+	client->len += n;
+	client->buf[client->len] = '\0';
+
+	while (client->fd != INVSOCK) {
+		char *eol = strchr(client->buf, '\n');
+		int linelen;
+
+		if (!eol)
+			break;
+		*eol = '\0';
+		linelen = eol - client->buf + 1;
+		bench_line(client, client->buf);
+		if (client->fd == INVSOCK)
+			return;
+		client->len -= linelen;
+		memmove(client->buf, eol + 1, client->len + 1);
+	}
+	if (client->len >= (int)sizeof(client->buf) - 1)
+		bench_drop(client);
+}
+
+static void bench_load_fixtures(void)
+{
+	char buf[BENCH_BUFSIZ];
+	FILE *f;
+
+	f = fopen(opt_bench_pool_notify, "r");
+	if (!f)
+		quit(1, "Failed to open bench pool fixture file %s",
+		     opt_bench_pool_notify);
+	while (bench_nfixtures < BENCH_MAX_FIXTURES &&
+	       fgets(buf, sizeof(buf), f)) {
+		char *p = buf + strspn(buf, " \t");
+
+		p[strcspn(p, "\r\n")] = '\0';
+		if (*p != '[')
+			continue;
+		bench_fixtures[bench_nfixtures] = strdup(p);
+		if (!bench_fixtures[bench_nfixtures])
+			quit(1, "Failed to strdup bench fixture");
+		bench_nfixtures++;
+	}
+	fclose(f);
+	if (!bench_nfixtures)
+		quit(1, "No mining.notify fixture lines in %s",
+		     opt_bench_pool_notify);
+	applog(LOG_NOTICE, "Bench pool loaded %d notify fixture(s) from %s",
+	       bench_nfixtures, opt_bench_pool_notify);
+}
+
+static void *bench_thread(void __maybe_unused *userdata)
+{
+	struct timeval next_notify, interval;
+
+	pthread_detach(pthread_self());
+	RenameThread("benchpool");
+
+	us_to_timeval(&interval, BENCH_NOTIFY_INTERVAL * 1000000LL);
+	cgtime(&next_notify);
+	addtime(&interval, &next_notify);
+
+	while (42) {
+		struct timeval now, timeout, *earliest = &next_notify;
+		SOCKETTYPE maxfd = bench_listen;
+		fd_set rfds;
+		int i, j;
+
+		FD_ZERO(&rfds);
+		FD_SET(bench_listen, &rfds);
+		for (i = 0; i < BENCH_MAX_CLIENTS; i++) {
+			struct bench_client *client = &bench_clients[i];
+
+			if (client->fd == INVSOCK)
+				continue;
+			FD_SET(client->fd, &rfds);
+			if (client->fd > maxfd)
+				maxfd = client->fd;
+			if (client->nacks &&
+			    time_more(earliest, &client->acks[0].due))
+				earliest = &client->acks[0].due;
+		}
+
+		cgtime(&now);
+		if (time_more(&now, earliest))
+			timerclear(&timeout);
+		else
+			timersub(earliest, &now, &timeout);
+		if (select(maxfd + 1, &rfds, NULL, NULL, &timeout) < 0)
+			continue;
+
+		if (FD_ISSET(bench_listen, &rfds)) {
+			SOCKETTYPE fd = accept(bench_listen, NULL, NULL);
+
+			if (fd != INVSOCK) {
+				for (i = 0; i < BENCH_MAX_CLIENTS; i++)
+					if (bench_clients[i].fd == INVSOCK)
+						break;
+				if (i == BENCH_MAX_CLIENTS)
+					CLOSESOCKET(fd);
+				else
+					bench_clients[i].fd = fd;
+			}
+		}
+
+		cgtime(&now);
+		for (i = 0; i < BENCH_MAX_CLIENTS; i++) {
+			struct bench_client *client = &bench_clients[i];
+
+			if (client->fd == INVSOCK)
+				continue;
+			if (FD_ISSET(client->fd, &rfds))
+				bench_recv(client);
+			/* Flush share acks that have aged past the
+			 * configured latency */
+			for (j = 0; client->fd != INVSOCK && j < client->nacks &&
+			     time_more(&now, &client->acks[j].due); j++)
+				bench_send(client, "{\"id\":%"PRId64",\"error\":null,\"result\":true}",
+					   client->acks[j].id);
+			if (client->fd != INVSOCK && j) {
+				client->nacks -= j;
+				memmove(client->acks, client->acks + j,
+					client->nacks * sizeof(client->acks[0]));
+			}
+		}
+
+		if (time_more(&now, &next_notify)) {
+			bench_new_job();
+			for (i = 0; i < BENCH_MAX_CLIENTS; i++)
+				if (bench_clients[i].fd != INVSOCK &&
+				    bench_clients[i].subscribed)
+					bench_notify(&bench_clients[i], false);
+			applog(LOG_NOTICE, "Bench pool: %d shares in last %ds (%.1f/s), %d total",
+			       bench_shares_last, BENCH_NOTIFY_INTERVAL,
+			       (double)bench_shares_last / BENCH_NOTIFY_INTERVAL,
+			       bench_shares_total);
+			bench_shares_last = 0;
+			cgtime(&next_notify);
+			addtime(&interval, &next_notify);
+		}
+	}
+	return NULL;
+}
+
+/* Start the loopback stratum server on an ephemeral localhost port and
+ * return the port number to point the bench pool at */
+int bench_pool_start(void)
+{
+	struct sockaddr_in serv;
+	socklen_t servlen = sizeof(serv);
+	pthread_t pth;
+	int i, on = 1;
+
+	for (i = 0; i < BENCH_MAX_CLIENTS; i++)
+		bench_clients[i].fd = INVSOCK;
+	if (opt_bench_pool_notify)
+		bench_load_fixtures();
+	else
+		bench_new_job();
+
+	bench_listen = socket(AF_INET, SOCK_STREAM, 0);
+	if (bench_listen == INVSOCK)
+		quit(1, "Failed to create bench pool socket");
+	setsockopt(bench_listen, SOL_SOCKET, SO_REUSEADDR,
+		   (void *)&on, sizeof(on));
+	memset(&serv, 0, sizeof(serv));
+	serv.sin_family = AF_INET;
+	serv.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	serv.sin_port = 0;
+	if (bind(bench_listen, (struct sockaddr *)&serv, sizeof(serv)) < 0)
+		quit(1, "Failed to bind bench pool socket");
+	if (listen(bench_listen, BENCH_MAX_CLIENTS) < 0)
+		quit(1, "Failed to listen on bench pool socket");
+	if (getsockname(bench_listen, (struct sockaddr *)&serv, &servlen) < 0)
+		quit(1, "Failed to getsockname on bench pool socket");
+
+	if (pthread_create(&pth, NULL, bench_thread, NULL))
+		quit(1, "Failed to create bench pool thread");
+
+	applog(LOG_NOTICE, "Bench pool listening on 127.0.0.1:%d",
+	       ntohs(serv.sin_port));
+	return ntohs(serv.sin_port);
+}
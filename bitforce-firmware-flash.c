@@ -11,9 +11,12 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include <libgen.h>
 #include <arpa/inet.h>
+#include <sys/wait.h>
 
 #define BFL_FILE_MAGIC   "BFLDATA"
 #define BFL_UPLOAD_MAGIC "NGH-STREAM"
@@ -30,79 +33,140 @@ do {  \
 
 #define WAITFOROK(n, msg) \
 do {  \
-	myassert(fgets(buf, sizeof(buf), BFL), n, "Error reading response from " msg "\n");  \
-	myassert(!strcmp(buf, "OK\n"), n, "Invalid response from " msg ": %s%s", ERRRESP(buf));  \
+	myassert(fgets(buf, sizeof(buf), BFL), n, "%sError reading response from " msg "\n", devpfx);  \
+	myassert(!strcmp(buf, "OK\n"), n, "%sInvalid response from " msg ": %s%s", devpfx, ERRRESP(buf));  \
 } while(0)
 
-int main(int argc, char**argv)
+/* Device name prefix on output lines, so concurrent flashes stay readable */
+static char devpfx[64];
+static int multi;
+
+static int flash_one(const char *devpath, const char *fwpath)
 {
-	myassert(argc == 3, 1, "Usage: %s <serialdev> <firmware.bfl>\n", argv[0]);
-	setbuf(stdout, NULL);
-	
 	// Check filename
-	char *FWname = basename(strdup(argv[2]));
+	char *FWname = basename(strdup(fwpath));
 	size_t FWnameLen = strlen(FWname);
 	myassert(FWnameLen <= 255, 0x0f, "Firmware filename '%s' is too long\n", FWname);
 	uint8_t n8 = FWnameLen;
-	
+
 	// Open and check firmware file
-	FILE *FW = fopen(argv[2], "r");
-	myassert(FW, 0x10, "Failed to open '%s' for reading\n", argv[2]);
+	FILE *FW = fopen(fwpath, "r");
+	myassert(FW, 0x10, "Failed to open '%s' for reading\n", fwpath);
 	char buf[0x20];
-	myassert(1 == fread(buf, 7, 1, FW), 0x10, "Failed to read from '%s'\n", argv[2]);
-	myassert(!memcmp(buf, BFL_FILE_MAGIC, sizeof(BFL_FILE_MAGIC)-1), 0x11, "'%s' doesn't look like a BFL firmware\n", argv[2]);
-	myassert(!fseek(FW, 0, SEEK_END), 0x12, "Failed to find end of '%s'\n", argv[2]);
+	myassert(1 == fread(buf, 7, 1, FW), 0x10, "Failed to read from '%s'\n", fwpath);
+	myassert(!memcmp(buf, BFL_FILE_MAGIC, sizeof(BFL_FILE_MAGIC)-1), 0x11, "'%s' doesn't look like a BFL firmware\n", fwpath);
+	myassert(!fseek(FW, 0, SEEK_END), 0x12, "Failed to find end of '%s'\n", fwpath);
 	long FWlen = ftell(FW);
-	myassert(FWlen > 0, 0x12, "Couldn't get size of '%s'\n", argv[2]);
+	myassert(FWlen > 0, 0x12, "Couldn't get size of '%s'\n", fwpath);
 	myassert(!fseek(FW, 7, SEEK_SET), 0x12, "Failed to rewind firmware file after getting size\n");
 	FWlen -= 7;
-	printf("Firmware file looks OK :)\n");
-	
+	if (!multi)
+		printf("Firmware file looks OK :)\n");
+
 	// Open device
-	FILE *BFL = fopen(argv[1], "r+");
-	myassert(BFL, 0x20, "Failed to open '%s' for read/write\n", argv[1]);
-	myassert(!setvbuf(BFL, NULL, _IOFBF, 1032), 0x21, "Failed to setup buffer for device");
-	
+	FILE *BFL = fopen(devpath, "r+");
+	myassert(BFL, 0x20, "%sFailed to open '%s' for read/write\n", devpfx, devpath);
+	myassert(!setvbuf(BFL, NULL, _IOFBF, 1032), 0x21, "%sFailed to setup buffer for device", devpfx);
+
 	// ZAX: Start firmware upload
-	printf("Starting firmware upload... ");
-	myassert(1 == fwrite("ZAX", 3, 1, BFL), 0x22, "Failed to issue ZAX command\n");
+	printf("%sStarting firmware upload...%s", devpfx, multi ? "\n" : " ");
+	myassert(1 == fwrite("ZAX", 3, 1, BFL), 0x22, "%sFailed to issue ZAX command\n", devpfx);
 	WAITFOROK(0x22, "ZAX");
-	
+
 	// Firmware upload header
-	myassert(1 == fwrite(BFL_UPLOAD_MAGIC, sizeof(BFL_UPLOAD_MAGIC)-1, 1, BFL), 0x23, "Failed to send firmware upload header (magic)\n");
+	myassert(1 == fwrite(BFL_UPLOAD_MAGIC, sizeof(BFL_UPLOAD_MAGIC)-1, 1, BFL), 0x23, "%sFailed to send firmware upload header (magic)\n", devpfx);
 	uint32_t n32 = htonl(FWlen - FWlen / 6);
-	myassert(1 == fwrite(&n32, sizeof(n32), 1, BFL), 0x23, "Failed to send firmware upload header (size)\n");
-	myassert(1 == fwrite("\0\0", 2        , 1, BFL), 0x23, "Failed to send firmware upload header (padding 1)\n");
-	myassert(1 == fwrite(&n8, sizeof(n8)  , 1, BFL), 0x23, "Failed to send firmware upload header (filename length)\n");
-	myassert(1 == fwrite(FWname, n8       , 1, BFL), 0x23, "Failed to send firmware upload header (filename)\n");
-	myassert(1 == fwrite("\0>>>>>>>>", 9  , 1, BFL), 0x23, "Failed to send firmware upload header (padding 2)\n");
+	myassert(1 == fwrite(&n32, sizeof(n32), 1, BFL), 0x23, "%sFailed to send firmware upload header (size)\n", devpfx);
+	myassert(1 == fwrite("\0\0", 2        , 1, BFL), 0x23, "%sFailed to send firmware upload header (padding 1)\n", devpfx);
+	myassert(1 == fwrite(&n8, sizeof(n8)  , 1, BFL), 0x23, "%sFailed to send firmware upload header (filename length)\n", devpfx);
+	myassert(1 == fwrite(FWname, n8       , 1, BFL), 0x23, "%sFailed to send firmware upload header (filename)\n", devpfx);
+	myassert(1 == fwrite("\0>>>>>>>>", 9  , 1, BFL), 0x23, "%sFailed to send firmware upload header (padding 2)\n", devpfx);
 	WAITFOROK(0x23, "firmware upload header");
-	printf("OK, sending...\n");
-	
+	if (!multi)
+		printf("OK, sending...\n");
+
 	// Actual firmware upload
 	long i, j;
+	int pct, nextpct = 10;
 	for (i = 0, j = 0; i < FWlen; ++i) {
-		myassert(1 == fread(&n8, sizeof(n8), 1, FW), 0x30, "Error reading data from firmware file\n");
+		myassert(1 == fread(&n8, sizeof(n8), 1, FW), 0x30, "%sError reading data from firmware file\n", devpfx);
 		if (5 == i % 6)
 			continue;
 		n8 ^= 0x2f;
-		myassert(1 == fwrite(&n8, sizeof(n8), 1, BFL), 0x31, "Error sending data to device\n");
+		myassert(1 == fwrite(&n8, sizeof(n8), 1, BFL), 0x31, "%sError sending data to device\n", devpfx);
 		if (!(++j % 0x400)) {
-			myassert(1 == fwrite(">>>>>>>>", 8, 1, BFL), 0x32, "Error sending block-finish to device\n");
-			printf("\r%5.2f%% complete", (double)i * 100. / (double)FWlen);
+			myassert(1 == fwrite(">>>>>>>>", 8, 1, BFL), 0x32, "%sError sending block-finish to device\n", devpfx);
+			if (multi) {
+				// Whole lines at coarse steps so interleaved
+				// device outputs stay readable
+				pct = i * 100 / FWlen;
+				if (pct >= nextpct) {
+					printf("%s%d%% complete\n", devpfx, pct);
+					nextpct += 10;
+				}
+			} else
+				printf("\r%5.2f%% complete", (double)i * 100. / (double)FWlen);
 			WAITFOROK(0x32, "block-finish");
 		}
 	}
-	printf("\r100%% complete :)\n");
-	myassert(1 == fwrite(">>>>>>>>", 8, 1, BFL), 0x3f, "Error sending upload-finished to device\n");
-	myassert(fgets(buf, sizeof(buf), BFL), 0x3f, "Error reading response from upload-finished\n");
-	myassert(!strcmp(buf, "DONE\n"), 0x3f, "Invalid response from upload-finished: %s%s", ERRRESP(buf));
+	printf("%s100%% complete :)\n", multi ? devpfx : "\r");
+	myassert(1 == fwrite(">>>>>>>>", 8, 1, BFL), 0x3f, "%sError sending upload-finished to device\n", devpfx);
+	myassert(fgets(buf, sizeof(buf), BFL), 0x3f, "%sError reading response from upload-finished\n", devpfx);
+	myassert(!strcmp(buf, "DONE\n"), 0x3f, "%sInvalid response from upload-finished: %s%s", devpfx, ERRRESP(buf));
 
 	// ZBX: Finish programming
-	printf("Waiting for device... ");
-	myassert(1 == fwrite("ZBX", 3, 1, BFL), 0x40, "Failed to issue ZBX command\n");
+	printf("%sWaiting for device...%s", devpfx, multi ? "\n" : " ");
+	myassert(1 == fwrite("ZBX", 3, 1, BFL), 0x40, "%sFailed to issue ZBX command\n", devpfx);
 	WAITFOROK(0x40, "ZBX");
-	printf("All done! Try mining to test the flash succeeded.\n");
+	printf("%sAll done! Try mining to test the flash succeeded.\n", devpfx);
 
 	return 0;
 }
+
+int main(int argc, char**argv)
+{
+	int stagger = 0, first = 1, ndev, fails = 0, status, i;
+
+	if (argc > 2 && !strcmp(argv[1], "-s")) {
+		stagger = atoi(argv[2]);
+		myassert(stagger > 0, 1, "Stagger must be a positive number of seconds\n");
+		first = 3;
+	}
+	myassert(argc - first >= 2, 1, "Usage: %s [-s stagger_secs] <serialdev> [serialdev ...] <firmware.bfl>\n", argv[0]);
+	setbuf(stdout, NULL);
+
+	const char *fwpath = argv[argc - 1];
+	ndev = argc - 1 - first;
+
+	if (ndev == 1)
+		return flash_one(argv[first], fwpath);
+
+	/* Flash all devices concurrently, one child per device - independent
+	 * USB paths permit it. Stagger the starts with -s where shared hub
+	 * power limits require it. */
+	multi = 1;
+	pid_t pids[ndev];
+	for (i = 0; i < ndev; i++) {
+		if (i && stagger)
+			sleep(stagger);
+		pids[i] = fork();
+		myassert(pids[i] >= 0, 2, "Failed to fork for '%s'\n", argv[first + i]);
+		if (!pids[i]) {
+			snprintf(devpfx, sizeof(devpfx), "%s: ", basename(argv[first + i]));
+			return flash_one(argv[first + i], fwpath);
+		}
+	}
+	for (i = 0; i < ndev; i++) {
+		waitpid(pids[i], &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "%s: flash FAILED\n", argv[first + i]);
+			fails++;
+		}
+	}
+	if (fails)
+		fprintf(stderr, "%d of %d devices failed to flash\n", fails, ndev);
+	else
+		printf("All %d devices flashed\n", ndev);
+
+	return fails ? 1 : 0;
+}
@@ -36,8 +36,14 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #ifndef WIN32
 #include <sys/resource.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #else
 #include <windows.h>
 #endif
@@ -100,19 +106,29 @@ static char packagename[256];
 
 bool opt_work_update;
 bool opt_protocol;
+static bool opt_bench;
 static bool opt_benchmark;
+static int opt_verify_threads;
+static char *opt_benchmark_replay;
+static int opt_replay_speed = 1;
+static char *opt_stratum_trace;
 bool have_longpoll;
 bool want_per_device_stats;
 bool use_syslog;
 bool opt_quiet;
 bool opt_realquiet;
 bool opt_loginput;
+bool opt_clock_gov;
 bool opt_compact;
 const int opt_cutofftemp = 95;
 int opt_log_interval = 5;
 int opt_queue = 1;
+int opt_ntime_expand;
 int opt_scantime = -1;
 int opt_expiry = 120;
+int opt_rt_read_prio;
+int opt_rt_send_prio;
+int opt_submit_conns = 1;
 static const bool opt_time = true;
 unsigned long long global_hashrate;
 unsigned long global_quota_gcd = 1;
@@ -142,11 +158,19 @@ bool use_curses;
 static bool opt_submit_stale = true;
 static int opt_shares;
 bool opt_fail_only;
+int opt_warm_pools;
+int opt_net_timeout = 5;
 static bool opt_fix_protocol;
 bool opt_lowmem;
+static bool opt_lock_mem;
+/* Set once mlockall has succeeded, reported via the memstats API */
+bool mem_locked;
 bool opt_autofan;
 bool opt_autoengine;
 bool opt_noadl;
+static char *opt_affinity_api;
+static char *opt_affinity_miner;
+static char *opt_affinity_net;
 char *opt_api_allow = NULL;
 char *opt_api_groups;
 char *opt_api_description = PACKAGE_STRING;
@@ -181,6 +205,9 @@ bool opt_usb_list_all;
 cgsem_t usb_resource_sem;
 static pthread_t usb_poll_thread;
 static bool usb_polling;
+static libusb_hotplug_callback_handle hotplug_cbh;
+static bool hotplug_cb_registered;
+static cgsem_t hotplug_sem;
 #endif
 
 char *opt_kernel_path;
@@ -197,6 +224,7 @@ static int gwsched_thr_id;
 static int watchpool_thr_id;
 static int watchdog_thr_id;
 #ifdef HAVE_CURSES
+static int display_thr_id;
 static int input_thr_id;
 #endif
 int gpur_thr_id;
@@ -220,7 +248,6 @@ static pthread_mutex_t *stgd_lock;
 pthread_mutex_t console_lock;
 cglock_t ch_lock;
 static pthread_rwlock_t blk_lock;
-static pthread_mutex_t sshare_lock;
 
 pthread_rwlock_t netacc_lock;
 pthread_rwlock_t mining_thr_lock;
@@ -253,6 +280,12 @@ unsigned int found_blocks;
 unsigned int local_work;
 unsigned int total_go, total_ro;
 
+uint64_t memsys_bytes[MEM_MEMSYS];
+const char *memsys_names[MEM_MEMSYS] = {
+	"Work", "Stratum Jobs", "Sockbufs", "Shares Table", "Curl", "Json",
+	"API IO",
+};
+
 struct pool **pools;
 static struct pool *currentpool = NULL;
 
@@ -280,28 +313,42 @@ double current_diff = 0xFFFFFFFFFFFFFFFFULL;
 static char block_diff[8];
 uint64_t best_diff = 0;
 
+/* Ring of recently seen block identities, newest overwriting oldest. Work
+ * from blocks older than the last few is stale regardless, so a small fixed
+ * ring bounds memory without any pruning pass. Protected by blk_lock. */
+#define RECENT_BLOCKS 8
+
 struct block {
-	char hash[68];
-	UT_hash_handle hh;
-	int block_no;
+	unsigned char hash[32];
+	uint64_t block_id;
+	unsigned int block_no;
 };
 
-static struct block *blocks = NULL;
+static struct block recent_blocks[RECENT_BLOCKS];
+static int recent_block_next;
+static int recent_blocks_stored;
+
+/* block_id() of the current block for the single compare fast path */
+static uint64_t current_block_id;
 
 
 int swork_id;
 
-/* For creating a hash database of stratum shares submitted that have not had
- * a response yet */
+/* Database entry for a stratum share submitted that has not had a response
+ * yet. Each pool keeps its own hash of these under its own sshare_lock so
+ * the submit and receive paths of different pools never contend, plus a
+ * small cache of spent entries linked through cache_next for reuse. */
 struct stratum_share {
 	UT_hash_handle hh;
 	bool block;
 	struct work *work;
 	int id;
 	time_t sshare_time;
+	struct timeval sshare_sent;
+	struct stratum_share *cache_next;
 };
 
-static struct stratum_share *stratum_shares = NULL;
+#define SSHARE_CACHE_MAX 64
 
 char *opt_socks_proxy = NULL;
 
@@ -322,10 +369,32 @@ static int include_count;
 
 struct sigaction termhandler, inthandler;
 
-struct thread_q *getq;
+/* The staging path has its own mutex and condvar rather than borrowing a
+ * thread_q; pushes wake a single waiter and hash_pop_many chain-signals
+ * while work remains, so a burst of staged work never broadcasts to every
+ * waiting miner thread at once. */
+static pthread_mutex_t stgd_mutex;
+static pthread_cond_t stgd_cond;
 
 static int total_work;
-struct work *staged_work = NULL;
+
+/* Staged work is kept in two FIFO lanes appended in tv_staged order: clones
+ * that cannot be rolled further and rollable master items. hash_pop prefers
+ * the clone lane so masters are kept around to be reused, matching the old
+ * sorted uthash behaviour at O(1) per push and pop. The counter is
+ * maintained atomically so it can be read without taking stgd_lock. */
+static LIST_HEAD(staged_clones);
+static LIST_HEAD(staged_masters);
+
+/* Hashed timer wheel scheduling staged work expiry. Each work is hung off
+ * the slot its deadline hashes to when it is staged, making expiry O(1)
+ * per work; the watchdog only visits the slots whose time has come rather
+ * than sweeping the whole staged table while holding stgd_lock. One
+ * second granularity, protected by stgd_lock. */
+#define EXPIRY_WHEEL_SLOTS 64 /* power of two */
+static struct list_head expiry_wheel[EXPIRY_WHEEL_SLOTS];
+static time_t expiry_wheel_time;
+static int staged_count;
 
 struct schedtime {
 	bool enable;
@@ -425,6 +494,36 @@ static void applog_and_exit(const char *fmt, ...)
 
 static pthread_mutex_t sharelog_lock;
 static FILE *sharelog_file = NULL;
+static bool opt_sharelog_bin;
+#if defined(unix) || defined(__APPLE__)
+static char *opt_stats_shm;
+#endif
+
+/* Share log records are queued here and written out by a dedicated thread
+ * so share handling never blocks on the filesystem. The queue is bounded;
+ * records are dropped and counted if the writer can't keep up. */
+static struct mpsc_q *sharelog_q;
+static unsigned int sharelog_dropped;
+
+struct sharelog_rec {
+	size_t len;
+	char buf[];
+};
+
+/* Fixed width binary share log record, written in host byte order with a
+ * constant 224 byte stride so analytics tools can mmap the file. The
+ * fields mirror the text format with the pool url replaced by its number. */
+struct sharelog_bin {
+	uint32_t timestamp;
+	char disposition[8];
+	unsigned char target[32];
+	uint32_t pool_no;
+	char dev[8];
+	uint32_t device_id;
+	uint32_t thr_id;
+	unsigned char hash[32];
+	unsigned char data[128];
+};
 
 static struct thr_info *__get_thread(int thr_id)
 {
@@ -460,15 +559,59 @@ struct cgpu_info *get_devices(int id)
 	return cgpu;
 }
 
+static void sharelog_write(const char *buf, size_t len)
+{
+	size_t ret;
+
+	mutex_lock(&sharelog_lock);
+	ret = fwrite(buf, len, 1, sharelog_file);
+	fflush(sharelog_file);
+	mutex_unlock(&sharelog_lock);
+
+	if (ret != 1)
+		applog(LOG_ERR, "sharelog fwrite error");
+}
+
+static void *sharelog_thread(void __maybe_unused *userdata)
+{
+	struct sharelog_rec *rec;
+	unsigned int dropped;
+
+	pthread_detach(pthread_self());
+	RenameThread("Sharelog");
+
+	while (42) {
+		rec = mpscq_pop(sharelog_q, -1);
+		if (unlikely(!rec))
+			continue;
+		sharelog_write(rec->buf, rec->len);
+		free(rec);
+
+		dropped = sharelog_dropped;
+		if (unlikely(dropped) && __sync_bool_compare_and_swap(&sharelog_dropped, dropped, 0))
+			applog(LOG_ERR, "sharelog overflowed, %u records dropped", dropped);
+	}
+	return NULL;
+}
+
+static void sharelog_init(void)
+{
+	pthread_t pth;
+
+	sharelog_q = mpscq_new(4096);
+	if (unlikely(!sharelog_q))
+		return;
+	if (unlikely(pthread_create(&pth, NULL, sharelog_thread, NULL)))
+		sharelog_q = NULL;
+}
+
 static void sharelog(const char*disposition, const struct work*work)
 {
-	char *target, *hash, *data;
+	struct sharelog_rec *rec;
 	struct cgpu_info *cgpu;
 	unsigned long int t;
 	struct pool *pool;
 	int thr_id, rv;
-	char s[1024];
-	size_t ret;
 
 	if (!sharelog_file)
 		return;
@@ -477,29 +620,61 @@ static void sharelog(const char*disposition, const struct work*work)
 	cgpu = get_thr_cgpu(thr_id);
 	pool = work->pool;
 	t = (unsigned long int)(work->tv_work_found.tv_sec);
-	target = bin2hex(work->target, sizeof(work->target));
-	hash = bin2hex(work->hash, sizeof(work->hash));
-	data = bin2hex(work->data, sizeof(work->data));
-
-	// timestamp,disposition,target,pool,dev,thr,sharehash,sharedata
-	rv = snprintf(s, sizeof(s), "%lu,%s,%s,%s,%s%u,%u,%s,%s\n", t, disposition, target, pool->rpc_url, cgpu->drv->name, cgpu->device_id, thr_id, hash, data);
-	free(target);
-	free(hash);
-	free(data);
-	if (rv >= (int)(sizeof(s)))
-		s[sizeof(s) - 1] = '\0';
-	else if (rv < 0) {
-		applog(LOG_ERR, "sharelog printf error");
-		return;
-	}
 
-	mutex_lock(&sharelog_lock);
-	ret = fwrite(s, rv, 1, sharelog_file);
-	fflush(sharelog_file);
-	mutex_unlock(&sharelog_lock);
+	if (opt_sharelog_bin) {
+		struct sharelog_bin *bin;
+
+		rec = calloc(1, sizeof(*rec) + sizeof(*bin));
+		if (unlikely(!rec))
+			quit(1, "Failed to calloc sharelog rec");
+		rec->len = sizeof(*bin);
+		bin = (struct sharelog_bin *)rec->buf;
+		bin->timestamp = (uint32_t)t;
+		snprintf(bin->disposition, sizeof(bin->disposition), "%s", disposition);
+		memcpy(bin->target, work->target, sizeof(bin->target));
+		bin->pool_no = pool->pool_no;
+		snprintf(bin->dev, sizeof(bin->dev), "%s", cgpu->drv->name);
+		bin->device_id = cgpu->device_id;
+		bin->thr_id = thr_id;
+		memcpy(bin->hash, work->hash, sizeof(bin->hash));
+		memcpy(bin->data, work->data, sizeof(bin->data));
+	} else {
+		char *target, *hash, *data;
+		char s[1024];
+
+		target = bin2hex(work->target, sizeof(work->target));
+		hash = bin2hex(work->hash, sizeof(work->hash));
+		data = bin2hex(work->data, sizeof(work->data));
+
+		// timestamp,disposition,target,pool,dev,thr,sharehash,sharedata
+		rv = snprintf(s, sizeof(s), "%lu,%s,%s,%s,%s%u,%u,%s,%s\n", t, disposition, target, pool->rpc_url, cgpu->drv->name, cgpu->device_id, thr_id, hash, data);
+		free(target);
+		free(hash);
+		free(data);
+		if (rv >= (int)(sizeof(s))) {
+			s[sizeof(s) - 1] = '\0';
+			rv = sizeof(s) - 1;
+		} else if (rv < 0) {
+			applog(LOG_ERR, "sharelog printf error");
+			return;
+		}
 
-	if (ret != 1)
-		applog(LOG_ERR, "sharelog fwrite error");
+		rec = malloc(sizeof(*rec) + rv);
+		if (unlikely(!rec))
+			quit(1, "Failed to malloc sharelog rec");
+		rec->len = rv;
+		memcpy(rec->buf, s, rv);
+	}
+
+	/* Fall back to writing synchronously if the writer thread never came
+	 * up, otherwise queue the record and let it take the fwrite stall */
+	if (!sharelog_q) {
+		sharelog_write(rec->buf, rec->len);
+		free(rec);
+	} else if (unlikely(!mpscq_push(sharelog_q, rec))) {
+		free(rec);
+		__sync_add_and_fetch(&sharelog_dropped, 1);
+	}
 }
 
 static char *getwork_req = "{\"method\": \"getwork\", \"params\": [], \"id\":0}\n";
@@ -508,6 +683,14 @@ static char *gbt_req = "{\"id\": 0, \"method\": \"getblocktemplate\", \"params\"
 
 /* Adjust all the pools' quota to the greatest common denominator after a pool
  * has been added or the quotas changed. */
+/* The quota the scheduler actually distributes by: the performance scaled
+ * effective quota once adjust_quota_perf has computed one, else the
+ * configured quota as is. */
+static int effective_quota(struct pool *pool)
+{
+	return pool->quota_eff ? pool->quota_eff : pool->quota;
+}
+
 void adjust_quota_gcd(void)
 {
 	unsigned long gcd, lowest_quota = ~0UL, quota;
@@ -516,7 +699,7 @@ void adjust_quota_gcd(void)
 
 	for (i = 0; i < total_pools; i++) {
 		pool = pools[i];
-		quota = pool->quota;
+		quota = effective_quota(pool);
 		if (!quota)
 			continue;
 		if (quota < lowest_quota)
@@ -527,7 +710,7 @@ void adjust_quota_gcd(void)
 		gcd = lowest_quota;
 		for (i = 0; i < total_pools; i++) {
 			pool = pools[i];
-			quota = pool->quota;
+			quota = effective_quota(pool);
 			if (!quota)
 				continue;
 			while (quota % gcd)
@@ -540,7 +723,7 @@ void adjust_quota_gcd(void)
 		pool = pools[i];
 		pool->quota_used *= global_quota_gcd;
 		pool->quota_used /= gcd;
-		pool->quota_gcd = pool->quota / gcd;
+		pool->quota_gcd = effective_quota(pool) / gcd;
 	}
 
 	global_quota_gcd = gcd;
@@ -563,6 +746,7 @@ struct pool *add_pool(void)
 		quit(1, "Failed to pthread_cond_init in add_pool");
 	cglock_init(&pool->data_lock);
 	mutex_init(&pool->stratum_lock);
+	mutex_init(&pool->sshare_lock);
 	cglock_init(&pool->gbt_lock);
 	INIT_LIST_HEAD(&pool->curlring);
 
@@ -660,6 +844,16 @@ static char *set_int_1_to_10(const char *arg, int *i)
 	return set_int_range(arg, i, 1, 10);
 }
 
+static char *set_int_0_to_99(const char *arg, int *i)
+{
+	return set_int_range(arg, i, 0, 99);
+}
+
+static char *set_int_1_to_4(const char *arg, int *i)
+{
+	return set_int_range(arg, i, 1, MAX_SUBMIT_CONNS);
+}
+
 #ifdef USE_FPGA_SERIAL
 static char *add_serial(char *arg)
 {
@@ -745,6 +939,14 @@ static char *set_rr(enum pool_strategy *strategy)
  * stratum+tcp or by detecting a stratum server response */
 bool detect_stratum(struct pool *pool, char *url)
 {
+	char *xnsub = strstr(url, "#xnsub");
+
+	if (xnsub) {
+		/* Pool wants a mining.extranonce.subscribe after auth */
+		pool->extranonce_subscribe = true;
+		*xnsub = '\0';
+	}
+
 	if (!extract_sockaddr(url, &pool->sockaddr_url, &pool->stratum_port))
 		return false;
 
@@ -818,6 +1020,8 @@ static char *set_quota(char *arg)
 	pool = add_url();
 	setup_url(pool, url);
 	pool->quota = quota;
+	pool->quota_eff = 0;
+	pool->quota_perf = 0;
 	applog(LOG_INFO, "Setting pool %d to quota %d", pool->pool_no, pool->quota);
 	adjust_quota_gcd();
 
@@ -1079,6 +1283,15 @@ static char *set_null(const char __maybe_unused *arg)
 
 /* These options are available from config file or commandline */
 static struct opt_table opt_config_table[] = {
+	OPT_WITH_ARG("--affinity-api",
+		     opt_set_charp, NULL, &opt_affinity_api,
+		     "Hex mask of CPUs to bind the API thread to, e.g. 0xf0"),
+	OPT_WITH_ARG("--affinity-miner",
+		     opt_set_charp, NULL, &opt_affinity_miner,
+		     "Hex mask of CPUs to bind mining device threads to"),
+	OPT_WITH_ARG("--affinity-net",
+		     opt_set_charp, NULL, &opt_affinity_net,
+		     "Hex mask of CPUs to bind stratum and longpoll threads to"),
 	OPT_WITH_ARG("--api-allow",
 		     set_api_allow, NULL, NULL,
 		     "Allow API access only to the given list of [G:]IP[/Prefix] addresses[/subnets]"),
@@ -1115,9 +1328,26 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--balance",
 		     set_balance, &pool_strategy,
 		     "Change multipool strategy from failover to even share balance"),
+	OPT_WITHOUT_ARG("--bench",
+			opt_set_bool, &opt_bench,
+			"Run microbenchmarks of the hashing and codec primitives and exit"),
+#ifdef USE_SIM
+	OPT_WITHOUT_ARG("--bench-pool",
+			opt_set_bool, &opt_bench_pool,
+			"Mine against a built in loopback stratum pool for end to end benchmarks"),
+	OPT_WITH_ARG("--bench-pool-latency",
+		     set_int_0_to_9999, opt_show_intval, &opt_bench_pool_latency,
+		     "Milliseconds the loopback pool delays each share acknowledgement"),
+	OPT_WITH_ARG("--bench-pool-notify",
+		     opt_set_charp, NULL, &opt_bench_pool_notify,
+		     "File of recorded mining.notify params lines for the loopback pool to replay"),
+#endif
 	OPT_WITHOUT_ARG("--benchmark",
 			opt_set_bool, &opt_benchmark,
 			"Run cgminer in benchmark mode - produces no shares"),
+	OPT_WITH_ARG("--benchmark-replay",
+		     opt_set_charp, NULL, &opt_benchmark_replay,
+		     "Run in benchmark mode replaying a stratum trace recorded with --stratum-trace"),
 #if defined(USE_BITFORCE)
 	OPT_WITHOUT_ARG("--bfl-range",
 			opt_set_bool, &opt_bfl_noncerange,
@@ -1133,6 +1363,9 @@ static struct opt_table opt_config_table[] = {
 		     set_int_0_to_200, opt_show_intval, &opt_bxf_temp_target,
 		     "Set target temperature for BXF devices"),
 #endif
+	OPT_WITHOUT_ARG("--clock-governor",
+			opt_set_bool, &opt_clock_gov,
+			"Tune device clocks within driver bounds for best effective hashrate"),
 #ifdef HAVE_CURSES
 	OPT_WITHOUT_ARG("--compact",
 			opt_set_bool, &opt_compact,
@@ -1153,6 +1386,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--failover-only",
 			opt_set_bool, &opt_fail_only,
 			"Don't leak work to backup pools when primary pool is lagging"),
+	OPT_WITH_ARG("--failover-warm",
+		     set_int_0_to_9999, opt_show_intval, &opt_warm_pools,
+		     "Keep authenticated stratum connections warm on this many backup pools in failover mode"),
 	OPT_WITHOUT_ARG("--fix-protocol",
 			opt_set_bool, &opt_fix_protocol,
 			"Do not redirect to a different getwork protocol (eg. stratum)"),
@@ -1233,9 +1469,20 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--load-balance",
 		     set_loadbalance, &pool_strategy,
 		     "Change multipool strategy from failover to quota based balance"),
+#ifndef WIN32
+	OPT_WITHOUT_ARG("--lock-mem",
+			opt_set_bool, &opt_lock_mem,
+			"Lock all memory to prevent page faults in hot paths, needs root or a raised RLIMIT_MEMLOCK"),
+#endif
 	OPT_WITH_ARG("--log|-l",
 		     set_int_0_to_9999, opt_show_intval, &opt_log_interval,
 		     "Interval in seconds between log output"),
+	OPT_WITHOUT_ARG("--log-async",
+			opt_set_bool, &opt_log_async,
+			"Write log messages from a separate thread so mining threads never block on output"),
+	OPT_WITHOUT_ARG("--log-dedup",
+			opt_set_bool, &opt_log_dedup,
+			"Suppress rapidly repeating log messages, periodically reporting the repeat count"),
 	OPT_WITHOUT_ARG("--lowmem",
 			opt_set_bool, &opt_lowmem,
 			"Minimise caching of shares for low memory applications"),
@@ -1247,12 +1494,18 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--net-delay",
 			opt_set_bool, &opt_delaynet,
 			"Impose small delays in networking to not overload slow routers"),
+	OPT_WITH_ARG("--net-timeout",
+		     set_int_1_to_65535, opt_show_intval, &opt_net_timeout,
+		     "Deadline in seconds for stratum DNS resolution and connection attempts"),
 	OPT_WITHOUT_ARG("--no-pool-disable",
 			opt_set_invbool, &opt_disable_pool,
 			opt_hidden),
 	OPT_WITHOUT_ARG("--no-submit-stale",
 			opt_set_invbool, &opt_submit_stale,
 		        "Don't submit shares if they are detected as stale"),
+	OPT_WITH_ARG("--ntime-expand",
+		     set_int_0_to_10, opt_show_intval, &opt_ntime_expand,
+		     "Expand each generated stratum work into this many extra ntime rolled copies (0 - 10)"),
 	OPT_WITH_ARG("--pass|-p",
 		     set_pass, NULL, NULL,
 		     "Password for bitcoin JSON-RPC server"),
@@ -1277,6 +1530,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--remove-disabled",
 		     opt_set_bool, &opt_removedisabled,
 	         "Remove disabled devices entirely, as if they didn't exist"),
+	OPT_WITH_ARG("--replay-speed",
+		     set_int_0_to_9999, opt_show_intval, &opt_replay_speed,
+		     "Time acceleration factor for --benchmark-replay, 0 to replay without delays (default: 1)"),
 	OPT_WITH_ARG("--retries",
 		     set_null, NULL, NULL,
 		     opt_hidden),
@@ -1289,6 +1545,12 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--round-robin",
 		     set_rr, &pool_strategy,
 		     "Change multipool strategy from failover to round robin on failure"),
+	OPT_WITH_ARG("--rt-read-prio",
+		     set_int_0_to_99, opt_show_intval, &opt_rt_read_prio,
+		     "SCHED_RR realtime priority for device result read threads, 0 for default scheduling"),
+	OPT_WITH_ARG("--rt-send-prio",
+		     set_int_0_to_99, opt_show_intval, &opt_rt_send_prio,
+		     "SCHED_RR realtime priority for stratum share send threads, 0 for default scheduling"),
 #ifdef USE_FPGA_SERIAL
 	OPT_WITH_ARG("--scan-serial|-S",
 		     add_serial, NULL, NULL,
@@ -1306,12 +1568,46 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--sharelog",
 		     set_sharelog, NULL, NULL,
 		     "Append share log to file"),
+	OPT_WITHOUT_ARG("--sharelog-bin",
+			opt_set_bool, &opt_sharelog_bin,
+			"Write the share log as fixed width 224 byte binary records instead of text lines"),
 	OPT_WITH_ARG("--shares",
 		     opt_set_intval, NULL, &opt_shares,
 		     "Quit after mining N shares (default: unlimited)"),
+#ifdef USE_SIM
+	OPT_WITH_ARG("--sim-devices",
+		     opt_set_intval, opt_show_intval, &opt_sim_devices,
+		     "Number of simulated devices to create"),
+	OPT_WITH_ARG("--sim-error",
+		     set_int_0_to_100, opt_show_intval, &opt_sim_error,
+		     "Percentage of simulated shares that are hardware errors"),
+	OPT_WITH_ARG("--sim-latency",
+		     set_int_1_to_65535, opt_show_intval, &opt_sim_latency,
+		     "Mean simulated result latency in milliseconds"),
+	OPT_WITH_ARG("--sim-mhs",
+		     opt_set_intval, opt_show_intval, &opt_sim_mhs,
+		     "Hashrate of each simulated device in megahashes"),
+	OPT_WITH_ARG("--sim-queue",
+		     set_int_1_to_10, opt_show_intval, &opt_sim_queue,
+		     "Work items each simulated device keeps queued"),
+#endif
 	OPT_WITH_ARG("--socks-proxy",
 		     opt_set_charp, NULL, &opt_socks_proxy,
 		     "Set socks4 proxy (host:port)"),
+#if defined(unix) || defined(__APPLE__)
+	OPT_WITH_ARG("--stats-shm",
+		     opt_set_charp, NULL, &opt_stats_shm,
+		     "Publish stats to a memory mapped file for local scrapers"),
+#endif
+	OPT_WITH_ARG("--stratum-proxy",
+		     set_int_1_to_65535, opt_show_intval, &opt_sproxy_port,
+		     "Serve stratum to downstream rigs on this port, aggregating their shares upstream"),
+	OPT_WITH_ARG("--stratum-trace",
+		     opt_set_charp, NULL, &opt_stratum_trace,
+		     "Record timestamped stratum traffic to a binary file for --benchmark-replay"),
+	OPT_WITH_ARG("--submit-conns",
+		     set_int_1_to_4, opt_show_intval, &opt_submit_conns,
+		     "Total stratum connections per pool to shard share submission across (default: 1)"),
 #ifdef HAVE_SYSLOG_H
 	OPT_WITHOUT_ARG("--syslog",
 			opt_set_bool, &use_syslog,
@@ -1350,6 +1646,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--verbose",
 			opt_set_bool, &opt_log_output,
 			"Log verbose output to stderr as well as status output"),
+	OPT_WITH_ARG("--verify-threads",
+		     set_int_0_to_9999, opt_show_intval, &opt_verify_threads,
+		     "Number of worker threads verifying raw device results, 0 to verify inline (default: 0)"),
 	OPT_WITH_ARG("--userpass|-O",
 		     set_userpass, NULL, NULL,
 		     "Username:Password pair for bitcoin JSON-RPC server"),
@@ -1365,6 +1664,346 @@ static char *load_config(const char *arg, void __maybe_unused *unused);
 
 static int fileconf_load;
 
+/* Preparsed binary config cache. Parsing a config replays every option
+ * through the ccan/opt callbacks after a jansson parse; on large configs
+ * the flattened option/value pairs are recorded here and written next to
+ * the config file, so a warm start replays them with a few reads and no
+ * JSON parse at all. The cache carries a sha256 of every config file it
+ * was built from plus the cgminer version and is ignored the moment any
+ * of them changed. */
+#define CFG_CACHE_MAGIC		0x43464743 /* "CGFC" */
+#define CFG_CACHE_VERSION	1
+#define CFG_CACHE_SUFFIX	".cache"
+#define CFG_CACHE_MAX_STR	4096
+#define CFG_CACHE_MAX_ENTRIES	65536
+
+struct cfg_cache_file {
+	char *path;
+	unsigned char hash[32];
+};
+
+struct cfg_cache_opt {
+	char *name;
+	char *value;	/* NULL for options without an argument */
+};
+
+static struct cfg_cache_file *cfg_cache_files;
+static int cfg_cache_nfiles;
+static struct cfg_cache_opt *cfg_cache_opts;
+static int cfg_cache_nopts;
+/* Recording runs from the first config file load until the cache is
+ * written after option parsing completes */
+static bool cfg_cache_recording;
+/* Set when anything happens the cache cannot faithfully reproduce */
+static bool cfg_cache_poisoned;
+static int cfg_cache_toplevel_loads;
+static int cfg_load_depth;
+
+extern char *cnfbuf;
+
+static bool cfg_hash_file(const char *path, unsigned char *digest)
+{
+	unsigned char *buf;
+	long len;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return false;
+	if (fseek(f, 0, SEEK_END)) {
+		fclose(f);
+		return false;
+	}
+	len = ftell(f);
+	rewind(f);
+	if (len < 0 || len > (16 << 20)) {
+		fclose(f);
+		return false;
+	}
+	buf = malloc(len ? len : 1);
+	if (!buf) {
+		fclose(f);
+		return false;
+	}
+	if (fread(buf, 1, len, f) != (size_t)len) {
+		free(buf);
+		fclose(f);
+		return false;
+	}
+	fclose(f);
+	sha256(buf, len, digest);
+	free(buf);
+	return true;
+}
+
+static void cfg_cache_record_file(const char *path)
+{
+	struct cfg_cache_file *cf;
+
+	if (!cfg_cache_recording || cfg_cache_poisoned)
+		return;
+	cfg_cache_files = realloc(cfg_cache_files,
+				  sizeof(*cfg_cache_files) * (cfg_cache_nfiles + 1));
+	if (!cfg_cache_files) {
+		cfg_cache_nfiles = 0;
+		cfg_cache_poisoned = true;
+		return;
+	}
+	cf = &cfg_cache_files[cfg_cache_nfiles];
+	cf->path = strdup(path);
+	if (!cf->path || !cfg_hash_file(path, cf->hash)) {
+		cfg_cache_poisoned = true;
+		return;
+	}
+	cfg_cache_nfiles++;
+}
+
+static void cfg_cache_record_opt(const char *name, const char *value)
+{
+	struct cfg_cache_opt *co;
+
+	if (!cfg_cache_recording || cfg_cache_poisoned)
+		return;
+	if (cfg_cache_nopts >= CFG_CACHE_MAX_ENTRIES ||
+	    (value && strlen(value) >= CFG_CACHE_MAX_STR)) {
+		cfg_cache_poisoned = true;
+		return;
+	}
+	cfg_cache_opts = realloc(cfg_cache_opts,
+				 sizeof(*cfg_cache_opts) * (cfg_cache_nopts + 1));
+	if (!cfg_cache_opts) {
+		cfg_cache_nopts = 0;
+		cfg_cache_poisoned = true;
+		return;
+	}
+	co = &cfg_cache_opts[cfg_cache_nopts];
+	co->name = strdup(name);
+	co->value = value ? strdup(value) : NULL;
+	if (!co->name || (value && !co->value)) {
+		cfg_cache_poisoned = true;
+		return;
+	}
+	cfg_cache_nopts++;
+}
+
+/* Apply one cached option through the opt table, mirroring what
+ * parse_config would have done for the same name and value. */
+static char *cfg_cache_apply(const char *name, const char *value)
+{
+	struct opt_table *opt;
+
+	for (opt = opt_config_table; opt->type != OPT_END; opt++) {
+		char *p, *optname;
+		bool found = false;
+		char *err = NULL;
+
+		if (!opt->names)
+			continue;
+		optname = strdup(opt->names);
+		for (p = strtok(optname, "|"); p; p = strtok(NULL, "|")) {
+			if (p[1] != '-')
+				continue;
+			if (!strcmp(p + 2, name)) {
+				found = true;
+				break;
+			}
+		}
+		free(optname);
+		if (!found)
+			continue;
+		if (value) {
+			if (opt->type & OPT_HASARG)
+				err = opt->cb_arg(value, opt->u.arg);
+			else
+				err = "Unexpected value";
+		} else {
+			if (opt->type & OPT_NOARG)
+				err = opt->cb(opt->u.arg);
+			else
+				err = "Missing value";
+		}
+		return err;
+	}
+	return "Unknown option";
+}
+
+static bool cfg_read_u32(FILE *f, uint32_t *val)
+{
+	return fread(val, sizeof(*val), 1, f) == 1;
+}
+
+static char *cfg_read_str(FILE *f)
+{
+	uint32_t len;
+	char *str;
+
+	if (!cfg_read_u32(f, &len) || len >= CFG_CACHE_MAX_STR)
+		return NULL;
+	str = malloc(len + 1);
+	if (!str)
+		return NULL;
+	if (len && fread(str, 1, len, f) != len) {
+		free(str);
+		return NULL;
+	}
+	str[len] = '\0';
+	return str;
+}
+
+/* Attempt a warm start from the cache beside the given config file,
+ * verifying the version and the hash of every file the cache was built
+ * from before applying anything. Returns true if the config was applied
+ * from the cache. */
+static bool cfg_cache_replay(const char *arg)
+{
+	struct cfg_cache_opt *opts = NULL;
+	char path[PATH_MAX];
+	uint32_t magic, version, nfiles, nopts, i;
+	uint32_t applied = 0;
+	bool ok = false;
+	char *ver = NULL;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s" CFG_CACHE_SUFFIX, arg);
+	f = fopen(path, "rb");
+	if (!f)
+		return false;
+
+	if (!cfg_read_u32(f, &magic) || magic != CFG_CACHE_MAGIC ||
+	    !cfg_read_u32(f, &version) || version != CFG_CACHE_VERSION)
+		goto out;
+	ver = cfg_read_str(f);
+	if (!ver || strcmp(ver, VERSION))
+		goto out;
+	if (!cfg_read_u32(f, &nfiles) || !nfiles || nfiles > CFG_CACHE_MAX_ENTRIES ||
+	    !cfg_read_u32(f, &nopts) || !nopts || nopts > CFG_CACHE_MAX_ENTRIES)
+		goto out;
+
+	for (i = 0; i < nfiles; i++) {
+		unsigned char wanted[32], now[32];
+		char *fpath = cfg_read_str(f);
+		bool match;
+
+		if (!fpath)
+			goto out;
+		if (fread(wanted, 1, sizeof(wanted), f) != sizeof(wanted)) {
+			free(fpath);
+			goto out;
+		}
+		match = cfg_hash_file(fpath, now) && !memcmp(wanted, now, sizeof(now));
+		if (!i && strcmp(fpath, arg))
+			match = false;
+		free(fpath);
+		if (!match)
+			goto out;
+	}
+
+	/* Read and validate every option before applying any so a corrupt
+	 * tail cannot leave the config half applied */
+	opts = calloc(nopts, sizeof(*opts));
+	if (!opts)
+		goto out;
+	for (i = 0; i < nopts; i++) {
+		uint8_t has_value;
+
+		opts[i].name = cfg_read_str(f);
+		if (!opts[i].name || fread(&has_value, 1, 1, f) != 1)
+			goto out;
+		if (has_value) {
+			opts[i].value = cfg_read_str(f);
+			if (!opts[i].value)
+				goto out;
+		}
+	}
+
+	for (i = 0; i < nopts; i++) {
+		char *err = cfg_cache_apply(opts[i].name, opts[i].value);
+
+		/* Mirror the lenient file config behaviour: log and skip */
+		if (err)
+			applog(LOG_ERR, "Invalid cached config option %s: %s", opts[i].name, err);
+		else
+			applied++;
+	}
+	applog(LOG_DEBUG, "Applied %u cached config options from %s", applied, path);
+	ok = true;
+out:
+	if (opts) {
+		for (i = 0; i < nopts; i++) {
+			free(opts[i].name);
+			free(opts[i].value);
+		}
+		free(opts);
+	}
+	free(ver);
+	fclose(f);
+	return ok;
+}
+
+/* Write the recorded option state beside the config file once option
+ * parsing has completed. Only a run that loaded exactly one top level
+ * config cleanly is cacheable. */
+static void cfg_cache_write(void)
+{
+	char path[PATH_MAX], tmppath[PATH_MAX];
+	uint32_t u32;
+	bool ok = true;
+	FILE *f;
+	int i;
+
+	if (!cfg_cache_recording || cfg_cache_poisoned || !cnfbuf ||
+	    cfg_cache_toplevel_loads != 1 || !cfg_cache_nfiles || !cfg_cache_nopts)
+		return;
+
+	snprintf(path, sizeof(path), "%s" CFG_CACHE_SUFFIX, cnfbuf);
+	snprintf(tmppath, sizeof(tmppath), "%s" CFG_CACHE_SUFFIX ".tmp", cnfbuf);
+	f = fopen(tmppath, "wb");
+	if (!f)
+		return;
+
+	u32 = CFG_CACHE_MAGIC;
+	ok &= fwrite(&u32, sizeof(u32), 1, f) == 1;
+	u32 = CFG_CACHE_VERSION;
+	ok &= fwrite(&u32, sizeof(u32), 1, f) == 1;
+	u32 = strlen(VERSION);
+	ok &= fwrite(&u32, sizeof(u32), 1, f) == 1;
+	ok &= fwrite(VERSION, 1, strlen(VERSION), f) == strlen(VERSION);
+	u32 = cfg_cache_nfiles;
+	ok &= fwrite(&u32, sizeof(u32), 1, f) == 1;
+	u32 = cfg_cache_nopts;
+	ok &= fwrite(&u32, sizeof(u32), 1, f) == 1;
+
+	for (i = 0; i < cfg_cache_nfiles && ok; i++) {
+		struct cfg_cache_file *cf = &cfg_cache_files[i];
+
+		u32 = strlen(cf->path);
+		ok &= fwrite(&u32, sizeof(u32), 1, f) == 1;
+		ok &= fwrite(cf->path, 1, u32, f) == u32;
+		ok &= fwrite(cf->hash, 1, sizeof(cf->hash), f) == sizeof(cf->hash);
+	}
+	for (i = 0; i < cfg_cache_nopts && ok; i++) {
+		struct cfg_cache_opt *co = &cfg_cache_opts[i];
+		uint8_t has_value = co->value != NULL;
+
+		u32 = strlen(co->name);
+		ok &= fwrite(&u32, sizeof(u32), 1, f) == 1;
+		ok &= fwrite(co->name, 1, u32, f) == u32;
+		ok &= fwrite(&has_value, 1, 1, f) == 1;
+		if (has_value) {
+			u32 = strlen(co->value);
+			ok &= fwrite(&u32, sizeof(u32), 1, f) == 1;
+			ok &= fwrite(co->value, 1, u32, f) == u32;
+		}
+	}
+
+	if (fclose(f) || !ok) {
+		unlink(tmppath);
+		return;
+	}
+	if (rename(tmppath, path))
+		unlink(tmppath);
+}
+
 static char *parse_config(json_t *config, bool fileconf)
 {
 	static char err_buf[200];
@@ -1399,24 +2038,31 @@ static char *parse_config(json_t *config, bool fileconf)
 			if ((opt->type & OPT_HASARG) && json_is_string(val)) {
 				err = opt->cb_arg(json_string_value(val),
 						  opt->u.arg);
+				if (!err)
+					cfg_cache_record_opt(p + 2, json_string_value(val));
 			} else if ((opt->type & OPT_HASARG) && json_is_array(val)) {
 				int n, size = json_array_size(val);
 
 				for (n = 0; n < size && !err; n++) {
-					if (json_is_string(json_array_get(val, n)))
+					if (json_is_string(json_array_get(val, n))) {
 						err = opt->cb_arg(json_string_value(json_array_get(val, n)), opt->u.arg);
-					else if (json_is_object(json_array_get(val, n)))
+						if (!err)
+							cfg_cache_record_opt(p + 2, json_string_value(json_array_get(val, n)));
+					} else if (json_is_object(json_array_get(val, n)))
 						err = parse_config(json_array_get(val, n), false);
 				}
-			} else if ((opt->type & OPT_NOARG) && json_is_true(val))
+			} else if ((opt->type & OPT_NOARG) && json_is_true(val)) {
 				err = opt->cb(opt->u.arg);
-			else
+				if (!err)
+					cfg_cache_record_opt(p + 2, NULL);
+			} else
 				err = "Invalid value";
 
 			if (err) {
 				/* Allow invalid values to be in configuration
 				 * file, just skipping over them provided the
 				 * JSON is still valid after that. */
+				cfg_cache_poisoned = true;
 				if (fileconf) {
 					applog(LOG_ERR, "Invalid config option %s: %s", p, err);
 					fileconf_load = -1;
@@ -1444,6 +2090,8 @@ static char *load_config(const char *arg, void __maybe_unused *unused)
 	json_error_t err;
 	json_t *config;
 	char *json_error;
+	bool toplevel;
+	char *ret;
 	size_t siz;
 
 	if (!cnfbuf)
@@ -1452,6 +2100,21 @@ static char *load_config(const char *arg, void __maybe_unused *unused)
 	if (++include_count > JSON_MAX_DEPTH)
 		return JSON_MAX_DEPTH_ERR;
 
+	toplevel = !cfg_load_depth;
+	if (toplevel) {
+		/* Only a run loading a single top level config cleanly can
+		 * be replayed or recorded */
+		if (cfg_cache_toplevel_loads++)
+			cfg_cache_poisoned = true;
+		else if (cfg_cache_replay(arg)) {
+			config_loaded = true;
+			fileconf_load = 1;
+			return NULL;
+		} else
+			cfg_cache_recording = true;
+	}
+	cfg_cache_record_file(arg);
+
 #if JANSSON_MAJOR_VERSION > 1
 	config = json_load_file(arg, 0, &err);
 #else
@@ -1471,7 +2134,10 @@ static char *load_config(const char *arg, void __maybe_unused *unused)
 
 	/* Parse the config now, so we can override it.  That can keep pointers
 	 * so don't free config object. */
-	return parse_config(config, true);
+	cfg_load_depth++;
+	ret = parse_config(config, true);
+	cfg_load_depth--;
+	return ret;
 }
 
 static char *set_default_config(const char *arg)
@@ -1613,12 +2279,31 @@ static void calc_midstate(struct work *work)
 	endian_flip32(work->midstate, work->midstate);
 }
 
+/* Per thread cache of zeroed free work structs, keeping the allocator out of
+ * the work generation and completion hot paths and avoiding the heap
+ * fragmentation of millions of large alloc/free cycles on long uptimes.
+ * Work is regularly freed by a different thread than allocated it so each
+ * thread caps its own cache, releasing any overflow back to the
+ * allocator. */
+#define WORK_CACHE_MAX 64
+
+static __thread struct work *work_cache;
+static __thread int work_cached;
+
 static struct work *make_work(void)
 {
-	struct work *work = calloc(1, sizeof(struct work));
+	struct work *work = work_cache;
 
-	if (unlikely(!work))
-		quit(1, "Failed to calloc work in make_work");
+	if (work) {
+		work_cache = work->cache_next;
+		work_cached--;
+		work->cache_next = NULL;
+	} else {
+		work = calloc(1, sizeof(struct work));
+		if (unlikely(!work))
+			quit(1, "Failed to calloc work in make_work");
+		mem_account(MEM_WORK, sizeof(struct work));
+	}
 
 	cg_wlock(&control_lock);
 	work->id = total_work++;
@@ -1627,23 +2312,91 @@ static struct work *make_work(void)
 	return work;
 }
 
+/* Takes ownership of the already allocated coinbase hex while duplicating
+ * the other strings, any of which may be NULL */
+struct stratum_job *sjob_new(const char *job_id, const char *nonce1,
+			     const char *ntime, char *coinbase)
+{
+	struct stratum_job *sjob;
+
+	sjob = calloc(1, sizeof(struct stratum_job));
+	if (unlikely(!sjob))
+		quithere(1, "Failed to calloc sjob");
+	sjob->job_id = job_id ? strdup(job_id) : NULL;
+	sjob->nonce1 = nonce1 ? strdup(nonce1) : NULL;
+	sjob->ntime = ntime ? strdup(ntime) : NULL;
+	sjob->coinbase = coinbase;
+	sjob->refcount = 1;
+	mem_account(MEM_SJOB, sizeof(struct stratum_job));
+	return sjob;
+}
+
+struct stratum_job *sjob_ref(struct stratum_job *sjob)
+{
+	__sync_add_and_fetch(&sjob->refcount, 1);
+	return sjob;
+}
+
+void sjob_unref(struct stratum_job *sjob)
+{
+	if (!sjob)
+		return;
+	if (__sync_sub_and_fetch(&sjob->refcount, 1))
+		return;
+	mem_account(MEM_SJOB, -(int64_t)(sizeof(struct stratum_job) +
+		    sjob->cb_len + 32 * sjob->merkles));
+	free(sjob->job_id);
+	free(sjob->nonce1);
+	free(sjob->ntime);
+	free(sjob->coinbase);
+	free(sjob->cb_bin);
+	free(sjob->merkle_bin);
+	free(sjob);
+}
+
+/* Give a work item private copies of the job strings it borrows from a
+ * shared job template, for the paths that modify them in place */
+static void work_unshare_sjob(struct work *work)
+{
+	if (!work->sjob)
+		return;
+	work->job_id = work->job_id ? strdup(work->job_id) : NULL;
+	work->nonce1 = work->nonce1 ? strdup(work->nonce1) : NULL;
+	work->ntime = work->ntime ? strdup(work->ntime) : NULL;
+	work->coinbase = work->coinbase ? strdup(work->coinbase) : NULL;
+	sjob_unref(work->sjob);
+	work->sjob = NULL;
+}
+
 /* This is the central place all work that is about to be retired should be
  * cleaned to remove any dynamically allocated arrays within the struct */
 void clean_work(struct work *work)
 {
-	free(work->job_id);
-	free(work->ntime);
-	free(work->coinbase);
-	free(work->nonce1);
+	if (work->sjob)
+		sjob_unref(work->sjob);
+	else {
+		free(work->job_id);
+		free(work->ntime);
+		free(work->nonce1);
+		free(work->coinbase);
+	}
 	memset(work, 0, sizeof(struct work));
 }
 
 /* All dynamically allocated work structs should be freed here to not leak any
- * ram from arrays allocated within the work struct */
+ * ram from arrays allocated within the work struct. The cleaned struct is
+ * recycled through the freeing thread's work cache when there is room. */
 void free_work(struct work *work)
 {
 	clean_work(work);
-	free(work);
+	if (work_cached < WORK_CACHE_MAX) {
+		work->cache_next = work_cache;
+		work_cache = work;
+		work_cached++;
+	} else {
+		mem_account(MEM_WORK, -(int64_t)sizeof(struct work));
+		free(work);
+	}
 }
 
 static void gen_hash(unsigned char *data, unsigned char *hash, int len);
@@ -1651,16 +2404,93 @@ static void calc_diff(struct work *work, double known);
 char *workpadding = "000000800000000000000000000000000000000000000000000000000000000000000000000000000000000080020000";
 
 #ifdef HAVE_LIBCURL
+/* Transaction hashing and the merkle fold are spread over a few transient
+ * worker threads when a template is large enough to be worth it. Template
+ * refreshes are seconds apart so the thread creation cost is noise next to
+ * hashing thousands of transactions. */
+#define GBT_MAX_WORKERS 8
+#define GBT_PAR_THRESHOLD 64
+
+static int gbt_workers(void)
+{
+	int nworkers = num_processors;
+
+	if (nworkers > GBT_MAX_WORKERS)
+		nworkers = GBT_MAX_WORKERS;
+	return nworkers;
+}
+
+/* Decode and hash one transaction straight out of the parser's string
+ * storage, growing the caller's scratch buffer as needed so a template's
+ * worth of transactions shares one allocation instead of one each */
+static void gbt_hash_txn(json_t *txn_array, unsigned char *txn_hashes, int i,
+			 unsigned char **scratch, size_t *scratch_siz)
+{
+	json_t *txn_val = json_object_get(json_array_get(txn_array, i), "data");
+	const char *txn = json_string_value(txn_val);
+	size_t txn_len = strlen(txn) / 2;
+
+	if (txn_len > *scratch_siz) {
+		size_t cal_len = txn_len;
+
+		align_len(&cal_len);
+		*scratch = realloc(*scratch, cal_len);
+		if (unlikely(!*scratch))
+			quit(1, "Failed to realloc scratch in gbt_hash_txn");
+		*scratch_siz = cal_len;
+	}
+	if (unlikely(!hex2bin(*scratch, txn, txn_len)))
+		quit(1, "Failed to hex2bin txn in gbt_hash_txn");
+
+	gen_hash(*scratch, txn_hashes + (32 * i), txn_len);
+}
+
+struct gbt_txn_arg {
+	json_t *txn_array;
+	unsigned char *txn_hashes;
+	int *need;
+	int nneed;
+	int nworkers;
+	int worker;
+};
+
+static void *gbt_txn_worker(void *arg)
+{
+	struct gbt_txn_arg *ga = (struct gbt_txn_arg *)arg;
+	unsigned char *scratch = NULL;
+	size_t scratch_siz = 0;
+	int i;
+
+	for (i = ga->worker; i < ga->nneed; i += ga->nworkers)
+		gbt_hash_txn(ga->txn_array, ga->txn_hashes, ga->need[i],
+			     &scratch, &scratch_siz);
+	free(scratch);
+	return NULL;
+}
+
+/* Cache of transaction hashes keyed by the raw transaction hex, retained
+ * between template refreshes so only transactions that were not in the
+ * previous template need hashing. Protected by gbt_lock. */
+struct txn_ent {
+	unsigned char hash[32];
+	UT_hash_handle hh;
+	int keylen;
+	char key[];
+};
+
+static void __build_gbt_merkle(struct pool *pool);
+
 /* Process transactions with GBT by storing the binary value of the first
  * transaction, and the hashes of the remaining transactions since these
  * remain constant with an altered coinbase when generating work. Must be
  * entered under gbt_lock */
 static bool __build_gbt_txns(struct pool *pool, json_t *res_val)
 {
+	int i, cached = 0, nneed = 0, nworkers = gbt_workers();
+	struct txn_ent *newcache = NULL, *ent, *tmp;
 	json_t *txn_array;
+	int *need = NULL;
 	bool ret = false;
-	size_t cal_len;
-	int i;
 
 	free(pool->txn_hashes);
 	pool->txn_hashes = NULL;
@@ -1678,55 +2508,205 @@ static bool __build_gbt_txns(struct pool *pool, json_t *res_val)
 	pool->txn_hashes = calloc(32 * (pool->gbt_txns + 1), 1);
 	if (unlikely(!pool->txn_hashes))
 		quit(1, "Failed to calloc txn_hashes in __build_gbt_txns");
+	need = malloc(pool->gbt_txns * sizeof(int));
+	if (unlikely(!need))
+		quit(1, "Failed to malloc need in __build_gbt_txns");
 
+	/* Take the hash the daemon supplies, or the one cached from the
+	 * previous template, and only hash the transaction data of whatever
+	 * is genuinely new */
 	for (i = 0; i < pool->gbt_txns; i++) {
-		json_t *txn_val = json_object_get(json_array_get(txn_array, i), "data");
-		const char *txn = json_string_value(txn_val);
-		int txn_len = strlen(txn);
-		unsigned char *txn_bin;
+		json_t *txn_val = json_array_get(txn_array, i);
+		const char *hash = json_string_value(json_object_get(txn_val, "hash"));
+		const char *txn = json_string_value(json_object_get(txn_val, "data"));
+		int txn_len = txn ? strlen(txn) : 0;
 
-		cal_len = txn_len;
-		align_len(&cal_len);
-		txn_bin = calloc(cal_len, 1);
-		if (unlikely(!txn_bin))
-			quit(1, "Failed to calloc txn_bin in __build_gbt_txns");
-		if (unlikely(!hex2bin(txn_bin, txn, txn_len / 2)))
-			quit(1, "Failed to hex2bin txn_bin");
+		if (hash && strlen(hash) == 64) {
+			unsigned char hash_swap[32];
 
-		gen_hash(txn_bin, pool->txn_hashes + (32 * i), txn_len / 2);
-		free(txn_bin);
+			hex2bin(hash_swap, hash, 32);
+			swab256(pool->txn_hashes + 32 * i, hash_swap);
+			continue;
+		}
+		HASH_FIND(hh, pool->txn_cache, txn, txn_len, ent);
+		if (ent) {
+			HASH_DELETE(hh, pool->txn_cache, ent);
+			HASH_ADD_KEYPTR(hh, newcache, ent->key, ent->keylen, ent);
+			memcpy(pool->txn_hashes + 32 * i, ent->hash, 32);
+			cached++;
+		} else
+			need[nneed++] = i;
 	}
-out:
+
+	if (nneed < GBT_PAR_THRESHOLD || nworkers < 2) {
+		unsigned char *scratch = NULL;
+		size_t scratch_siz = 0;
+
+		for (i = 0; i < nneed; i++)
+			gbt_hash_txn(txn_array, pool->txn_hashes, need[i],
+				     &scratch, &scratch_siz);
+		free(scratch);
+	} else {
+		struct gbt_txn_arg args[GBT_MAX_WORKERS];
+		pthread_t workers[GBT_MAX_WORKERS];
+
+		for (i = 0; i < nworkers; i++) {
+			args[i].txn_array = txn_array;
+			args[i].txn_hashes = pool->txn_hashes;
+			args[i].need = need;
+			args[i].nneed = nneed;
+			args[i].nworkers = nworkers;
+			args[i].worker = i;
+			if (unlikely(pthread_create(&workers[i], NULL, gbt_txn_worker, &args[i])))
+				quit(1, "Failed to create gbt txn worker");
+		}
+		for (i = 0; i < nworkers; i++)
+			pthread_join(workers[i], NULL);
+	}
+
+	/* Remember the freshly hashed transactions for the next refresh */
+	for (i = 0; i < nneed; i++) {
+		json_t *txn_val = json_array_get(txn_array, need[i]);
+		const char *txn = json_string_value(json_object_get(txn_val, "data"));
+		int txn_len = txn ? strlen(txn) : 0;
+
+		ent = malloc(sizeof(struct txn_ent) + txn_len + 1);
+		if (unlikely(!ent))
+			quit(1, "Failed to malloc txn_ent in __build_gbt_txns");
+		memcpy(ent->hash, pool->txn_hashes + 32 * need[i], 32);
+		ent->keylen = txn_len;
+		if (txn_len)
+			memcpy(ent->key, txn, txn_len);
+		ent->key[txn_len] = '\0';
+		HASH_ADD_KEYPTR(hh, newcache, ent->key, ent->keylen, ent);
+	}
+	applog(LOG_DEBUG, "GBT template with %d txns: %d cached, %d hashed",
+	       pool->gbt_txns, cached, nneed);
+out:
+	/* Drop cache entries for transactions no longer in the template */
+	HASH_ITER(hh, pool->txn_cache, ent, tmp) {
+		HASH_DELETE(hh, pool->txn_cache, ent);
+		free(ent);
+	}
+	pool->txn_cache = newcache;
+	free(need);
+	__build_gbt_merkle(pool);
+
 	return ret;
 }
 
+struct gbt_merkle_arg {
+	unsigned char *in;
+	unsigned char *out;
+	int pairs;
+	int nworkers;
+	int worker;
+};
+
+static void *gbt_merkle_worker(void *arg)
+{
+	struct gbt_merkle_arg *ma = (struct gbt_merkle_arg *)arg;
+	int i;
+
+	for (i = ma->worker; i < ma->pairs; i += ma->nworkers)
+		gen_hash(ma->in + i * 64, ma->out + i * 32, 64);
+	return NULL;
+}
+
+/* Fold one merkle level of the given number of pairs from in to out. The
+ * pairs within a level are independent so wide levels are spread across
+ * workers; the levels themselves are inherently serial. */
+static void gbt_merkle_level(unsigned char *in, unsigned char *out, int pairs)
+{
+	int i, nworkers = gbt_workers();
+	struct gbt_merkle_arg args[GBT_MAX_WORKERS];
+	pthread_t workers[GBT_MAX_WORKERS];
+
+	if (pairs < GBT_PAR_THRESHOLD || nworkers < 2) {
+		for (i = 0; i < pairs; i++)
+			gen_hash(in + i * 64, out + i * 32, 64);
+		return;
+	}
+	for (i = 0; i < nworkers; i++) {
+		args[i].in = in;
+		args[i].out = out;
+		args[i].pairs = pairs;
+		args[i].nworkers = nworkers;
+		args[i].worker = i;
+		if (unlikely(pthread_create(&workers[i], NULL, gbt_merkle_worker, &args[i])))
+			quit(1, "Failed to create gbt merkle worker");
+	}
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+}
+
+/* Build the merkle branch pairing with the coinbase path from the
+ * transaction hashes, so each work generation only folds the fresh coinbase
+ * hash up the branch instead of remaking the whole tree. Must be entered
+ * under gbt_lock */
+static void __build_gbt_merkle(struct pool *pool)
+{
+	unsigned char *in, *out, *swap;
+	int m, b = 0;
+
+	free(pool->merklebin);
+	pool->merklebin = NULL;
+	pool->merkles = 0;
+	if (!pool->gbt_txns)
+		return;
+
+	in = calloc(32 * (pool->gbt_txns + 2), 1);
+	if (unlikely(!in))
+		quit(1, "Failed to calloc in in __build_gbt_merkle");
+	out = calloc(32 * (pool->gbt_txns + 2), 1);
+	if (unlikely(!out))
+		quit(1, "Failed to calloc out in __build_gbt_merkle");
+	/* Enough branch levels to cover an int's worth of transactions */
+	pool->merklebin = calloc(32 * 33, 1);
+	if (unlikely(!pool->merklebin))
+		quit(1, "Failed to calloc merklebin in __build_gbt_merkle");
+
+	memcpy(in, pool->txn_hashes, 32 * pool->gbt_txns);
+	m = pool->gbt_txns;
+	while (m > 0) {
+		/* The first node on each level is the sibling of the
+		 * coinbase path */
+		memcpy(pool->merklebin + 32 * b++, in, 32);
+		/* A level with an odd node count, including the coinbase
+		 * path node, duplicates its last node */
+		if (!(m % 2)) {
+			memcpy(&in[32 * m], &in[32 * (m - 1)], 32);
+			m++;
+		}
+		gbt_merkle_level(in + 32, out, (m - 1) / 2);
+		m = (m - 1) / 2;
+		swap = in;
+		in = out;
+		out = swap;
+	}
+	pool->merkles = b;
+	free(in);
+	free(out);
+}
+
 static unsigned char *__gbt_merkleroot(struct pool *pool)
 {
+	unsigned char merkle_sha[64];
 	unsigned char *merkle_hash;
-	int i, txns;
+	int i;
 
-	merkle_hash = calloc(32 * (pool->gbt_txns + 2), 1);
+	merkle_hash = calloc(32, 1);
 	if (unlikely(!merkle_hash))
 		quit(1, "Failed to calloc merkle_hash in __gbt_merkleroot");
 
 	gen_hash(pool->coinbase, merkle_hash, pool->coinbase_len);
 
-	if (pool->gbt_txns)
-		memcpy(merkle_hash + 32, pool->txn_hashes, pool->gbt_txns * 32);
-
-	txns = pool->gbt_txns + 1;
-	while (txns > 1) {
-		if (txns % 2) {
-			memcpy(&merkle_hash[txns * 32], &merkle_hash[(txns - 1) * 32], 32);
-			txns++;
-		}
-		for (i = 0; i < txns; i += 2){
-			unsigned char hashout[32];
-
-			gen_hash(merkle_hash + (i * 32), hashout, 64);
-			memcpy(merkle_hash + (i / 2 * 32), hashout, 32);
-		}
-		txns /= 2;
+	/* Fold the coinbase hash up the precomputed branch, the only path of
+	 * the tree that changes within one template */
+	for (i = 0; i < pool->merkles; i++) {
+		memcpy(merkle_sha, merkle_hash, 32);
+		memcpy(merkle_sha + 32, pool->merklebin + 32 * i, 32);
+		gen_hash(merkle_sha, merkle_hash, 64);
 	}
 	return merkle_hash;
 }
@@ -1795,13 +2775,17 @@ static void gen_gbt_work(struct pool *pool, struct work *work)
 
 	memcpy(work->target, pool->gbt_target, 32);
 
-	work->coinbase = bin2hex(pool->coinbase, pool->coinbase_len);
+	/* The workid and serialised coinbase are immutable for this work item
+	 * and all its rolled copies, so hand them out through a shared
+	 * refcounted base */
+	work->sjob = sjob_new(pool->gbt_workid, NULL, NULL,
+			      bin2hex(pool->coinbase, pool->coinbase_len));
+	work->coinbase = work->sjob->coinbase;
+	work->job_id = work->sjob->job_id;
 
 	/* For encoding the block data on submission */
 	work->gbt_txns = pool->gbt_txns + 1;
 
-	if (pool->gbt_workid)
-		work->job_id = strdup(pool->gbt_workid);
 	cg_runlock(&pool->gbt_lock);
 
 	flip32(work->data + 4 + 32, merkleroot);
@@ -1832,6 +2816,56 @@ static void gen_gbt_work(struct pool *pool, struct work *work)
 	cgtime(&work->tv_staged);
 }
 
+/* Preassemble the submitblock request for the current template, with
+ * placeholder digits where the 80 byte header and the coinbase belong, so
+ * submitting a solved block is two in-place patches and a POST rather than
+ * hex encoding and string assembly at the most latency critical moment of
+ * solo mining. Must be entered under gbt_lock */
+static void __build_gbt_submit(struct pool *pool)
+{
+	static const char *prefix = "{\"id\": 0, \"method\": \"submitblock\", \"params\": [\"";
+	int txns = pool->gbt_txns + 1;
+	char varint[12];
+	int len;
+
+	free(pool->submit_tmpl);
+	pool->submit_tmpl = NULL;
+
+	if (txns < 0xfd) {
+		uint8_t val8 = txns;
+
+		__bin2hex(varint, (const unsigned char *)&val8, 1);
+	} else if (txns <= 0xffff) {
+		uint16_t val16 = htole16(txns);
+
+		strcpy(varint, "fd");
+		__bin2hex(varint + 2, (const unsigned char *)&val16, 2);
+	} else {
+		uint32_t val32 = htole32(txns);
+
+		strcpy(varint, "fe");
+		__bin2hex(varint + 2, (const unsigned char *)&val32, 4);
+	}
+
+	pool->submit_hdr_off = strlen(prefix);
+	pool->submit_cb_off = pool->submit_hdr_off + 160 + strlen(varint);
+	pool->submit_cb_len = pool->coinbase_len * 2;
+	len = pool->submit_cb_off + pool->submit_cb_len;
+	pool->submit_tmpl = malloc(len + 64 + (pool->gbt_workid ? strlen(pool->gbt_workid) : 0));
+	if (unlikely(!pool->submit_tmpl))
+		quit(1, "Failed to malloc submit_tmpl in __build_gbt_submit");
+
+	strcpy(pool->submit_tmpl, prefix);
+	memset(pool->submit_tmpl + pool->submit_hdr_off, '0', 160);
+	strcpy(pool->submit_tmpl + pool->submit_hdr_off + 160, varint);
+	memset(pool->submit_tmpl + pool->submit_cb_off, '0', pool->submit_cb_len);
+	if (pool->gbt_workid)
+		sprintf(pool->submit_tmpl + len, "\", {\"workid\": \"%s\"}]}\n", pool->gbt_workid);
+	else
+		sprintf(pool->submit_tmpl + len, "\", {}]}\n");
+	pool->submit_tmpl_len = strlen(pool->submit_tmpl);
+}
+
 static bool gbt_decode(struct pool *pool, json_t *res_val)
 {
 	const char *previousblockhash;
@@ -1879,9 +2913,10 @@ static bool gbt_decode(struct pool *pool, json_t *res_val)
 		applog(LOG_DEBUG, "workid: %s", workid);
 
 	cg_wlock(&pool->gbt_lock);
-	free(pool->coinbasetxn);
-	pool->coinbasetxn = strdup(coinbasetxn);
-	cbt_len = strlen(pool->coinbasetxn) / 2;
+	/* Decode the coinbase straight from the parser's string storage into
+	 * its binary destination - nothing reads the hex again afterwards so
+	 * keeping a copy of it would be a wasted generation */
+	cbt_len = strlen(coinbasetxn) / 2;
 	/* We add 8 bytes of extra data corresponding to nonce2 */
 	pool->n2size = 8;
 	pool->coinbase_len = cbt_len + pool->n2size;
@@ -1891,12 +2926,12 @@ static bool gbt_decode(struct pool *pool, json_t *res_val)
 	pool->coinbase = calloc(cal_len, 1);
 	if (unlikely(!pool->coinbase))
 		quit(1, "Failed to calloc pool coinbase in gbt_decode");
-	hex2bin(pool->coinbase, pool->coinbasetxn, 42);
+	hex2bin(pool->coinbase, coinbasetxn, 42);
 	extra_len = (uint8_t *)(pool->coinbase + 41);
 	orig_len = *extra_len;
-	hex2bin(pool->coinbase + 42, pool->coinbasetxn + 84, orig_len);
+	hex2bin(pool->coinbase + 42, coinbasetxn + 84, orig_len);
 	*extra_len += pool->n2size;
-	hex2bin(pool->coinbase + 42 + *extra_len, pool->coinbasetxn + 84 + (orig_len * 2),
+	hex2bin(pool->coinbase + 42 + *extra_len, coinbasetxn + 84 + (orig_len * 2),
 		cbt_len - orig_len - 42);
 	pool->nonce2_offset = orig_len + 42;
 
@@ -1922,6 +2957,7 @@ static bool gbt_decode(struct pool *pool, json_t *res_val)
 	hex2bin((unsigned char *)&pool->gbt_bits, bits, 4);
 
 	__build_gbt_txns(pool, res_val);
+	__build_gbt_submit(pool);
 	cg_wunlock(&pool->gbt_lock);
 
 	return true;
@@ -2010,18 +3046,38 @@ void decay_time(double *f, double fadd, double fsecs)
 
 static int __total_staged(void)
 {
-	return HASH_COUNT(staged_work);
+	return staged_count;
 }
 
 static int total_staged(void)
 {
-	int ret;
+	return staged_count;
+}
 
-	mutex_lock(stgd_lock);
-	ret = __total_staged();
-	mutex_unlock(stgd_lock);
+/* Size the staged work target from the summed per device work consumption
+ * rates so every device has just enough work prefetched to cover the time a
+ * replacement takes to generate or fetch, instead of one global depth
+ * treating all device classes the same. opt_queue acts as the floor and the
+ * old static provisioning as the ceiling. */
+static int dynamic_staged_target(struct pool *cp)
+{
+	double rate = 0.0, window;
+	int i, target;
 
-	return ret;
+	rd_lock(&devices_lock);
+	for (i = 0; i < total_devices; i++)
+		rate += devices[i]->work_rate;
+	rd_unlock(&devices_lock);
+
+	/* Cover twice the pool's rolling getwork latency, with a floor for
+	 * scheduler wakeup time */
+	window = cp->cgminer_pool_stats.getwork_wait_rolling * 2 + 0.1;
+	target = ceil(rate * window);
+	if (target < opt_queue)
+		target = opt_queue;
+	if (target > mining_threads + opt_queue)
+		target = mining_threads + opt_queue;
+	return target;
 }
 
 #ifdef HAVE_CURSES
@@ -2171,38 +3227,51 @@ static bool shared_strategy(void)
 	wprintw(win, "%s", tmp42); \
 } while (0)
 
-/* Must be called with curses mutex lock held and curses_active */
-static void curses_print_status(void)
+/* Staged copies of the status window rows. The display thread formats a
+ * frame into cur without holding the curses lock, then repaints only the
+ * rows whose text differs from the previously painted frame so a steady
+ * state screen costs no curses work at all. */
+#define DISPLAY_ROW_LEN CURBUFSIZ
+struct display_row {
+	char cur[DISPLAY_ROW_LEN];
+	char last[DISPLAY_ROW_LEN];
+};
+
+#define DISPLAY_STATUS_ROWS 4 /* rows 2 to 5 of the status window */
+static struct display_row display_status[DISPLAY_STATUS_ROWS];
+static struct display_row *display_dev_rows;
+static int display_dev_rows_alloc;
+/* Repaint every row and the decorations on the next frame */
+static bool display_redraw = true;
+
+/* Format the dynamic status window rows into their staging buffers. Takes
+ * no curses locks. */
+static void format_status_rows(void)
 {
 	struct pool *pool = current_pool();
 
-	wattron(statuswin, A_BOLD);
-	cg_mvwprintw(statuswin, 0, 0, " " PACKAGE " version " VERSION " - Started: %s", datestamp);
-	wattroff(statuswin, A_BOLD);
-	mvwhline(statuswin, 1, 0, '-', 80);
-	cg_mvwprintw(statuswin, 2, 0, " %s", statusline);
-	wclrtoeol(statuswin);
-	cg_mvwprintw(statuswin, 3, 0, " ST: %d  SS: %d  NB: %d  LW: %d  GF: %d  RF: %d",
+	snprintf(display_status[0].cur, DISPLAY_ROW_LEN, " %s", statusline);
+	snprintf(display_status[1].cur, DISPLAY_ROW_LEN,
+		" ST: %d  SS: %d  NB: %d  LW: %d  GF: %d  RF: %d",
 		total_staged(), total_stale, new_blocks,
 		local_work, total_go, total_ro);
-	wclrtoeol(statuswin);
 	if (shared_strategy() && total_pools > 1) {
-		cg_mvwprintw(statuswin, 4, 0, " Connected to multiple pools with%s block change notify",
+		snprintf(display_status[2].cur, DISPLAY_ROW_LEN,
+			" Connected to multiple pools with%s block change notify",
 			have_longpoll ? "": "out");
 	} else if (pool->has_stratum) {
-		cg_mvwprintw(statuswin, 4, 0, " Connected to %s diff %s with stratum as user %s",
+		snprintf(display_status[2].cur, DISPLAY_ROW_LEN,
+			" Connected to %s diff %s with stratum as user %s",
 			pool->sockaddr_url, pool->diff, pool->rpc_user);
 	} else {
-		cg_mvwprintw(statuswin, 4, 0, " Connected to %s diff %s with%s %s as user %s",
+		snprintf(display_status[2].cur, DISPLAY_ROW_LEN,
+			" Connected to %s diff %s with%s %s as user %s",
 			pool->sockaddr_url, pool->diff, have_longpoll ? "": "out",
 			pool->has_gbt ? "GBT" : "LP", pool->rpc_user);
 	}
-	wclrtoeol(statuswin);
-	cg_mvwprintw(statuswin, 5, 0, " Block: %s...  Diff:%s  Started: %s  Best share: %s   ",
-		     prev_block, block_diff, blocktime, best_share);
-	mvwhline(statuswin, 6, 0, '-', 80);
-	mvwhline(statuswin, statusy - 1, 0, '-', 80);
-	cg_mvwprintw(statuswin, devcursor - 1, 1, "[P]ool management [S]ettings [D]isplay options [Q]uit");
+	snprintf(display_status[3].cur, DISPLAY_ROW_LEN,
+		" Block: %s...  Diff:%s  Started: %s  Best share: %s   ",
+		prev_block, block_diff, blocktime, best_share);
 }
 
 static void adj_width(int var, int *length)
@@ -2219,7 +3288,8 @@ static void adj_fwidth(float var, int *length)
 
 static int dev_width;
 
-static void curses_print_devstatus(struct cgpu_info *cgpu, int count)
+/* Format one device row into its staging buffer. Takes no curses locks. */
+static void format_devstatus(struct cgpu_info *cgpu, char *buf, size_t siz)
 {
 	static int dawidth = 1, drwidth = 1, hwwidth = 1, wuwidth = 1;
 	char logline[256];
@@ -2227,15 +3297,7 @@ static void curses_print_devstatus(struct cgpu_info *cgpu, int count)
 	uint64_t dh64, dr64;
 	struct timeval now;
 	double dev_runtime, wu;
-
-	if (opt_compact)
-		return;
-
-	if (devcursor + count > LINES - 2)
-		return;
-
-	if (count >= most_devices)
-		return;
+	size_t off;
 
 	if (cgpu->dev_start_tv.tv_sec == 0)
 		dev_runtime = total_secs;
@@ -2250,11 +3312,14 @@ static void curses_print_devstatus(struct cgpu_info *cgpu, int count)
 	cgpu->utility = cgpu->accepted / dev_runtime * 60;
 	wu = cgpu->diff1 / dev_runtime * 60;
 
-	wmove(statuswin,devcursor + count, 0);
-	cg_wprintw(statuswin, " %s %*d: ", cgpu->drv->name, dev_width, cgpu->device_id);
+	off = snprintf(buf, siz, " %s %*d: ", cgpu->drv->name, dev_width, cgpu->device_id);
+	if (off >= siz)
+		return;
 	logline[0] = '\0';
 	cgpu->drv->get_statline_before(logline, sizeof(logline), cgpu);
-	cg_wprintw(statuswin, "%s", logline);
+	off += snprintf(buf + off, siz - off, "%s", logline);
+	if (off >= siz)
+		return;
 
 	dh64 = (double)cgpu->total_mhashes / dev_runtime * 1000000ull;
 	dr64 = (double)cgpu->rolling * 1000000ull;
@@ -2263,36 +3328,75 @@ static void curses_print_devstatus(struct cgpu_info *cgpu, int count)
 
 #ifdef USE_USBUTILS
 	if (cgpu->usbinfo.nodev)
-		cg_wprintw(statuswin, "ZOMBIE");
+		off += snprintf(buf + off, siz - off, "ZOMBIE");
 	else
 #endif
 	if (cgpu->status == LIFE_DEAD)
-		cg_wprintw(statuswin, "DEAD  ");
+		off += snprintf(buf + off, siz - off, "DEAD  ");
 	else if (cgpu->status == LIFE_SICK)
-		cg_wprintw(statuswin, "SICK  ");
+		off += snprintf(buf + off, siz - off, "SICK  ");
 	else if (cgpu->deven == DEV_DISABLED)
-		cg_wprintw(statuswin, "OFF   ");
+		off += snprintf(buf + off, siz - off, "OFF   ");
 	else if (cgpu->deven == DEV_RECOVER)
-		cg_wprintw(statuswin, "REST  ");
+		off += snprintf(buf + off, siz - off, "REST  ");
 	else
-		cg_wprintw(statuswin, "%6s", displayed_rolling);
+		off += snprintf(buf + off, siz - off, "%6s", displayed_rolling);
+	if (off >= siz)
+		return;
 	adj_fwidth(cgpu->diff_accepted, &dawidth);
 	adj_fwidth(cgpu->diff_rejected, &drwidth);
 	adj_width(cgpu->hw_errors, &hwwidth);
 	adj_width(wu, &wuwidth);
 
-	cg_wprintw(statuswin, "/%6sh/s | A:%*.0f R:%*.0f HW:%*d WU:%*.1f/m",
+	off += snprintf(buf + off, siz - off, "/%6sh/s | A:%*.0f R:%*.0f HW:%*d WU:%*.1f/m",
 			displayed_hashes,
 			dawidth, cgpu->diff_accepted,
 			drwidth, cgpu->diff_rejected,
 			hwwidth, cgpu->hw_errors,
 			wuwidth + 2, wu);
+	if (off >= siz)
+		return;
 
 	logline[0] = '\0';
 	cgpu->drv->get_statline(logline, sizeof(logline), cgpu);
-	cg_wprintw(statuswin, "%s", logline);
+	snprintf(buf + off, siz - off, "%s", logline);
+}
 
+/* Repaint one staged row if its text changed since the last frame. Must be
+ * called with curses mutex lock held and curses_active */
+static void display_paint_row(int y, struct display_row *row)
+{
+	if (!display_redraw && !strcmp(row->cur, row->last))
+		return;
+	mvwprintw(statuswin, y, 0, "%s", row->cur);
 	wclrtoeol(statuswin);
+	strcpy(row->last, row->cur);
+}
+
+/* Paint the staged frame, repainting only changed rows plus the static
+ * decorations when a full redraw was flagged. Must be called with curses
+ * mutex lock held and curses_active */
+static void display_paint(int devcount)
+{
+	int i;
+
+	if (display_redraw) {
+		wattron(statuswin, A_BOLD);
+		cg_mvwprintw(statuswin, 0, 0, " " PACKAGE " version " VERSION " - Started: %s", datestamp);
+		wattroff(statuswin, A_BOLD);
+		mvwhline(statuswin, 1, 0, '-', 80);
+		mvwhline(statuswin, 6, 0, '-', 80);
+		mvwhline(statuswin, statusy - 1, 0, '-', 80);
+		cg_mvwprintw(statuswin, devcursor - 1, 1, "[P]ool management [S]ettings [D]isplay options [Q]uit");
+	}
+	for (i = 0; i < DISPLAY_STATUS_ROWS; i++)
+		display_paint_row(2 + i, &display_status[i]);
+	for (i = 0; i < devcount; i++) {
+		if (devcursor + i > LINES - 2)
+			break;
+		display_paint_row(devcursor + i, &display_dev_rows[i]);
+	}
+	display_redraw = false;
 }
 #endif
 
@@ -2314,13 +3418,16 @@ static inline void change_logwinsize(void)
 		logcursor = statusy + 1;
 		mvwin(logwin, logcursor, 0);
 		wresize(statuswin, statusy, x);
+		display_redraw = true;
 	}
 
 	y -= logcursor;
 	getmaxyx(logwin, logy, logx);
 	/* Detect screen size change */
-	if (x != logx || y != logy)
+	if (x != logx || y != logy) {
 		wresize(logwin, y, x);
+		display_redraw = true;
+	}
 }
 
 static void check_winsizes(void)
@@ -2363,6 +3470,7 @@ static void switch_logsize(bool __maybe_unused newdevs)
 			logstart = devcursor + most_devices + 1;
 			logcursor = logstart + 1;
 		}
+		display_redraw = true;
 #ifdef WIN32
 		if (newdevs)
 			enable_curses_windows();
@@ -2393,12 +3501,49 @@ static void switch_logsize(bool __maybe_unused newdevs)
 #endif
 
 #ifdef HAVE_CURSES
-bool log_curses_only(int prio, const char *datetime, const char *str)
+/* Fixed ring buffering log lines bound for the scrolling log window.
+ * Producers claim a slot with an atomic increment and format into it
+ * without ever taking the curses lock, so a burst of device errors can
+ * never block the threads generating them; the display thread appends
+ * unshown entries to logwin at frame rate. The ring retains the last
+ * LOGWIN_RECORDS lines, the storage a future scrollback view needs. */
+#define LOGWIN_RECORDS 256
+#define LOGWIN_LINE_LEN 256
+struct logwin_rec {
+	unsigned int seq; /* claim number + 1, 0 = never written */
+	int prio;
+	char line[LOGWIN_LINE_LEN];
+};
+static struct logwin_rec logwin_ring[LOGWIN_RECORDS];
+static unsigned int logwin_seq;
+static unsigned int logwin_shown;
+/* Set once the display thread is consuming the ring; until then lines are
+ * painted synchronously so startup messages are not held back. */
+static bool logwin_async;
+
+bool log_curses_only(int prio, const char *datetime, const char *str, bool force)
 {
 	bool high_prio;
 
 	high_prio = (prio == LOG_WARNING || prio == LOG_ERR);
 
+	if (logwin_async && !force) {
+		struct logwin_rec *rec;
+		unsigned int seq;
+
+		if (!curses_active)
+			return false;
+		seq = __sync_fetch_and_add(&logwin_seq, 1);
+		rec = &logwin_ring[seq % LOGWIN_RECORDS];
+		rec->seq = 0;
+		__sync_synchronize();
+		rec->prio = prio;
+		snprintf(rec->line, sizeof(rec->line), "%s%s", datetime, str);
+		__sync_synchronize();
+		rec->seq = seq + 1;
+		return true;
+	}
+
 	if (curses_active_locked()) {
 		if (!opt_loginput || high_prio) {
 			wprintw(logwin, "%s%s\n", datetime, str);
@@ -2413,6 +3558,29 @@ bool log_curses_only(int prio, const char *datetime, const char *str)
 	return false;
 }
 
+/* Append ring entries not yet shown to logwin, skipping torn or recycled
+ * slots. Must be called with curses mutex lock held and curses_active */
+static void logwin_drain(void)
+{
+	while (logwin_shown != logwin_seq) {
+		unsigned int seq = logwin_shown;
+		struct logwin_rec rec;
+
+		if (logwin_seq - seq > LOGWIN_RECORDS) {
+			/* Overrun - skip to the oldest retained line */
+			logwin_shown = logwin_seq - LOGWIN_RECORDS;
+			continue;
+		}
+		memcpy(&rec, &logwin_ring[seq % LOGWIN_RECORDS], sizeof(rec));
+		logwin_shown = seq + 1;
+		if (rec.seq != seq + 1)
+			continue;
+		if (opt_loginput && rec.prio != LOG_WARNING && rec.prio != LOG_ERR)
+			continue;
+		wprintw(logwin, "%s\n", rec.line);
+	}
+}
+
 void clear_logwin(void)
 {
 	if (curses_active_locked()) {
@@ -2457,6 +3625,7 @@ static void reject_pool(struct pool *pool)
 }
 
 static void restart_threads(void);
+static void shared_thread_restart(void);
 
 /* Theoretically threads could race when modifying accepted and
  * rejected values but the chance of two submits completing at the
@@ -2468,8 +3637,39 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 	struct pool *pool = work->pool;
 	struct cgpu_info *cgpu;
 
+	/* Shares rebuilt by the stratum proxy belong to no local device so
+	 * account them against the pool alone */
+	if (unlikely(work->thr_id < 0)) {
+		bool ok = json_is_true(res);
+
+		mutex_lock(&stats_lock);
+		if (ok) {
+			total_accepted++;
+			pool->accepted++;
+			total_diff_accepted += work->work_difficulty;
+			pool->diff_accepted += work->work_difficulty;
+		} else {
+			total_rejected++;
+			pool->rejected++;
+			total_diff_rejected += work->work_difficulty;
+			pool->diff_rejected += work->work_difficulty;
+		}
+		mutex_unlock(&stats_lock);
+		if (ok) {
+			pool->seq_rejects = 0;
+			pool->last_share_time = time(NULL);
+			pool->last_share_diff = work->work_difficulty;
+		} else
+			pool->seq_rejects++;
+		applog(LOG_DEBUG, "%s proxied share %s pool %d",
+		       ok ? "Accepted" : "Rejected", hashshow, pool->pool_no);
+		return;
+	}
+
 	cgpu = get_thr_cgpu(work->thr_id);
 
+	TRACE2(share_result, work->id, pool->pool_no);
+
 	if (json_is_true(res) || (work->gbt && json_is_null(res))) {
 		mutex_lock(&stats_lock);
 		cgpu->accepted++;
@@ -2496,6 +3696,13 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 				       hashshow, cgpu->drv->name, cgpu->device_id, resubmit ? "(resubmit)" : "", worktime);
 		}
 		sharelog("accept", work);
+		{
+			char eventdesc[256];
+
+			snprintf(eventdesc, sizeof(eventdesc), "%s %s %d pool %d",
+				 hashshow, cgpu->drv->name, cgpu->device_id, work->pool->pool_no);
+			api_event("accepted", eventdesc);
+		}
 		if (opt_shares && total_diff_accepted >= opt_shares) {
 			applog(LOG_WARNING, "Successfully mined %d accepted shares as requested and exiting.", opt_shares);
 			kill_work();
@@ -2565,6 +3772,13 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 			       hashshow, cgpu->drv->name, cgpu->device_id, where, reason, resubmit ? "(resubmit)" : "", worktime);
 			sharelog(disposition, work);
 		}
+		{
+			char eventdesc[256];
+
+			snprintf(eventdesc, sizeof(eventdesc), "%s %s %d pool %d",
+				 hashshow, cgpu->drv->name, cgpu->device_id, work->pool->pool_no);
+			api_event("rejected", eventdesc);
+		}
 
 		/* Once we have more than a nominal amount of sequential rejects,
 		 * at least 10 and more than 3 mins at the current utility,
@@ -2627,9 +3841,14 @@ static void print_status(int thr_id)
 		text_print_status(thr_id);
 }
 
-static bool submit_upstream_work(struct work *work, CURL *curl, bool resubmit)
+/* Constant skeleton of a getwork submit, built once per connection with the
+ * hex encoded header patched into place per share */
+#define GWS_PREFIX "{\"method\": \"getwork\", \"params\": [ \""
+#define GWS_SUFFIX "\" ], \"id\":1}\n"
+#define GWS_HDR_OFF (sizeof(GWS_PREFIX) - 1)
+
+static bool submit_upstream_work(struct work *work, struct curl_ent *ce, bool resubmit)
 {
-	char *hexstr = NULL;
 	json_t *val, *res, *err;
 	char *s;
 	bool rc = false;
@@ -2647,58 +3866,96 @@ static bool submit_upstream_work(struct work *work, CURL *curl, bool resubmit)
 
 	endian_flip128(work->data, work->data);
 
-	/* build hex string */
-	hexstr = bin2hex(work->data, sizeof(work->data));
-
 	/* build JSON-RPC request */
 	if (work->gbt) {
 		char *gbt_block, *varint;
 		unsigned char data[80];
+		char hdr_hex[161];
+		bool prebuilt = false;
 
 		flip80(data, work->data);
-		gbt_block = bin2hex(data, 80);
 
-		if (work->gbt_txns < 0xfd) {
-			uint8_t val = work->gbt_txns;
+		/* Use the preassembled submission buffer when this work came
+		 * from the currently held template, leaving only the header
+		 * and coinbase to patch into their placeholders */
+		cg_rlock(&pool->gbt_lock);
+		if (pool->submit_tmpl &&
+		    work->gbt_txns == pool->gbt_txns + 1 &&
+		    (int)strlen(work->coinbase) == pool->submit_cb_len &&
+		    !strcmp(work->job_id ? work->job_id : "",
+			    pool->gbt_workid ? pool->gbt_workid : "")) {
+			s = malloc(pool->submit_tmpl_len + 1);
+			if (unlikely(!s))
+				quit(1, "Failed to malloc s in submit_upstream_work");
+			memcpy(s, pool->submit_tmpl, pool->submit_tmpl_len + 1);
+			__bin2hex(hdr_hex, data, 80);
+			memcpy(s + pool->submit_hdr_off, hdr_hex, 160);
+			memcpy(s + pool->submit_cb_off, work->coinbase, pool->submit_cb_len);
+			prebuilt = true;
+		}
+		cg_runlock(&pool->gbt_lock);
 
-			varint = bin2hex((const unsigned char *)&val, 1);
-		} else if (work->gbt_txns <= 0xffff) {
-			uint16_t val = htole16(work->gbt_txns);
+		if (!prebuilt) {
+			gbt_block = bin2hex(data, 80);
 
-			gbt_block = realloc_strcat(gbt_block, "fd");
-			varint = bin2hex((const unsigned char *)&val, 2);
-		} else {
-			uint32_t val = htole32(work->gbt_txns);
+			if (work->gbt_txns < 0xfd) {
+				uint8_t val = work->gbt_txns;
 
-			gbt_block = realloc_strcat(gbt_block, "fe");
-			varint = bin2hex((const unsigned char *)&val, 4);
-		}
-		gbt_block = realloc_strcat(gbt_block, varint);
-		free(varint);
-		gbt_block = realloc_strcat(gbt_block, work->coinbase);
+				varint = bin2hex((const unsigned char *)&val, 1);
+			} else if (work->gbt_txns <= 0xffff) {
+				uint16_t val = htole16(work->gbt_txns);
 
-		s = strdup("{\"id\": 0, \"method\": \"submitblock\", \"params\": [\"");
-		s = realloc_strcat(s, gbt_block);
-		if (work->job_id) {
-			s = realloc_strcat(s, "\", {\"workid\": \"");
-			s = realloc_strcat(s, work->job_id);
-			s = realloc_strcat(s, "\"}]}");
-		} else
-			s = realloc_strcat(s, "\", {}]}");
-		free(gbt_block);
+				gbt_block = realloc_strcat(gbt_block, "fd");
+				varint = bin2hex((const unsigned char *)&val, 2);
+			} else {
+				uint32_t val = htole32(work->gbt_txns);
+
+				gbt_block = realloc_strcat(gbt_block, "fe");
+				varint = bin2hex((const unsigned char *)&val, 4);
+			}
+			gbt_block = realloc_strcat(gbt_block, varint);
+			free(varint);
+			gbt_block = realloc_strcat(gbt_block, work->coinbase);
+
+			s = strdup("{\"id\": 0, \"method\": \"submitblock\", \"params\": [\"");
+			s = realloc_strcat(s, gbt_block);
+			if (work->job_id) {
+				s = realloc_strcat(s, "\", {\"workid\": \"");
+				s = realloc_strcat(s, work->job_id);
+				s = realloc_strcat(s, "\"}]}");
+			} else
+				s = realloc_strcat(s, "\", {}]}");
+			free(gbt_block);
+			s = realloc_strcat(s, "\n");
+		}
 	} else {
-		s = strdup("{\"method\": \"getwork\", \"params\": [ \"");
-		s = realloc_strcat(s, hexstr);
-		s = realloc_strcat(s, "\" ], \"id\":1}");
+		/* Build the constant JSON skeleton once per connection, then
+		 * each share is just the hex encode of its header done in
+		 * place - no allocations or formatting per submit */
+		if (!ce->gws_buf) {
+			ce->gws_buf = malloc(GWS_HDR_OFF + sizeof(work->data) * 2 +
+					     sizeof(GWS_SUFFIX));
+			if (unlikely(!ce->gws_buf))
+				quit(1, "Failed to malloc gws_buf in submit_upstream_work");
+			memcpy(ce->gws_buf, GWS_PREFIX, GWS_HDR_OFF);
+			memcpy(ce->gws_buf + GWS_HDR_OFF + sizeof(work->data) * 2,
+			       GWS_SUFFIX, sizeof(GWS_SUFFIX));
+			mem_account(MEM_CURL, GWS_HDR_OFF +
+				    sizeof(work->data) * 2 + sizeof(GWS_SUFFIX));
+		}
+		s = ce->gws_buf;
+		__bin2hex(s + GWS_HDR_OFF, work->data, sizeof(work->data));
+		/* The hex encode terminates over the closing quote */
+		s[GWS_HDR_OFF + sizeof(work->data) * 2] = '"';
 	}
 	applog(LOG_DEBUG, "DBG: sending %s submit RPC call: %s", pool->rpc_url, s);
-	s = realloc_strcat(s, "\n");
 
 	cgtime(&tv_submit);
 	/* issue JSON-RPC request */
-	val = json_rpc_call(curl, pool->rpc_url, pool->rpc_userpass, s, false, false, &rolltime, pool, true);
+	val = json_rpc_call(ce->curl, pool->rpc_url, pool->rpc_userpass, s, false, false, &rolltime, pool, true);
 	cgtime(&tv_submit_reply);
-	free(s);
+	if (work->gbt)
+		free(s);
 
 	if (unlikely(!val)) {
 		applog(LOG_INFO, "submit_upstream_work json_rpc_call failed");
@@ -2794,7 +4051,6 @@ static bool submit_upstream_work(struct work *work, CURL *curl, bool resubmit)
 
 	rc = true;
 out:
-	free(hexstr);
 	return rc;
 }
 
@@ -3006,8 +4262,15 @@ static double le256todouble(const void *target)
 static void calc_diff(struct work *work, double known)
 {
 	struct cgminer_pool_stats *pool_stats = &(work->pool->cgminer_pool_stats);
+	uint64_t *target64 = (uint64_t *)work->target;
 	double difficulty;
-	int intdiff;
+	int intdiff, i;
+
+	/* Cache the target in big endian word order for the branch free
+	 * compare in fulltest_work. All work generation paths come through
+	 * here after the target is set. */
+	for (i = 0; i < 4; i++)
+		work->target_be[i] = le64toh(target64[3 - i]);
 
 	if (known)
 		work->work_difficulty = known;
@@ -3114,20 +4377,34 @@ static void kill_timeout(struct thr_info *thr)
 	cg_completion_timeout(&thr_info_cancel, thr, 1000);
 }
 
+#ifdef USE_USBUTILS
+static void *usb_cleanup_thread(void __maybe_unused *arg)
+{
+	cg_completion_timeout(&usb_cleanup, NULL, 1000);
+	return NULL;
+}
+#endif
+
 static void kill_mining(void)
 {
 	struct thr_info *thr;
 	int i;
 
 	forcelog(LOG_DEBUG, "Killing off mining threads");
-	/* Kill the mining threads*/
+	/* Cancel every thread first so they all tear down in parallel,
+	 * then reap the joins - cancelling and joining one at a time made
+	 * shutdown time scale with device count */
+	for (i = 0; i < mining_threads; i++) {
+		thr = get_thread(i);
+		if (thr)
+			thr_info_cancel(thr);
+	}
 	for (i = 0; i < mining_threads; i++) {
 		pthread_t *pth = NULL;
 
 		thr = get_thread(i);
 		if (thr && PTH(thr) != 0L)
 			pth = &thr->pth;
-		thr_info_cancel(thr);
 #ifndef WIN32
 		if (pth && *pth)
 			pthread_join(*pth, NULL);
@@ -3180,7 +4457,22 @@ static void __kill_work(void)
 		cgpu->shutdown = true;
 	}
 
-	sleep(1);
+	/* Give the threads a moment to see the shutdown flags and wind
+	 * down on their own before cancelling whatever remains */
+	cgsleep_ms(250);
+
+#ifdef USE_USBUTILS
+	/* Release USB resources in case it's a restart and not a QUIT,
+	 * overlapped with the mining thread joins below - each release
+	 * serializes against its device's own threads via the device
+	 * lock, and the completion timeout bounds the wait */
+	pthread_t usb_cleanup_pth;
+	bool usb_cleanup_started;
+
+	forcelog(LOG_DEBUG, "Releasing all USB devices");
+	usb_cleanup_started = !pthread_create(&usb_cleanup_pth, NULL,
+					      usb_cleanup_thread, NULL);
+#endif
 
 	cg_completion_timeout(&kill_mining, NULL, 3000);
 
@@ -3190,10 +4482,10 @@ static void __kill_work(void)
 	kill_timeout(thr);
 
 #ifdef USE_USBUTILS
-	/* Release USB resources in case it's a restart
-	 * and not a QUIT */
-	forcelog(LOG_DEBUG, "Releasing all USB devices");
-	cg_completion_timeout(&usb_cleanup, NULL, 1000);
+	if (usb_cleanup_started)
+		pthread_join(usb_cleanup_pth, NULL);
+	else
+		cg_completion_timeout(&usb_cleanup, NULL, 1000);
 
 	forcelog(LOG_DEBUG, "Killing off usbres thread");
 	thr = &control_thr[usbres_thr_id];
@@ -3218,10 +4510,105 @@ char **initial_args;
 
 static void clean_up(bool restarting);
 
+#if defined(unix) || defined(__APPLE__)
+#define HANDOFF_ENV "CGMINER_HANDOFF"
+
+/* Hand live stratum connections over an execv restart. Each entry records
+ * the socket fd and session state the new process needs to resume mining
+ * on the same TCP connection, so a binary upgrade doesn't force every
+ * instance on a farm to reconnect at once. The fds survive exec as we
+ * never set close-on-exec on them. USB handles cannot be carried over as
+ * libusb has no way to rebuild its internal state around an inherited
+ * descriptor, so devices still reinitialise in the new process. */
+static void export_stratum_handoff(void)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+		char ent[512];
+		size_t elen;
+
+		if (!pool->has_stratum || !pool->stratum_active || pool->sock < 1)
+			continue;
+		if (!pool->sessionid || !pool->nonce1)
+			continue;
+		snprintf(ent, sizeof(ent), "%s%s|%d|%d|%s|%s", len ? " " : "",
+			 pool->rpc_url, pool->sock, pool->n2size,
+			 pool->sessionid, pool->nonce1);
+		elen = strlen(ent);
+		buf = realloc(buf, len + elen + 1);
+		if (unlikely(!buf))
+			quit(1, "Failed to realloc in export_stratum_handoff");
+		strcpy(buf + len, ent);
+		len += elen;
+	}
+	if (buf) {
+		setenv(HANDOFF_ENV, buf, 1);
+		free(buf);
+	}
+}
+
+/* Adopt any stratum connections handed over by the previous process. Runs
+ * before the pools are probed so pool_active finds the session already
+ * primed and initiate_stratum resumes it over the inherited socket. */
+static void import_stratum_handoff(void)
+{
+	char *env = getenv(HANDOFF_ENV), *buf, *ent, *saveptr = NULL;
+
+	if (!env)
+		return;
+	buf = strdup(env);
+	unsetenv(HANDOFF_ENV);
+	for (ent = strtok_r(buf, " ", &saveptr); ent; ent = strtok_r(NULL, " ", &saveptr)) {
+		char *url, *fd, *n2size, *sessionid, *nonce1, *sp = NULL;
+		struct pool *pool = NULL;
+		int i;
+
+		url = strtok_r(ent, "|", &sp);
+		fd = strtok_r(NULL, "|", &sp);
+		n2size = strtok_r(NULL, "|", &sp);
+		sessionid = strtok_r(NULL, "|", &sp);
+		nonce1 = strtok_r(NULL, "|", &sp);
+		if (!url || !fd || !n2size || !sessionid || !nonce1)
+			continue;
+		for (i = 0; i < total_pools; i++) {
+			if (!strcmp(pools[i]->rpc_url, url) && !pools[i]->handoff_sock) {
+				pool = pools[i];
+				break;
+			}
+		}
+		if (!pool) {
+			/* Pool dropped from the config; don't leak its fd */
+			close(atoi(fd));
+			continue;
+		}
+		pool->sock = atoi(fd);
+		pool->n2size = atoi(n2size);
+		pool->sessionid = strdup(sessionid);
+		pool->nonce1 = strdup(nonce1);
+		pool->n1_len = strlen(nonce1) / 2;
+		pool->nonce1bin = calloc(pool->n1_len + 1, 1);
+		if (unlikely(!pool->nonce1bin))
+			quit(1, "Failed to calloc nonce1bin in import_stratum_handoff");
+		hex2bin(pool->nonce1bin, pool->nonce1, pool->n1_len);
+		pool->handoff_sock = true;
+		applog(LOG_NOTICE, "Pool %d %s: resuming stratum session on inherited connection",
+		       pool->pool_no, pool->rpc_url);
+	}
+	free(buf);
+}
+#endif
+
 void app_restart(void)
 {
 	applog(LOG_WARNING, "Attempting to restart %s", packagename);
 
+#if defined(unix) || defined(__APPLE__)
+	export_stratum_handoff();
+#endif
 	__kill_work();
 	clean_up(true);
 
@@ -3260,6 +4647,9 @@ static void recruit_curl(struct pool *pool)
 
 	list_add(&ce->node, &pool->curlring);
 	pool->curls++;
+	/* The handle's internal buffers are opaque to us so only the entry
+	 * itself and any preformatted submit buffer are counted */
+	mem_account(MEM_CURL, sizeof(struct curl_ent));
 }
 
 /* Grab an available curl if there is one. If not, then recruit extra curls
@@ -3357,22 +4747,17 @@ static void roll_work(struct work *work)
 	work->id = total_work++;
 }
 
-static void *submit_work_thread(void *userdata)
+/* Submit a getwork solution to bitcoin via JSON-RPC, retrying until it is
+ * accepted, goes stale or the pool is in lowmem mode. */
+static void submit_getwork_share(struct work *work)
 {
-	struct work *work = (struct work *)userdata;
 	struct pool *pool = work->pool;
 	bool resubmit = false;
 	struct curl_ent *ce;
 
-	pthread_detach(pthread_self());
-
-	RenameThread("submit_work");
-
-	applog(LOG_DEBUG, "Creating extra submit work thread");
-
 	ce = pop_curl_entry(pool);
 	/* submit solution to bitcoin via JSON-RPC */
-	while (!submit_upstream_work(work, ce->curl, resubmit)) {
+	while (!submit_upstream_work(work, ce, resubmit)) {
 		if (opt_lowmem) {
 			applog(LOG_NOTICE, "Pool %d share being discarded to minimise memory cache", pool->pool_no);
 			break;
@@ -3396,8 +4781,6 @@ static void *submit_work_thread(void *userdata)
 		applog(LOG_INFO, "json_rpc_call failed on submit_work, retrying");
 	}
 	push_curl_entry(ce, pool);
-
-	return NULL;
 }
 
 static struct work *make_clone(struct work *work)
@@ -3417,16 +4800,32 @@ static struct work *make_clone(struct work *work)
 
 static void stage_work(struct work *work);
 
+static bool work_rollable(struct work *work)
+{
+	return (!work->clone && work->rolltime);
+}
+
+/* Remove a staged work item from its lane, adjusting the counters. Must be
+ * called under stgd_lock. */
+static void __unstage_work(struct work *work)
+{
+	list_del(&work->staged_node);
+	list_del(&work->expiry_node);
+	if (work_rollable(work))
+		__sync_sub_and_fetch(&staged_rollable, 1);
+	__sync_sub_and_fetch(&staged_count, 1);
+}
+
 static bool clone_available(void)
 {
-	struct work *work_clone = NULL, *work, *tmp;
+	struct work *work_clone = NULL, *work;
 	bool cloned = false;
 
 	mutex_lock(stgd_lock);
 	if (!staged_rollable)
 		goto out_unlock;
 
-	HASH_ITER(hh, staged_work, work, tmp) {
+	list_for_each_entry(work, &staged_masters, staged_node) {
 		if (can_roll(work) && should_roll(work)) {
 			roll_work(work);
 			work_clone = make_clone(work);
@@ -3451,7 +4850,7 @@ out_unlock:
  * the future */
 static struct work *clone_work(struct work *work)
 {
-	int mrs = mining_threads + opt_queue - total_staged();
+	int mrs = dynamic_staged_target(current_pool()) - total_staged();
 	struct work *work_clone;
 	bool cloned;
 
@@ -3482,12 +4881,61 @@ static struct work *clone_work(struct work *work)
 }
 
 #else /* HAVE_LIBCURL */
-static void *submit_work_thread(void __maybe_unused *userdata)
+static void submit_getwork_share(struct work *work)
+{
+	free_work(work);
+}
+#endif /* HAVE_LIBCURL */
+
+#define GWSUBMIT_THREADS 2
+#define GWSUBMIT_QSIZE 1024
+
+static struct mpsc_q **gwsubmit_qs;
+static unsigned int gwsubmit_rr;
+
+/* Persistent getwork share submitter, replacing the old thread per share
+ * which paid thread creation and teardown for every result and grew without
+ * bound during share bursts. Each worker owns one queue so the single
+ * consumer contract of mpsc_q holds; concurrent submissions to one pool
+ * still multiplex over its curl ring as before. */
+static void *gwsubmit_thread(void *userdata)
 {
+	struct mpsc_q *q = (struct mpsc_q *)userdata;
+
 	pthread_detach(pthread_self());
+	RenameThread("GWSubmit");
+
+	while (42) {
+		struct work *work = mpscq_pop(q, -1);
+
+		submit_getwork_share(work);
+	}
 	return NULL;
 }
-#endif /* HAVE_LIBCURL */
+
+/* Started lazily on the first getwork share so stratum only setups never
+ * carry the submitter threads */
+static void gwsubmit_start(void)
+{
+	static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+	struct mpsc_q **qs;
+	pthread_t pth;
+	int i;
+
+	mutex_lock(&start_lock);
+	if (!gwsubmit_qs) {
+		qs = malloc(sizeof(struct mpsc_q *) * GWSUBMIT_THREADS);
+		if (!qs)
+			quit(1, "Failed to malloc gwsubmit_qs");
+		for (i = 0; i < GWSUBMIT_THREADS; i++) {
+			qs[i] = mpscq_new(GWSUBMIT_QSIZE);
+			if (unlikely(pthread_create(&pth, NULL, gwsubmit_thread, qs[i])))
+				quit(1, "Failed to create gwsubmit thread");
+		}
+		gwsubmit_qs = qs;
+	}
+	mutex_unlock(&start_lock);
+}
 
 /* Return an adjusted ntime if we're submitting work that a device has
  * internally offset the ntime. */
@@ -3514,6 +4962,14 @@ static void _copy_work(struct work *work, const struct work *base_work, int noff
 	/* Keep the unique new id assigned during make_work to prevent copied
 	 * work from having the same id. */
 	work->id = id;
+	if (base_work->sjob && !noffset) {
+		/* The string and coinbase pointers borrowed from the shared
+		 * base were copied by the memcpy, just take another
+		 * reference */
+		work->sjob = sjob_ref(base_work->sjob);
+		return;
+	}
+	work->sjob = NULL;
 	if (base_work->job_id)
 		work->job_id = strdup(base_work->job_id);
 	if (base_work->nonce1)
@@ -3546,6 +5002,7 @@ void set_work_ntime(struct work *work, int ntime)
 	uint32_t *work_ntime = (uint32_t *)(work->data + 68);
 
 	*work_ntime = htobe32(ntime);
+	work_unshare_sjob(work);
 	if (work->ntime) {
 		free(work->ntime);
 		work->ntime = bin2hex((unsigned char *)work_ntime, 4);
@@ -3565,10 +5022,48 @@ struct work *copy_work_noffset(struct work *base_work, int noffset)
 	return work;
 }
 
+/* Per pool reconnect backoff: the delay doubles with each consecutive
+ * failure from 5 seconds up to 5 minutes, and half of each interval is
+ * randomised so a farm of rigs does not hammer a recovering pool in
+ * lockstep. Returns the number of seconds to wait before the next try. */
+#define BACKOFF_MIN_SECS 5
+#define BACKOFF_MAX_SECS 300
+
+static int pool_backoff(struct pool *pool)
+{
+	int delay = pool->backoff_secs;
+
+	if (!delay)
+		delay = BACKOFF_MIN_SECS;
+	pool->backoff_secs = delay * 2;
+	if (pool->backoff_secs > BACKOFF_MAX_SECS)
+		pool->backoff_secs = BACKOFF_MAX_SECS;
+	return delay / 2 + rand() % (delay / 2 + 1);
+}
+
+static void pool_backoff_reset(struct pool *pool)
+{
+	pool->backoff_secs = 0;
+}
+
+static cgsem_t watchpool_sem;
+
+/* Fast retest hook: clear a dead pool's backoff and kick the watchpool
+ * thread, so an explicit API request or a network change event doesn't
+ * have to wait out the backoff interval */
+void pool_probe_now(struct pool *pool)
+{
+	pool_backoff_reset(pool);
+	pool->idle_wait = 0;
+	pool->tv_idle.tv_sec = 0;
+	cgsem_post(&watchpool_sem);
+}
+
 static void pool_died(struct pool *pool)
 {
 	if (!pool_tset(pool, &pool->idle)) {
 		cgtime(&pool->tv_idle);
+		pool->idle_wait = pool_backoff(pool);
 		if (pool == current_pool()) {
 			applog(LOG_WARNING, "Pool %d %s not responding!", pool->pool_no, pool->rpc_url);
 			switch_pools(NULL);
@@ -3577,6 +5072,12 @@ static void pool_died(struct pool *pool)
 	}
 }
 
+/* Set while a pool switch waits for the first staged work from the new
+ * pool. The pool being left keeps its staged work valid until then so
+ * devices never idle over the switch. */
+static struct pool *transition_pool;
+static void complete_pool_transition(void);
+
 static bool stale_work(struct work *work, bool share)
 {
 	struct timeval now;
@@ -3603,21 +5104,23 @@ static bool stale_work(struct work *work, bool share)
 	pool = work->pool;
 
 	if (!share && pool->has_stratum) {
-		bool same_job;
+		unsigned int pool_job_seq, seq;
 
 		if (!pool->stratum_active || !pool->stratum_notify) {
 			applog(LOG_DEBUG, "Work stale due to stratum inactive");
 			return true;
 		}
 
-		same_job = true;
-
-		cg_rlock(&pool->data_lock);
-		if (strcmp(work->job_id, pool->swork.job_id))
-			same_job = false;
-		cg_runlock(&pool->data_lock);
+		/* Compare the job sequence numbers with the seqlock read
+		 * path so staleness checks never write the data_lock's
+		 * cachelines, nor look at the job_id string a notify may
+		 * be freeing */
+		do {
+			seq = cg_seq_begin(&pool->data_lock);
+			pool_job_seq = pool->swork.job_seq;
+		} while (cg_seq_retry(&pool->data_lock, seq));
 
-		if (!same_job) {
+		if (work->job_seq != pool_job_seq) {
 			applog(LOG_DEBUG, "Work stale due to stratum job_id mismatch");
 			return true;
 		}
@@ -3637,7 +5140,8 @@ static bool stale_work(struct work *work, bool share)
 	}
 
 	if (opt_fail_only && !share && pool != current_pool() && !work->mandatory &&
-	    pool_strategy != POOL_LOADBALANCE && pool_strategy != POOL_BALANCE) {
+	    pool_strategy != POOL_LOADBALANCE && pool_strategy != POOL_BALANCE &&
+	    pool != transition_pool) {
 		applog(LOG_DEBUG, "Work stale due to fail only pool mismatch");
 		return true;
 	}
@@ -3686,6 +5190,30 @@ static void regen_hash(struct work *work)
 	sha256(hash1, 32, (unsigned char *)(work->hash));
 }
 
+/* Regenerates work->hash resuming the first hash from the midstate stored
+ * at work generation time, costing two sha256 transforms instead of the
+ * three regen_hash spends redoing the first 64 header bytes. */
+static void regen_hash_midstate(struct work *work)
+{
+	uint32_t *data32 = (uint32_t *)(work->data);
+	uint32_t *mid32 = (uint32_t *)(work->midstate);
+	unsigned char tail[16];
+	uint32_t *tail32 = (uint32_t *)tail;
+	unsigned char hash1[32];
+	sha256_ctx ctx;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		ctx.h[i] = le32toh(mid32[i]);
+	ctx.tot_len = 64;
+	ctx.len = 0;
+	for (i = 0; i < 4; i++)
+		tail32[i] = swab32(data32[16 + i]);
+	sha256_update(&ctx, tail, 16);
+	sha256_final(&ctx, hash1);
+	sha256(hash1, 32, (unsigned char *)(work->hash));
+}
+
 static bool cnx_needed(struct pool *pool);
 
 /* Find the pool that currently has the highest priority */
@@ -3722,13 +5250,33 @@ static bool pool_unusable(struct pool *pool)
 	return false;
 }
 
-void switch_pools(struct pool *selected)
+/* Push a changed share difficulty down to devices that can filter results
+ * on their own hardware, so they stop returning nonces the host would only
+ * verify and discard. Only the current pool's difficulty is pushed since
+ * that is what the work being mined carries, capped to the highest target
+ * difficulty the device supports. */
+void update_device_diffs(struct pool *pool, double diff)
 {
-	struct pool *pool, *last_pool;
-	int i, pool_no, next_pool;
+	int i;
 
-	cg_wlock(&control_lock);
-	last_pool = currentpool;
+	if (pool != current_pool())
+		return;
+	for (i = 0; i < total_devices; i++) {
+		struct cgpu_info *cgpu = get_devices(i);
+
+		if (!cgpu->drv->set_work_diff || cgpu->deven != DEV_ENABLED)
+			continue;
+		cgpu->drv->set_work_diff(cgpu, MIN(diff, cgpu->drv->max_diff));
+	}
+}
+
+void switch_pools(struct pool *selected)
+{
+	struct pool *pool, *last_pool;
+	int i, pool_no, next_pool;
+
+	cg_wlock(&control_lock);
+	last_pool = currentpool;
 	pool_no = currentpool->pool_no;
 
 	/* Switch selected to pool number 0 and move the rest down */
@@ -3792,8 +5340,23 @@ void switch_pools(struct pool *selected)
 
 	if (pool != last_pool && pool_strategy != POOL_LOADBALANCE && pool_strategy != POOL_BALANCE) {
 		applog(LOG_WARNING, "Switching to pool %d %s", pool->pool_no, pool->rpc_url);
-		if (pool_localgen(pool) || opt_fail_only)
-			clear_pool_work(last_pool);
+		api_event("pool_switch", pool->rpc_url);
+		/* The new pool's share difficulty governs on-device result
+		 * filtering from here on */
+		if (pool->has_stratum)
+			update_device_diffs(pool, pool->swork.diff);
+		if (pool_localgen(pool) || opt_fail_only) {
+			struct pool *prev;
+
+			/* Serve the old pool's work until the new pool stages
+			 * its first work, then clear it in one flip */
+			cg_wlock(&control_lock);
+			prev = transition_pool;
+			transition_pool = last_pool;
+			cg_wunlock(&control_lock);
+			if (prev && prev != last_pool)
+				clear_pool_work(prev);
+		}
 	}
 
 	mutex_lock(&lp_lock);
@@ -3824,24 +5387,43 @@ static void wake_gws(void)
 	mutex_unlock(stgd_lock);
 }
 
-static void discard_stale(void)
+/* Advance the timer wheel to the current time, discarding staged work in
+ * the slots that have come due. Entries whose deadline lies more than a
+ * revolution ahead share a slot with nearer ones and are simply left for
+ * a later pass. Work that went stale early through a block or job change
+ * is rejected as the devices pop it; the wheel reclaims whatever is never
+ * popped once its scheduled expiry arrives. */
+static void expire_staged(void)
 {
 	struct work *work, *tmp;
+	struct timeval now;
 	int stale = 0;
+	time_t t;
 
+	cgtime(&now);
 	mutex_lock(stgd_lock);
-	HASH_ITER(hh, staged_work, work, tmp) {
-		if (stale_work(work, false)) {
-			HASH_DEL(staged_work, work);
+	if (!expiry_wheel_time)
+		expiry_wheel_time = now.tv_sec - 1;
+	/* Cap a large jump - a full revolution already visits every slot */
+	if (now.tv_sec - expiry_wheel_time > EXPIRY_WHEEL_SLOTS)
+		expiry_wheel_time = now.tv_sec - EXPIRY_WHEEL_SLOTS;
+	for (t = expiry_wheel_time + 1; t <= now.tv_sec; t++) {
+		struct list_head *slot = &expiry_wheel[t & (EXPIRY_WHEEL_SLOTS - 1)];
+
+		list_for_each_entry_safe(work, tmp, slot, expiry_node) {
+			if (work->expiry > now.tv_sec)
+				continue;
+			__unstage_work(work);
 			discard_work(work);
 			stale++;
 		}
 	}
+	expiry_wheel_time = now.tv_sec;
 	pthread_cond_signal(&gws_cond);
 	mutex_unlock(stgd_lock);
 
 	if (stale)
-		applog(LOG_DEBUG, "Discarded %d stales that didn't match current hash", stale);
+		applog(LOG_DEBUG, "Discarded %d expired staged works", stale);
 }
 
 /* A generic wait function for threads that poll that will wait a specified
@@ -3874,6 +5456,26 @@ int restart_wait(struct thr_info *thr, unsigned int mstime)
 	
 static void flush_queue(struct cgpu_info *cgpu);
 
+/* Called by a driver once the device side queue has actually been discarded
+ * after a work restart, closing the time-to-flush measurement opened in
+ * restart_thread. The elapsed time is reported per device in the API. */
+void device_flushed(struct cgpu_info *cgpu)
+{
+	struct timeval now;
+	double ms;
+
+	if (!cgpu->flush_pending)
+		return;
+	cgpu->flush_pending = false;
+	cgtime(&now);
+	ms = us_tdiff(&now, &cgpu->tv_flush_req) / 1000.0;
+	cgpu->last_flush_ms = ms;
+	cgpu->total_flush_ms += ms;
+	cgpu->flush_count++;
+	applog(LOG_DEBUG, "%s %d flushed device queue in %.1fms",
+	       cgpu->drv->name, cgpu->device_id, ms);
+}
+
 static void *restart_thread(void __maybe_unused *arg)
 {
 	struct pool *cp = current_pool();
@@ -3886,8 +5488,11 @@ static void *restart_thread(void __maybe_unused *arg)
 	 * fast enough  messages after every long poll */
 	pool_tset(cp, &cp->lagging);
 
-	/* Discard staged work that is now stale */
-	discard_stale();
+	/* Staged work from before the work_block bump is not walked and
+	 * discarded here; it is rejected lazily by the epoch check in
+	 * stale_work as consumers pop it, keeping the restart path free of
+	 * lock convoys when fresh work most needs to flow. The expiry timer
+	 * wheel reclaims anything left over. */
 
 	rd_lock(&mining_thr_lock);
 	mt = mining_threads;
@@ -3900,6 +5505,8 @@ static void *restart_thread(void __maybe_unused *arg)
 		if (cgpu->deven != DEV_ENABLED)
 			continue;
 		mining_thr[i]->work_restart = true;
+		cgtime(&cgpu->tv_flush_req);
+		cgpu->flush_pending = true;
 		flush_queue(cgpu);
 		cgpu->drv->flush_work(cgpu);
 	}
@@ -3908,6 +5515,10 @@ static void *restart_thread(void __maybe_unused *arg)
 	pthread_cond_broadcast(&restart_cond);
 	mutex_unlock(&restart_lock);
 
+	/* Devices on the shared polling executor have no thread of their own
+	 * blocked on restart_cond, so pull their service deadlines in too */
+	shared_thread_restart();
+
 #ifdef USE_USBUTILS
 	/* Cancels any cancellable usb transfers. Flagged as such it means they
 	 * are usualy waiting on a read result and it's safe to abort the read
@@ -3939,6 +5550,16 @@ static void signal_work_update(void)
 	rd_unlock(&mining_thr_lock);
 }
 
+/* Block identity for integer comparison: the low 8 bytes of the big endian
+ * hash, the only bytes with any entropy given the run of leading zeroes. */
+static inline uint64_t block_id(const unsigned char *bedata)
+{
+	uint64_t id;
+
+	memcpy(&id, bedata + 24, 8);
+	return id;
+}
+
 static void set_curblock(char *hexstr, unsigned char *bedata)
 {
 	int ofs;
@@ -3947,6 +5568,7 @@ static void set_curblock(char *hexstr, unsigned char *bedata)
 	cgtime(&block_timeval);
 	strcpy(current_hash, hexstr);
 	memcpy(current_block, bedata, 32);
+	current_block_id = block_id(bedata);
 	get_timestamp(blocktime, sizeof(blocktime), &block_timeval);
 	cg_wunlock(&ch_lock);
 
@@ -3958,38 +5580,33 @@ static void set_curblock(char *hexstr, unsigned char *bedata)
 	prev_block[8] = '\0';
 
 	applog(LOG_INFO, "New block: %s... diff %s", current_hash, block_diff);
+	api_event("new_block", current_hash);
 }
 
-/* Search to see if this string is from a block that has been seen before */
-static bool block_exists(char *hexstr)
+/* Search to see if this block identity has been seen recently */
+static bool block_exists(const unsigned char *bedata)
 {
-	struct block *s;
-
-	rd_lock(&blk_lock);
-	HASH_FIND_STR(blocks, hexstr, s);
-	rd_unlock(&blk_lock);
+	uint64_t id = block_id(bedata);
+	bool ret = false;
+	int i;
 
-	if (s)
+	/* Common case: another work item from the block we are already on */
+	if (likely(id == current_block_id && !memcmp(bedata, current_block, 32)))
 		return true;
-	return false;
-}
 
-/* Tests if this work is from a block that has been seen before */
-static inline bool from_existing_block(struct work *work)
-{
-	char *hexstr = bin2hex(work->data + 8, 18);
-	bool ret;
+	rd_lock(&blk_lock);
+	for (i = 0; i < recent_blocks_stored; i++) {
+		if (recent_blocks[i].block_id == id &&
+		    !memcmp(recent_blocks[i].hash, bedata, 32)) {
+			ret = true;
+			break;
+		}
+	}
+	rd_unlock(&blk_lock);
 
-	ret = block_exists(hexstr);
-	free(hexstr);
 	return ret;
 }
 
-static int block_sort(struct block *blocka, struct block *blockb)
-{
-	return blocka->block_no - blockb->block_no;
-}
-
 /* Decode the current block difficulty which is in packed form */
 static void set_blockdiff(const struct work *work)
 {
@@ -4017,38 +5634,29 @@ static bool test_work_current(struct work *work)
 		return ret;
 
 	swap256(bedata, work->data + 4);
-	__bin2hex(hexstr, bedata, 32);
 
 	/* Search to see if this block exists yet and if not, consider it a
 	 * new block and set the current block details to this one */
-	if (!block_exists(hexstr)) {
-		struct block *s = calloc(sizeof(struct block), 1);
+	if (!block_exists(bedata)) {
 		int deleted_block = 0;
-
-		if (unlikely(!s))
-			quit (1, "test_work_current OOM");
-		strcpy(s->hash, hexstr);
-		s->block_no = new_blocks++;
+		struct block *s;
 
 		wr_lock(&blk_lock);
-		/* Only keep the last hour's worth of blocks in memory since
-		 * work from blocks before this is virtually impossible and we
-		 * want to prevent memory usage from continually rising */
-		if (HASH_COUNT(blocks) > 6) {
-			struct block *oldblock;
-
-			HASH_SORT(blocks, block_sort);
-			oldblock = blocks;
-			deleted_block = oldblock->block_no;
-			HASH_DEL(blocks, oldblock);
-			free(oldblock);
-		}
-		HASH_ADD_STR(blocks, hash, s);
+		s = &recent_blocks[recent_block_next];
+		recent_block_next = (recent_block_next + 1) % RECENT_BLOCKS;
+		if (recent_blocks_stored < RECENT_BLOCKS)
+			recent_blocks_stored++;
+		else
+			deleted_block = s->block_no;
+		memcpy(s->hash, bedata, 32);
+		s->block_id = block_id(bedata);
+		s->block_no = new_blocks++;
 		set_blockdiff(work);
 		wr_unlock(&blk_lock);
 
 		if (deleted_block)
 			applog(LOG_DEBUG, "Deleted block %d from database", deleted_block);
+		__bin2hex(hexstr, bedata, 32);
 		set_curblock(hexstr, bedata);
 		/* Copy the information to this pool's prev_block since it
 		 * knows the new block exists. */
@@ -4058,9 +5666,14 @@ static bool test_work_current(struct work *work)
 			goto out;
 		}
 
-		work->work_block = ++work_block;
+		work->work_block = __sync_add_and_fetch(&work_block, 1);
 
 		if (work->longpoll) {
+			char lpdesc[32];
+
+			snprintf(lpdesc, sizeof(lpdesc), "%s pool %d",
+				 work->stratum ? "stratum" : "longpoll", pool->pool_no);
+			api_event("lp_block", lpdesc);
 			if (work->stratum) {
 				applog(LOG_NOTICE, "Stratum from pool %d detected new block",
 				       pool->pool_no);
@@ -4098,8 +5711,13 @@ static bool test_work_current(struct work *work)
 			applog(LOG_DEBUG, "Pool %d still on old block", pool->pool_no);
 #endif
 		if (work->longpoll) {
-			work->work_block = ++work_block;
+			work->work_block = __sync_add_and_fetch(&work_block, 1);
 			if (shared_strategy() || work->pool == current_pool()) {
+				char lpdesc[32];
+
+				snprintf(lpdesc, sizeof(lpdesc), "%s pool %d",
+					 work->stratum ? "stratum" : "longpoll", pool->pool_no);
+				api_event("lp_restart", lpdesc);
 				if (work->stratum) {
 					applog(LOG_NOTICE, "Stratum from pool %d requested work restart",
 					       pool->pool_no);
@@ -4117,41 +5735,54 @@ out:
 	return ret;
 }
 
-static int tv_sort(struct work *worka, struct work *workb)
+/* Mirror of the time based staleness rule in stale_work, evaluated once
+ * when the work is staged to schedule its expiry on the timer wheel. */
+static time_t work_expiry_deadline(struct work *work)
 {
-	return worka->tv_staged.tv_sec - workb->tv_staged.tv_sec;
-}
+	struct pool *pool = work->pool;
+	time_t work_expiry;
+	int getwork_delay;
 
-static bool work_rollable(struct work *work)
-{
-	return (!work->clone && work->rolltime);
+	if (work->rolltime > opt_scantime)
+		work_expiry = work->rolltime;
+	else
+		work_expiry = opt_expiry;
+	getwork_delay = pool->cgminer_pool_stats.getwork_wait_rolling * 5 + 1;
+	work_expiry -= getwork_delay;
+	if (unlikely(work_expiry < 5))
+		work_expiry = 5;
+
+	return work->tv_staged.tv_sec + work_expiry;
 }
 
-static bool hash_push(struct work *work)
+static void hash_push(struct work *work)
 {
-	bool rc = true;
-
 	mutex_lock(stgd_lock);
-	if (work_rollable(work))
-		staged_rollable++;
-	if (likely(!getq->frozen)) {
-		HASH_ADD_INT(staged_work, id, work);
-		HASH_SORT(staged_work, tv_sort);
+	if (work_rollable(work)) {
+		__sync_add_and_fetch(&staged_rollable, 1);
+		list_add_tail(&work->staged_node, &staged_masters);
 	} else
-		rc = false;
-	pthread_cond_broadcast(&getq->cond);
+		list_add_tail(&work->staged_node, &staged_clones);
+	work->expiry = work_expiry_deadline(work);
+	list_add_tail(&work->expiry_node,
+		      &expiry_wheel[work->expiry & (EXPIRY_WHEEL_SLOTS - 1)]);
+	__sync_add_and_fetch(&staged_count, 1);
+	/* Wake one waiter only; hash_pop_many signals the next in line if
+	 * work is still staged when it finishes. */
+	pthread_cond_signal(&stgd_cond);
 	mutex_unlock(stgd_lock);
-
-	return rc;
 }
 
 static void stage_work(struct work *work)
 {
+	TRACE2(work_staged, work->id, work->pool->pool_no);
 	applog(LOG_DEBUG, "Pushing work from pool %d to hash queue", work->pool->pool_no);
 	work->work_block = work_block;
 	test_work_current(work);
 	work->pool->works++;
 	hash_push(work);
+	if (unlikely(transition_pool) && work->pool == current_pool())
+		complete_pool_transition();
 }
 
 #ifdef HAVE_CURSES
@@ -4458,6 +6089,7 @@ void zero_stats(void)
 		pool->diff_rejected = 0;
 		pool->diff_stale = 0;
 		pool->last_share_diff = 0;
+		memset(&pool->history, 0, sizeof(pool->history));
 	}
 
 	zero_bestshare();
@@ -4476,6 +6108,7 @@ void zero_stats(void)
 		cgpu->diff_accepted = 0;
 		cgpu->diff_rejected = 0;
 		cgpu->last_share_diff = 0;
+		memset(&cgpu->history, 0, sizeof(cgpu->history));
 		mutex_unlock(&hash_lock);
 	}
 }
@@ -4492,6 +6125,63 @@ static void set_highprio(void)
 #endif
 }
 
+#ifndef WIN32
+/* Lock the whole address space into RAM once initialization has mapped the
+ * pools, devices and control threads, so cohabiting services pushing the
+ * controller into swap cannot cost us a major fault mid submit_nonce or
+ * __stratum_send. MCL_CURRENT faults in and pins everything already
+ * allocated - the work caches, sockbufs and submit buffers included - while
+ * MCL_FUTURE pins later allocations as they are mapped, so steady state
+ * operation takes no page faults at all. */
+static void lock_mem(void)
+{
+	struct rlimit rlp;
+
+	/* Best effort; mlockall reports the real verdict */
+	rlp.rlim_cur = rlp.rlim_max = RLIM_INFINITY;
+	setrlimit(RLIMIT_MEMLOCK, &rlp);
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		applog(LOG_WARNING, "Failed to lock memory (%s), needs root or a raised RLIMIT_MEMLOCK - continuing unlocked",
+		       strerror(errno));
+		return;
+	}
+	mem_locked = true;
+	if (opt_lowmem)
+		applog(LOG_WARNING, "--lock-mem pins all buffers so --lowmem will not return memory to the system");
+	applog(LOG_NOTICE, "Locked all memory to prevent page faults");
+}
+#endif
+
+/* Place the calling thread into the SCHED_RR realtime class at the given
+ * priority, for the result read and share send paths where scheduling latency
+ * behind a curses redraw or API burst shows up as stale shares. Needs root or
+ * CAP_SYS_NICE; without privileges the thread keeps its default class and we
+ * warn only once. */
+void set_sched_prio(int prio)
+{
+#ifndef WIN32
+	struct sched_param param;
+	static bool warned;
+
+	if (prio <= 0)
+		return;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = prio;
+	if (pthread_setschedparam(pthread_self(), SCHED_RR, &param)) {
+		if (!warned) {
+			warned = true;
+			applog(LOG_WARNING, "Unable to set realtime priority %d, needs root or CAP_SYS_NICE - continuing with default scheduling", prio);
+		}
+	} else
+		applog(LOG_DEBUG, "Thread set to SCHED_RR priority %d", prio);
+#else
+	if (prio <= 0)
+		return;
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+#endif
+}
+
 static void set_lowprio(void)
 {
 #ifndef WIN32
@@ -4654,6 +6344,8 @@ retry:
 			goto retry;
 		}
 		pool->quota = selected;
+		pool->quota_eff = 0;
+		pool->quota_perf = 0;
 		adjust_quota_gcd();
 		goto updated;
 	} else if (!strncasecmp(&input, "f", 1)) {
@@ -4908,6 +6600,7 @@ static void *api_thread(void *userdata)
 	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
 
 	RenameThread("api");
+	bind_affinity(opt_affinity_api);
 
 	set_lowprio();
 	api(api_thr_id);
@@ -4917,6 +6610,21 @@ static void *api_thread(void *userdata)
 	return NULL;
 }
 
+/* Set when a device that is not well posts a heartbeat so the watchdog
+ * revisits it promptly instead of waiting for its next wheel deadline. */
+static volatile int health_kick;
+
+/* Post a device heartbeat: a single word store the watchdog reads racily
+ * in place of sweeping every device's thread timevals each pass. */
+static void post_heartbeat(struct thr_info *thr)
+{
+	struct cgpu_info *cgpu = thr->cgpu;
+
+	cgpu->heartbeat = thr->last.tv_sec;
+	if (unlikely(cgpu->status != LIFE_WELL))
+		health_kick = 1;
+}
+
 /* Sole work devices are serialised wrt calling get_work so they report in on
  * each pass through their scanhash function as well as in get_work whereas
  * queued work devices work asynchronously so get them to report in and out
@@ -4927,6 +6635,7 @@ static void thread_reportin(struct thr_info *thr)
 	cgtime(&thr->last);
 	thr->cgpu->status = LIFE_WELL;
 	thr->cgpu->device_last_well = time(NULL);
+	post_heartbeat(thr);
 }
 
 /* Tell the watchdog thread this thread is waiting on get work and should not
@@ -4937,49 +6646,256 @@ static void thread_reportout(struct thr_info *thr)
 	cgtime(&thr->last);
 	thr->cgpu->status = LIFE_WELL;
 	thr->cgpu->device_last_well = time(NULL);
+	post_heartbeat(thr);
+}
+
+/* Double buffered snapshot of the global stats, republished by hashmeter()
+ * each log interval with a pointer swap so readers such as the API can copy
+ * a coherent set of totals without ever taking hash_lock */
+static struct stats_snapshot snap_bufs[2];
+static struct stats_snapshot *volatile cur_snap = &snap_bufs[0];
+
+struct stats_snapshot *stats_snapshot(void)
+{
+	return cur_snap;
+}
+
+/* Called under hash_lock */
+static void publish_snapshot(void)
+{
+	struct stats_snapshot *snap;
+
+	snap = (cur_snap == &snap_bufs[0]) ? &snap_bufs[1] : &snap_bufs[0];
+
+	snap->total_secs = total_secs;
+	snap->total_mhashes_done = total_mhashes_done;
+	snap->total_rolling = total_rolling;
+	snap->found_blocks = found_blocks;
+	snap->total_getworks = total_getworks;
+	snap->total_accepted = total_accepted;
+	snap->total_rejected = total_rejected;
+	snap->hw_errors = hw_errors;
+	snap->total_discarded = total_discarded;
+	snap->total_stale = total_stale;
+	snap->total_diff1 = total_diff1;
+	snap->total_go = total_go;
+	snap->local_work = local_work;
+	snap->total_ro = total_ro;
+	snap->new_blocks = new_blocks;
+	snap->total_diff_accepted = total_diff_accepted;
+	snap->total_diff_rejected = total_diff_rejected;
+	snap->total_diff_stale = total_diff_stale;
+	snap->best_diff = best_diff;
+
+	__sync_synchronize();
+	cur_snap = snap;
+}
+
+#if defined(unix) || defined(__APPLE__)
+/* Shared memory stats segment for local scrapers. The writer is the
+ * watchdog stats pass; readers mmap the same file and copy the block,
+ * retrying whenever the sequence count is odd or changed across the copy
+ * (a seqlock), so reading costs no syscalls and no text parsing. The
+ * layout is versioned by the magic/version header fields and documented
+ * in the README - keep them in step. */
+#define STATS_SHM_MAGIC		0x53474d43
+#define STATS_SHM_VERSION	1
+#define STATS_SHM_MAXDEVS	64
+#define STATS_SHM_MAXPOOLS	32
+
+struct shm_dev {
+	char name[8];
+	uint32_t device_id;
+	uint32_t status;		/* enum alive */
+	uint32_t accepted;
+	uint32_t rejected;
+	uint32_t hw_errors;
+	uint32_t pad;
+	double rolling;
+	double total_mhashes;
+};
+
+struct shm_pool {
+	uint32_t pool_no;
+	uint32_t alive;			/* enabled and not idle */
+	uint32_t accepted;
+	uint32_t rejected;
+	uint32_t stale;
+	uint32_t pad;
+	double diff_accepted;
+	double diff_rejected;
+};
+
+struct stats_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;			/* odd while an update is in flight */
+	uint32_t size;			/* sizeof(struct stats_shm) */
+	uint32_t num_devs;
+	uint32_t num_pools;
+	uint32_t pad[2];
+	double total_secs;
+	double total_mhashes_done;
+	double total_rolling;
+	double total_diff_accepted;
+	double total_diff_rejected;
+	uint64_t best_diff;
+	uint32_t total_accepted;
+	uint32_t total_rejected;
+	uint32_t hw_errors;
+	uint32_t found_blocks;
+	uint32_t new_blocks;
+	uint32_t pad2;
+	struct shm_dev dev[STATS_SHM_MAXDEVS];
+	struct shm_pool pool[STATS_SHM_MAXPOOLS];
+};
+
+static struct stats_shm *stats_shm;
+
+static void stats_shm_init(void)
+{
+	int fd;
+
+	fd = open(opt_stats_shm, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		applog(LOG_ERR, "Failed to open %s for stats shm", opt_stats_shm);
+		return;
+	}
+	if (ftruncate(fd, sizeof(struct stats_shm))) {
+		applog(LOG_ERR, "Failed to size stats shm %s", opt_stats_shm);
+		close(fd);
+		return;
+	}
+	stats_shm = mmap(NULL, sizeof(struct stats_shm), PROT_READ | PROT_WRITE,
+			 MAP_SHARED, fd, 0);
+	close(fd);
+	if (stats_shm == MAP_FAILED) {
+		applog(LOG_ERR, "Failed to mmap stats shm %s", opt_stats_shm);
+		stats_shm = NULL;
+		return;
+	}
+	memset(stats_shm, 0, sizeof(struct stats_shm));
+	stats_shm->magic = STATS_SHM_MAGIC;
+	stats_shm->version = STATS_SHM_VERSION;
+	stats_shm->size = sizeof(struct stats_shm);
+}
+
+/* Called from the watchdog stats pass under hash_lock */
+static void stats_shm_update(void)
+{
+	struct stats_shm *shm = stats_shm;
+	int i, n;
+
+	if (!shm)
+		return;
+
+	shm->seq++;
+	__sync_synchronize();
+
+	shm->total_secs = total_secs;
+	shm->total_mhashes_done = total_mhashes_done;
+	shm->total_rolling = total_rolling;
+	shm->total_diff_accepted = total_diff_accepted;
+	shm->total_diff_rejected = total_diff_rejected;
+	shm->best_diff = best_diff;
+	shm->total_accepted = total_accepted;
+	shm->total_rejected = total_rejected;
+	shm->hw_errors = hw_errors;
+	shm->found_blocks = found_blocks;
+	shm->new_blocks = new_blocks;
+
+	n = 0;
+	for (i = 0; i < total_devices && n < STATS_SHM_MAXDEVS; i++) {
+		struct cgpu_info *cgpu = get_devices(i);
+		struct shm_dev *dev = &shm->dev[n];
+
+		if (!cgpu)
+			continue;
+		snprintf(dev->name, sizeof(dev->name), "%s", cgpu->drv->name);
+		dev->device_id = cgpu->device_id;
+		dev->status = cgpu->status;
+		dev->accepted = cgpu->accepted;
+		dev->rejected = cgpu->rejected;
+		dev->hw_errors = cgpu->hw_errors;
+		dev->rolling = cgpu->rolling;
+		dev->total_mhashes = cgpu->total_mhashes;
+		n++;
+	}
+	shm->num_devs = n;
+
+	n = 0;
+	for (i = 0; i < total_pools && n < STATS_SHM_MAXPOOLS; i++) {
+		struct pool *pool = pools[i];
+		struct shm_pool *sp = &shm->pool[n];
+
+		if (pool->removed)
+			continue;
+		sp->pool_no = pool->pool_no;
+		sp->alive = pool->enabled == POOL_ENABLED && !pool->idle;
+		sp->accepted = pool->accepted;
+		sp->rejected = pool->rejected;
+		sp->stale = pool->stale_shares;
+		sp->diff_accepted = pool->diff_accepted;
+		sp->diff_rejected = pool->diff_rejected;
+		n++;
+	}
+	shm->num_pools = n;
+
+	__sync_synchronize();
+	shm->seq++;
+}
+#endif /* unix || __APPLE__ */
+
+/* Add this pass's deltas to the per minute bucket covering now, recycling
+ * the ring slot if its minute has lapped */
+static void history_add(struct hash_history *hist, time_t now, double mhashes,
+			int accepted, int rejected)
+{
+	time_t minute = now / 60;
+	struct hash_bucket *b = &hist->buckets[minute % HISTORY_MINUTES];
+
+	if (b->minute != minute) {
+		memset(b, 0, sizeof(*b));
+		b->minute = minute;
+	}
+	b->mhashes += mhashes;
+	b->accepted += accepted;
+	b->rejected += rejected;
 }
 
 static void hashmeter(int thr_id, struct timeval *diff,
 		      uint64_t hashes_done)
 {
-	struct timeval temp_tv_end, total_diff;
-	double secs;
-	double local_secs;
+	struct timeval temp_tv_end, total_diff, pass_diff;
+	static struct timeval stats_pass_tv;
+	double local_secs, pass_secs;
 	static double local_mhashes_done = 0;
 	double local_mhashes;
 	bool showlog = false;
 	char displayed_hashes[16], displayed_rolling[16];
 	uint64_t dh64, dr64;
 	struct thr_info *thr;
+	int i, j;
 
-	local_mhashes = (double)hashes_done / 1000000.0;
-	/* Update the last time this thread reported in */
+	/* Mining thread pass: only this thread's own state is updated, with
+	 * plain stores. The global and device totals are aggregated from the
+	 * per thread counters by the watchdog pass below, so mining threads
+	 * never touch hash_lock. */
 	if (thr_id >= 0) {
+		double secs = (double)diff->tv_sec + ((double)diff->tv_usec / 1000000.0);
+
+		local_mhashes = (double)hashes_done / 1000000.0;
 		thr = get_thread(thr_id);
 		cgtime(&(thr->last));
 		thr->cgpu->device_last_well = time(NULL);
-	}
-
-	secs = (double)diff->tv_sec + ((double)diff->tv_usec / 1000000.0);
-
-	/* So we can call hashmeter from a non worker thread */
-	if (thr_id >= 0) {
-		struct cgpu_info *cgpu = thr->cgpu;
-		double thread_rolling = 0.0;
-		int i;
+		post_heartbeat(thr);
 
 		applog(LOG_DEBUG, "[thread %d: %"PRIu64" hashes, %.1f khash/sec]",
 			thr_id, hashes_done, hashes_done / 1000 / secs);
 
-		/* Rolling average for each thread and each device */
+		/* Rolling average for this thread, only ever written here */
 		decay_time(&thr->rolling, local_mhashes / secs, secs);
-		for (i = 0; i < cgpu->threads; i++)
-			thread_rolling += cgpu->thr[i]->rolling;
-
-		mutex_lock(&hash_lock);
-		decay_time(&cgpu->rolling, thread_rolling, secs);
-		cgpu->total_mhashes += local_mhashes;
-		mutex_unlock(&hash_lock);
+		thr->stats.hashes_done += hashes_done;
 
 		// If needed, output detailed, per-device stats
 		if (want_per_device_stats) {
@@ -5002,15 +6918,71 @@ static void hashmeter(int thr_id, struct timeval *diff,
 					applog(LOG_INFO, "%s", logline);
 			}
 		}
+		return;
 	}
 
-	/* Totals are updated by all threads so can race without locking */
+	/* Stats pass, from the watchdog thread: sweep the per thread hash
+	 * counters into the device and global totals. hash_lock now only
+	 * serialises this pass against readers like zero_stats. */
 	mutex_lock(&hash_lock);
 	cgtime(&temp_tv_end);
+	if (unlikely(!stats_pass_tv.tv_sec))
+		stats_pass_tv = total_tv_start;
+	timersub(&temp_tv_end, &stats_pass_tv, &pass_diff);
+	pass_secs = (double)pass_diff.tv_sec + ((double)pass_diff.tv_usec / 1000000.0);
+	stats_pass_tv = temp_tv_end;
+
+	local_mhashes = 0.0;
+	for (i = 0; i < total_devices; i++) {
+		struct cgpu_info *cgpu = get_devices(i);
+		double thread_rolling = 0.0;
+		double dev_mhashes = 0.0;
+
+		if (!cgpu || !cgpu->thr)
+			continue;
+		for (j = 0; j < cgpu->threads; j++) {
+			struct thr_info *t = cgpu->thr[j];
+			uint64_t done = t->stats.hashes_done;
+
+			dev_mhashes += (double)(done - t->stats.hashes_seen) / 1000000.0;
+			t->stats.hashes_seen = done;
+			thread_rolling += t->rolling;
+		}
+		if (likely(pass_secs > 0))
+			decay_time(&cgpu->rolling, thread_rolling, pass_secs);
+		cgpu->total_mhashes += dev_mhashes;
+		local_mhashes += dev_mhashes;
+
+		history_add(&cgpu->history, temp_tv_end.tv_sec, dev_mhashes,
+			    cgpu->accepted - cgpu->history.acc_seen,
+			    cgpu->rejected - cgpu->history.rej_seen);
+		cgpu->history.acc_seen = cgpu->accepted;
+		cgpu->history.rej_seen = cgpu->rejected;
+	}
+
+	/* Pool buckets track the accepted/rejected counts and the accepted
+	 * share difficulty in place of hashes */
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+
+		history_add(&pool->history, temp_tv_end.tv_sec,
+			    pool->diff_accepted - pool->history.diff_seen,
+			    pool->accepted - pool->history.acc_seen,
+			    pool->rejected - pool->history.rej_seen);
+		pool->history.diff_seen = pool->diff_accepted;
+		pool->history.acc_seen = pool->accepted;
+		pool->history.rej_seen = pool->rejected;
+	}
+
 	timersub(&temp_tv_end, &total_tv_end, &total_diff);
 
 	total_mhashes_done += local_mhashes;
 	local_mhashes_done += local_mhashes;
+
+#if defined(unix) || defined(__APPLE__)
+	stats_shm_update();
+#endif
+
 	/* Only update with opt_log_interval */
 	if (total_diff.tv_sec < opt_log_interval)
 		goto out_unlock;
@@ -5038,6 +7010,7 @@ static void hashmeter(int thr_id, struct timeval *diff,
 		total_diff1 / total_secs * 60);
 
 	local_mhashes_done = 0;
+	publish_snapshot();
 out_unlock:
 	mutex_unlock(&hash_lock);
 
@@ -5050,6 +7023,24 @@ out_unlock:
 	}
 }
 
+/* Return a spent share entry to the pool's cache, or to the allocator once
+ * the cache is full. */
+static void free_sshare(struct pool *pool, struct stratum_share *sshare)
+{
+	mutex_lock(&pool->sshare_lock);
+	if (pool->sshare_cached < SSHARE_CACHE_MAX) {
+		sshare->cache_next = pool->sshare_cache;
+		pool->sshare_cache = sshare;
+		pool->sshare_cached++;
+		sshare = NULL;
+	}
+	mutex_unlock(&pool->sshare_lock);
+	if (sshare) {
+		mem_account(MEM_SSHARE, -(int64_t)sizeof(struct stratum_share));
+		free(sshare);
+	}
+}
+
 static void stratum_share_result(json_t *val, json_t *res_val, json_t *err_val,
 				 struct stratum_share *sshare)
 {
@@ -5097,13 +7088,38 @@ static bool parse_stratum_response(struct pool *pool, char *s)
 
 	id = json_integer_value(id_val);
 
-	mutex_lock(&sshare_lock);
-	HASH_FIND_INT(stratum_shares, &id, sshare);
+	if (id && id == pool->suggest_id) {
+		/* Response, if any, to our mining.suggest_difficulty; the
+		 * diff the pool actually sets remains authoritative */
+		ret = true;
+		goto out;
+	}
+
+	if (id && id == pool->extranonce_id) {
+		/* Response to our mining.extranonce.subscribe request */
+		if (json_is_true(res_val))
+			applog(LOG_INFO, "Pool %d extranonce subscribe succeeded", pool->pool_no);
+		else
+			applog(LOG_INFO, "Pool %d does not support extranonce subscribe", pool->pool_no);
+		ret = true;
+		goto out;
+	}
+
+	mutex_lock(&pool->sshare_lock);
+	HASH_FIND_INT(pool->stratum_shares, &id, sshare);
 	if (sshare) {
-		HASH_DEL(stratum_shares, sshare);
+		HASH_DEL(pool->stratum_shares, sshare);
 		pool->sshares--;
 	}
-	mutex_unlock(&sshare_lock);
+	mutex_unlock(&pool->sshare_lock);
+
+	if (sshare) {
+		struct timeval tv_response;
+
+		cgtime(&tv_response);
+		lat_hist_add(&pool->sub_lat,
+			     us_tdiff(&tv_response, &sshare->sshare_sent));
+	}
 
 	if (!sshare) {
 		double pool_diff;
@@ -5139,7 +7155,7 @@ static bool parse_stratum_response(struct pool *pool, char *s)
 	}
 	stratum_share_result(val, res_val, err_val, sshare);
 	free_work(sshare->work);
-	free(sshare);
+	free_sshare(pool, sshare);
 
 	ret = true;
 out:
@@ -5155,18 +7171,17 @@ void clear_stratum_shares(struct pool *pool)
 	double diff_cleared = 0;
 	int cleared = 0;
 
-	mutex_lock(&sshare_lock);
-	HASH_ITER(hh, stratum_shares, sshare, tmpshare) {
-		if (sshare->work->pool == pool) {
-			HASH_DEL(stratum_shares, sshare);
-			diff_cleared += sshare->work->work_difficulty;
-			free_work(sshare->work);
-			pool->sshares--;
-			free(sshare);
-			cleared++;
-		}
+	mutex_lock(&pool->sshare_lock);
+	HASH_ITER(hh, pool->stratum_shares, sshare, tmpshare) {
+		HASH_DEL(pool->stratum_shares, sshare);
+		diff_cleared += sshare->work->work_difficulty;
+		free_work(sshare->work);
+		pool->sshares--;
+		mem_account(MEM_SSHARE, -(int64_t)sizeof(struct stratum_share));
+		free(sshare);
+		cleared++;
 	}
-	mutex_unlock(&sshare_lock);
+	mutex_unlock(&pool->sshare_lock);
 
 	if (cleared) {
 		applog(LOG_WARNING, "Lost %d shares due to stratum disconnect on pool %d", cleared, pool->pool_no);
@@ -5177,15 +7192,58 @@ void clear_stratum_shares(struct pool *pool)
 	}
 }
 
+/* In lowmem mode bound the unacknowledged share db - a pool that accepts
+ * submissions but never responds to them would otherwise grow it without
+ * limit. uthash iterates in insertion order so the front of the walk is
+ * always the oldest share. */
+#define LOWMEM_SSHARES_MAX 256
+
+static void cull_stratum_shares(struct pool *pool)
+{
+	struct stratum_share *sshare, *tmpshare;
+	double diff_cleared = 0;
+	int cleared = 0;
+
+	mutex_lock(&pool->sshare_lock);
+	HASH_ITER(hh, pool->stratum_shares, sshare, tmpshare) {
+		if (pool->sshares <= LOWMEM_SSHARES_MAX)
+			break;
+		HASH_DEL(pool->stratum_shares, sshare);
+		diff_cleared += sshare->work->work_difficulty;
+		free_work(sshare->work);
+		pool->sshares--;
+		mem_account(MEM_SSHARE, -(int64_t)sizeof(struct stratum_share));
+		free(sshare);
+		cleared++;
+	}
+	mutex_unlock(&pool->sshare_lock);
+
+	if (cleared) {
+		applog(LOG_NOTICE, "Dropped %d unacknowledged shares over lowmem cap on pool %d",
+		       cleared, pool->pool_no);
+		pool->stale_shares += cleared;
+		total_stale += cleared;
+		pool->diff_stale += diff_cleared;
+		total_diff_stale += diff_cleared;
+	}
+}
+
 static void clear_pool_work(struct pool *pool)
 {
 	struct work *work, *tmp;
 	int cleared = 0;
 
 	mutex_lock(stgd_lock);
-	HASH_ITER(hh, staged_work, work, tmp) {
+	list_for_each_entry_safe(work, tmp, &staged_clones, staged_node) {
+		if (work->pool == pool) {
+			__unstage_work(work);
+			free_work(work);
+			cleared++;
+		}
+	}
+	list_for_each_entry_safe(work, tmp, &staged_masters, staged_node) {
 		if (work->pool == pool) {
-			HASH_DEL(staged_work, work);
+			__unstage_work(work);
 			free_work(work);
 			cleared++;
 		}
@@ -5193,6 +7251,24 @@ static void clear_pool_work(struct pool *pool)
 	mutex_unlock(stgd_lock);
 }
 
+/* The new pool has staged its first work: stop serving the pool we left
+ * and drop whatever it still has staged. */
+static void complete_pool_transition(void)
+{
+	struct pool *pool;
+
+	cg_wlock(&control_lock);
+	pool = transition_pool;
+	transition_pool = NULL;
+	cg_wunlock(&control_lock);
+
+	if (pool) {
+		applog(LOG_INFO, "Pool %d work cleared on completed switch to pool %d",
+		       pool->pool_no, current_pool()->pool_no);
+		clear_pool_work(pool);
+	}
+}
+
 static int cp_prio(void)
 {
 	int prio;
@@ -5204,6 +7280,31 @@ static int cp_prio(void)
 	return prio;
 }
 
+/* Whether this pool falls within the --failover-warm quota of backup pools
+ * whose authenticated stratum sessions are kept alive so a failover can
+ * start issuing work from their cached swork immediately rather than paying
+ * a full connect and subscribe round trip first. The quota covers the best
+ * priority enabled stratum pools other than the one currently mined. */
+static bool pool_warm_standby(struct pool *pool)
+{
+	struct pool *cp = current_pool();
+	int i, rank = 0;
+
+	if (pool == cp || !pool->has_stratum)
+		return false;
+	for (i = 0; i < total_pools; i++) {
+		struct pool *other = pools[i];
+
+		if (other == cp || other == pool || other->removed)
+			continue;
+		if (other->enabled != POOL_ENABLED || !other->has_stratum)
+			continue;
+		if (other->prio < pool->prio)
+			rank++;
+	}
+	return rank < opt_warm_pools;
+}
+
 /* We only need to maintain a secondary pool connection when we need the
  * capacity to get work from the backup pools while still on the primary */
 static bool cnx_needed(struct pool *pool)
@@ -5239,6 +7340,10 @@ static bool cnx_needed(struct pool *pool)
 	 * it. */
 	if (pool_strategy == POOL_FAILOVER && pool->prio < cp_prio())
 		return true;
+	/* Warm standby connections for the failover strategy */
+	if (pool_strategy == POOL_FAILOVER && opt_warm_pools &&
+	    pool_warm_standby(pool))
+		return true;
 	if (pool_unworkable(cp))
 		return true;
 	/* We've run out of work, bring anything back to life. */
@@ -5247,6 +7352,16 @@ static bool cnx_needed(struct pool *pool)
 	return false;
 }
 
+/* Match the condition wait_lpcurrent blocks on: a connection should be
+ * brought up when it's needed as a backup, or the pool is enabled and either
+ * current or part of a balance strategy. */
+static bool lpcurrent_active(struct pool *pool)
+{
+	return cnx_needed(pool) || (pool->enabled != POOL_DISABLED &&
+		(pool == current_pool() || pool_strategy == POOL_LOADBALANCE ||
+		 pool_strategy == POOL_BALANCE));
+}
+
 static void wait_lpcurrent(struct pool *pool);
 static void pool_resus(struct pool *pool);
 static void gen_stratum_work(struct pool *pool, struct work *work);
@@ -5272,19 +7387,223 @@ static bool supports_resume(struct pool *pool)
 	return ret;
 }
 
-/* One stratum receive thread per pool that has stratum waits on the socket
- * checking for new messages and for the integrity of the socket connection. We
- * reset the connection based on the integrity of the receive side only as the
- * send side will eventually expire data it fails to send. */
-static void *stratum_rthread(void *userdata)
-{
-	struct pool *pool = (struct pool *)userdata;
-	char threadname[16];
+/* Stratum trace recording. Every message received from a pool is appended
+ * verbatim to a binary file along with a microsecond timestamp so a replay
+ * can reproduce the original arrival pacing. Session records carrying the
+ * extranonce parameters are interleaved whenever they change, allowing the
+ * replay to rebuild valid work from the notifies that follow. */
+#define TRACE_MAGIC "CGTRACE1"
+#define TRACE_REC_SESSION 1
+#define TRACE_REC_LINE 2
 
-	pthread_detach(pthread_self());
+static FILE *trace_fp;
+static struct timeval trace_start;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void trace_write(uint8_t type, uint8_t pool_no, uint64_t usec,
+			const void *data, uint32_t len)
+{
+	if (fwrite(&usec, sizeof(usec), 1, trace_fp) != 1 ||
+	    fwrite(&len, sizeof(len), 1, trace_fp) != 1 ||
+	    fwrite(&type, sizeof(type), 1, trace_fp) != 1 ||
+	    fwrite(&pool_no, sizeof(pool_no), 1, trace_fp) != 1 ||
+	    (len && fwrite(data, len, 1, trace_fp) != 1))
+		quit(1, "Failed to write stratum trace file");
+}
+
+static void trace_record_line(struct pool *pool, const char *s)
+{
+	static char sess_nonce1[256];
+	static int sess_pool = -1, sess_n2size;
+	struct timeval now;
+	uint64_t usec;
+
+	cgtime(&now);
+	usec = (now.tv_sec - trace_start.tv_sec) * 1000000LL +
+	       (now.tv_usec - trace_start.tv_usec);
+
+	mutex_lock(&trace_lock);
+	cg_rlock(&pool->data_lock);
+	if (pool->nonce1 && (pool->pool_no != sess_pool ||
+	    pool->n2size != sess_n2size ||
+	    strcmp(pool->nonce1, sess_nonce1))) {
+		char sess[sizeof(sess_nonce1) + 16];
+		int len;
+
+		len = snprintf(sess, sizeof(sess), "%d %s", pool->n2size,
+			       pool->nonce1);
+		if (len >= (int)sizeof(sess))
+			len = sizeof(sess) - 1;
+		trace_write(TRACE_REC_SESSION, pool->pool_no, usec, sess, len);
+		sess_pool = pool->pool_no;
+		sess_n2size = pool->n2size;
+		snprintf(sess_nonce1, sizeof(sess_nonce1), "%s", pool->nonce1);
+	}
+	cg_runlock(&pool->data_lock);
+	trace_write(TRACE_REC_LINE, pool->pool_no, usec, s, strlen(s));
+	fflush(trace_fp);
+	mutex_unlock(&trace_lock);
+}
+
+/* Handle one newline delimited stratum message. s is a view into the pool
+ * sockbuf and is only valid for the duration of the call. Common to the
+ * dedicated receive thread and the reactor. */
+static void stratum_process_line(struct pool *pool, char *s)
+{
+	if (unlikely(trace_fp))
+		trace_record_line(pool, s);
+
+	/* Check this pool hasn't died while being a backup pool and
+	 * has not had its idle flag cleared */
+	stratum_resumed(pool);
+
+	if (!parse_method(pool, s) && !parse_stratum_response(pool, s))
+		applog(LOG_INFO, "Unknown stratum msg: %s", s);
+	else if (pool->swork.clean) {
+		struct work *work = make_work();
+
+		/* Generate a single work item to update the current
+		 * block database */
+		pool->swork.clean = false;
+		gen_stratum_work(pool, work);
+		work->longpoll = true;
+		/* Return value doesn't matter. We're just informing
+		 * that we may need to restart. */
+		test_work_current(work);
+		free_work(work);
+	}
+}
+
+/* Receive side bookkeeping for a stratum connection that has dropped. */
+static void stratum_dropped(struct pool *pool)
+{
+	applog(LOG_NOTICE, "Stratum connection to pool %d interrupted", pool->pool_no);
+	pool->getfail_occasions++;
+	total_go++;
+
+	/* If the socket to our stratum pool disconnects, all
+	 * tracked submitted shares are lost and we will leak
+	 * the memory if we don't discard their records. */
+	if (!supports_resume(pool) || opt_lowmem)
+		clear_stratum_shares(pool);
+	clear_pool_work(pool);
+	if (pool == current_pool())
+		restart_threads();
+}
+
+/* Install the extranonce parameters from a trace session record, standing in
+ * for the mining.subscribe exchange a live connection would have made. */
+static void replay_set_session(struct pool *pool, const char *nonce1, int n2size)
+{
+	cg_wlock(&pool->data_lock);
+	free(pool->nonce1);
+	pool->nonce1 = strdup(nonce1);
+	pool->n1_len = strlen(nonce1) / 2;
+	free(pool->nonce1bin);
+	pool->nonce1bin = calloc(pool->n1_len, 1);
+	if (unlikely(!pool->nonce1bin))
+		quit(1, "Failed to calloc nonce1bin in replay_set_session");
+	hex2bin(pool->nonce1bin, pool->nonce1, pool->n1_len);
+	pool->n2size = n2size;
+	cg_wunlock(&pool->data_lock);
+	pool->stratum_active = true;
+}
+
+/* Feed a recorded stratum trace through the normal message processing path,
+ * pacing message delivery by the recorded timestamps scaled down by the
+ * replay speed. This exercises the full parse, work generation and staging
+ * pipeline with realistic traffic instead of the single static benchmark
+ * block. */
+static void *replay_thread(void *userdata)
+{
+	struct pool *pool = (struct pool *)userdata;
+	struct timeval tv_start, tv_end;
+	uint64_t last_usec = 0;
+	bool sess_ok = false;
+	char magic[8];
+	int lines = 0;
+	FILE *f;
+
+	pthread_detach(pthread_self());
+	RenameThread("Replay");
+
+	f = fopen(opt_benchmark_replay, "rb");
+	if (!f)
+		quit(1, "Failed to open replay trace file %s", opt_benchmark_replay);
+	if (fread(magic, sizeof(magic), 1, f) != 1 ||
+	    memcmp(magic, TRACE_MAGIC, sizeof(magic)))
+		quit(1, "%s is not a stratum trace file", opt_benchmark_replay);
+
+	cgtime(&tv_start);
+	while (42) {
+		uint8_t type, pool_no;
+		uint64_t usec;
+		char *payload;
+		uint32_t len;
+
+		if (fread(&usec, sizeof(usec), 1, f) != 1 ||
+		    fread(&len, sizeof(len), 1, f) != 1 ||
+		    fread(&type, sizeof(type), 1, f) != 1 ||
+		    fread(&pool_no, sizeof(pool_no), 1, f) != 1)
+			break;
+		if (unlikely(len > 0x100000))
+			quit(1, "Corrupt record in replay trace file %s", opt_benchmark_replay);
+		payload = malloc(len + 1);
+		if (unlikely(!payload))
+			quit(1, "Failed to malloc replay payload");
+		if (len && fread(payload, len, 1, f) != 1) {
+			free(payload);
+			break;
+		}
+		payload[len] = '\0';
+
+		if (opt_replay_speed && usec > last_usec)
+			cgsleep_ms((usec - last_usec) / 1000 / opt_replay_speed);
+		last_usec = usec;
+
+		if (type == TRACE_REC_SESSION) {
+			char nonce1[256];
+			int n2size;
+
+			if (sscanf(payload, "%d %255s", &n2size, nonce1) == 2) {
+				replay_set_session(pool, nonce1, n2size);
+				sess_ok = true;
+			}
+		} else if (type == TRACE_REC_LINE && sess_ok) {
+			stratum_process_line(pool, payload);
+			lines++;
+		}
+		free(payload);
+	}
+	fclose(f);
+	cgtime(&tv_end);
+
+	applog(LOG_NOTICE, "Replay of %s complete: %d messages in %.1fs",
+	       opt_benchmark_replay, lines, tdiff(&tv_end, &tv_start));
+	return NULL;
+}
+
+#ifndef HAVE_SYS_EPOLL_H
+/* Without the reactor there is no write ready handler; stratum_send_class
+ * drains its queue in line so nothing is ever left armed. */
+void reactor_arm_tx(struct pool __maybe_unused *pool, bool __maybe_unused arm)
+{
+}
+
+/* One stratum receive thread per pool that has stratum waits on the socket
+ * checking for new messages and for the integrity of the socket connection. We
+ * reset the connection based on the integrity of the receive side only as the
+ * send side will eventually expire data it fails to send. */
+static void *stratum_rthread(void *userdata)
+{
+	struct pool *pool = (struct pool *)userdata;
+	char threadname[16];
+
+	pthread_detach(pthread_self());
 
 	snprintf(threadname, 16, "StratumR/%d", pool->pool_no);
 	RenameThread(threadname);
+	bind_affinity(opt_affinity_net);
 
 	while (42) {
 		struct timeval timeout;
@@ -5309,9 +7628,10 @@ static void *stratum_rthread(void *userdata)
 				while (!restart_stratum(pool)) {
 					if (pool->removed)
 						goto out;
-					cgsleep_ms(30000);
+					cgsleep_ms(pool_backoff(pool) * 1000);
 				}
 			}
+			pool_backoff_reset(pool);
 		}
 
 		FD_ZERO(&rd);
@@ -5329,61 +7649,349 @@ static void *stratum_rthread(void *userdata)
 		} else
 			s = recv_line(pool);
 		if (!s) {
-			applog(LOG_NOTICE, "Stratum connection to pool %d interrupted", pool->pool_no);
-			pool->getfail_occasions++;
-			total_go++;
+			stratum_dropped(pool);
 
-			/* If the socket to our stratum pool disconnects, all
-			 * tracked submitted shares are lost and we will leak
-			 * the memory if we don't discard their records. */
-			if (!supports_resume(pool) || opt_lowmem)
-				clear_stratum_shares(pool);
-			clear_pool_work(pool);
-			if (pool == current_pool())
-				restart_threads();
-
-			if (restart_stratum(pool))
+			if (restart_stratum(pool)) {
+				pool_backoff_reset(pool);
 				continue;
+			}
 
 			pool_died(pool);
 			while (!restart_stratum(pool)) {
 				if (pool->removed)
 					goto out;
-				cgsleep_ms(30000);
+				cgsleep_ms(pool_backoff(pool) * 1000);
 			}
+			pool_backoff_reset(pool);
 			stratum_resumed(pool);
 			continue;
 		}
 
-		/* Check this pool hasn't died while being a backup pool and
-		 * has not had its idle flag cleared */
-		stratum_resumed(pool);
+		stratum_process_line(pool, s);
+	}
 
-		if (!parse_method(pool, s) && !parse_stratum_response(pool, s))
-			applog(LOG_INFO, "Unknown stratum msg: %s", s);
-		else if (pool->swork.clean) {
-			struct work *work = make_work();
+out:
+	return NULL;
+}
+#else /* HAVE_SYS_EPOLL_H */
 
-			/* Generate a single work item to update the current
-			 * block database */
-			pool->swork.clean = false;
-			gen_stratum_work(pool, work);
-			work->longpoll = true;
-			/* Return value doesn't matter. We're just informing
-			 * that we may need to restart. */
-			test_work_current(work);
-			free_work(work);
+/* Instead of running one receive thread per pool, all stratum sockets are
+ * multiplexed onto a single epoll instance serviced by one reactor thread,
+ * avoiding the stacks and scheduler wakeups of scores of mostly idle threads
+ * on many-pool setups. The reactor never blocks on any single pool; the
+ * potentially slow connection re-establishment is handed off to a separate
+ * reconnect thread so one dead pool cannot stall the others. */
+
+#define REACTOR_TICK 5
+/* The protocol specifies that notify messages should be sent every minute so
+ * if we fail to receive any for 90 seconds we assume the connection has been
+ * dropped and treat the pool as dead. */
+#define REACTOR_MSG_TIMEOUT 90
+
+static int reactor_epfd = -1;
+static pthread_t reactor_pth, recon_pth;
+static pthread_mutex_t recon_lock;
+static pthread_cond_t recon_cond;
+
+/* Queue a pool for the reconnect thread, optionally delaying the first
+ * attempt by delay seconds. */
+static void reactor_queue_recon(struct pool *pool, int delay)
+{
+	mutex_lock(&recon_lock);
+	pool->recon_pending = true;
+	pool->recon_when = time(NULL) + delay;
+	pthread_cond_signal(&recon_cond);
+	mutex_unlock(&recon_lock);
+}
+
+static void reactor_register(struct pool *pool)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = pool;
+	pool->last_msg_t = time(NULL);
+	if (unlikely(epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, pool->sock, &ev) == -1))
+		quit(1, "Failed to epoll_ctl add pool %d in reactor_register", pool->pool_no);
+	pool->reactor_reg = true;
+}
+
+/* Arm or disarm write readiness for a registered pool socket. Armed by
+ * stratum_send_class when it queues a message and disarmed by
+ * stratum_flush_sendq once the queue is empty, both under stratum_lock so
+ * the epoll state always matches the queue. */
+void reactor_arm_tx(struct pool *pool, bool arm)
+{
+	struct epoll_event ev;
+
+	ev.events = arm ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	ev.data.ptr = pool;
+	epoll_ctl(reactor_epfd, EPOLL_CTL_MOD, pool->sock, &ev);
+}
+
+static void reactor_unregister(struct pool *pool)
+{
+	if (!pool->reactor_reg)
+		return;
+	pool->reactor_reg = false;
+	/* A socket that has already been closed has left the epoll set by
+	 * itself */
+	if (pool->sock)
+		epoll_ctl(reactor_epfd, EPOLL_CTL_DEL, pool->sock, NULL);
+}
+
+/* Drain all complete lines buffered for one readable pool socket without
+ * blocking the reactor on a partially received line. */
+static void reactor_service_pool(struct pool *pool)
+{
+	char *s;
+
+	while (!pool->removed && sock_full(pool)) {
+		s = recv_line_to(pool, 1);
+		if (!s) {
+			/* An incomplete line stays buffered and epoll will
+			 * tell us when the remainder arrives */
+			if (likely(pool->stratum_active))
+				return;
+			reactor_unregister(pool);
+			stratum_dropped(pool);
+			reactor_queue_recon(pool, 0);
+			return;
+		}
+		pool->last_msg_t = time(NULL);
+		stratum_process_line(pool, s);
+	}
+}
+
+/* Periodic housekeeping over all stratum pools: enforce the receive timeout,
+ * drop connections that are no longer needed and revive suspended pools once
+ * they are wanted again. */
+static void reactor_sweep_pools(void)
+{
+	time_t now_t = time(NULL);
+	int i;
+
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+
+		if (!pool->has_stratum || !pool->stratum_init || pool->removed)
+			continue;
+		if (pool->reactor_reg) {
+			if (now_t - pool->last_msg_t > REACTOR_MSG_TIMEOUT) {
+				applog(LOG_DEBUG, "Stratum receive timeout on pool %d", pool->pool_no);
+				reactor_unregister(pool);
+				suspend_stratum(pool);
+				stratum_dropped(pool);
+				reactor_queue_recon(pool, 0);
+			} else if (!sock_full(pool) && !cnx_needed(pool)) {
+				/* Check to see whether we need to maintain
+				 * this connection indefinitely or just bring
+				 * it up when we switch to this pool */
+				reactor_unregister(pool);
+				suspend_stratum(pool);
+				clear_stratum_shares(pool);
+				clear_pool_work(pool);
+			}
+		} else if (!pool->recon_pending && !pool->stratum_active &&
+			   lpcurrent_active(pool))
+			reactor_queue_recon(pool, 0);
+	}
+}
+
+static void *stratum_reactor_thread(void __maybe_unused *userdata)
+{
+	struct epoll_event events[8];
+
+	pthread_detach(pthread_self());
+
+	RenameThread("StratumRx");
+	bind_affinity(opt_affinity_net);
+
+	while (42) {
+		int n, i;
+
+		n = epoll_wait(reactor_epfd, events, 8, REACTOR_TICK * 1000);
+		for (i = 0; i < n; i++) {
+			struct pool *pool = events[i].data.ptr;
+
+			if (unlikely(!pool->reactor_reg))
+				continue;
+			if (events[i].events & EPOLLOUT) {
+				if (unlikely(!stratum_flush_sendq(pool))) {
+					reactor_unregister(pool);
+					suspend_stratum(pool);
+					stratum_dropped(pool);
+					reactor_queue_recon(pool, 0);
+					continue;
+				}
+			}
+			reactor_service_pool(pool);
+		}
+		reactor_sweep_pools();
+	}
+
+	return NULL;
+}
+
+/* Bring flagged pools back up on behalf of the reactor, retrying failed
+ * pools every 30 seconds as the per-pool receive threads used to. */
+static void *stratum_recon_thread(void __maybe_unused *userdata)
+{
+	pthread_detach(pthread_self());
+
+	RenameThread("StratumCx");
+
+	while (42) {
+		struct timespec abstime;
+		struct timeval now;
+		time_t now_t;
+		int i;
+
+		cgtime(&now);
+		abstime.tv_sec = now.tv_sec + 1;
+		abstime.tv_nsec = now.tv_usec * 1000;
+
+		mutex_lock(&recon_lock);
+		pthread_cond_timedwait(&recon_cond, &recon_lock, &abstime);
+		mutex_unlock(&recon_lock);
+
+		now_t = time(NULL);
+		for (i = 0; i < total_pools; i++) {
+			struct pool *pool = pools[i];
+
+			if (!pool->recon_pending || pool->recon_when > now_t)
+				continue;
+			if (unlikely(pool->removed)) {
+				pool->recon_pending = false;
+				continue;
+			}
+			if (restart_stratum(pool)) {
+				pool->recon_pending = false;
+				pool_backoff_reset(pool);
+				stratum_resumed(pool);
+				reactor_register(pool);
+			} else {
+				pool_died(pool);
+				pool->recon_when = now_t + pool_backoff(pool);
+			}
 		}
-		free(s);
 	}
 
-out:
 	return NULL;
 }
 
+static void init_stratum_reactor(void)
+{
+	mutex_init(&recon_lock);
+	if (unlikely(pthread_cond_init(&recon_cond, NULL)))
+		quit(1, "Failed to pthread_cond_init recon_cond");
+	reactor_epfd = epoll_create(42);
+	if (unlikely(reactor_epfd == -1))
+		quit(1, "Failed to create stratum reactor epoll fd");
+	if (unlikely(pthread_create(&recon_pth, NULL, stratum_recon_thread, NULL)))
+		quit(1, "Failed to create stratum recon thread");
+	if (unlikely(pthread_create(&reactor_pth, NULL, stratum_reactor_thread, NULL)))
+		quit(1, "Failed to create stratum reactor thread");
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
+/* Maximum shares concatenated into one send and the formatting room assumed
+ * per mining.submit line */
+#define SSHARE_BATCH 32
+#define SSHARE_LINELEN 1024
+#define SSHARE_QSIZE 4096
+
+/* Aim for one share per this many seconds per rig when suggesting a share
+ * difficulty, trading useless share volume for verification and submission
+ * overhead on the controller. */
+#define SUGGEST_SHARE_SECS 3
+
+/* The share difficulty that would produce the target share rate at the
+ * current rolling hashrate, or 0 when there is no meaningful measurement to
+ * base a suggestion on yet. */
+double suggested_share_diff(void)
+{
+	double hashes_per_sec = total_rolling * 1000000.0;
+
+	if (hashes_per_sec < 1000000.0)
+		return 0;
+	return hashes_per_sec * SUGGEST_SHARE_SECS / 4294967296.0;
+}
+
+/* Format one mining.submit line for work into s, returning the tracking
+ * entry that parse_stratum_response will match the reply against, or NULL
+ * if the share cannot be submitted. */
+static struct stratum_share *format_stratum_share(struct pool *pool,
+						  struct work *work, char *s,
+						  size_t size)
+{
+	char noncehex[12], nonce2hex[20];
+	struct stratum_share *sshare;
+	uint32_t *hash32, nonce;
+	unsigned char nonce2[8];
+	uint64_t *nonce2_64;
+
+	if (unlikely(work->nonce2_len > 8)) {
+		applog(LOG_ERR, "Pool %d asking for inappropriately long nonce2 length %d",
+		       pool->pool_no, (int)work->nonce2_len);
+		applog(LOG_ERR, "Not attempting to submit shares");
+		free_work(work);
+		return NULL;
+	}
+
+	mutex_lock(&pool->sshare_lock);
+	sshare = pool->sshare_cache;
+	if (sshare) {
+		pool->sshare_cache = sshare->cache_next;
+		pool->sshare_cached--;
+	}
+	mutex_unlock(&pool->sshare_lock);
+	if (sshare)
+		memset(sshare, 0, sizeof(*sshare));
+	else {
+		sshare = calloc(sizeof(struct stratum_share), 1);
+		mem_account(MEM_SSHARE, sizeof(struct stratum_share));
+	}
+	hash32 = (uint32_t *)work->hash;
+
+	sshare->sshare_time = time(NULL);
+	/* This work item is freed in parse_stratum_response */
+	sshare->work = work;
+	nonce = *((uint32_t *)(work->data + 76));
+	__bin2hex(noncehex, (const unsigned char *)&nonce, 4);
+
+	/* Give the stratum share a unique id */
+	sshare->id = __sync_fetch_and_add(&swork_id, 1);
+
+	nonce2_64 = (uint64_t *)nonce2;
+	*nonce2_64 = htole64(work->nonce2);
+	__bin2hex(nonce2hex, nonce2, work->nonce2_len);
+
+	if (work->version_mask) {
+		/* Version rolling was negotiated so include the bits this
+		 * share changed as the sixth submit parameter */
+		uint32_t vbits = be32toh(*(uint32_t *)work->data) ^ work->base_version;
+
+		snprintf(s, size,
+			"{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\", \"%08x\"], \"id\": %d, \"method\": \"mining.submit\"}",
+			pool->rpc_user, work->job_id, nonce2hex, work->ntime, noncehex, vbits, sshare->id);
+	} else {
+		snprintf(s, size,
+			"{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
+			pool->rpc_user, work->job_id, nonce2hex, work->ntime, noncehex, sshare->id);
+	}
+
+	applog(LOG_INFO, "Submitting share %08lx to pool %d",
+				(long unsigned int)htole32(hash32[6]), pool->pool_no);
+
+	return sshare;
+}
+
 /* Each pool has one stratum send thread for sending shares to avoid many
  * threads being created for submission since all sends need to be serialised
- * anyway. */
+ * anyway. Bursts of shares waiting in the queue are drained and concatenated
+ * into a single newline separated send rather than paying one system call
+ * and lock round trip per share. */
 static void *stratum_sthread(void *userdata)
 {
 	struct pool *pool = (struct pool *)userdata;
@@ -5393,78 +8001,90 @@ static void *stratum_sthread(void *userdata)
 
 	snprintf(threadname, 16, "StratumS/%d", pool->pool_no);
 	RenameThread(threadname);
+	bind_affinity(opt_affinity_net);
+	set_sched_prio(opt_rt_send_prio);
 
-	pool->stratum_q = tq_new();
+	pool->stratum_q = mpscq_new(SSHARE_QSIZE);
 	if (!pool->stratum_q)
 		quit(1, "Failed to create stratum_q in stratum_sthread");
 
 	while (42) {
-		char noncehex[12], nonce2hex[20], s[1024];
-		struct stratum_share *sshare;
-		uint32_t *hash32, nonce;
-		unsigned char nonce2[8];
-		uint64_t *nonce2_64;
+		struct stratum_share *sshares[SSHARE_BATCH];
+		/* Room for the batch, separators and the newline
+		 * stratum_send appends */
+		char buf[SSHARE_BATCH * SSHARE_LINELEN + 2];
+		int nshares = 0, i;
 		struct work *work;
 		bool submitted;
+		size_t buflen;
 
 		if (unlikely(pool->removed))
 			break;
 
-		work = tq_pop(pool->stratum_q, NULL);
+		work = mpscq_pop(pool->stratum_q, -1);
 		if (unlikely(!work))
 			quit(1, "Stratum q returned empty work");
 
-		if (unlikely(work->nonce2_len > 8)) {
-			applog(LOG_ERR, "Pool %d asking for inappropriately long nonce2 length %d",
-			       pool->pool_no, (int)work->nonce2_len);
-			applog(LOG_ERR, "Not attempting to submit shares");
-			free_work(work);
-			continue;
+		/* Drain whatever else is already queued into the same send,
+		 * keeping room for the line and its newline separator */
+		buflen = 0;
+		while (work) {
+			struct stratum_share *sshare;
+			struct timeval tv_pop;
+
+			cgtime(&tv_pop);
+			lat_hist_add(&pool->queue_lat,
+				     us_tdiff(&tv_pop, &work->tv_work_found));
+			sshare = format_stratum_share(pool, work, buf + buflen,
+						      SSHARE_LINELEN);
+			if (sshare) {
+				sshares[nshares++] = sshare;
+				buflen += strlen(buf + buflen);
+				if (nshares == SSHARE_BATCH)
+					break;
+				buf[buflen++] = '\n';
+			}
+			work = mpscq_pop(pool->stratum_q, 0);
+			if (!work && nshares) {
+				/* Strip the trailing separator ready to
+				 * send */
+				buf[--buflen] = '\0';
+			}
 		}
+		if (unlikely(!nshares))
+			continue;
 
-		sshare = calloc(sizeof(struct stratum_share), 1);
-		hash32 = (uint32_t *)work->hash;
 		submitted = false;
 
-		sshare->sshare_time = time(NULL);
-		/* This work item is freed in parse_stratum_response */
-		sshare->work = work;
-		nonce = *((uint32_t *)(work->data + 76));
-		__bin2hex(noncehex, (const unsigned char *)&nonce, 4);
-		memset(s, 0, 1024);
-
-		mutex_lock(&sshare_lock);
-		/* Give the stratum share a unique id */
-		sshare->id = swork_id++;
-		mutex_unlock(&sshare_lock);
-
-		nonce2_64 = (uint64_t *)nonce2;
-		*nonce2_64 = htole64(work->nonce2);
-		__bin2hex(nonce2hex, nonce2, work->nonce2_len);
-
-		snprintf(s, sizeof(s),
-			"{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
-			pool->rpc_user, work->job_id, nonce2hex, work->ntime, noncehex, sshare->id);
-
-		applog(LOG_INFO, "Submitting share %08lx to pool %d",
-					(long unsigned int)htole32(hash32[6]), pool->pool_no);
-
 		/* Try resubmitting for up to 2 minutes if we fail to submit
 		 * once and the stratum pool nonce1 still matches suggesting
 		 * we may be able to resume. */
-		while (time(NULL) < sshare->sshare_time + 120) {
+		while (time(NULL) < sshares[0]->sshare_time + 120) {
+			struct timeval tv_send_start;
 			bool sessionid_match;
 
-			if (likely(stratum_send(pool, s, strlen(s)))) {
+			cgtime(&tv_send_start);
+			if (likely(stratum_send_shard(pool, buf, buflen, sshares[0]->id))) {
+				struct timeval tv_sent;
+
 				if (pool_tclear(pool, &pool->submit_fail))
 						applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
 
-				mutex_lock(&sshare_lock);
-				HASH_ADD_INT(stratum_shares, id, sshare);
-				pool->sshares++;
-				mutex_unlock(&sshare_lock);
+				cgtime(&tv_sent);
+				lat_hist_add(&pool->send_lat,
+					     us_tdiff(&tv_sent, &tv_send_start));
+				mutex_lock(&pool->sshare_lock);
+				for (i = 0; i < nshares; i++) {
+					copy_time(&sshares[i]->sshare_sent, &tv_sent);
+					HASH_ADD_INT(pool->stratum_shares, id, sshares[i]);
+					pool->sshares++;
+				}
+				mutex_unlock(&pool->sshare_lock);
 
-				applog(LOG_DEBUG, "Successfully submitted, adding to stratum_shares db");
+				applog(LOG_DEBUG, "Successfully submitted %d shares, adding to stratum_shares db",
+				       nshares);
+				if (opt_lowmem)
+					cull_stratum_shares(pool);
 				submitted = true;
 				break;
 			}
@@ -5480,7 +8100,7 @@ static void *stratum_sthread(void *userdata)
 			}
 
 			cg_rlock(&pool->data_lock);
-			sessionid_match = (pool->nonce1 && !strcmp(work->nonce1, pool->nonce1));
+			sessionid_match = (pool->nonce1 && !strcmp(sshares[0]->work->nonce1, pool->nonce1));
 			cg_runlock(&pool->data_lock);
 
 			if (!sessionid_match) {
@@ -5492,17 +8112,82 @@ static void *stratum_sthread(void *userdata)
 		}
 
 		if (unlikely(!submitted)) {
-			applog(LOG_DEBUG, "Failed to submit stratum share, discarding");
-			free_work(work);
-			free(sshare);
-			pool->stale_shares++;
-			total_stale++;
+			applog(LOG_DEBUG, "Failed to submit stratum shares, discarding");
+			for (i = 0; i < nshares; i++) {
+				free_work(sshares[i]->work);
+				free(sshares[i]);
+			}
+			pool->stale_shares += nshares;
+			total_stale += nshares;
 		}
 	}
 
-	/* Freeze the work queue but don't free up its memory in case there is
-	 * work still trying to be submitted to the removed pool. */
-	tq_freeze(pool->stratum_q);
+	/* Leave the queue and anything still in it intact in case there is
+	 * work still trying to be submitted to the removed pool; producers
+	 * check pool->removed before queueing. */
+	return NULL;
+}
+
+/* Reader for the extra submit connections opened with --submit-conns. Only
+ * share results arrive on them - the job stream is consumed from the primary
+ * connection alone - so anything carrying a method is dropped and the rest
+ * is matched against the share database exactly as primary replies are. */
+static void *submit_rthread(void *userdata)
+{
+	struct pool *pool = (struct pool *)userdata;
+	char threadname[16];
+
+	pthread_detach(pthread_self());
+
+	snprintf(threadname, 16, "StratumA/%d", pool->pool_no);
+	RenameThread(threadname);
+	bind_affinity(opt_affinity_net);
+
+	while (42) {
+		struct timeval timeout = {1, 0};
+		int i, maxfd = -1, nconns;
+		fd_set rd;
+
+		if (unlikely(pool->removed))
+			break;
+
+		FD_ZERO(&rd);
+		mutex_lock(&pool->stratum_lock);
+		nconns = pool->subconn_count;
+		for (i = 0; i < nconns; i++) {
+			struct submit_conn *sc = &pool->subconns[i];
+
+			if (!sc->active)
+				continue;
+			FD_SET(sc->sock, &rd);
+			if (sc->sock > maxfd)
+				maxfd = sc->sock;
+		}
+		mutex_unlock(&pool->stratum_lock);
+
+		if (maxfd < 0) {
+			sleep(1);
+			continue;
+		}
+		if (select(maxfd + 1, &rd, NULL, NULL, &timeout) < 1)
+			continue;
+		for (i = 0; i < nconns; i++) {
+			struct submit_conn *sc = &pool->subconns[i];
+			char *s;
+
+			if (!sc->active || !FD_ISSET(sc->sock, &rd))
+				continue;
+			while ((s = submit_conn_recv_line(sc, 0))) {
+				if (!strstr(s, "\"method\"") &&
+				    !parse_stratum_response(pool, s))
+					applog(LOG_INFO, "Unknown submit conn msg: %s", s);
+				free(s);
+			}
+			if (!sc->active)
+				applog(LOG_INFO, "Pool %d extra submit connection %d closed",
+				       pool->pool_no, i);
+		}
+	}
 
 	return NULL;
 }
@@ -5513,11 +8198,18 @@ static void init_stratum_threads(struct pool *pool)
 
 	if (unlikely(pthread_create(&pool->stratum_sthread, NULL, stratum_sthread, (void *)pool)))
 		quit(1, "Failed to create stratum sthread");
+	if (opt_submit_conns > 1 &&
+	    unlikely(pthread_create(&pool->submit_rthread, NULL, submit_rthread, (void *)pool)))
+		quit(1, "Failed to create submit rthread");
+#ifdef HAVE_SYS_EPOLL_H
+	reactor_register(pool);
+#else
 	if (unlikely(pthread_create(&pool->stratum_rthread, NULL, stratum_rthread, (void *)pool)))
 		quit(1, "Failed to create stratum rthread");
+#endif
 }
 
-static void *longpoll_thread(void *userdata);
+static void lp_add_pool(struct pool *pool);
 
 static bool stratum_works(struct pool *pool)
 {
@@ -5696,8 +8388,7 @@ retry_stratum:
 
 		if (!pool->lp_started) {
 			pool->lp_started = true;
-			if (unlikely(pthread_create(&pool->longpoll_thread, NULL, longpoll_thread, (void *)pool)))
-				quit(1, "Failed to create pool longpoll thread");
+			lp_add_pool(pool);
 		}
 	} else {
 		/* If we failed to parse a getwork, this could be a stratum
@@ -5718,19 +8409,49 @@ out:
 
 static void pool_resus(struct pool *pool)
 {
+	int i;
+
 	if (pool_strategy == POOL_FAILOVER && pool->prio < cp_prio())
 		applog(LOG_WARNING, "Pool %d %s alive, testing stability", pool->pool_no, pool->rpc_url);
 	else
 		applog(LOG_INFO, "Pool %d %s alive", pool->pool_no, pool->rpc_url);
+
+	/* One pool coming back is as good a network change signal as we
+	 * get, so probe the other dead pools promptly too instead of
+	 * waiting out their backoff */
+	for (i = 0; i < total_pools; i++) {
+		struct pool *other = pools[i];
+
+		if (other != pool && other->idle && other->enabled == POOL_ENABLED)
+			pool_probe_now(other);
+	}
+}
+
+/* Take the next staged work, preferring clone work to allow masters to
+ * be reused. Called under stgd_lock with staged_count non zero. */
+static struct work *__hash_pop_next(void)
+{
+	struct work *work;
+
+	if (!list_empty(&staged_clones))
+		work = list_entry(staged_clones.next, struct work, staged_node);
+	else
+		work = list_entry(staged_masters.next, struct work, staged_node);
+	__unstage_work(work);
+	return work;
 }
 
-static struct work *hash_pop(void)
+/* Pop up to n staged work items in a single lock round trip, blocking
+ * until at least one is available. Returns the number popped. When cgpu
+ * is given its local work cache is topped up in the same round trip,
+ * but only while enough staged work remains for every other device, so
+ * a burst of demand from one fast device can't strand the rest. */
+static int hash_pop_many(struct work **works, int n, struct cgpu_info *cgpu)
 {
-	struct work *work = NULL, *tmp;
-	int hc;
+	int popped = 0;
 
 	mutex_lock(stgd_lock);
-	while (!HASH_COUNT(staged_work)) {
+	while (!staged_count) {
 		struct timespec then;
 		struct timeval now;
 		int rc;
@@ -5739,7 +8460,7 @@ static struct work *hash_pop(void)
 		then.tv_sec = now.tv_sec + 10;
 		then.tv_nsec = now.tv_usec * 1000;
 		pthread_cond_signal(&gws_cond);
-		rc = pthread_cond_timedwait(&getq->cond, stgd_lock, &then);
+		rc = pthread_cond_timedwait(&stgd_cond, stgd_lock, &then);
 		/* Check again for !no_work as multiple threads may be
 			* waiting on this condition and another may set the
 			* bool separately. */
@@ -5754,27 +8475,26 @@ static struct work *hash_pop(void)
 		no_work = false;
 	}
 
-	hc = HASH_COUNT(staged_work);
-	/* Find clone work if possible, to allow masters to be reused */
-	if (hc > staged_rollable) {
-		HASH_ITER(hh, staged_work, work, tmp) {
-			if (!work_rollable(work))
-				break;
-		}
-	} else
-		work = staged_work;
-	HASH_DEL(staged_work, work);
-	if (work_rollable(work))
-		staged_rollable--;
+	while (popped < n && staged_count)
+		works[popped++] = __hash_pop_next();
+
+	if (cgpu) {
+		mutex_lock(&cgpu->wcache_lock);
+		while (cgpu->wcache_count < WCACHE_MAX &&
+		       staged_count > total_devices)
+			cgpu->wcache[cgpu->wcache_count++] = __hash_pop_next();
+		mutex_unlock(&cgpu->wcache_lock);
+	}
 
 	/* Signal the getwork scheduler to look for more work */
 	pthread_cond_signal(&gws_cond);
 
 	/* Signal hash_pop again in case there are mutliple hash_pop waiters */
-	pthread_cond_signal(&getq->cond);
+	if (staged_count)
+		pthread_cond_signal(&stgd_cond);
 	mutex_unlock(stgd_lock);
 
-	return work;
+	return popped;
 }
 
 static void gen_hash(unsigned char *data, unsigned char *hash, int len)
@@ -5837,33 +8557,32 @@ void set_target(unsigned char *dest_target, double diff)
 	memcpy(dest_target, target, 32);
 }
 
-/* Generates stratum based work based on the most recent notify information
- * from the pool. This will keep generating work while a pool is down so we use
- * other means to detect when the pool has died in stratum_thread */
-static void gen_stratum_work(struct pool *pool, struct work *work)
+/* Body of stratum work generation once the job is pinned and the nonce2
+ * chosen, shared with the proxy share reconstruction in sproxy_submit.
+ * Takes ownership of the passed sjob reference. */
+static void gen_stratum_work_job(struct pool *pool, struct work *work,
+				 struct stratum_job *sjob, uint64_t nonce2)
 {
 	unsigned char merkle_root[32], merkle_sha[64];
+	unsigned char *coinbase;
 	uint32_t *data32, *swap32;
 	uint64_t nonce2le;
 	int i;
 
-	cg_wlock(&pool->data_lock);
-
 	/* Update coinbase. Always use an LE encoded nonce2 to fill in values
 	 * from left to right and prevent overflow errors with small n2sizes */
-	nonce2le = htole64(pool->nonce2);
-	memcpy(pool->coinbase + pool->nonce2_offset, &nonce2le, pool->n2size);
-	work->nonce2 = pool->nonce2++;
-	work->nonce2_len = pool->n2size;
-
-	/* Downgrade to a read lock to read off the pool variables */
-	cg_dwlock(&pool->data_lock);
+	work->nonce2 = nonce2;
+	work->nonce2_len = sjob->n2size;
+	coinbase = alloca(sjob->cb_len);
+	memcpy(coinbase, sjob->cb_bin, sjob->cb_len);
+	nonce2le = htole64(work->nonce2);
+	memcpy(coinbase + sjob->nonce2_offset, &nonce2le, sjob->n2size);
 
 	/* Generate merkle root */
-	gen_hash(pool->coinbase, merkle_root, pool->swork.cb_len);
+	gen_hash(coinbase, merkle_root, sjob->cb_len);
 	memcpy(merkle_sha, merkle_root, 32);
-	for (i = 0; i < pool->swork.merkles; i++) {
-		memcpy(merkle_sha + 32, pool->swork.merkle_bin[i], 32);
+	for (i = 0; i < sjob->merkles; i++) {
+		memcpy(merkle_sha + 32, sjob->merkle_bin + 32 * i, 32);
 		gen_hash(merkle_sha, merkle_root, 64);
 		memcpy(merkle_sha, merkle_root, 32);
 	}
@@ -5871,19 +8590,20 @@ static void gen_stratum_work(struct pool *pool, struct work *work)
 	swap32 = (uint32_t *)merkle_root;
 	flip32(swap32, data32);
 
-	/* Copy the data template from header_bin */
-	memcpy(work->data, pool->header_bin, 128);
-	memcpy(work->data + pool->merkle_offset, merkle_root, 32);
+	/* Copy the data template from the job's header_bin */
+	memcpy(work->data, sjob->header_bin, 128);
+	memcpy(work->data + sjob->merkle_offset, merkle_root, 32);
 
-	/* Store the stratum work diff to check it still matches the pool's
-	 * stratum diff when submitting shares */
-	work->sdiff = pool->swork.diff;
+	/* Carry the negotiated version rolling mask and the version as the
+	 * pool issued it so rolled bits can be validated and submitted */
+	work->version_mask = pool->vmask;
+	work->base_version = be32toh(*(uint32_t *)work->data);
 
-	/* Copy parameters required for share submission */
-	work->job_id = strdup(pool->swork.job_id);
-	work->nonce1 = strdup(pool->nonce1);
-	work->ntime = strdup(pool->swork.ntime);
-	cg_runlock(&pool->data_lock);
+	/* Reference the parameters required for share submission */
+	work->sjob = sjob;
+	work->job_id = sjob->job_id;
+	work->nonce1 = sjob->nonce1;
+	work->ntime = sjob->ntime;
 
 	if (opt_debug) {
 		char *header, *merkle_hash;
@@ -5916,26 +8636,192 @@ static void gen_stratum_work(struct pool *pool, struct work *work)
 	cgtime(&work->tv_staged);
 }
 
-struct work *get_work(struct thr_info *thr, const int thr_id)
+/* Generates stratum based work based on the most recent notify information
+ * from the pool. This will keep generating work while a pool is down so we use
+ * other means to detect when the pool has died in stratum_thread */
+static void gen_stratum_work(struct pool *pool, struct work *work)
 {
-	struct work *work = NULL;
+	struct stratum_job *sjob;
+	uint64_t nonce2;
+
+	/* Pin the published job and read off the fields that change outside
+	 * a notify. Everything else comes from the pinned immutable job so
+	 * generation never contends with the notify parser rebuilding it. */
+	cg_rlock(&pool->data_lock);
+	sjob = sjob_ref(pool->sjob);
+	/* Store the stratum work diff to check it still matches the pool's
+	 * stratum diff when submitting shares */
+	work->sdiff = pool->swork.diff;
+	work->job_seq = pool->swork.job_seq;
+	cg_runlock(&pool->data_lock);
+
+	nonce2 = __sync_fetch_and_add(&pool->nonce2, 1);
+	/* In proxy mode the low nonce2 byte is the downstream prefix space
+	 * and local generation owns prefix zero, see sproxy.c */
+	if (opt_sproxy_port)
+		nonce2 <<= 8;
+	gen_stratum_work_job(pool, work, sjob, nonce2);
+}
+
+/* Fan a large stratum generation deficit out over transient workers, the
+ * same pattern as the GBT transaction hashing. Now that generation runs
+ * off a pinned immutable job, the only shared mutable state is the atomic
+ * nonce2 counter, which mints disjoint values to the workers with no
+ * further coordination. */
+#define SGW_MAX_WORKERS 4
+#define SGW_PAR_THRESHOLD 8
+#define SGW_BATCH_MAX 64
+
+struct sgw_arg {
+	struct pool *pool;
+	struct work **works;
+	int count;
+	int nworkers;
+	int worker;
+};
+
+static void *sgw_worker(void *arg)
+{
+	struct sgw_arg *sa = (struct sgw_arg *)arg;
+	int i;
+
+	for (i = sa->worker; i < sa->count; i += sa->nworkers)
+		gen_stratum_work(sa->pool, sa->works[i]);
+	return NULL;
+}
+
+/* Generate and stage a batch of stratum work in parallel, taking ownership
+ * of the caller's already allocated first work item */
+static void gen_stratum_batch(struct pool *pool, struct work *work, int count)
+{
+	struct work *works[SGW_BATCH_MAX];
+	struct sgw_arg args[SGW_MAX_WORKERS];
+	pthread_t workers[SGW_MAX_WORKERS];
+	int i, nworkers = num_processors;
+
+	if (nworkers > SGW_MAX_WORKERS)
+		nworkers = SGW_MAX_WORKERS;
+	if (count > SGW_BATCH_MAX)
+		count = SGW_BATCH_MAX;
+	works[0] = work;
+	for (i = 1; i < count; i++)
+		works[i] = make_work();
+	for (i = 0; i < nworkers; i++) {
+		args[i].pool = pool;
+		args[i].works = works;
+		args[i].count = count;
+		args[i].nworkers = nworkers;
+		args[i].worker = i;
+		if (unlikely(pthread_create(&workers[i], NULL, sgw_worker, &args[i])))
+			quit(1, "Failed to create sgw worker");
+	}
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+	for (i = 0; i < count; i++)
+		stage_work(works[i]);
+}
+
+/* Pop up to n works from a device's local cache, returning the number
+ * taken. The per device lock is mostly uncontended - only a stealing
+ * neighbour ever competes for it. */
+static int wcache_pop(struct cgpu_info *cgpu, struct work **works, int n)
+{
+	int got = 0;
+
+	if (!cgpu->wcache_count)
+		return 0;
+	mutex_lock(&cgpu->wcache_lock);
+	while (got < n && cgpu->wcache_count)
+		works[got++] = cgpu->wcache[--cgpu->wcache_count];
+	mutex_unlock(&cgpu->wcache_lock);
+	return got;
+}
+
+/* Steal up to half the most overstocked neighbour's cache, leaving it at
+ * least one work, before falling back to the staging locks */
+static int wcache_steal(struct cgpu_info *cgpu, struct work **works, int n)
+{
+	struct cgpu_info *victim = NULL;
+	int i, best = 1, take;
+
+	for (i = 0; i < total_devices; i++) {
+		struct cgpu_info *other = get_devices(i);
+
+		if (!other || other == cgpu)
+			continue;
+		if (other->wcache_count > best) {
+			best = other->wcache_count;
+			victim = other;
+		}
+	}
+	if (!victim)
+		return 0;
+	take = best / 2;
+	if (take > n)
+		take = n;
+	return wcache_pop(victim, works, take);
+}
+
+/* Bulk work fetch for queue drivers. Fetches up to n work items from the
+ * device's local cache, a neighbour's, or with a single pass over the
+ * staging locks, blocking until at least one is obtained. Returns the
+ * number of works written to the works array. */
+int get_works(struct thr_info *thr, const int thr_id, struct work **works, int n)
+{
+	struct cgpu_info *cgpu = thr->cgpu;
+	struct timeval now;
+	int got = 0, i, j;
+	double secs;
 
 	thread_reportout(thr);
 	applog(LOG_DEBUG, "Popping work from get queue to get work");
-	while (!work) {
-		work = hash_pop();
-		if (stale_work(work, false)) {
-			discard_work(work);
-			work = NULL;
-			wake_gws();
+	while (!got) {
+		bool discarded = false;
+
+		got = wcache_pop(cgpu, works, n);
+		if (!got)
+			got = wcache_steal(cgpu, works, n);
+		if (!got)
+			got = hash_pop_many(works, n, cgpu);
+		/* Compact out any works that went stale while staged */
+		j = 0;
+		for (i = 0; i < got; i++) {
+			if (stale_work(works[i], false)) {
+				discard_work(works[i]);
+				discarded = true;
+			} else
+				works[j++] = works[i];
 		}
+		got = j;
+		if (discarded)
+			wake_gws();
 	}
-	applog(LOG_DEBUG, "Got work from get queue to get work for thread %d", thr_id);
+	applog(LOG_DEBUG, "Got %d works from get queue for thread %d", got, thr_id);
+
+	/* Update this device's decayed work consumption rate */
+	cgtime(&now);
+	secs = tdiff(&now, &cgpu->tv_work_rate);
+	if (cgpu->tv_work_rate.tv_sec && secs > 0)
+		decay_time(&cgpu->work_rate, got / secs, secs);
+	copy_time(&cgpu->tv_work_rate, &now);
 
-	work->thr_id = thr_id;
 	thread_reportin(thr);
-	work->mined = true;
-	work->device_diff = MIN(thr->cgpu->drv->max_diff, work->work_difficulty);
+	for (i = 0; i < got; i++) {
+		struct work *work = works[i];
+
+		work->thr_id = thr_id;
+		work->mined = true;
+		work->device_diff = MIN(cgpu->drv->max_diff, work->work_difficulty);
+	}
+	return got;
+}
+
+struct work *get_work(struct thr_info *thr, const int thr_id)
+{
+	struct work *work;
+
+	get_works(thr, thr_id, &work, 1);
+	TRACE2(work_pulled, work->id, thr_id);
 	return work;
 }
 
@@ -5943,10 +8829,18 @@ struct work *get_work(struct thr_info *thr, const int thr_id)
 static void submit_work_async(struct work *work)
 {
 	struct pool *pool = work->pool;
-	pthread_t submit_thread;
 
 	cgtime(&work->tv_work_found);
 
+	/* Close the verification stage of the share pipeline. Shares that did
+	 * not come in through a driver nonce report carry no stamp. */
+	if (likely(work->tv_nonce_found.tv_sec)) {
+		struct cgpu_info *cgpu = get_thr_cgpu(work->thr_id);
+
+		lat_hist_add(&cgpu->verify_lat,
+			     us_tdiff(&work->tv_work_found, &work->tv_nonce_found));
+	}
+
 	if (stale_work(work, true)) {
 		if (opt_submit_stale)
 			applog(LOG_NOTICE, "Pool %d stale share detected, submitting as user requested", pool->pool_no);
@@ -5969,19 +8863,72 @@ static void submit_work_async(struct work *work)
 		work->stale = true;
 	}
 
+	/* Benchmark and replay shares have nowhere to be sent. Account for
+	 * them as accepted so the displays and API exercise their usual
+	 * paths. */
+	if (opt_benchmark) {
+		mutex_lock(&stats_lock);
+		total_accepted++;
+		pool->accepted++;
+		total_diff_accepted += work->work_difficulty;
+		pool->diff_accepted += work->work_difficulty;
+		mutex_unlock(&stats_lock);
+		free_work(work);
+		return;
+	}
+
 	if (work->stratum) {
+		bool pushed = false;
+
 		applog(LOG_DEBUG, "Pushing pool %d work to stratum queue", pool->pool_no);
-		if (unlikely(!tq_push(pool->stratum_q, work))) {
+		while (likely(!pool->removed)) {
+			pushed = mpscq_push(pool->stratum_q, work);
+			if (likely(pushed))
+				break;
+			/* Queue full - the send thread is wedged mid
+			 * submission, so apply brief backpressure */
+			cgsleep_ms(10);
+		}
+		if (unlikely(!pushed)) {
 			applog(LOG_DEBUG, "Discarding work from removed pool");
 			free_work(work);
 		}
 	} else {
-		applog(LOG_DEBUG, "Pushing submit work to work thread");
-		if (unlikely(pthread_create(&submit_thread, NULL, submit_work_thread, (void *)work)))
-			quit(1, "Failed to create submit_work_thread");
+		unsigned int i;
+
+		applog(LOG_DEBUG, "Pushing submit work to getwork submitter");
+		if (unlikely(!gwsubmit_qs))
+			gwsubmit_start();
+		i = __sync_fetch_and_add(&gwsubmit_rr, 1) % GWSUBMIT_THREADS;
+		while (unlikely(!mpscq_push(gwsubmit_qs[i], work))) {
+			/* Queue full - the submitters are wedged on a slow
+			 * pool, so apply brief backpressure */
+			cgsleep_ms(10);
+		}
 	}
 }
 
+/* Register a fixed per chip nonce counter array for the chipstats API
+ * command. Called once by a multichip driver when its chip count is known. */
+void chip_stats_init(struct cgpu_info *cgpu, int chips)
+{
+	if (chips < 1 || cgpu->chip_results)
+		return;
+	cgpu->chip_results = calloc(chips, sizeof(uint64_t));
+	if (unlikely(!cgpu->chip_results))
+		quit(1, "Failed to calloc chip_results");
+	cgpu->chip_count = chips;
+}
+
+/* Count a valid nonce against the chip that produced it. Only ever written
+ * by the device's result read thread so a plain increment suffices. */
+void chip_result(struct cgpu_info *cgpu, int chip)
+{
+	if (unlikely(!cgpu->chip_results || chip < 0 || chip >= cgpu->chip_count))
+		return;
+	cgpu->chip_results[chip]++;
+}
+
 void inc_hw_errors(struct thr_info *thr)
 {
 	applog(LOG_INFO, "%s%d: invalid nonce - HW error", thr->cgpu->drv->name,
@@ -6002,7 +8949,7 @@ static void rebuild_nonce(struct work *work, uint32_t nonce)
 
 	*work_nonce = htole32(nonce);
 
-	regen_hash(work);
+	regen_hash_midstate(work);
 }
 
 /* For testing a nonce against diff 1 */
@@ -6014,66 +8961,260 @@ bool test_nonce(struct work *work, uint32_t nonce)
 	return (*hash_32 == 0);
 }
 
-/* For testing a nonce against an arbitrary diff */
-bool test_nonce_diff(struct work *work, uint32_t nonce, double diff)
-{
-	uint64_t *hash64 = (uint64_t *)(work->hash + 24), diff64;
+/* For testing a nonce against an arbitrary diff */
+bool test_nonce_diff(struct work *work, uint32_t nonce, double diff)
+{
+	uint64_t *hash64 = (uint64_t *)(work->hash + 24), diff64;
+
+	rebuild_nonce(work, nonce);
+	diff64 = 0x00000000ffff0000ULL;
+	diff64 /= diff;
+
+	return (le64toh(*hash64) <= diff64);
+}
+
+static void update_work_stats(struct thr_info *thr, struct work *work)
+{
+	double test_diff = current_diff;
+
+	work->share_diff = share_diff(work);
+
+	if (unlikely(work->share_diff >= test_diff)) {
+		work->block = true;
+		work->pool->solved++;
+		found_blocks++;
+		work->mandatory = true;
+		applog(LOG_NOTICE, "Found block for pool %d!", work->pool->pool_no);
+	}
+
+	mutex_lock(&stats_lock);
+	total_diff1 += work->device_diff;
+	thr->cgpu->diff1 += work->device_diff;
+	work->pool->diff1 += work->device_diff;
+	thr->cgpu->last_device_valid_work = time(NULL);
+	mutex_unlock(&stats_lock);
+}
+
+/* To be used once the work has been tested to be meet diff1 and has had its
+ * nonce adjusted. */
+/* A device may only change header version bits the pool agreed to in the
+ * negotiated rolling mask; anything outside it makes a header the pool
+ * would reject as invalid */
+static bool valid_version_roll(struct work *work)
+{
+	uint32_t version = be32toh(*(uint32_t *)work->data);
+
+	return !((version ^ work->base_version) & ~work->version_mask);
+}
+
+void submit_tested_work(struct thr_info *thr, struct work *work)
+{
+	struct work *work_out;
+
+	if (unlikely(work->stratum && !valid_version_roll(work))) {
+		applog(LOG_WARNING, "%s %d: discarding share with version rolled outside negotiated mask",
+		       thr->cgpu->drv->name, thr->cgpu->device_id);
+		return;
+	}
+
+	update_work_stats(thr, work);
+
+	if (!fulltest_work(work)) {
+		applog(LOG_INFO, "Share above target");
+		return;
+	}
+	work_out = copy_work(work);
+	submit_work_async(work_out);
+}
+
+/* States of entries in the work's duplicate nonce suppression table */
+enum dupe_state {
+	DUPE_EMPTY = 0,
+	DUPE_PENDING,	/* handed to the verify pool, outcome unknown */
+	DUPE_INVALID,
+	DUPE_VALID,
+};
+
+/* Look nonce up in the work's recent nonce table, inserting it as pending
+ * when absent. Returns the previous state (DUPE_EMPTY for a first report)
+ * with *slot pointing at the entry so the tested outcome can be recorded. */
+static int work_dupe_nonce(struct work *work, uint32_t nonce, int *slot)
+{
+	int i, pos = nonce & (WORK_DUPE_CACHE - 1);
+
+	for (i = 0; i < WORK_DUPE_CACHE; i++) {
+		if (work->dupe_state[pos] == DUPE_EMPTY)
+			break;
+		if (work->dupe_nonce[pos] == nonce) {
+			*slot = pos;
+			return work->dupe_state[pos];
+		}
+		pos = (pos + 1) & (WORK_DUPE_CACHE - 1);
+	}
+	/* Keep the most recent reports when the table is full */
+	if (i == WORK_DUPE_CACHE)
+		pos = nonce & (WORK_DUPE_CACHE - 1);
+	work->dupe_nonce[pos] = nonce;
+	work->dupe_state[pos] = DUPE_PENDING;
+	*slot = pos;
+	return DUPE_EMPTY;
+}
+
+/* Returns true if nonce for work was a valid share */
+bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
+{
+	int slot;
+
+	cgtime(&work->tv_nonce_found);
+
+	/* A duplicate report is neither a fresh share nor a fresh hardware
+	 * error - return the outcome of the first submission */
+	switch (work_dupe_nonce(work, nonce, &slot)) {
+	case DUPE_VALID:
+	case DUPE_PENDING:
+		return true;
+	case DUPE_INVALID:
+		return false;
+	}
+
+	if (test_nonce(work, nonce)) {
+		work->dupe_state[slot] = DUPE_VALID;
+		TRACE3(nonce_found, work->id, nonce, thr->id);
+		submit_tested_work(thr, work);
+	} else {
+		work->dupe_state[slot] = DUPE_INVALID;
+		inc_hw_errors(thr);
+		return false;
+	}
+
+	return true;
+}
+
+/* Batch variant of submit_nonce for drivers whose results arrive many
+ * nonces per message. The pairs are verified four at a time with the
+ * transposed vector double hash, and valid shares fed through the usual
+ * tested work submission. The same work may appear in several entries.
+ * Returns how many of the nonces were valid. */
+int submit_nonces(struct thr_info *thr, struct work **works, uint32_t *nonces, int n)
+{
+	int valid = 0, i = 0;
+#ifdef HAVE_SHA256D80_4WAY
+	unsigned char flipped[4][80], hashes[4][32];
+	const unsigned char *head[4];
+	unsigned char *hash[4];
+	struct timeval tv_nonce;
+	int l;
+
+	cgtime(&tv_nonce);
+	for (l = 0; l < 4; l++) {
+		head[l] = flipped[l];
+		hash[l] = hashes[l];
+	}
+
+	for (; i + 4 <= n; i += 4) {
+		for (l = 0; l < 4; l++) {
+			struct work *work = works[i + l];
+			uint32_t *work_nonce = (uint32_t *)(work->data + 64 + 12);
+
+			copy_time(&work->tv_nonce_found, &tv_nonce);
+			*work_nonce = htole32(nonces[i + l]);
+			flip80(flipped[l], work->data);
+		}
+
+		sha256d80_4way(head, hash);
+
+		for (l = 0; l < 4; l++) {
+			struct work *work = works[i + l];
+			uint32_t *work_nonce = (uint32_t *)(work->data + 64 + 12);
+			uint32_t *hash_32 = (uint32_t *)(work->hash + 28);
+			int slot, state;
+
+			/* Restore this pair's nonce and hash as a duplicated
+			 * work entry holds the last lane's values */
+			*work_nonce = htole32(nonces[i + l]);
+			memcpy(work->hash, hashes[l], 32);
+			state = work_dupe_nonce(work, nonces[i + l], &slot);
+			if (state != DUPE_EMPTY) {
+				/* Duplicate report, already accounted */
+				if (state == DUPE_VALID)
+					valid++;
+				continue;
+			}
+			if (*hash_32 == 0) {
+				work->dupe_state[slot] = DUPE_VALID;
+				submit_tested_work(thr, work);
+				valid++;
+			} else {
+				work->dupe_state[slot] = DUPE_INVALID;
+				inc_hw_errors(thr);
+			}
+		}
+	}
+#endif
+	/* Tail, and fallback without the vector kernel */
+	for (; i < n; i++)
+		valid += submit_nonce(thr, works[i], nonces[i]);
+
+	return valid;
+}
 
-	rebuild_nonce(work, nonce);
-	diff64 = 0x00000000ffff0000ULL;
-	diff64 /= diff;
+#define VERIFY_QSIZE 4096
 
-	return (le64toh(*hash64) <= diff64);
-}
+static struct mpsc_q **verify_qs;
+static unsigned int verify_rr;
 
-static void update_work_stats(struct thr_info *thr, struct work *work)
+/* Worker verifying raw device results off the driver threads. Each worker
+ * owns one queue so the single consumer contract of mpsc_q holds. */
+static void *verify_thread(void *userdata)
 {
-	double test_diff = current_diff;
+	struct mpsc_q *q = (struct mpsc_q *)userdata;
 
-	work->share_diff = share_diff(work);
+	pthread_detach(pthread_self());
+	RenameThread("Verify");
 
-	if (unlikely(work->share_diff >= test_diff)) {
-		work->block = true;
-		work->pool->solved++;
-		found_blocks++;
-		work->mandatory = true;
-		applog(LOG_NOTICE, "Found block for pool %d!", work->pool->pool_no);
-	}
+	while (42) {
+		struct work *work = mpscq_pop(q, -1);
+		struct thr_info *thr = get_thread(work->thr_id);
 
-	mutex_lock(&stats_lock);
-	total_diff1 += work->device_diff;
-	thr->cgpu->diff1 += work->device_diff;
-	work->pool->diff1 += work->device_diff;
-	thr->cgpu->last_device_valid_work = time(NULL);
-	mutex_unlock(&stats_lock);
+		if (test_nonce(work, work->nonce))
+			submit_tested_work(thr, work);
+		else
+			inc_hw_errors(thr);
+		free_work(work);
+	}
+	return NULL;
 }
 
-/* To be used once the work has been tested to be meet diff1 and has had its
- * nonce adjusted. */
-void submit_tested_work(struct thr_info *thr, struct work *work)
+/* As submit_nonce but with the verification handed off to the worker pool
+ * when --verify-threads is set, letting a driver result thread get back to
+ * the wire without waiting on the double hash. Only for callers that do
+ * not use the validity result; hardware error accounting is done by the
+ * worker against the submitting thread's device. */
+void submit_nonce_async(struct thr_info *thr, struct work *work, uint32_t nonce)
 {
-	struct work *work_out;
-	update_work_stats(thr, work);
+	struct work *vwork;
+	unsigned int i;
+	int slot;
 
-	if (!fulltest(work->hash, work->target)) {
-		applog(LOG_INFO, "Share above target");
+	if (!opt_verify_threads) {
+		submit_nonce(thr, work, nonce);
 		return;
 	}
-	work_out = copy_work(work);
-	submit_work_async(work_out);
-}
 
-/* Returns true if nonce for work was a valid share */
-bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
-{
-	if (test_nonce(work, nonce))
-		submit_tested_work(thr, work);
-	else {
-		inc_hw_errors(thr);
-		return false;
-	}
+	/* Dedup against the driver's own work item - the verify copy is
+	 * discarded so the entry stays pending here */
+	if (work_dupe_nonce(work, nonce, &slot) != DUPE_EMPTY)
+		return;
 
-	return true;
+	/* The driver retains ownership of its work item so verify a copy */
+	vwork = copy_work(work);
+	cgtime(&vwork->tv_nonce_found);
+	vwork->nonce = nonce;
+	vwork->thr_id = thr->id;
+	/* Round robin the raw results across the worker queues */
+	i = __sync_fetch_and_add(&verify_rr, 1) % opt_verify_threads;
+	while (unlikely(!mpscq_push(verify_qs[i], vwork)))
+		cgsleep_ms(1);
 }
 
 /* Allows drivers to submit work items where the driver has changed the ntime
@@ -6087,13 +9228,14 @@ bool submit_noffset_nonce(struct thr_info *thr, struct work *work_in, uint32_t n
 	bool ret = false;
 
 	_copy_work(work, work_in, noffset);
+	cgtime(&work->tv_nonce_found);
 	if (!test_nonce(work, nonce)) {
 		inc_hw_errors(thr);
 		goto out;
 	}
 	ret = true;
 	update_work_stats(thr, work);
-	if (!fulltest(work->hash, work->target)) {
+	if (!fulltest_work(work)) {
 		applog(LOG_INFO, "Share above target");
 		goto  out;
 	}
@@ -6105,6 +9247,67 @@ out:
 	return ret;
 }
 
+/* Maximum ntime roll accepted from a downstream proxy client, matching the
+ * nominal driver allowance with headroom for queued work */
+#define SPROXY_NTIME_LIMIT 600
+
+/* Reconstruct a share reported by a downstream stratum proxy client and,
+ * when it is for the current job and meets the stratum difficulty, feed it
+ * into the upstream submission path. nonce2 is the full upstream nonce2
+ * with the client's prefix byte spliced back in. Returns false when the
+ * share is stale or fails verification. */
+bool sproxy_submit(struct pool *pool, const char *job_id, uint64_t nonce2,
+		   const char *ntime, uint32_t nonce)
+{
+	struct work *work = make_work();
+	struct stratum_job *sjob;
+	int noffset = 0;
+
+	cg_rlock(&pool->data_lock);
+	sjob = pool->sjob ? sjob_ref(pool->sjob) : NULL;
+	work->sdiff = pool->swork.diff;
+	work->job_seq = pool->swork.job_seq;
+	cg_runlock(&pool->data_lock);
+
+	if (!sjob)
+		goto out_free;
+	if (strcmp(sjob->job_id, job_id)) {
+		sjob_unref(sjob);
+		goto out_free;
+	}
+	if (strcmp(ntime, sjob->ntime)) {
+		noffset = (int)(strtoul(ntime, NULL, 16) -
+				strtoul(sjob->ntime, NULL, 16));
+		if (noffset < 0 || noffset > SPROXY_NTIME_LIMIT) {
+			sjob_unref(sjob);
+			goto out_free;
+		}
+	}
+	gen_stratum_work_job(pool, work, sjob, nonce2);
+	/* The share belongs to no local device thread */
+	work->thr_id = -1;
+	if (noffset) {
+		struct work *rolled = make_work();
+
+		_copy_work(rolled, work, noffset);
+		free_work(work);
+		work = rolled;
+	}
+	if (!test_nonce(work, nonce))
+		goto out_free;
+	work->share_diff = share_diff(work);
+	if (!fulltest_work(work)) {
+		applog(LOG_INFO, "Proxied share above target");
+		goto out_free;
+	}
+	submit_work_async(work);
+	return true;
+
+out_free:
+	free_work(work);
+	return false;
+}
+
 static inline bool abandon_work(struct work *work, struct timeval *wdiff, uint64_t hashes)
 {
 	if (wdiff->tv_sec > opt_scantime || hashes >= 0xfffffffe ||
@@ -6127,6 +9330,37 @@ static void mt_disable(struct thr_info *mythr, const int thr_id,
 /* The main hashing loop for devices that are slow enough to work on one work
  * item at a time, without a queue, aborting work before the entire nonce
  * range has been hashed if needed. */
+/* Pacing service for drivers. Instead of embedding a fixed cgsleep in the
+ * scan loop, a driver declares when it next expects to have something to do
+ * and the hash loop waits out the remainder after the driver returns. The
+ * wait is on the restart condition so a work restart or shutdown wakes the
+ * thread immediately rather than sleeping deaf, and the deadline is
+ * measured from the declaration so driver processing time after the call
+ * comes out of the wait instead of being added on top of it. */
+void cgpu_set_deadline(struct cgpu_info *cgpu, int ms)
+{
+	cgtimer_time(&cgpu->pace_start);
+	cgpu->pace_ms = ms;
+	cgpu->pace_set = true;
+}
+
+/* Wait out the remainder of a deadline declared via cgpu_set_deadline */
+static void deadline_wait(struct thr_info *mythr)
+{
+	struct cgpu_info *cgpu = mythr->cgpu;
+	cgtimer_t now, elapsed;
+	int ms;
+
+	if (!cgpu->pace_set)
+		return;
+	cgpu->pace_set = false;
+	cgtimer_time(&now);
+	cgtimer_sub(&now, &cgpu->pace_start, &elapsed);
+	ms = cgpu->pace_ms - cgtimer_to_ms(&elapsed);
+	if (ms > 0)
+		restart_wait(mythr, ms);
+}
+
 static void hash_sole_work(struct thr_info *mythr)
 {
 	const int thr_id = mythr->id;
@@ -6198,6 +9432,8 @@ static void hash_sole_work(struct thr_info *mythr)
 			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 			pthread_testcancel();
 
+			deadline_wait(mythr);
+
 			/* tv_end is == &getwork_start */
 			cgtime(&getwork_start);
 
@@ -6278,18 +9514,38 @@ static void hash_sole_work(struct thr_info *mythr)
  * the driver tells us it's full so that it may extract the work item using
  * the get_queued() function which adds it to the hashtable on
  * cgpu->queued_work. */
+/* Number of work items fetched per trip once a queue driver shows demand
+ * beyond a single refill */
+#define FILL_BATCH 8
+
 static void fill_queue(struct thr_info *mythr, struct cgpu_info *cgpu, struct device_drv *drv, const int thr_id)
 {
+	struct work *works[FILL_BATCH];
+	bool first = true;
+	int have = 0, used = 0;
+
 	do {
 		bool need_work;
 
 		/* Do this lockless just to know if we need more unqueued work. */
 		need_work = (!cgpu->unqueued_work);
 
-		/* get_work is a blocking function so do it outside of lock
+		/* get_works is a blocking function so do it outside of lock
 		 * to prevent deadlocks with other locks. */
 		if (need_work) {
-			struct work *work = get_work(mythr, thr_id);
+			struct work *work;
+
+			if (used == have) {
+				/* Most calls top up a single slot; if the
+				 * driver keeps asking, batch the fetches to
+				 * take the staging locks once per FILL_BATCH
+				 * items instead of once per item. */
+				have = get_works(mythr, thr_id, works,
+						 first ? 1 : FILL_BATCH);
+				used = 0;
+				first = false;
+			}
+			work = works[used++];
 
 			wr_lock(&cgpu->qlock);
 			/* Check we haven't grabbed work somehow between
@@ -6307,13 +9563,31 @@ static void fill_queue(struct thr_info *mythr, struct cgpu_info *cgpu, struct de
 		 * actually place work items on the physical device if it
 		 * does have a queue. */
 	} while (!drv->queue_full(cgpu));
+
+	/* Hand back any prefetched items the driver did not take */
+	while (used < have)
+		stage_work(works[used++]);
 }
 
+/* Queued work is matched back to device results by the midstate and merkle
+ * tail bytes the hardware echoes with each nonce. Alongside the id keyed
+ * hashlist, maintain a second hash keyed directly on those bytes so result
+ * to work matching is a single lookup instead of a memcmp against every
+ * queued item. These are the common geometry values noted below. */
+#define QUEUED_KEY_MIDLEN 32
+#define QUEUED_KEY_OFFSET 64
+#define QUEUED_KEY_DATALEN 12
+#define QUEUED_KEYLEN (QUEUED_KEY_MIDLEN + QUEUED_KEY_DATALEN)
+
 /* Add a work item to a cgpu's queued hashlist */
 void __add_queued(struct cgpu_info *cgpu, struct work *work)
 {
 	cgpu->queued_count++;
+	memcpy(work->queued_key, work->midstate, QUEUED_KEY_MIDLEN);
+	memcpy(work->queued_key + QUEUED_KEY_MIDLEN,
+	       work->data + QUEUED_KEY_OFFSET, QUEUED_KEY_DATALEN);
 	HASH_ADD_INT(cgpu->queued_work, id, work);
+	HASH_ADD(hh_mid, cgpu->queued_work_mid, queued_key, QUEUED_KEYLEN, work);
 }
 
 /* This function is for retrieving one work item from the unqueued pointer and
@@ -6370,6 +9644,24 @@ struct work *__find_work_bymidstate(struct work *que, char *midstate, size_t mid
 	return ret;
 }
 
+/* As __find_work_bymidstate but against a device's queued work, using the
+ * (midstate, merkle tail) index when the caller's geometry matches it and
+ * only falling back to the linear scan for unusual lengths. */
+static struct work *__find_queued_work(struct cgpu_info *cgpu, char *midstate, size_t midstatelen, char *data, int offset, size_t datalen)
+{
+	if (midstatelen == QUEUED_KEY_MIDLEN && offset == QUEUED_KEY_OFFSET &&
+	    datalen == QUEUED_KEY_DATALEN) {
+		char key[QUEUED_KEYLEN];
+		struct work *work;
+
+		memcpy(key, midstate, QUEUED_KEY_MIDLEN);
+		memcpy(key + QUEUED_KEY_MIDLEN, data, QUEUED_KEY_DATALEN);
+		HASH_FIND(hh_mid, cgpu->queued_work_mid, key, QUEUED_KEYLEN, work);
+		return work;
+	}
+	return __find_work_bymidstate(cgpu->queued_work, midstate, midstatelen, data, offset, datalen);
+}
+
 /* This function is for finding an already queued work item in the
  * device's queued_work hashtable. Code using this function must be able
  * to handle NULL as a return which implies there is no matching work.
@@ -6379,7 +9671,7 @@ struct work *find_queued_work_bymidstate(struct cgpu_info *cgpu, char *midstate,
 	struct work *ret;
 
 	rd_lock(&cgpu->qlock);
-	ret = __find_work_bymidstate(cgpu->queued_work, midstate, midstatelen, data, offset, datalen);
+	ret = __find_queued_work(cgpu, midstate, midstatelen, data, offset, datalen);
 	rd_unlock(&cgpu->qlock);
 
 	return ret;
@@ -6390,7 +9682,7 @@ struct work *clone_queued_work_bymidstate(struct cgpu_info *cgpu, char *midstate
 	struct work *work, *ret = NULL;
 
 	rd_lock(&cgpu->qlock);
-	work = __find_work_bymidstate(cgpu->queued_work, midstate, midstatelen, data, offset, datalen);
+	work = __find_queued_work(cgpu, midstate, midstatelen, data, offset, datalen);
 	if (work)
 		ret = copy_work(work);
 	rd_unlock(&cgpu->qlock);
@@ -6402,6 +9694,7 @@ void __work_completed(struct cgpu_info *cgpu, struct work *work)
 {
 	cgpu->queued_count--;
 	HASH_DEL(cgpu->queued_work, work);
+	HASH_DELETE(hh_mid, cgpu->queued_work_mid, work);
 }
 
 /* This iterates over a queued hashlist finding work started more than secs
@@ -6445,7 +9738,7 @@ struct work *take_queued_work_bymidstate(struct cgpu_info *cgpu, char *midstate,
 	struct work *work;
 
 	wr_lock(&cgpu->qlock);
-	work = __find_work_bymidstate(cgpu->queued_work, midstate, midstatelen, data, offset, datalen);
+	work = __find_queued_work(cgpu, midstate, midstatelen, data, offset, datalen);
 	if (work)
 		__work_completed(cgpu, work);
 	wr_unlock(&cgpu->qlock);
@@ -6518,6 +9811,8 @@ void hash_queued_work(struct thr_info *mythr)
 			copy_time(&tv_start, &tv_end);
 		}
 
+		deadline_wait(mythr);
+
 		if (unlikely(mythr->pause || cgpu->deven != DEV_ENABLED))
 			mt_disable(mythr, thr_id, drv);
 
@@ -6569,6 +9864,8 @@ void hash_driver_work(struct thr_info *mythr)
 			copy_time(&tv_start, &tv_end);
 		}
 
+		deadline_wait(mythr);
+
 		if (unlikely(mythr->pause || cgpu->deven != DEV_ENABLED))
 			mt_disable(mythr, thr_id, drv);
 
@@ -6578,6 +9875,222 @@ void hash_driver_work(struct thr_info *mythr)
 	cgpu->deven = DEV_DISABLED;
 }
 
+/* Shared polling executor for low rate devices. A dedicated miner thread
+ * per device is wasteful when the device only produces a few results a
+ * second and its thread mostly sleeps; drivers whose scanwork does not
+ * block and that pace themselves with cgpu_set_deadline can set
+ * drv->shared_thread to have their devices serviced by a small pool of
+ * executor threads instead, one per POLL_DEVS_PER_THREAD devices. Each
+ * service pass mirrors one hash_driver_work iteration and the declared
+ * deadline becomes the device's next service time rather than a sleep.
+ * A work restart pulls every deadline in and wakes the executors through
+ * shared_thread_restart so devices pivot to new-block work immediately
+ * instead of riding out their declared deadlines. */
+
+#define POLL_DEVS_PER_THREAD 16
+#define POLL_MAX_THREADS 4
+
+struct poll_dev {
+	struct thr_info *thr;
+	bool inited;
+	/* Being serviced right now by an executor thread */
+	bool busy;
+	bool dead;
+	int64_t hashes_done;
+	struct timeval tv_start;
+	cgtimer_t due_start;
+	int due_ms;
+	struct poll_dev *next;
+};
+
+static pthread_mutex_t poll_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poll_cond = PTHREAD_COND_INITIALIZER;
+static struct poll_dev *poll_devs;
+static int poll_ndevs;
+static int poll_nthreads;
+
+static int poll_dev_remaining(struct poll_dev *pd, cgtimer_t *now)
+{
+	cgtimer_t elapsed;
+	int ms;
+
+	cgtimer_sub(now, &pd->due_start, &elapsed);
+	ms = pd->due_ms - cgtimer_to_ms(&elapsed);
+	return ms > 0 ? ms : 0;
+}
+
+/* One hash_driver_work iteration for a shared device */
+static void poll_dev_service(struct poll_dev *pd)
+{
+	struct thr_info *mythr = pd->thr;
+	struct cgpu_info *cgpu = mythr->cgpu;
+	struct device_drv *drv = cgpu->drv;
+	struct timeval tv_end, diff;
+	int64_t hashes;
+
+	if (unlikely(cgpu->shutdown)) {
+		drv->thread_shutdown(mythr);
+		cgpu->deven = DEV_DISABLED;
+		pd->dead = true;
+		return;
+	}
+	if (unlikely(!pd->inited)) {
+		pd->inited = true;
+		if (!drv->thread_init(mythr)) {
+			dev_error(cgpu, REASON_THREAD_FAIL_INIT);
+			cgpu->deven = DEV_DISABLED;
+			pd->dead = true;
+			return;
+		}
+		cgtime(&pd->tv_start);
+	}
+	/* Paused and disabled devices stay enrolled and are looked at again
+	 * on the next pass instead of blocking in mt_disable */
+	if (unlikely(mythr->pause || cgpu->deven != DEV_ENABLED))
+		return;
+
+	mythr->work_update = false;
+
+	hashes = drv->scanwork(mythr);
+
+	/* Reset the bool here in case the driver looks for it
+	 * synchronously in the scanwork loop. */
+	mythr->work_restart = false;
+
+	if (unlikely(hashes == -1 )) {
+		applog(LOG_ERR, "%s %d failure, disabling!", drv->name, cgpu->device_id);
+		cgpu->deven = DEV_DISABLED;
+		dev_error(cgpu, REASON_THREAD_ZERO_HASH);
+		return;
+	}
+
+	pd->hashes_done += hashes;
+	cgtime(&tv_end);
+	timersub(&tv_end, &pd->tv_start, &diff);
+	/* Update the hashmeter at most 5 times per second */
+	if ((pd->hashes_done && (diff.tv_sec > 0 || diff.tv_usec > 200000)) ||
+	    diff.tv_sec >= opt_log_interval) {
+		hashmeter(mythr->id, &diff, pd->hashes_done);
+		pd->hashes_done = 0;
+		copy_time(&pd->tv_start, &tv_end);
+	}
+
+	if (mythr->work_update)
+		drv->update_work(cgpu);
+}
+
+static void *poll_thread(void __maybe_unused *userdata)
+{
+	pthread_detach(pthread_self());
+	RenameThread("sharedpoll");
+
+	mutex_lock(&poll_lock);
+	while (42) {
+		struct poll_dev *pd, *best = NULL;
+		struct cgpu_info *cgpu;
+		int wait_ms = 0;
+		cgtimer_t now;
+
+		cgtimer_time(&now);
+		for (pd = poll_devs; pd; pd = pd->next) {
+			int remaining;
+
+			if (pd->busy || pd->dead)
+				continue;
+			remaining = poll_dev_remaining(pd, &now);
+			if (!best || remaining < wait_ms) {
+				best = pd;
+				wait_ms = remaining;
+			}
+		}
+		if (!best) {
+			pthread_cond_wait(&poll_cond, &poll_lock);
+			continue;
+		}
+		if (wait_ms > 0) {
+			struct timeval tnow, then, tdiff;
+			struct timespec abstime;
+
+			/* Capped so devices enrolled while we sleep are
+			 * noticed reasonably promptly, and waited out on the
+			 * condition so a work restart wakes us immediately */
+			if (wait_ms > 100)
+				wait_ms = 100;
+			tdiff.tv_sec = wait_ms / 1000;
+			tdiff.tv_usec = wait_ms * 1000 - (tdiff.tv_sec * 1000000);
+			cgtime(&tnow);
+			timeradd(&tnow, &tdiff, &then);
+			abstime.tv_sec = then.tv_sec;
+			abstime.tv_nsec = then.tv_usec * 1000;
+			pthread_cond_timedwait(&poll_cond, &poll_lock, &abstime);
+			continue;
+		}
+		best->busy = true;
+		mutex_unlock(&poll_lock);
+
+		poll_dev_service(best);
+
+		mutex_lock(&poll_lock);
+		best->busy = false;
+		cgpu = best->thr->cgpu;
+		if (cgpu->pace_set) {
+			cgpu->pace_set = false;
+			best->due_start = cgpu->pace_start;
+			best->due_ms = cgpu->pace_ms;
+		} else {
+			/* Drivers are expected to declare a deadline; don't
+			 * let one that didn't spin the executor */
+			cgtimer_time(&best->due_start);
+			best->due_ms = 10;
+		}
+	}
+	return NULL;
+}
+
+/* Pull every enrolled device's next service time in and wake the executor
+ * threads, so a work restart is acted on within milliseconds instead of at
+ * the next scheduled service */
+static void shared_thread_restart(void)
+{
+	struct poll_dev *pd;
+
+	mutex_lock(&poll_lock);
+	for (pd = poll_devs; pd; pd = pd->next)
+		pd->due_ms = 0;
+	pthread_cond_broadcast(&poll_cond);
+	mutex_unlock(&poll_lock);
+}
+
+/* Enroll a mining thread with the shared polling executor in place of
+ * creating a dedicated miner thread for it */
+static void shared_thread_add(struct thr_info *thr)
+{
+	struct poll_dev *pd;
+
+	pd = calloc(1, sizeof(*pd));
+	if (unlikely(!pd))
+		quit(1, "Failed to calloc poll_dev");
+	pd->thr = thr;
+	cgsem_init(&thr->sem);
+	thread_reportout(thr);
+	cgtimer_time(&pd->due_start);
+
+	mutex_lock(&poll_lock);
+	pd->next = poll_devs;
+	poll_devs = pd;
+	poll_ndevs++;
+	while (poll_nthreads < POLL_MAX_THREADS &&
+	       poll_nthreads * POLL_DEVS_PER_THREAD < poll_ndevs) {
+		pthread_t pth;
+
+		if (unlikely(pthread_create(&pth, NULL, poll_thread, NULL)))
+			quit(1, "Failed to create shared poll thread");
+		poll_nthreads++;
+	}
+	pthread_cond_signal(&poll_cond);
+	mutex_unlock(&poll_lock);
+}
+
 void *miner_thread(void *userdata)
 {
 	struct thr_info *mythr = userdata;
@@ -6588,6 +10101,7 @@ void *miner_thread(void *userdata)
 
         snprintf(threadname, 24, "miner/%d", thr_id);
 	RenameThread(threadname);
+	bind_affinity(opt_affinity_miner);
 
 	thread_reportout(mythr);
 	if (!drv->thread_init(mythr)) {
@@ -6599,6 +10113,7 @@ void *miner_thread(void *userdata)
 	cgsem_wait(&mythr->sem);
 
 	set_highprio();
+	set_sched_prio(opt_rt_read_prio);
 	drv->hash_work(mythr);
 out:
 	drv->thread_shutdown(mythr);
@@ -6690,9 +10205,7 @@ static struct pool *select_longpoll_pool(struct pool *cp)
  */
 static void wait_lpcurrent(struct pool *pool)
 {
-	while (!cnx_needed(pool) && (pool->enabled == POOL_DISABLED ||
-	       (pool != current_pool() && pool_strategy != POOL_LOADBALANCE &&
-	       pool_strategy != POOL_BALANCE))) {
+	while (!lpcurrent_active(pool)) {
 		mutex_lock(&lp_lock);
 		pthread_cond_wait(&lp_cond, &lp_lock);
 		mutex_unlock(&lp_lock);
@@ -6700,138 +10213,228 @@ static void wait_lpcurrent(struct pool *pool)
 }
 
 #ifdef HAVE_LIBCURL
-static void *longpoll_thread(void *userdata)
-{
-	struct pool *cp = (struct pool *)userdata;
-	/* This *pool is the source of the actual longpoll, not the pool we've
-	 * tied it to */
-	struct timeval start, reply, end;
-	struct pool *pool = NULL;
-	char threadname[16];
-	CURL *curl = NULL;
-	int failures = 0;
+/* State for one pool's longpoll connection. All longpolls are driven off a
+ * single curl multi handle by one longpoll thread, each over a persistent
+ * connection, so any number of HTTP pools cost one thread between them. */
+struct lp_conn {
+	/* This is the pool the longpoll is tied to, while pool below is the
+	 * source of the actual longpoll which may differ */
+	struct pool *cp;
+	struct pool *pool;
+	CURL *curl;
+	struct json_rpc_req req;
 	char lpreq[1024];
 	char *lp_url;
-	int rolltime;
+	struct timeval start;
+	time_t retry_at;
+	int failures;
+	bool active;	/* Transfer currently on the multi handle */
+	bool no_lp_logged;
+	struct lp_conn *next;
+};
 
-	snprintf(threadname, 16, "longpoll/%d", cp->pool_no);
-	RenameThread(threadname);
+static struct lp_conn *lp_conns;
+static pthread_mutex_t lp_conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool lp_thread_started;
+static pthread_t lp_thread_pth;
 
-	curl = curl_easy_init();
-	if (unlikely(!curl)) {
-		applog(LOG_ERR, "CURL initialisation failed");
-		return NULL;
-	}
+/* Begin one longpoll request for conn, adding its transfer to the multi
+ * handle. Returns false if the conn should be dropped entirely because its
+ * block change detection has moved to stratum. */
+static bool lp_conn_start(struct lp_conn *conn, CURLM *multi)
+{
+	struct pool *pool;
 
-retry_pool:
-	pool = select_longpoll_pool(cp);
-	if (!pool) {
-		applog(LOG_WARNING, "No suitable long-poll found for %s", cp->rpc_url);
-		while (!pool) {
-			cgsleep_ms(60000);
-			pool = select_longpoll_pool(cp);
+	pool = select_longpoll_pool(conn->cp);
+	if (!pool || unlikely(pool->removed)) {
+		if (!conn->no_lp_logged) {
+			applog(LOG_WARNING, "No suitable long-poll found for %s", conn->cp->rpc_url);
+			conn->no_lp_logged = true;
 		}
+		conn->retry_at = time(NULL) + 60;
+		return true;
 	}
+	conn->no_lp_logged = false;
 
 	if (pool->has_stratum) {
 		applog(LOG_WARNING, "Block change for %s detection via %s stratum",
-		       cp->rpc_url, pool->rpc_url);
-		goto out;
+		       conn->cp->rpc_url, pool->rpc_url);
+		return false;
 	}
 
 	/* Any longpoll from any pool is enough for this to be true */
 	have_longpoll = true;
 
-	wait_lpcurrent(cp);
-
 	if (pool->has_gbt) {
-		lp_url = pool->rpc_url;
-		applog(LOG_WARNING, "GBT longpoll ID activated for %s", lp_url);
+		conn->lp_url = pool->rpc_url;
+		if (pool != conn->pool)
+			applog(LOG_WARNING, "GBT longpoll ID activated for %s", conn->lp_url);
+		/* Update the longpollid every time, but do it under lock to
+		 * avoid races */
+		cg_rlock(&pool->gbt_lock);
+		snprintf(conn->lpreq, sizeof(conn->lpreq),
+			"{\"id\": 0, \"method\": \"getblocktemplate\", \"params\": "
+			"[{\"capabilities\": [\"coinbasetxn\", \"workid\", \"coinbase/append\"], "
+			"\"longpollid\": \"%s\"}]}\n", pool->longpollid);
+		cg_runlock(&pool->gbt_lock);
 	} else {
-		strcpy(lpreq, getwork_req);
+		strcpy(conn->lpreq, getwork_req);
+
+		conn->lp_url = pool->lp_url;
+		if (pool != conn->pool) {
+			if (conn->cp == pool)
+				applog(LOG_WARNING, "Long-polling activated for %s", conn->lp_url);
+			else
+				applog(LOG_WARNING, "Long-polling activated for %s via %s", conn->cp->rpc_url, conn->lp_url);
+		}
+	}
+	conn->pool = pool;
+
+	cgtime(&conn->start);
+	json_rpc_start(conn->curl, &conn->req, conn->lp_url, pool->rpc_userpass,
+		       conn->lpreq, false, true, pool, false);
+	curl_easy_setopt(conn->curl, CURLOPT_PRIVATE, conn);
+	curl_multi_add_handle(multi, conn->curl);
+	conn->active = true;
+
+	return true;
+}
 
-		lp_url = pool->lp_url;
-		if (cp == pool)
-			applog(LOG_WARNING, "Long-polling activated for %s", lp_url);
+/* Handle the result of a completed longpoll transfer, converting its
+ * response to work. Some pools regularly drop the longpoll request so only
+ * see it as a longpoll failure if it happens immediately and just restart
+ * it the rest of the time. */
+static void lp_conn_result(struct lp_conn *conn, int perform_rc)
+{
+	struct timeval reply, end;
+	json_t *val, *soval;
+	int rolltime;
+
+	cgtime(&reply);
+
+	val = json_rpc_result(conn->curl, &conn->req, perform_rc, &rolltime, conn->pool);
+	if (likely(val)) {
+		soval = json_object_get(json_object_get(val, "result"), "submitold");
+		if (soval)
+			conn->pool->submit_old = json_is_true(soval);
 		else
-			applog(LOG_WARNING, "Long-polling activated for %s via %s", cp->rpc_url, lp_url);
+			conn->pool->submit_old = false;
+		convert_to_work(val, rolltime, conn->pool, &conn->start, &reply);
+		conn->failures = 0;
+		json_decref(val);
+	} else {
+		cgtime(&end);
+		if (end.tv_sec - conn->start.tv_sec > 30)
+			return;
+		if (++conn->failures == 1)
+			applog(LOG_WARNING, "longpoll failed for %s, retrying every 30s", conn->lp_url);
+		conn->retry_at = time(NULL) + 30;
 	}
+}
 
-	while (42) {
-		json_t *val, *soval;
+static void lp_multi_wait(CURLM *multi)
+{
+#if LIBCURL_VERSION_NUM >= 0x071c00
+	int numfds;
+
+	curl_multi_wait(multi, NULL, 0, 1000, &numfds);
+#else
+	struct timeval timeout = {1, 0};
+	fd_set fdread, fdwrite, fdexcep;
+	int maxfd = -1;
+
+	FD_ZERO(&fdread);
+	FD_ZERO(&fdwrite);
+	FD_ZERO(&fdexcep);
+	curl_multi_fdset(multi, &fdread, &fdwrite, &fdexcep, &maxfd);
+	select(maxfd + 1, &fdread, &fdwrite, &fdexcep, &timeout);
+#endif
+}
 
-		wait_lpcurrent(cp);
+static void *longpoll_thread(void __maybe_unused *userdata)
+{
+	CURLM *multi;
 
-		cgtime(&start);
+	RenameThread("longpoll");
+	bind_affinity(opt_affinity_net);
 
-		/* Update the longpollid every time, but do it under lock to
-		 * avoid races */
-		if (pool->has_gbt) {
-			cg_rlock(&pool->gbt_lock);
-			snprintf(lpreq, sizeof(lpreq),
-				"{\"id\": 0, \"method\": \"getblocktemplate\", \"params\": "
-				"[{\"capabilities\": [\"coinbasetxn\", \"workid\", \"coinbase/append\"], "
-				"\"longpollid\": \"%s\"}]}\n", pool->longpollid);
-			cg_runlock(&pool->gbt_lock);
-		}
-
-		/* Longpoll connections can be persistent for a very long time
-		 * and any number of issues could have come up in the meantime
-		 * so always establish a fresh connection instead of relying on
-		 * a persistent one. */
-		curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1);
-		val = json_rpc_call(curl, lp_url, pool->rpc_userpass,
-				    lpreq, false, true, &rolltime, pool, false);
-
-		cgtime(&reply);
-
-		if (likely(val)) {
-			soval = json_object_get(json_object_get(val, "result"), "submitold");
-			if (soval)
-				pool->submit_old = json_is_true(soval);
-			else
-				pool->submit_old = false;
-			convert_to_work(val, rolltime, pool, &start, &reply);
-			failures = 0;
-			json_decref(val);
-		} else {
-			/* Some pools regularly drop the longpoll request so
-			 * only see this as longpoll failure if it happens
-			 * immediately and just restart it the rest of the
-			 * time. */
-			cgtime(&end);
-			if (end.tv_sec - start.tv_sec > 30)
-				continue;
-			if (failures == 1)
-				applog(LOG_WARNING, "longpoll failed for %s, retrying every 30s", lp_url);
-			cgsleep_ms(30000);
-		}
+	multi = curl_multi_init();
+	if (unlikely(!multi))
+		quit(1, "CURL multi initialisation failed");
 
-		if (pool != cp) {
-			pool = select_longpoll_pool(cp);
-			if (pool->has_stratum) {
-				applog(LOG_WARNING, "Block change for %s detection via %s stratum",
-				       cp->rpc_url, pool->rpc_url);
-				break;
+	while (42) {
+		struct lp_conn *conn, **connp;
+		time_t now_t = time(NULL);
+		struct CURLMsg *msg;
+		int running, msgs;
+
+		mutex_lock(&lp_conn_lock);
+		connp = &lp_conns;
+		while ((conn = *connp)) {
+			bool drop = false;
+
+			if (!conn->active) {
+				if (unlikely(conn->cp->removed))
+					drop = true;
+				else if (conn->retry_at <= now_t && lpcurrent_active(conn->cp))
+					drop = !lp_conn_start(conn, multi);
 			}
-			if (unlikely(!pool))
-				goto retry_pool;
+			if (drop) {
+				*connp = conn->next;
+				curl_easy_cleanup(conn->curl);
+				free(conn);
+			} else
+				connp = &conn->next;
 		}
+		mutex_unlock(&lp_conn_lock);
 
-		if (unlikely(pool->removed))
-			break;
-	}
+		curl_multi_perform(multi, &running);
 
-out:
-	curl_easy_cleanup(curl);
+		while ((msg = curl_multi_info_read(multi, &msgs))) {
+			char *cpriv = NULL;
+
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &cpriv);
+			conn = (struct lp_conn *)cpriv;
+			curl_multi_remove_handle(multi, conn->curl);
+			conn->active = false;
+			lp_conn_result(conn, msg->data.result);
+		}
+
+		lp_multi_wait(multi);
+	}
 
 	return NULL;
 }
+
+/* Register a pool with the shared longpoll thread, creating the thread the
+ * first time any pool needs it. */
+static void lp_add_pool(struct pool *pool)
+{
+	struct lp_conn *conn;
+
+	conn = calloc(sizeof(struct lp_conn), 1);
+	if (unlikely(!conn))
+		quit(1, "Failed to calloc lp_conn in lp_add_pool");
+	conn->cp = pool;
+	conn->curl = curl_easy_init();
+	if (unlikely(!conn->curl))
+		quit(1, "CURL initialisation failed in lp_add_pool");
+
+	mutex_lock(&lp_conn_lock);
+	conn->next = lp_conns;
+	lp_conns = conn;
+	if (!lp_thread_started) {
+		lp_thread_started = true;
+		if (unlikely(pthread_create(&lp_thread_pth, NULL, longpoll_thread, NULL)))
+			quit(1, "Failed to create longpoll thread");
+	}
+	mutex_unlock(&lp_conn_lock);
+}
 #else /* HAVE_LIBCURL */
-static void *longpoll_thread(void __maybe_unused *userdata)
+static void lp_add_pool(struct pool __maybe_unused *pool)
 {
-	pthread_detach(pthread_self());
-	return NULL;
 }
 #endif /* HAVE_LIBCURL */
 
@@ -6865,13 +10468,109 @@ static void reap_curl(struct pool *pool)
 			pool->curls--;
 			list_del(&ent->node);
 			curl_easy_cleanup(ent->curl);
+			mem_account(MEM_CURL, -(int64_t)(sizeof(struct curl_ent) +
+				    (ent->gws_buf ? GWS_HDR_OFF + 256 +
+				     sizeof(GWS_SUFFIX) : 0)));
+			free(ent->gws_buf);
 			free(ent);
 		}
 	}
-	mutex_unlock(&pool->pool_lock);
+	mutex_unlock(&pool->pool_lock);
+
+	if (reaped)
+		applog(LOG_DEBUG, "Reaped %d curl%s from pool %d", reaped, reaped > 1 ? "s" : "", pool->pool_no);
+}
+
+/* Under loadbalance, scale each pool's effective quota by how well its
+ * shares have been converting: the acceptance rate over the last interval
+ * damped by the measured submit round trip, smoothed with the same decaying
+ * average as pool utility. Quotas are scaled relative to the best pool, are
+ * never boosted past their configured value, and never drop below one so
+ * the measurements keep flowing; a pool with no shares this interval drifts
+ * back towards neutral rather than being judged on stale data. */
+static void adjust_quota_perf(void)
+{
+	struct pool *pool;
+	bool changed = false;
+	double best = 0.0;
+	int i;
+
+	for (i = 0; i < total_pools; i++) {
+		uint64_t lat_n, lat_us;
+		int acc, rej, tot;
+		double sample;
+
+		pool = pools[i];
+		if (!pool->quota)
+			continue;
+		acc = pool->accepted - pool->qp_accepted;
+		rej = pool->rejected - pool->qp_rejected;
+		rej += pool->stale_shares - pool->qp_stale;
+		pool->qp_accepted = pool->accepted;
+		pool->qp_rejected = pool->rejected;
+		pool->qp_stale = pool->stale_shares;
+		lat_n = pool->sub_lat.count - pool->qp_lat_count;
+		lat_us = pool->sub_lat.sum_us - pool->qp_lat_sum;
+		pool->qp_lat_count = pool->sub_lat.count;
+		pool->qp_lat_sum = pool->sub_lat.sum_us;
+
+		if (!pool->quota_perf)
+			pool->quota_perf = 1.0;
+		tot = acc + rej;
+		if (tot > 0) {
+			sample = (double)acc / (double)tot;
+			if (lat_n)
+				sample /= 1.0 + (double)(lat_us / lat_n) / 250000.0;
+			pool->quota_perf = (pool->quota_perf + sample * 0.63) / 1.63;
+		} else
+			pool->quota_perf = (pool->quota_perf + 0.63) / 1.63;
+		if (pool->quota_perf > best)
+			best = pool->quota_perf;
+	}
+
+	if (best < 0.0001)
+		return;
+
+	for (i = 0; i < total_pools; i++) {
+		int eff;
+
+		pool = pools[i];
+		if (!pool->quota)
+			continue;
+		eff = pool->quota * pool->quota_perf / best + 0.5;
+		if (eff < 1)
+			eff = 1;
+		if (eff > pool->quota)
+			eff = pool->quota;
+		if (eff != pool->quota_eff) {
+			applog(LOG_DEBUG, "Pool %d effective quota %d of %d (perf %.3f)",
+			       pool->pool_no, eff, pool->quota, pool->quota_perf);
+			pool->quota_eff = eff;
+			changed = true;
+		}
+	}
+	if (changed)
+		adjust_quota_gcd();
+}
 
-	if (reaped)
-		applog(LOG_DEBUG, "Reaped %d curl%s from pool %d", reaped, reaped > 1 ? "s" : "", pool->pool_no);
+/* A single dead pool probe, detached so the watchpool thread never blocks
+ * on the full network test - with many decommissioned pools in a config
+ * the serial tests used to stall the whole loop for their timeouts */
+static void *retest_pool_thread(void *arg)
+{
+	struct pool *pool = (struct pool *)arg;
+
+	pthread_detach(pthread_self());
+	RenameThread("retestpool");
+
+	if (pool_active(pool, true) && pool_tclear(pool, &pool->idle)) {
+		pool_resus(pool);
+		pool_backoff_reset(pool);
+	} else
+		pool->idle_wait = pool_backoff(pool);
+	pool->retesting = false;
+
+	return NULL;
 }
 
 static void *watchpool_thread(void __maybe_unused *userdata)
@@ -6917,11 +10616,30 @@ static void *watchpool_thread(void __maybe_unused *userdata)
 				pool->testing = false;
 			}
 
-			/* Test pool is idle once every minute */
-			if (pool->idle && now.tv_sec - pool->tv_idle.tv_sec > 30) {
+			/* Re-suggest a share difficulty if the rig has been
+			 * retuned to a significantly different hashrate
+			 * since the last suggestion */
+			if (pool->stratum_active) {
+				double sdiff = suggested_share_diff();
+
+				if (sdiff >= 1 &&
+				    (sdiff > pool->suggested_diff * 2 ||
+				     sdiff < pool->suggested_diff / 2))
+					suggest_difficulty(pool, sdiff);
+			}
+
+			/* Retest idle pools with jittered exponential backoff
+			 * so a farm's recovery probes are spread out, each
+			 * probe on its own thread so the full blocking
+			 * network test never stalls this loop */
+			if (pool->idle && !pool->retesting &&
+			    now.tv_sec - pool->tv_idle.tv_sec > pool->idle_wait) {
+				pthread_t pth;
+
 				cgtime(&pool->tv_idle);
-				if (pool_active(pool, true) && pool_tclear(pool, &pool->idle))
-					pool_resus(pool);
+				pool->retesting = true;
+				if (unlikely(pthread_create(&pth, NULL, retest_pool_thread, pool)))
+					pool->retesting = false;
 			}
 
 			/* Only switch pools if the failback pool has been
@@ -6935,6 +10653,9 @@ static void *watchpool_thread(void __maybe_unused *userdata)
 			}
 		}
 
+		if (pool_strategy == POOL_LOADBALANCE && total_pools > 1)
+			adjust_quota_perf();
+
 		if (current_pool()->idle)
 			switch_pools(NULL);
 
@@ -6943,8 +10664,9 @@ static void *watchpool_thread(void __maybe_unused *userdata)
 			switch_pools(NULL);
 		}
 
-		cgsleep_ms(30000);
-			
+		/* Interruptible so pool_probe_now() can bring a requested
+		 * retest forward instead of waiting out the cycle */
+		cgsem_mswait(&watchpool_sem, 30000);
 	}
 	return NULL;
 }
@@ -6953,66 +10675,260 @@ static void *watchpool_thread(void __maybe_unused *userdata)
  * the screen at regular intervals, and restarts threads if they appear to have
  * died. */
 #define WATCHDOG_INTERVAL		2
-#define WATCHDOG_SICK_TIME		120
-#define WATCHDOG_DEAD_TIME		600
-#define WATCHDOG_SICK_COUNT		(WATCHDOG_SICK_TIME/WATCHDOG_INTERVAL)
-#define WATCHDOG_DEAD_COUNT		(WATCHDOG_DEAD_TIME/WATCHDOG_INTERVAL)
 
-static void *watchdog_thread(void __maybe_unused *userdata)
+#ifdef HAVE_CURSES
+/* Curses display refresh on its own thread so the watchdog never blocks
+ * device health checks behind the curses lock. */
+static void *display_thread(void __maybe_unused *userdata)
 {
-	const unsigned int interval = WATCHDOG_INTERVAL;
-	struct timeval zero_tv;
-
+	pthread_detach(pthread_self());
 	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
 
-	RenameThread("watchdog");
+	RenameThread("display");
 
 	set_lowprio();
-	memset(&zero_tv, 0, sizeof(struct timeval));
-	cgtime(&rotate_tv);
 
-	while (1) {
-		int i;
-		struct timeval now;
-
-		sleep(interval);
+	logwin_async = true;
 
-		discard_stale();
+	while (42) {
+		struct cgpu_info *cgpu;
+		int i, count;
 
-		hashmeter(-1, &zero_tv, 0);
+		sleep(WATCHDOG_INTERVAL);
 
-#ifdef HAVE_CURSES
-		if (curses_active_locked()) {
-			struct cgpu_info *cgpu;
-			int count;
+		if (!curses_active)
+			continue;
 
-			change_logwinsize();
-			curses_print_status();
-			count = 0;
-			for (i = 0; i < total_devices; i++) {
+		/* Stage the whole frame without holding the curses lock so
+		 * threads logging to the screen are never blocked behind
+		 * row formatting. */
+		format_status_rows();
+		count = 0;
+		if (!opt_compact) {
+			if (total_devices > display_dev_rows_alloc) {
+				display_dev_rows = realloc(display_dev_rows,
+						sizeof(*display_dev_rows) * total_devices);
+				if (!display_dev_rows)
+					quit(1, "Failed to realloc display_dev_rows");
+				memset(display_dev_rows + display_dev_rows_alloc, 0,
+					sizeof(*display_dev_rows) * (total_devices - display_dev_rows_alloc));
+				display_dev_rows_alloc = total_devices;
+			}
+			for (i = 0; i < total_devices && count < most_devices; i++) {
 				cgpu = get_devices(i);
 #ifndef USE_USBUTILS
 				if (cgpu)
 #else
 				if (cgpu && !cgpu->usbinfo.nodev)
 #endif
-					curses_print_devstatus(cgpu, count++);
+					format_devstatus(cgpu, display_dev_rows[count++].cur, DISPLAY_ROW_LEN);
 			}
 #ifdef USE_USBUTILS
-			for (i = 0; i < total_devices; i++) {
+			for (i = 0; i < total_devices && count < most_devices; i++) {
 				cgpu = get_devices(i);
 				if (cgpu && cgpu->usbinfo.nodev)
-					curses_print_devstatus(cgpu, count++);
+					format_devstatus(cgpu, display_dev_rows[count++].cur, DISPLAY_ROW_LEN);
 			}
 #endif
-			touchwin(statuswin);
+		}
+
+		if (curses_active_locked()) {
+			bool redraw;
+
+			change_logwinsize();
+			redraw = display_redraw;
+			display_paint(count);
+			logwin_drain();
+			/* The frame diff repaints changed rows; a full
+			 * retransmit via touchwin is only needed after a
+			 * resize or layout change. */
+			if (redraw) {
+				touchwin(statuswin);
+				touchwin(logwin);
+			}
 			wrefresh(statuswin);
-			touchwin(logwin);
 			wrefresh(logwin);
 			unlock_curses();
 		}
+	}
+
+	return NULL;
+}
 #endif
 
+#define WATCHDOG_SICK_TIME		120
+#define WATCHDOG_DEAD_TIME		600
+#define WATCHDOG_SICK_COUNT		(WATCHDOG_SICK_TIME/WATCHDOG_INTERVAL)
+#define WATCHDOG_DEAD_COUNT		(WATCHDOG_DEAD_TIME/WATCHDOG_INTERVAL)
+/* Healthy devices are revisited at least this often so driver get_stats
+ * polling stays reasonably fresh */
+#define WATCHDOG_VISIT_TIME		30
+
+/* Deadline wheel for device health. Each device hangs off the slot its
+ * next deadline hashes to so the watchdog only visits devices that have
+ * come due instead of sweeping the whole device list every pass. Only
+ * ever touched from the watchdog thread. Same sharing rule as the staged
+ * expiry wheel: deadlines more than a revolution out share a slot with
+ * nearer ones and are skipped until they really fall due. */
+#define HEALTH_WHEEL_SLOTS 64 /* power of two */
+static struct list_head health_wheel[HEALTH_WHEEL_SLOTS];
+static time_t health_wheel_time;
+static int health_watched;
+
+static void health_hang(struct cgpu_info *cgpu, time_t due)
+{
+	cgpu->health_due = due;
+	list_add_tail(&cgpu->health_node,
+		      &health_wheel[due & (HEALTH_WHEEL_SLOTS - 1)]);
+}
+
+/* Re-evaluate one device's health, returning the time the watchdog should
+ * next look at it. The checks mirror the old per-pass sweep but are driven
+ * by the heartbeat the device's threads post: a well device is left alone
+ * until its heartbeat could have gone stale, sick and dead devices keep
+ * the old per-pass restart cadence until they recover. */
+static time_t health_visit(struct cgpu_info *cgpu, time_t now)
+{
+	struct thr_info *thr = cgpu->thr[0];
+	enum dev_enable *denable;
+	time_t beat = cgpu->heartbeat;
+	char dev_str[8];
+
+	cgpu->drv->get_stats(cgpu);
+
+	denable = &cgpu->deven;
+	snprintf(dev_str, sizeof(dev_str), "%s%d", cgpu->drv->name, cgpu->device_id);
+
+	/* Thread is waiting on getwork or disabled */
+	if (thr->getwork || *denable == DEV_DISABLED)
+		return now + WATCHDOG_VISIT_TIME;
+
+	if (cgpu->status != LIFE_WELL && (now - beat < WATCHDOG_SICK_TIME)) {
+		if (cgpu->status != LIFE_INIT) {
+		applog(LOG_ERR, "%s: Recovered, declaring WELL!", dev_str);
+		api_event("device_well", dev_str);
+		}
+		cgpu->status = LIFE_WELL;
+		cgpu->device_last_well = time(NULL);
+	} else if (cgpu->status == LIFE_WELL && (now - beat > WATCHDOG_SICK_TIME)) {
+		thr->rolling = cgpu->rolling = 0;
+		cgpu->status = LIFE_SICK;
+		applog(LOG_ERR, "%s: Idle for more than 60 seconds, declaring SICK!", dev_str);
+		api_event("device_sick", dev_str);
+		cgtime(&thr->sick);
+
+		dev_error(cgpu, REASON_DEV_SICK_IDLE_60);
+		if (opt_restart) {
+			applog(LOG_ERR, "%s: Attempting to restart", dev_str);
+			reinit_device(cgpu);
+		}
+	} else if (cgpu->status == LIFE_SICK && (now - beat > WATCHDOG_DEAD_TIME)) {
+		cgpu->status = LIFE_DEAD;
+		applog(LOG_ERR, "%s: Not responded for more than 10 minutes, declaring DEAD!", dev_str);
+		api_event("device_dead", dev_str);
+		cgtime(&thr->sick);
+
+		dev_error(cgpu, REASON_DEV_DEAD_IDLE_600);
+	} else if (now - thr->sick.tv_sec > 60 &&
+		   (cgpu->status == LIFE_SICK || cgpu->status == LIFE_DEAD)) {
+		/* Attempt to restart a GPU that's sick or dead once every minute */
+		cgtime(&thr->sick);
+		if (opt_restart)
+			reinit_device(cgpu);
+	}
+
+	if (cgpu->status == LIFE_WELL) {
+		time_t due = beat + WATCHDOG_SICK_TIME + 1;
+
+		if (due > now + WATCHDOG_VISIT_TIME)
+			due = now + WATCHDOG_VISIT_TIME;
+		if (due <= now)
+			due = now + 1;
+		return due;
+	}
+
+	/* Sick and dead devices are rare and cheap to watch */
+	return now + WATCHDOG_INTERVAL;
+}
+
+/* Closed loop clock governor. Perturb and observe: each evaluation window
+ * the clock moves one step in the current direction, reversing whenever the
+ * effective rate - difficulty accepted less hardware errors - came out
+ * worse than the window before. The optimum drifts with temperature and
+ * silicon aging so the governor never settles, oscillating a step around
+ * whatever the current best clock is. Enabled with --clock-governor for
+ * devices whose driver filled in the gov_* bounds. */
+#define GOV_EVAL_SECS 120
+
+static void clock_governor(struct cgpu_info *cgpu, time_t now_t)
+{
+	double eff, secs;
+	int clock;
+
+	if (!cgpu->drv->set_clock || !cgpu->gov_step)
+		return;
+	if (!cgpu->gov_eval_time) {
+		/* First sight of the device - take a baseline window */
+		cgpu->gov_eval_time = now_t;
+		cgpu->gov_accepted = cgpu->diff_accepted;
+		cgpu->gov_errors = cgpu->hw_errors;
+		cgpu->gov_dir = 1;
+		return;
+	}
+	secs = now_t - cgpu->gov_eval_time;
+	if (secs < GOV_EVAL_SECS)
+		return;
+
+	eff = (cgpu->diff_accepted - cgpu->gov_accepted -
+	       (cgpu->hw_errors - cgpu->gov_errors)) / secs;
+	if (eff < cgpu->gov_rate)
+		cgpu->gov_dir = -cgpu->gov_dir;
+	cgpu->gov_rate = eff;
+	cgpu->gov_accepted = cgpu->diff_accepted;
+	cgpu->gov_errors = cgpu->hw_errors;
+	cgpu->gov_eval_time = now_t;
+
+	clock = cgpu->gov_clock + cgpu->gov_dir * cgpu->gov_step;
+	if (clock >= cgpu->gov_max_clock) {
+		clock = cgpu->gov_max_clock;
+		cgpu->gov_dir = -1;
+	} else if (clock <= cgpu->gov_min_clock) {
+		clock = cgpu->gov_min_clock;
+		cgpu->gov_dir = 1;
+	}
+	if (clock != cgpu->gov_clock) {
+		applog(LOG_INFO, "%s %d: Governor moving clock %d -> %d (effective %.2f/s)",
+		       cgpu->drv->name, cgpu->device_id, cgpu->gov_clock,
+		       clock, eff);
+		cgpu->gov_clock = clock;
+		cgpu->drv->set_clock(cgpu, clock);
+	}
+}
+
+static void *watchdog_thread(void __maybe_unused *userdata)
+{
+	const unsigned int interval = WATCHDOG_INTERVAL;
+	struct timeval zero_tv;
+
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+	RenameThread("watchdog");
+
+	set_lowprio();
+	memset(&zero_tv, 0, sizeof(struct timeval));
+	cgtime(&rotate_tv);
+
+	while (1) {
+		struct timeval now;
+		time_t t;
+		int i;
+
+		sleep(interval);
+
+		expire_staged();
+
+		hashmeter(-1, &zero_tv, 0);
+
 		cgtime(&now);
 
 		if (!sched_paused && !should_run()) {
@@ -7053,53 +10969,56 @@ static void *watchdog_thread(void __maybe_unused *userdata)
 			}
 		}
 
-		for (i = 0; i < total_devices; ++i) {
-			struct cgpu_info *cgpu = get_devices(i);
-			struct thr_info *thr = cgpu->thr[0];
-			enum dev_enable *denable;
-			char dev_str[8];
-			int gpu;
+		if (opt_clock_gov) {
+			for (i = 0; i < total_devices; i++) {
+				struct cgpu_info *cgpu = get_devices(i);
 
-			cgpu->drv->get_stats(cgpu);
+				if (cgpu && cgpu->deven == DEV_ENABLED)
+					clock_governor(cgpu, now.tv_sec);
+			}
+		}
 
-			gpu = cgpu->device_id;
-			denable = &cgpu->deven;
-			snprintf(dev_str, sizeof(dev_str), "%s%d", cgpu->drv->name, gpu);
+		/* Hang devices added since the last pass on the wheel */
+		while (health_watched < total_devices) {
+			struct cgpu_info *cgpu = get_devices(health_watched);
 
-			/* Thread is waiting on getwork or disabled */
-			if (thr->getwork || *denable == DEV_DISABLED)
-				continue;
+			if (!cgpu)
+				break;
+			health_hang(cgpu, now.tv_sec + WATCHDOG_INTERVAL);
+			health_watched++;
+		}
 
-			if (cgpu->status != LIFE_WELL && (now.tv_sec - thr->last.tv_sec < WATCHDOG_SICK_TIME)) {
-				if (cgpu->status != LIFE_INIT)
-				applog(LOG_ERR, "%s: Recovered, declaring WELL!", dev_str);
-				cgpu->status = LIFE_WELL;
-				cgpu->device_last_well = time(NULL);
-			} else if (cgpu->status == LIFE_WELL && (now.tv_sec - thr->last.tv_sec > WATCHDOG_SICK_TIME)) {
-				thr->rolling = cgpu->rolling = 0;
-				cgpu->status = LIFE_SICK;
-				applog(LOG_ERR, "%s: Idle for more than 60 seconds, declaring SICK!", dev_str);
-				cgtime(&thr->sick);
-
-				dev_error(cgpu, REASON_DEV_SICK_IDLE_60);
-				if (opt_restart) {
-					applog(LOG_ERR, "%s: Attempting to restart", dev_str);
-					reinit_device(cgpu);
-				}
-			} else if (cgpu->status == LIFE_SICK && (now.tv_sec - thr->last.tv_sec > WATCHDOG_DEAD_TIME)) {
-				cgpu->status = LIFE_DEAD;
-				applog(LOG_ERR, "%s: Not responded for more than 10 minutes, declaring DEAD!", dev_str);
-				cgtime(&thr->sick);
-
-				dev_error(cgpu, REASON_DEV_DEAD_IDLE_600);
-			} else if (now.tv_sec - thr->sick.tv_sec > 60 &&
-				   (cgpu->status == LIFE_SICK || cgpu->status == LIFE_DEAD)) {
-				/* Attempt to restart a GPU that's sick or dead once every minute */
-				cgtime(&thr->sick);
-				if (opt_restart)
-					reinit_device(cgpu);
+		/* A sick or dead device posted a heartbeat - revisit those
+		 * devices now rather than at their next deadline */
+		if (unlikely(health_kick)) {
+			health_kick = 0;
+			for (i = 0; i < health_watched; i++) {
+				struct cgpu_info *cgpu = get_devices(i);
+
+				if (!cgpu || cgpu->status == LIFE_WELL)
+					continue;
+				list_del(&cgpu->health_node);
+				health_hang(cgpu, health_visit(cgpu, now.tv_sec));
+			}
+		}
+
+		if (!health_wheel_time)
+			health_wheel_time = now.tv_sec - 1;
+		/* Cap a large jump - a full revolution already visits every slot */
+		if (now.tv_sec - health_wheel_time > HEALTH_WHEEL_SLOTS)
+			health_wheel_time = now.tv_sec - HEALTH_WHEEL_SLOTS;
+		for (t = health_wheel_time + 1; t <= now.tv_sec; t++) {
+			struct list_head *slot = &health_wheel[t & (HEALTH_WHEEL_SLOTS - 1)];
+			struct cgpu_info *cgpu, *tmp;
+
+			list_for_each_entry_safe(cgpu, tmp, slot, health_node) {
+				if (cgpu->health_due > now.tv_sec)
+					continue;
+				list_del(&cgpu->health_node);
+				health_hang(cgpu, health_visit(cgpu, now.tv_sec));
 			}
 		}
+		health_wheel_time = now.tv_sec;
 	}
 
 	return NULL;
@@ -7222,6 +11141,11 @@ static void clean_up(bool restarting)
 	if (!restarting && !opt_realquiet && successful_connect)
 		print_summary();
 
+	if (trace_fp) {
+		fclose(trace_fp);
+		trace_fp = NULL;
+	}
+
 	curl_global_cleanup();
 }
 
@@ -7260,6 +11184,9 @@ char *curses_input(const char *query)
 #endif
 
 static bool pools_active = false;
+/* Posted when the first pool comes alive so startup stops waiting the
+ * moment a pool answers instead of polling */
+static cgsem_t pools_active_sem;
 
 static void *test_pool_thread(void *arg)
 {
@@ -7276,6 +11203,7 @@ static void *test_pool_thread(void *arg)
 			if (pool->pool_no != 0)
 				first_pool = true;
 			pools_active = true;
+			cgsem_post(&pools_active_sem);
 		}
 		cg_wunlock(&control_lock);
 
@@ -7596,6 +11524,7 @@ void enable_device(struct cgpu_info *cgpu)
 	}
 	rwlock_init(&cgpu->qlock);
 	cgpu->queued_work = NULL;
+	cgpu->queued_work_mid = NULL;
 }
 
 struct _cgpu_devid_counter {
@@ -7610,11 +11539,16 @@ static void adjust_mostdevs(void)
 		most_devices = total_devices - zombie_devs;
 }
 
+/* USB hotplug scans initialise devices in parallel worker threads so this
+ * must serialize access to the devid hash and the device counters */
+static pthread_mutex_t add_cgpu_lock = PTHREAD_MUTEX_INITIALIZER;
+
 bool add_cgpu(struct cgpu_info *cgpu)
 {
 	static struct _cgpu_devid_counter *devids = NULL;
 	struct _cgpu_devid_counter *d;
 
+	mutex_lock(&add_cgpu_lock);
 	HASH_FIND_STR(devids, cgpu->drv->name, d);
 	if (d)
 		cgpu->device_id = ++d->lastid;
@@ -7633,12 +11567,15 @@ bool add_cgpu(struct cgpu_info *cgpu)
 	cgpu->last_device_valid_work = time(NULL);
 	mutex_unlock(&stats_lock);
 
+	mutex_init(&cgpu->wcache_lock);
+
 	if (hotplug_mode)
 		devices[total_devices + new_devices++] = cgpu;
 	else
 		devices[total_devices++] = cgpu;
 
 	adjust_mostdevs();
+	mutex_unlock(&add_cgpu_lock);
 	return true;
 }
 
@@ -7700,6 +11637,13 @@ static void hotplug_process(void)
 			if (cgpu->drv->thread_prepare && !cgpu->drv->thread_prepare(thr))
 				continue;
 
+			if (cgpu->drv->shared_thread) {
+				shared_thread_add(thr);
+				cgpu->thr[j] = thr;
+				mining_threads++;
+				continue;
+			}
+
 			if (unlikely(thr_info_create(thr, NULL, miner_thread, thr)))
 				quit(1, "hotplug thread %d create failed", thr->id);
 
@@ -7753,8 +11697,18 @@ static void *hotplug_thread(void __maybe_unused *userdata)
 			if (new_devices)
 				hotplug_process();
 
-			// hotplug_time >0 && <=9999
-			cgsleep_ms(hotplug_time * 1000);
+			if (hotplug_cb_registered) {
+				/* Scan again when libusb reports an attach or
+				 * detach, with a slow periodic rescan kept as
+				 * a fallback safety net */
+				if (!cgsem_mswait(&hotplug_sem, hotplug_time * 12 * 1000)) {
+					// Let the device settle before scanning
+					cgsleep_ms(1000);
+				}
+			} else {
+				// hotplug_time >0 && <=9999
+				cgsleep_ms(hotplug_time * 1000);
+			}
 		}
 	}
 
@@ -7775,7 +11729,34 @@ static void probe_pools(void)
 }
 
 #define DRIVER_FILL_DEVICE_DRV(X) fill_device_drv(&X##_drv);
-#define DRIVER_DRV_DETECT_ALL(X) X##_drv.drv_detect(false);
+
+static void *drv_detect_thread(void *arg)
+{
+	struct device_drv *drv = (struct device_drv *)arg;
+
+	drv->drv_detect(false);
+	return NULL;
+}
+
+/* Run every driver's detection concurrently so startup takes the time of
+ * the slowest driver's bus scan rather than the sum of all of them.
+ * Device claiming and registration are serialised internally (cgusb_lock
+ * and devices_lock) so drivers only contend where libusb demands it. */
+static void detect_all_devices(void)
+{
+	pthread_t detect_pth[DRIVER_MAX];
+	int started = 0, i;
+
+#define DRIVER_DRV_DETECT_PARALLEL(X) \
+	if (unlikely(pthread_create(&detect_pth[started], NULL, drv_detect_thread, &X##_drv))) \
+		X##_drv.drv_detect(false); \
+	else \
+		started++;
+	DRIVER_PARSE_COMMANDS(DRIVER_DRV_DETECT_PARALLEL)
+
+	for (i = 0; i < started; i++)
+		pthread_join(detect_pth[i], NULL);
+}
 
 #ifdef USE_USBUTILS
 static void *libusb_poll_thread(void __maybe_unused *arg)
@@ -7790,6 +11771,9 @@ static void *libusb_poll_thread(void __maybe_unused *arg)
 	/* Cancel any cancellable usb transfers */
 	cancel_usb_transfers();
 
+	/* Stop the read-ahead engine resubmitting and reap its transfers */
+	usb_ra_shutdown_all();
+
 	/* Keep event handling going until there are no async transfers in
 	 * flight. */
 	do {
@@ -7799,6 +11783,37 @@ static void *libusb_poll_thread(void __maybe_unused *arg)
 	return NULL;
 }
 
+/* Called by libusb from the usb polling thread on attach/detach - just kick
+ * the hotplug thread which does the real scan */
+static int LIBUSB_CALL usb_hotplug_cb(libusb_context __maybe_unused *ctx,
+				      libusb_device __maybe_unused *dev,
+				      libusb_hotplug_event __maybe_unused event,
+				      void __maybe_unused *user_data)
+{
+	cgsem_post(&hotplug_sem);
+	return 0;
+}
+
+static void register_usb_hotplug(void)
+{
+	int err;
+
+	cgsem_init(&hotplug_sem);
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return;
+	err = libusb_hotplug_register_callback(NULL,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+			0, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+			LIBUSB_HOTPLUG_MATCH_ANY, usb_hotplug_cb, NULL,
+			&hotplug_cbh);
+	if (err)
+		applog(LOG_WARNING, "Failed to register USB hotplug callback (%d), using periodic scans", err);
+	else {
+		hotplug_cb_registered = true;
+		applog(LOG_DEBUG, "USB hotplug callback registered");
+	}
+}
+
 static void initialise_usb(void) {
 	int err = libusb_init(NULL);
 
@@ -7808,6 +11823,7 @@ static void initialise_usb(void) {
 		quit(1, "libusb_init() failed");
 	}
 	initialise_usblocks();
+	register_usb_hotplug();
 	usb_polling = true;
 	pthread_create(&usb_poll_thread, NULL, libusb_poll_thread, NULL);
 }
@@ -7815,11 +11831,119 @@ static void initialise_usb(void) {
 #define initialise_usb() {}
 #endif
 
+/* Microbenchmarks of the hashing and codec primitives under the share and
+ * job paths, run via --bench or make bench. Reports ns per operation and
+ * throughput where a byte count is meaningful so changes to these kernels
+ * can be compared across releases without deploying to a rig. */
+static const char bench_notify[] =
+	"{\"id\":null,\"method\":\"mining.notify\",\"params\":"
+	"[\"bench1\",\"4d16b6f85af6e2198f44ae2a6de67f78487ae5611b77c6c0440b921e00000000\","
+	"\"01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff20020862062f503253482f04b8864e5008\","
+	"\"072f736c7573682f000000000100f2052a010000001976a914d23fcdf86f7e756a64a7a9688ef9903327048ed988ac00000000\","
+	"[\"f0dbca1ee1a9f6388d07d97c1ab0de0e41acdf2edac4b95780ba0a1ec14103b3\","
+	"\"8e43fd2988ac40c5d97702b7e5ccdf5b06d58f0e0d323f74dd5082232c1aedf7\"],"
+	"\"00000002\",\"1c2ac4af\",\"504e86b9\",false]}";
+
+static void bench_report(const char *name, int iters, double us, int bytes)
+{
+	if (bytes)
+		applog(LOG_WARNING, "%-16s %10.1f ns/op %8.1f MB/s", name,
+		       us * 1000.0 / iters, bytes * (double)iters / us);
+	else
+		applog(LOG_WARNING, "%-16s %10.1f ns/op", name, us * 1000.0 / iters);
+}
+
+static void bench_and_exit(void)
+{
+	struct timeval tv_s, tv_e;
+	unsigned char bin[128];
+	struct work *work;
+	struct pool *pool;
+	char hexstr[257];
+	char line[1024];
+	int i, iters;
+
+	pool = add_pool();
+	pool->rpc_url = strdup("Bench");
+	pool->rpc_user = pool->rpc_url;
+	pool->rpc_pass = pool->rpc_url;
+	replay_set_session(pool, "f8002c90", 4);
+
+	work = make_work();
+	get_benchmark_work(work);
+
+	applog(LOG_WARNING, "Benchmarking primitives:");
+
+	iters = 1000000;
+	cgtime(&tv_s);
+	for (i = 0; i < iters; i++)
+		regen_hash(work);
+	cgtime(&tv_e);
+	bench_report("regen_hash", iters, us_tdiff(&tv_e, &tv_s), 80);
+
+	calc_midstate(work);
+	cgtime(&tv_s);
+	for (i = 0; i < iters; i++)
+		regen_hash_midstate(work);
+	cgtime(&tv_e);
+	bench_report("regen_hash_mid", iters, us_tdiff(&tv_e, &tv_s), 80);
+
+	cgtime(&tv_s);
+	for (i = 0; i < iters; i++)
+		calc_midstate(work);
+	cgtime(&tv_e);
+	bench_report("calc_midstate", iters, us_tdiff(&tv_e, &tv_s), 64);
+
+	set_target(work->target, 512);
+	calc_diff(work, 512);
+	cgtime(&tv_s);
+	for (i = 0; i < iters; i++)
+		fulltest_work(work);
+	cgtime(&tv_e);
+	bench_report("fulltest_work", iters, us_tdiff(&tv_e, &tv_s), 0);
+
+	memcpy(bin, work->data, sizeof(bin));
+	cgtime(&tv_s);
+	for (i = 0; i < iters; i++)
+		__bin2hex(hexstr, bin, sizeof(bin));
+	cgtime(&tv_e);
+	bench_report("bin2hex", iters, us_tdiff(&tv_e, &tv_s), sizeof(bin));
+
+	cgtime(&tv_s);
+	for (i = 0; i < iters; i++)
+		hex2bin(bin, hexstr, sizeof(bin));
+	cgtime(&tv_e);
+	bench_report("hex2bin", iters, us_tdiff(&tv_e, &tv_s), sizeof(bin));
+
+	iters = 100000;
+	cgtime(&tv_s);
+	for (i = 0; i < iters; i++) {
+		memcpy(line, bench_notify, sizeof(bench_notify));
+		if (unlikely(!parse_method(pool, line)))
+			quit(1, "Failed to parse benchmark notify");
+	}
+	cgtime(&tv_e);
+	bench_report("parse_notify", iters, us_tdiff(&tv_e, &tv_s),
+		     sizeof(bench_notify));
+
+	cg_wlock(&pool->data_lock);
+	pool->swork.diff = 512;
+	cg_wunlock(&pool->data_lock);
+	cgtime(&tv_s);
+	for (i = 0; i < iters; i++)
+		gen_stratum_work(pool, work);
+	cgtime(&tv_e);
+	bench_report("gen_stratum_work", iters, us_tdiff(&tv_e, &tv_s), 0);
+
+	free_work(work);
+	exit(0);
+}
+
 int main(int argc, char *argv[])
 {
 	struct sigaction handler;
 	struct thr_info *thr;
-	struct block *block;
+	bool probing_early = false;
 	unsigned int k;
 	int i, j;
 	char *s;
@@ -7828,6 +11952,10 @@ int main(int argc, char *argv[])
 	 * variables so do it before anything at all */
 	if (unlikely(curl_global_init(CURL_GLOBAL_ALL)))
 		quit(1, "Failed to curl_global_init");
+#ifdef HAVE_LIBCURL
+	curl_share_setup();
+#endif
+	json_alloc_setup();
 
 #if LOCK_TRACKING
 	// Must be first
@@ -7846,7 +11974,6 @@ int main(int argc, char *argv[])
 	mutex_init(&stats_lock);
 	mutex_init(&sharelog_lock);
 	cglock_init(&ch_lock);
-	mutex_init(&sshare_lock);
 	rwlock_init(&blk_lock);
 	rwlock_init(&netacc_lock);
 	rwlock_init(&mining_thr_lock);
@@ -7856,6 +11983,10 @@ int main(int argc, char *argv[])
 	if (unlikely(pthread_cond_init(&lp_cond, NULL)))
 		quit(1, "Failed to pthread_cond_init lp_cond");
 
+#ifdef HAVE_SYS_EPOLL_H
+	init_stratum_reactor();
+#endif
+
 	mutex_init(&restart_lock);
 	if (unlikely(pthread_cond_init(&restart_cond, NULL)))
 		quit(1, "Failed to pthread_cond_init restart_cond");
@@ -7863,12 +11994,44 @@ int main(int argc, char *argv[])
 	if (unlikely(pthread_cond_init(&gws_cond, NULL)))
 		quit(1, "Failed to pthread_cond_init gws_cond");
 
-	/* Create a unique get work queue */
-	getq = tq_new();
-	if (!getq)
-		quit(1, "Failed to create getq");
-	/* We use the getq mutex as the staged lock */
-	stgd_lock = &getq->mutex;
+	cgsem_init(&pools_active_sem);
+	cgsem_init(&watchpool_sem);
+
+#ifdef WIN32
+	{
+		SYSTEM_INFO sysinfo;
+
+		GetSystemInfo(&sysinfo);
+		num_processors = sysinfo.dwNumberOfProcessors;
+	}
+#else
+	num_processors = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (num_processors < 1)
+		num_processors = 1;
+
+	for (i = 0; i < EXPIRY_WHEEL_SLOTS; i++)
+		INIT_LIST_HEAD(&expiry_wheel[i]);
+	for (i = 0; i < HEALTH_WHEEL_SLOTS; i++)
+		INIT_LIST_HEAD(&health_wheel[i]);
+
+	if (opt_verify_threads) {
+		pthread_t verify_pth;
+
+		verify_qs = malloc(sizeof(struct mpsc_q *) * opt_verify_threads);
+		if (!verify_qs)
+			quit(1, "Failed to malloc verify_qs");
+		for (i = 0; i < opt_verify_threads; i++) {
+			verify_qs[i] = mpscq_new(VERIFY_QSIZE);
+			if (unlikely(pthread_create(&verify_pth, NULL, verify_thread, verify_qs[i])))
+				quit(1, "Failed to create verify thread");
+		}
+	}
+
+	mutex_init(&stgd_mutex);
+	if (unlikely(pthread_cond_init(&stgd_cond, NULL)))
+		quit(1, "Failed to pthread_cond_init stgd_cond");
+	stgd_lock = &stgd_mutex;
 
 	initialise_usb();
 
@@ -7896,13 +12059,12 @@ int main(int argc, char *argv[])
 	logstart = devcursor + 1;
 	logcursor = logstart + 1;
 
-	block = calloc(sizeof(struct block), 1);
-	if (unlikely(!block))
-		quit (1, "main OOM");
+	/* Seed the reconnect backoff jitter; mix in the stack address so
+	 * rigs booted by the same switch do not share a seed */
+	srand(time(NULL) ^ (unsigned int)(intptr_t)&handler);
+
 	for (i = 0; i < 36; i++)
-		strcat(block->hash, "0");
-	HASH_ADD_STR(blocks, hash, block);
-	strcpy(current_hash, block->hash);
+		strcat(current_hash, "0");
 
 	INIT_LIST_HEAD(&scan_devices);
 
@@ -7919,6 +12081,15 @@ int main(int argc, char *argv[])
 	if (!config_loaded)
 		load_default_config();
 
+	/* Cache the flattened config for the next warm start */
+	cfg_cache_write();
+
+	if (opt_bench)
+		bench_and_exit();
+
+	if (opt_benchmark_replay)
+		opt_benchmark = true;
+
 	if (opt_benchmark) {
 		struct pool *pool;
 
@@ -7930,6 +12101,19 @@ int main(int argc, char *argv[])
 		enable_pool(pool);
 		pool->idle = false;
 		successful_connect = true;
+		/* The replay thread feeds this pool recorded stratum
+		 * messages in place of a live connection */
+		if (opt_benchmark_replay)
+			pool->has_stratum = true;
+	}
+
+	if (opt_stratum_trace) {
+		trace_fp = fopen(opt_stratum_trace, "wb");
+		if (!trace_fp)
+			quit(1, "Failed to open stratum trace file %s", opt_stratum_trace);
+		if (fwrite(TRACE_MAGIC, 8, 1, trace_fp) != 1)
+			quit(1, "Failed to write stratum trace file %s", opt_stratum_trace);
+		cgtime(&trace_start);
 	}
 
 #ifdef HAVE_CURSES
@@ -7940,6 +12124,17 @@ int main(int argc, char *argv[])
 		enable_curses();
 #endif
 
+	if (opt_log_async)
+		applog_async_init();
+
+	if (sharelog_file)
+		sharelog_init();
+
+#if defined(unix) || defined(__APPLE__)
+	if (opt_stats_shm)
+		stats_shm_init();
+#endif
+
 	applog(LOG_WARNING, "Started %s", packagename);
 	if (cnfbuf) {
 		applog(LOG_NOTICE, "Loaded configuration file %s", cnfbuf);
@@ -7990,8 +12185,8 @@ int main(int argc, char *argv[])
 	/* Use the DRIVER_PARSE_COMMANDS macro to fill all the device_drvs */
 	DRIVER_PARSE_COMMANDS(DRIVER_FILL_DEVICE_DRV)
 
-	/* Use the DRIVER_PARSE_COMMANDS macro to detect all devices */
-	DRIVER_PARSE_COMMANDS(DRIVER_DRV_DETECT_ALL)
+	/* Detect all devices, all drivers scanning concurrently */
+	detect_all_devices();
 
 	if (opt_display_devs) {
 		applog(LOG_ERR, "Devices detected:");
@@ -8049,6 +12244,19 @@ int main(int argc, char *argv[])
 #endif
 	}
 
+#ifdef USE_SIM
+	if (opt_bench_pool) {
+		struct pool *pool;
+		char url[64];
+
+		snprintf(url, sizeof(url), "stratum+tcp://127.0.0.1:%d",
+			 bench_pool_start());
+		pool = add_pool();
+		add_pool_details(pool, true, strdup(url), strdup("bench"),
+				 strdup("x"));
+	}
+#endif
+
 	if (!total_pools) {
 		applog(LOG_WARNING, "Need to specify at least one pool server.");
 #ifdef HAVE_CURSES
@@ -8077,6 +12285,10 @@ int main(int argc, char *argv[])
 	/* Set the currentpool to pool 0 */
 	currentpool = pools[0];
 
+#if defined(unix) || defined(__APPLE__)
+	import_stratum_handoff();
+#endif
+
 #ifdef HAVE_SYSLOG_H
 	if (use_syslog)
 		openlog(PACKAGE, LOG_PID, LOG_USER);
@@ -8087,6 +12299,24 @@ int main(int argc, char *argv[])
 			fork_monitor();
 	#endif // defined(unix)
 
+	/* Probe all pools in parallel before the device threads are started
+	 * so network discovery overlaps device initialisation and initial
+	 * work can be staged by the time devices are ready. Benchmark modes
+	 * keep the old ordering: plain benchmark never probes and replay
+	 * needs its server thread up first. */
+	if (!opt_benchmark && !opt_benchmark_replay) {
+		for (i = 0; i < total_pools; i++) {
+			struct pool *pool = pools[i];
+
+			enable_pool(pool);
+			pool->idle = true;
+		}
+
+		applog(LOG_NOTICE, "Probing for an alive pool");
+		probe_pools();
+		probing_early = true;
+	}
+
 	mining_thr = calloc(mining_threads, sizeof(thr));
 	if (!mining_thr)
 		quit(1, "Failed to calloc mining_thr");
@@ -8113,6 +12343,12 @@ int main(int argc, char *argv[])
 			if (!cgpu->drv->thread_prepare(thr))
 				continue;
 
+			if (cgpu->drv->shared_thread) {
+				shared_thread_add(thr);
+				cgpu->thr[j] = thr;
+				continue;
+			}
+
 			if (unlikely(thr_info_create(thr, NULL, miner_thread, thr)))
 				quit(1, "thread %d create failed", thr->id);
 
@@ -8127,26 +12363,37 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (opt_benchmark_replay) {
+		pthread_t replay_pth;
+
+		if (unlikely(pthread_create(&replay_pth, NULL, replay_thread, pools[0])))
+			quit(1, "Failed to create replay thread");
+	}
+
 	if (opt_benchmark)
 		goto begin_bench;
 
-	for (i = 0; i < total_pools; i++) {
-		struct pool *pool  = pools[i];
+	if (!probing_early) {
+		for (i = 0; i < total_pools; i++) {
+			struct pool *pool  = pools[i];
 
-		enable_pool(pool);
-		pool->idle = true;
-	}
+			enable_pool(pool);
+			pool->idle = true;
+		}
 
-	applog(LOG_NOTICE, "Probing for an alive pool");
+		applog(LOG_NOTICE, "Probing for an alive pool");
+	}
 	do {
 		int slept = 0;
 
 		/* Look for at least one active pool before starting */
-		probe_pools();
-		do {
-			sleep(1);
+		if (!probing_early)
+			probe_pools();
+		probing_early = false;
+		while (!pools_active && slept < 60) {
+			cgsem_mswait(&pools_active_sem, 1000);
 			slept++;
-		} while (!pools_active && slept < 60);
+		}
 
 		if (!pools_active) {
 			applog(LOG_ERR, "No servers were found that could be used to get work from.");
@@ -8198,6 +12445,15 @@ begin_bench:
 		quit(1, "watchdog thread create failed");
 	pthread_detach(thr->pth);
 
+#ifdef HAVE_CURSES
+	display_thr_id = 4;
+	thr = &control_thr[display_thr_id];
+	/* start curses display refresh thread */
+	if (thr_info_create(thr, NULL, display_thread, NULL))
+		quit(1, "display thread create failed");
+	pthread_detach(thr->pth);
+#endif
+
 	/* Create API socket thread */
 	api_thr_id = 5;
 	thr = &control_thr[api_thr_id];
@@ -8227,9 +12483,17 @@ begin_bench:
 	if (total_control_threads != 8)
 		quit(1, "incorrect total_control_threads (%d) should be 8", total_control_threads);
 
+	if (opt_sproxy_port)
+		sproxy_start();
+
+#ifndef WIN32
+	if (opt_lock_mem)
+		lock_mem();
+#endif
+
 	/* Once everything is set up, main() becomes the getwork scheduler */
 	while (42) {
-		int ts, max_staged = opt_queue;
+		int i, ts, max_staged;
 		struct pool *pool, *cp;
 		bool lagging = false;
 		struct work *work;
@@ -8238,6 +12502,7 @@ begin_bench:
 			signal_work_update();
 		opt_work_update = false;
 		cp = current_pool();
+		max_staged = dynamic_staged_target(cp);
 
 		/* If the primary pool is a getwork pool and cannot roll work,
 		 * try to stage one extra work per mining thread */
@@ -8279,8 +12544,35 @@ retry:
 					goto retry;
 				}
 			}
+			/* A rig's worth of queues refilling at once - as after
+			 * a block change - outpaces a lone generator, so fan
+			 * large deficits out over parallel workers */
+			i = max_staged - total_staged();
+			if (i >= SGW_PAR_THRESHOLD && num_processors > 1) {
+				gen_stratum_batch(pool, work, i);
+				applog(LOG_DEBUG, "Generated stratum work batch");
+				continue;
+			}
 			gen_stratum_work(pool, work);
 			applog(LOG_DEBUG, "Generated stratum work");
+
+			/* Expand the expensively generated work into ntime
+			 * rolled variants while more work is wanted. The
+			 * copies are patched via the ntime offset, costing a
+			 * fraction of another full generation. The variants
+			 * must be created before the original is staged and
+			 * ownership passes to the queue. */
+			for (i = 1; i <= opt_ntime_expand; i++) {
+				struct work *variant;
+
+				if (total_staged() + i > max_staged)
+					break;
+				variant = copy_work_noffset(work, i);
+				/* Keep any driver internal rolling of the
+				 * variant within the nominal window */
+				variant->drv_rolllimit -= i;
+				stage_work(variant);
+			}
 			stage_work(work);
 			continue;
 		}
@@ -142,12 +142,34 @@ static int avalon_write(struct cgpu_info *avalon, char *buf, ssize_t len, int ep
 	return AVA_SEND_OK;
 }
 
-static int avalon_send_task(const struct avalon_task *at, struct cgpu_info *avalon)
+static int avalon_write_batch(struct cgpu_info *avalon,
+			      struct usb_batch_frame *frames, int nframes,
+			      ssize_t len, int ep)
+{
+	int err, amount;
+
+	err = usb_write_batch(avalon, frames, nframes, &amount, ep);
+	applog(LOG_DEBUG, "%s%i: usb_write_batch got err %d", avalon->drv->name,
+	       avalon->device_id, err);
+
+	if (unlikely(err != 0)) {
+		applog(LOG_WARNING, "usb_write error on avalon_write_batch");
+		return AVA_SEND_ERROR;
+	}
+	if (amount != len) {
+		applog(LOG_WARNING, "usb_write length mismatch on avalon_write_batch");
+		return AVA_SEND_ERROR;
+	}
+
+	return AVA_SEND_OK;
+}
+
+/* Marshal one task into buf, returning its wire length */
+static size_t avalon_pack_task(const struct avalon_task *at, uint8_t *buf)
 {
-	uint8_t buf[AVALON_WRITE_SIZE + 4 * AVALON_DEFAULT_ASIC_NUM];
-	int ret, i, ep = C_AVALON_TASK;
 	uint32_t nonce_range;
 	size_t nr_len;
+	int i;
 
 	if (at->nonce_elf)
 		nr_len = AVALON_WRITE_SIZE + 4 * at->asic_num;
@@ -186,6 +208,17 @@ static int avalon_send_task(const struct avalon_task *at, struct cgpu_info *aval
 	tt |= ((buf[4] & 0x80) ? (1 << 0) : 0);
 	buf[4] = tt;
 #endif
+	return nr_len;
+}
+
+static int avalon_send_task(const struct avalon_task *at, struct cgpu_info *avalon)
+{
+	uint8_t buf[AVALON_WRITE_SIZE + 4 * AVALON_DEFAULT_ASIC_NUM];
+	int ret, ep = C_AVALON_TASK;
+	size_t nr_len;
+
+	nr_len = avalon_pack_task(at, buf);
+
 	if (at->reset) {
 		ep = C_AVALON_RESET;
 		nr_len = 1;
@@ -258,7 +291,10 @@ static bool avalon_decode_nonce(struct thr_info *thr, struct cgpu_info *avalon,
 	info->matching_work[work->subid]++;
 	nonce = htole32(ar->nonce);
 	applog(LOG_DEBUG, "Avalon: nonce = %0x08x", nonce);
-	return submit_nonce(thr, work, nonce);
+	if (!submit_nonce(thr, work, nonce))
+		return false;
+	chip_result(avalon, work->subid);
+	return true;
 }
 
 /* Wait until the ftdi chip returns a CTS saying we can send more data. */
@@ -811,6 +847,8 @@ static struct cgpu_info *avalon_detect_one(libusb_device *dev, struct usb_find_d
 	info->temp_sum = 0;
 	info->temp_old = 0;
 
+	chip_stats_init(avalon, info->miner_count);
+
 	if (!add_cgpu(avalon))
 		goto unshin;
 
@@ -827,6 +865,15 @@ static struct cgpu_info *avalon_detect_one(libusb_device *dev, struct usb_find_d
 	       avalon->device_path, info->miner_count, info->asic_count, info->timeout,
 	       info->frequency);
 
+	/* Opt in to the clock governor unless the driver's own automatic
+	 * frequency adjustment is running and would fight it */
+	if (!opt_avalon_auto) {
+		avalon->gov_min_clock = opt_avalon_freq_min;
+		avalon->gov_max_clock = opt_avalon_freq_max;
+		avalon->gov_step = 2;
+		avalon->gov_clock = info->frequency;
+	}
+
 	if (usb_ident(avalon) == IDENT_BTB) {
 		if (opt_bitburner_core_voltage < BITBURNER_MIN_COREMV ||
 		    opt_bitburner_core_voltage > BITBURNER_MAX_COREMV) {
@@ -1014,7 +1061,11 @@ static void *avalon_get_results(void *userdata)
 static void avalon_rotate_array(struct cgpu_info *avalon, struct avalon_info *info)
 {
 	mutex_lock(&info->qlock);
-	avalon->queued = 0;
+	/* Work queued ahead of the array just sent carries over to the new
+	 * current array */
+	avalon->queued -= info->miner_count;
+	if (avalon->queued < 0)
+		avalon->queued = 0;
 	if (++avalon->work_array >= AVALON_ARRAY_SIZE)
 		avalon->work_array = 0;
 	mutex_unlock(&info->qlock);
@@ -1111,7 +1162,11 @@ static void *avalon_send_tasks(void *userdata)
 	RenameThread(threadname);
 
 	while (likely(!avalon->shutdown)) {
+		uint8_t taskbuf[AVALON_TASK_BATCH][AVALON_WRITE_SIZE + 4 * AVALON_DEFAULT_ASIC_NUM];
+		struct usb_batch_frame frames[AVALON_TASK_BATCH];
 		int start_count, end_count, i, j, ret;
+		int nframes = 0;
+		ssize_t batch_len = 0;
 		cgtimer_t ts_start;
 		struct avalon_task at;
 		bool idled = false;
@@ -1129,7 +1184,12 @@ static void *avalon_send_tasks(void *userdata)
 		start_count = avalon->work_array * avalon_get_work_count;
 		end_count = start_count + avalon_get_work_count;
 		for (i = start_count, j = 0; i < end_count; i++, j++) {
-			if (avalon_buffer_full(avalon)) {
+			size_t nr_len;
+
+			/* The buffer full check is itself a USB round trip so
+			 * it gates a small batch of tasks coalesced into one
+			 * write rather than every single task */
+			if (!nframes && avalon_buffer_full(avalon)) {
 				applog(LOG_INFO,
 				       "%s%i: Buffer full after only %d of %d work queued",
 					avalon->drv->name, avalon->device_id, j, avalon_get_work_count);
@@ -1159,7 +1219,22 @@ static void *avalon_send_tasks(void *userdata)
 			}
 			mutex_unlock(&info->qlock);
 
-			ret = avalon_send_task(&at, avalon);
+			nr_len = avalon_pack_task(&at, taskbuf[nframes]);
+			if (opt_debug) {
+				applog(LOG_DEBUG, "Avalon: Sent(%u):", (unsigned int)nr_len);
+				hexdump(taskbuf[nframes], nr_len);
+			}
+			frames[nframes].buf = (const char *)taskbuf[nframes];
+			frames[nframes].len = nr_len;
+			batch_len += nr_len;
+
+			if (++nframes < AVALON_TASK_BATCH && i + 1 < end_count)
+				continue;
+
+			ret = avalon_write_batch(avalon, frames, nframes,
+						 batch_len, C_AVALON_TASK);
+			nframes = 0;
+			batch_len = 0;
 
 			if (unlikely(ret == AVA_SEND_ERROR)) {
 				/* Send errors are fatal */
@@ -1454,13 +1529,20 @@ static void get_avalon_statline_before(char *buf, size_t bufsiz, struct cgpu_inf
 static bool avalon_fill(struct cgpu_info *avalon)
 {
 	struct avalon_info *info = avalon->device_data;
-	int subid, slot, mc;
+	int subid, slot, mc, depth;
 	struct work *work;
 	bool ret = true;
 
 	mc = info->miner_count;
+	/* Keep a full array queued ahead of the one being sent so the send
+	 * thread never has to idle miners waiting on a refill. The bitburner
+	 * consumes its array under the queue lock so it cannot fill ahead. */
+	if (is_bitburner(avalon))
+		depth = mc;
+	else
+		depth = mc * 2;
 	mutex_lock(&info->qlock);
-	if (avalon->queued >= mc)
+	if (avalon->queued >= depth)
 		goto out_unlock;
 	work = get_queued(avalon);
 	if (unlikely(!work)) {
@@ -1468,12 +1550,12 @@ static bool avalon_fill(struct cgpu_info *avalon)
 		goto out_unlock;
 	}
 	subid = avalon->queued++;
-	work->subid = subid;
-	slot = avalon->work_array * mc + subid;
+	work->subid = subid % mc;
+	slot = (avalon->work_array * mc + subid) % (AVALON_ARRAY_SIZE * mc);
 	if (likely(avalon->works[slot]))
 		work_completed(avalon, avalon->works[slot]);
 	avalon->works[slot] = work;
-	if (avalon->queued < mc)
+	if (avalon->queued < depth)
 		ret = false;
 out_unlock:
 	mutex_unlock(&info->qlock);
@@ -1536,6 +1618,7 @@ static void avalon_flush_work(struct cgpu_info *avalon)
 
 	/* Signal main loop we need more work */
 	cgsem_post(&info->qsem);
+	device_flushed(avalon);
 }
 
 static struct api_data *avalon_api_stats(struct cgpu_info *cgpu)
@@ -1667,6 +1750,7 @@ struct device_drv avalon_drv = {
 	.get_api_stats = avalon_api_stats,
 	.get_statline_before = get_avalon_statline_before,
 	.set_device = avalon_set_device,
+	.set_clock = avalon_set_freq,
 	.reinit_device = avalon_init,
 	.thread_shutdown = avalon_shutdown,
 };
@@ -167,7 +167,12 @@ struct avalon_info {
 
 #define AVALON_WRITE_SIZE (sizeof(struct avalon_task))
 #define AVALON_READ_SIZE (sizeof(struct avalon_result))
-#define AVALON_ARRAY_SIZE 3
+/* Tasks coalesced into one bulk write between buffer full checks - small
+ * enough to stay within the CTS flow control headroom */
+#define AVALON_TASK_BATCH 4
+/* One array being sent, one filled ahead of it, and two of completed work
+ * kept for matching late returned nonces */
+#define AVALON_ARRAY_SIZE 4
 #define BITBURNER_ARRAY_SIZE 4
 
 #define AVA_GETS_ERROR -1
@@ -39,6 +39,9 @@ static void bab_detect(__maybe_unused bool hotplug)
 #define BAB_SPI_SPEED 96000
 #define BAB_SPI_BUFSIZ 1024
 
+// Maximum chained segments per SPI_IOC_MESSAGE() ioctl
+#define BAB_TXRX_SEGMENTS 64
+
 #define BAB_ADDR(_n) (*((babinfo->gpio) + (_n)))
 
 #define BAB_INP_GPIO(_n) BAB_ADDR((_n) / 10) &= (~(7 << (((_n) % 10) * 3)))
@@ -658,12 +661,27 @@ static void _bab_reset(__maybe_unused struct cgpu_info *babcgpu, struct bab_info
 	BAB_OUT_GPIO_V(9, 0);
 }
 
+// Send a bank's chained transfer segments as one multi-segment ioctl
+static bool _bab_txrx_chain(struct cgpu_info *babcgpu, struct bab_info *babinfo, struct spi_ioc_transfer *trans, int nseg, bool detect_ignore, const char *file, const char *func, const int line)
+{
+	if (ioctl(babinfo->spifd, SPI_IOC_MESSAGE(nseg), (void *)trans) < 0) {
+		if (!detect_ignore || errno != 110) {
+			applog(LOG_ERR, "%s%d: ioctl (%d segs) failed err=%d" BAB_FFL,
+					babcgpu->drv->name, babcgpu->device_id,
+					nseg, errno, BAB_FFL_PASS);
+		}
+		return false;
+	}
+	return true;
+}
+
 // TODO: handle a false return where this is called?
 static bool _bab_txrx(struct cgpu_info *babcgpu, struct bab_info *babinfo, int buf, uint32_t siz, bool detect_ignore, const char *file, const char *func, const int line)
 {
-	int bank, i;
-	uint32_t pos;
+	struct spi_ioc_transfer trans[BAB_TXRX_SEGMENTS];
 	struct spi_ioc_transfer tran;
+	int bank, nseg, i;
+	uint32_t pos;
 	uintptr_t rbuf, wbuf;
 
 	wbuf = (uintptr_t)(babinfo->buf_write[buf]);
@@ -675,6 +693,7 @@ static bool _bab_txrx(struct cgpu_info *babcgpu, struct bab_info *babinfo, int b
 
 	i = 0;
 	pos = 0;
+	nseg = 0;
 	for (bank = 0; bank <= BAB_MAXBANKS; bank++) {
 		if (babinfo->bank_off[buf][bank]) {
 			bab_reset(bank, 64);
@@ -694,6 +713,14 @@ static bool _bab_txrx(struct cgpu_info *babcgpu, struct bab_info *babinfo, int b
 		tran.rx_buf = rbuf;
 		tran.speed_hz = BAB_SPI_SPEED;
 		if (pos == babinfo->bank_off[buf][bank]) {
+			/* Flush this bank's chain before the reset switches
+			 * the chip select over to the next bank */
+			if (nseg) {
+				if (!_bab_txrx_chain(babcgpu, babinfo, trans, nseg,
+						     detect_ignore, file, func, line))
+					return false;
+				nseg = 0;
+			}
 			for (; ++bank <= BAB_MAXBANKS; ) {
 				if (babinfo->bank_off[buf][bank] > pos) {
 					bab_reset(bank, 64);
@@ -740,13 +767,15 @@ static bool _bab_txrx(struct cgpu_info *babcgpu, struct bab_info *babinfo, int b
 						BAB_SPI_SPEED, BAB_FFL_PASS);
 		}
 
-		if (ioctl(babinfo->spifd, SPI_IOC_MESSAGE(1), (void *)&tran) < 0) {
-			if (!detect_ignore || errno != 110) {
-				applog(LOG_ERR, "%s%d: ioctl failed err=%d" BAB_FFL,
-						babcgpu->drv->name, babcgpu->device_id,
-						errno, BAB_FFL_PASS);
-			}
-			return false;
+		/* Queue the segment - the whole bank goes to the kernel as
+		 * one chained message so the bus isn't idled between chip
+		 * groups, each segment keeping its own clock speed */
+		memcpy(&(trans[nseg]), &tran, sizeof(tran));
+		if (++nseg >= BAB_TXRX_SEGMENTS) {
+			if (!_bab_txrx_chain(babcgpu, babinfo, trans, nseg,
+					     detect_ignore, file, func, line))
+				return false;
+			nseg = 0;
 		}
 
 		siz -= tran.len;
@@ -754,6 +783,13 @@ static bool _bab_txrx(struct cgpu_info *babcgpu, struct bab_info *babinfo, int b
 		rbuf += tran.len;
 		pos += tran.len;
 	}
+
+	if (nseg) {
+		if (!_bab_txrx_chain(babcgpu, babinfo, trans, nseg,
+				     detect_ignore, file, func, line))
+			return false;
+	}
+
 	mutex_lock(&(babinfo->did_lock));
 	cgtime(&(babinfo->last_did));
 	mutex_unlock(&(babinfo->did_lock));
@@ -1219,6 +1255,8 @@ static void bab_detect(bool hotplug)
 	mutex_init(&babinfo->did_lock);
 	cglock_init(&babinfo->blist_lock);
 
+	chip_stats_init(babcgpu, babinfo->chip_count);
+
 	babinfo->initialised = true;
 
 	return;
@@ -1321,6 +1359,7 @@ static void bab_flush_work(struct cgpu_info *babcgpu)
 	mutex_lock(&(babinfo->did_lock));
 	memset(&(babinfo->last_did), 0, sizeof(babinfo->last_did));
 	mutex_unlock(&(babinfo->did_lock));
+	device_flushed(babcgpu);
 }
 
 static void ms3steps(uint32_t *p)
@@ -1446,6 +1485,7 @@ static bool oknonce(struct thr_info *thr, struct cgpu_info *babcgpu, int chip, u
 					submit_tested_work(thr, bitem->work);
 					babinfo->nonce_offset_count[i]++;
 					babinfo->chip_good[chip]++;
+					chip_result(babcgpu, chip);
 					bitem->nonces++;
 					babinfo->new_nonces++;
 					babinfo->ok_nonces++;
@@ -1483,6 +1523,8 @@ static void *bab_res(void *userdata)
 	uint32_t nonce;
 	int chip;
 
+	set_sched_prio(opt_rt_read_prio);
+
 	applog(LOG_DEBUG, "%s%i: Results...",
 			  babcgpu->drv->name, babcgpu->device_id);
 
@@ -971,6 +971,8 @@ static void bflsc_flush_work(struct cgpu_info *bflsc)
 
 	for (dev = 0; dev < sc_info->sc_count; dev++)
 		flush_one_dev(bflsc, dev);
+
+	device_flushed(bflsc);
 }
 
 static void bflsc_flash_led(struct cgpu_info *bflsc, int dev)
@@ -1259,6 +1261,8 @@ static void process_nonces(struct cgpu_info *bflsc, int dev, char *xlink, char *
 	struct bflsc_info *sc_info = (struct bflsc_info *)(bflsc->device_data);
 	char midstate[MIDSTATE_BYTES], blockdata[MERKLE_BYTES];
 	struct thr_info *thr = bflsc->thr[0];
+	struct work *nonce_works[QUE_MAX_RESULTS];
+	uint32_t nonce_vals[QUE_MAX_RESULTS];
 	struct work *work;
 	int8_t core = -1;
 	uint32_t nonce;
@@ -1322,8 +1326,7 @@ static void process_nonces(struct cgpu_info *bflsc, int dev, char *xlink, char *
 		return;
 	}
 
-	res = false;
-	x = 0;
+	num = 0;
 	for (i = sc_info->que_fld_min; i < count; i++) {
 		if (strlen(fields[i]) != 8) {
 			tmp = str_text(data);
@@ -1334,19 +1337,24 @@ static void process_nonces(struct cgpu_info *bflsc, int dev, char *xlink, char *
 		}
 
 		hex2bin((void*)&nonce, fields[i], 4);
-		nonce = htobe32(nonce);
-		res = submit_nonce(thr, work, nonce);
-		if (res) {
-			wr_lock(&(sc_info->stat_lock));
-			sc_info->sc_devs[dev].nonces_found++;
-			wr_unlock(&(sc_info->stat_lock));
-
-			(*nonces)++;
-			x++;
+		nonce_works[num] = work;
+		nonce_vals[num++] = htobe32(nonce);
+	}
+
+	/* Verify the whole result message in one batched call */
+	x = submit_nonces(thr, nonce_works, nonce_vals, num);
+	res = (x > 0);
+	if (x) {
+		wr_lock(&(sc_info->stat_lock));
+		sc_info->sc_devs[dev].nonces_found += x;
+		wr_unlock(&(sc_info->stat_lock));
+
+		(*nonces) += x;
+		for (i = 0; i < x; i++)
 			inc_bflsc_nonces(sc_info, core);
-		} else
-			inc_core_errors(sc_info, core);
 	}
+	for (i = x; i < num; i++)
+		inc_core_errors(sc_info, core);
 
 	wr_lock(&(sc_info->stat_lock));
 	if (res)
@@ -1364,53 +1372,101 @@ static void process_nonces(struct cgpu_info *bflsc, int dev, char *xlink, char *
 	free_work(work);
 }
 
+/* In-place splitters for the high frequency result parsing path. The generic
+ * tolines/breakdown helpers strdup and realloc per line and per field which
+ * is visible controller load on a big rig, so results are split by writing
+ * NULs into a single stack copy of the message instead. Limits are well
+ * beyond anything a sane device returns - hitting one means garbage. */
+#define BFLSC_RES_LINES (QUE_MAX_RESULTS * 4)
+#define BFLSC_RES_FIELDS (QUE_MAX_RESULTS + 8)
+
+// Split buf into lines on LF, in place. -1 means a missing final LF or
+// too many lines, otherwise the line count is returned
+static int res_tolines(char *buf, char **lines, int maxlines)
+{
+	int n = 0;
+
+	while (*buf) {
+		char *lf = strchr(buf, '\n');
+
+		if (!lf || n >= maxlines)
+			return -1;
+		lines[n++] = buf;
+		*lf = '\0';
+		buf = lf + 1;
+	}
+	return n;
+}
+
+// Split a line into comma separated fields, in place
+// -1 means too many fields, otherwise the field count is returned
+static int res_fields(char *line, char **fields, int maxfields)
+{
+	int n = 0;
+
+	while (line && *line) {
+		char *comma = strchr(line, ',');
+
+		if (n >= maxfields)
+			return -1;
+		if (comma)
+			*(comma++) = '\0';
+		fields[n++] = line;
+		line = comma;
+	}
+	return n;
+}
+
 static int process_results(struct cgpu_info *bflsc, int dev, char *pbuf, int *nonces)
 {
 	struct bflsc_info *sc_info = (struct bflsc_info *)(bflsc->device_data);
-	char **items, *firstname, **fields, *lf;
-	int que = 0, i, lines, count;
-	char *tmp, *tmp2, *buf;
+	char *lines[BFLSC_RES_LINES], *fields[BFLSC_RES_FIELDS];
+	char buf[BFLSC_BUFSIZ+1];
+	int que = 0, i, nlines, count;
+	char *tmp, *tmp2, *colon;
 	char xlink[17];
-	bool res;
 
 	*nonces = 0;
 
 	xlinkstr(xlink, sizeof(xlink), dev, sc_info);
 
-	buf = strdup(pbuf);
-	res = tolines(bflsc, dev, buf, &lines, &items, C_GETRESULTS);
-	free(buf);
-	if (!res || lines < 1) {
+	/* Parse a copy in place so the error paths can still show the
+	 * original message */
+	strncpy(buf, pbuf, BFLSC_BUFSIZ);
+	buf[BFLSC_BUFSIZ] = '\0';
+	nlines = res_tolines(buf, lines, BFLSC_RES_LINES);
+	if (nlines < 1) {
 		tmp = str_text(pbuf);
 		applogsiz(LOG_ERR, BFLSC_APPLOGSIZ,
 				"%s%i:%s empty result (%s) ignored",
 				bflsc->drv->name, bflsc->device_id, xlink, tmp);
 		free(tmp);
-		goto arigatou;
+		return que;
 	}
 
-	if (lines < QUE_RES_LINES_MIN) {
+	if (nlines < QUE_RES_LINES_MIN) {
 		tmp = str_text(pbuf);
 		applogsiz(LOG_ERR, BFLSC_APPLOGSIZ,
 				"%s%i:%s result of %d too small (%s) ignored",
-				bflsc->drv->name, bflsc->device_id, xlink, lines, tmp);
+				bflsc->drv->name, bflsc->device_id, xlink, nlines, tmp);
 		free(tmp);
-		goto arigatou;
+		return que;
 	}
 
-	breakdown(ONECOLON, items[1], &count, &firstname, &fields, &lf);
+	colon = strchr(lines[1], ':');
+	count = colon ? res_fields(colon + 1, fields, BFLSC_RES_FIELDS) : 0;
 	if (count < 1) {
 		tmp = str_text(pbuf);
-		tmp2 = str_text(items[1]);
+		tmp2 = str_text(lines[1]);
 		applogsiz(LOG_ERR, BFLSC_APPLOGSIZ,
 				"%s%i:%s empty result count (%s) in (%s) ignoring",
 				bflsc->drv->name, bflsc->device_id, xlink, tmp2, tmp);
 		free(tmp2);
 		free(tmp);
-		goto arigatou;
+		return que;
 	} else if (count != 1) {
 		tmp = str_text(pbuf);
-		tmp2 = str_text(items[1]);
+		tmp2 = str_text(lines[1]);
 		applogsiz(LOG_ERR, BFLSC_APPLOGSIZ,
 				"%s%i:%s incorrect result count %d (%s) in (%s) will try anyway",
 				bflsc->drv->name, bflsc->device_id, xlink, count, tmp2, tmp);
@@ -1419,13 +1475,13 @@ static int process_results(struct cgpu_info *bflsc, int dev, char *pbuf, int *no
 	}
 
 	que = atoi(fields[0]);
-	if (que != (lines - QUE_RES_LINES_MIN)) {
+	if (que != (nlines - QUE_RES_LINES_MIN)) {
 		i = que;
 		// 1+ In case the last line isn't 'OK' - try to process it
-		que = 1 + lines - QUE_RES_LINES_MIN;
+		que = 1 + nlines - QUE_RES_LINES_MIN;
 
 		tmp = str_text(pbuf);
-		tmp2 = str_text(items[0]);
+		tmp2 = str_text(lines[0]);
 		applogsiz(LOG_ERR, BFLSC_APPLOGSIZ,
 				"%s%i:%s incorrect result count %d (%s) will try %d (%s)",
 				bflsc->drv->name, bflsc->device_id, xlink, i, tmp2, que, tmp);
@@ -1434,23 +1490,17 @@ static int process_results(struct cgpu_info *bflsc, int dev, char *pbuf, int *no
 
 	}
 
-	freebreakdown(&count, &firstname, &fields);
-
 	for (i = 0; i < que; i++) {
-		res = breakdown(NOCOLON, items[i + QUE_RES_LINES_MIN - 1], &count, &firstname, &fields, &lf);
-		if (likely(res))
-			process_nonces(bflsc, dev, &(xlink[0]), items[i], count, fields, nonces);
+		count = res_fields(lines[i + QUE_RES_LINES_MIN - 1], fields, BFLSC_RES_FIELDS);
+		if (likely(count > 0))
+			process_nonces(bflsc, dev, &(xlink[0]), lines[i], count, fields, nonces);
 		else
 			applogsiz(LOG_ERR, BFLSC_APPLOGSIZ,
 					"%s%i:%s failed to process nonce %s",
-					bflsc->drv->name, bflsc->device_id, xlink, items[i]);
-		freebreakdown(&count, &firstname, &fields);
+					bflsc->drv->name, bflsc->device_id, xlink, lines[i]);
 		sc_info->not_first_work = true;
 	}
 
-arigatou:
-	freetolines(&lines, &items);
-
 	return que;
 }
 
@@ -1469,6 +1519,8 @@ static void *bflsc_get_results(void *userdata)
 	int i, que, dev, nonces;
 	bool readok;
 
+	set_sched_prio(opt_rt_read_prio);
+
 	cgtime(&now);
 	for (i = 0; i < sc_info->sc_count; i++) {
 		copy_time(&(sc_info->sc_devs[i].last_check_result), &now);
@@ -1762,8 +1814,7 @@ static int64_t bflsc_scanwork(struct thr_info *thr)
 				wr_lock(&bflsc->qlock);
 				HASH_ITER(hh, bflsc->queued_work, work, tmp) {
 					if (work->devflag && work->subid == dev) {
-						bflsc->queued_count--;
-						HASH_DEL(bflsc->queued_work, work);
+						__work_completed(bflsc, work);
 						discard_work(work);
 					}
 				}
@@ -538,24 +538,24 @@ re_send:
 	return true;
 }
 
-static int64_t bitforce_get_result(struct thr_info *thr, struct work *work)
+/* Poll the device until the current job's result line is available, leaving
+ * it in buf for later parsing. Returns false if the result was abandoned
+ * due to a work restart or timeout. */
+static bool bitforce_poll_result(struct thr_info *thr, char *buf, size_t bufsiz)
 {
 	struct cgpu_info *bitforce = thr->cgpu;
 	unsigned int delay_time_ms;
 	struct timeval elapsed;
 	struct timeval now;
-	char buf[BITFORCE_BUFSIZ+1];
 	int amount;
-	char *pnoncebuf;
-	uint32_t nonce;
 
 	while (1) {
 		if (unlikely(thr->work_restart))
-			return 0;
+			return false;
 
 		mutex_lock(&bitforce->device_mutex);
 		usb_write(bitforce, BITFORCE_WORKSTATUS, BITFORCE_WORKSTATUS_LEN, &amount, C_REQUESTWORKSTATUS);
-		usb_read_nl(bitforce, buf, sizeof(buf)-1, &amount, C_GETWORKSTATUS);
+		usb_read_nl(bitforce, buf, bufsiz-1, &amount, C_GETWORKSTATUS);
 		mutex_unlock(&bitforce->device_mutex);
 
 		cgtime(&now);
@@ -565,7 +565,7 @@ static int64_t bitforce_get_result(struct thr_info *thr, struct work *work)
 			applog(LOG_ERR, "%s%i: took %ldms - longer than %dms",
 				bitforce->drv->name, bitforce->device_id,
 				tv_to_ms(elapsed), BITFORCE_LONG_TIMEOUT_MS);
-			return 0;
+			return false;
 		}
 
 		if (amount > 0 && buf[0] && strncasecmp(buf, "B", 1)) /* BFL does not respond during throttling */
@@ -583,9 +583,9 @@ static int64_t bitforce_get_result(struct thr_info *thr, struct work *work)
 			tv_to_ms(elapsed), BITFORCE_TIMEOUT_MS);
 		dev_error(bitforce, REASON_DEV_OVER_HEAT);
 
-		/* Only return if we got nothing after timeout - there still may be results */
+		/* Only abandon if we got nothing after timeout - there still may be results */
 		if (amount == 0)
-			return 0;
+			return false;
 	} else if (!strncasecmp(buf, BITFORCE_EITHER, BITFORCE_EITHER_LEN)) {
 		/* Simple timing adjustment. Allow a few polls to cope with
 		 * OS timer delays being variably reliable. wait_ms will
@@ -615,6 +615,17 @@ static int64_t bitforce_get_result(struct thr_info *thr, struct work *work)
 	applog(LOG_DEBUG, "%s%i: waited %dms until %s",
 			bitforce->drv->name, bitforce->device_id,
 			bitforce->wait_ms, buf);
+
+	return true;
+}
+
+/* Process a polled result line against the work it was mined from */
+static int64_t bitforce_parse_result(struct thr_info *thr, char *buf, struct work *work)
+{
+	struct cgpu_info *bitforce = thr->cgpu;
+	char *pnoncebuf;
+	uint32_t nonce;
+
 	if (!strncasecmp(buf, BITFORCE_NO_NONCE, BITFORCE_NO_NONCE_MATCH))
 		return bitforce->nonces;   /* No valid nonce found */
 	else if (!strncasecmp(buf, BITFORCE_IDLE, BITFORCE_IDLE_MATCH))
@@ -644,7 +655,7 @@ static int64_t bitforce_get_result(struct thr_info *thr, struct work *work)
 				bitforce->kname = KNAME_WORK;
 		}
 			
-		submit_nonce(thr, work, nonce);
+		submit_nonce_async(thr, work, nonce);
 		if (strncmp(&pnoncebuf[8], ",", 1))
 			break;
 		pnoncebuf += 9;
@@ -653,9 +664,14 @@ static int64_t bitforce_get_result(struct thr_info *thr, struct work *work)
 	return bitforce->nonces;
 }
 
-static void bitforce_shutdown(__maybe_unused struct thr_info *thr)
+static void bitforce_shutdown(struct thr_info *thr)
 {
-//	struct cgpu_info *bitforce = thr->cgpu;
+	struct cgpu_info *bitforce = thr->cgpu;
+
+	if (bitforce->prev_work) {
+		free_work(bitforce->prev_work);
+		bitforce->prev_work = NULL;
+	}
 }
 
 static void biforce_thread_enable(struct thr_info *thr)
@@ -665,37 +681,75 @@ static void biforce_thread_enable(struct thr_info *thr)
 	bitforce_initialise(bitforce, true);
 }
 
+/* Pipelined across calls: poll the result of the job sent last call, then
+ * submit the new job before parsing and submitting the nonces, so the device
+ * is already mining again while the results are processed. A copy of the
+ * previous work is kept to match the results against. */
 static int64_t bitforce_scanhash(struct thr_info *thr, struct work *work, int64_t __maybe_unused max_nonce)
 {
 	struct cgpu_info *bitforce = thr->cgpu;
-	bool send_ret;
-	int64_t ret;
+	char resbuf[BITFORCE_BUFSIZ+1];
+	struct timeval elapsed;
+	struct timeval now;
+	unsigned int wait_left;
+	bool send_ret, have_res = false;
+	int64_t ret = 0;
 
 	// Device is gone
-	if (bitforce->usbinfo.nodev)
-		return -1;
+	if (bitforce->usbinfo.nodev) {
+		ret = -1;
+		goto out_flush;
+	}
 
-	send_ret = bitforce_send_work(thr, work);
+	if (bitforce->prev_work) {
+		/* Wait out the remainder of the previous job's run time */
+		cgtime(&now);
+		timersub(&now, &bitforce->work_start_tv, &elapsed);
+		if (tv_to_ms(elapsed) < bitforce->sleep_ms)
+			wait_left = bitforce->sleep_ms - tv_to_ms(elapsed);
+		else
+			wait_left = 0;
 
-	if (!restart_wait(thr, bitforce->sleep_ms))
-		return 0;
+		if (wait_left && !restart_wait(thr, wait_left))
+			goto out_flush;
 
-	bitforce->wait_ms = bitforce->sleep_ms;
+		bitforce->wait_ms = bitforce->sleep_ms;
 
-	if (send_ret) {
 		bitforce->polling = true;
-		ret = bitforce_get_result(thr, work);
+		have_res = bitforce_poll_result(thr, resbuf, sizeof(resbuf));
 		bitforce->polling = false;
-	} else
-		ret = -1;
 
-	if (ret == -1) {
-		ret = 0;
+		if (unlikely(thr->work_restart))
+			goto out_flush;
+	}
+
+	send_ret = bitforce_send_work(thr, work);
+
+	if (have_res)
+		ret = bitforce_parse_result(thr, resbuf, bitforce->prev_work);
+
+	if (bitforce->prev_work) {
+		free_work(bitforce->prev_work);
+		bitforce->prev_work = NULL;
+	}
+
+	if (!send_ret) {
 		applog(LOG_ERR, "%s%i: Comms error", bitforce->drv->name, bitforce->device_id);
 		dev_error(bitforce, REASON_DEV_COMMS_ERROR);
 		bitforce->hw_errors++;
 		/* empty read buffer */
 		bitforce_initialise(bitforce, true);
+		return ret;
+	}
+
+	bitforce->prev_work = copy_work(work);
+
+	return ret;
+
+out_flush:
+	if (bitforce->prev_work) {
+		free_work(bitforce->prev_work);
+		bitforce->prev_work = NULL;
 	}
 	return ret;
 }
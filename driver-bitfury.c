@@ -220,6 +220,7 @@ static bool bxf_detect_one(struct cgpu_info *bitfury, struct bitfury_info *info)
 			applog(LOG_INFO, "%s %d: Version %d.%d rev %d chips %d",
 			       bitfury->drv->name, bitfury->device_id, info->ver_major,
 			       info->ver_minor, info->hw_rev, info->chips);
+			chip_stats_init(bitfury, info->chips);
 			break;
 		}
 		/* Keep parsing if the buffer is full without counting it as
@@ -334,8 +335,10 @@ static void parse_bxf_submit(struct cgpu_info *bitfury, struct bitfury_info *inf
 		       bitfury->drv->name, bitfury->device_id);
 		return;
 	}
-	if (chip > -1 && chip < 2)
+	if (chip > -1 && chip < 2) {
 		info->submits[chip]++;
+		chip_result(bitfury, chip);
+	}
 
 	applog(LOG_DEBUG, "%s %d: Parsed nonce %u workid %d timestamp %u",
 	       bitfury->drv->name, bitfury->device_id, nonce, workid, timestamp);
@@ -371,7 +374,8 @@ static void parse_bxf_submit(struct cgpu_info *bitfury, struct bitfury_info *inf
 	set_work_ntime(work, timestamp);
 	if (submit_nonce(thr, work, nonce)) {
 		mutex_lock(&info->lock);
-		info->nonces++;
+		/* A filtered result stands for filter_diff diff 1 nonces */
+		info->nonces += info->filter_diff;
 		mutex_unlock(&info->lock);
 	}
 	free_work(work);
@@ -387,6 +391,45 @@ static bool bxf_send_clock(struct cgpu_info *bitfury, struct bitfury_info *info,
 	return bxf_send_msg(bitfury, buf, C_BXF_CLOCK);
 }
 
+/* The BXF firmware filters results against a 32 bit share target. Keep the
+ * filter at a power of two of the capped pool difficulty so every returned
+ * nonce still stands for an exact number of diff 1 nonces and the rate
+ * estimation in bitfury_rate stays correct. */
+static void bxf_set_work_diff(struct cgpu_info *bitfury, struct bitfury_info *info,
+			      double diff)
+{
+	char buf[64];
+	int pow2 = 0;
+
+	while (diff >= 2 && pow2 < 20) {
+		diff /= 2;
+		pow2++;
+	}
+	if ((1 << pow2) == info->filter_diff)
+		return;
+	sprintf(buf, "target %08x\n", 0xffffffffU >> pow2);
+	if (!bxf_send_msg(bitfury, buf, C_BXF_TARGET))
+		return;
+	mutex_lock(&info->lock);
+	info->filter_diff = 1 << pow2;
+	mutex_unlock(&info->lock);
+	applog(LOG_INFO, "%s %d: On-device filter difficulty set to %d",
+	       bitfury->drv->name, bitfury->device_id, info->filter_diff);
+}
+
+static void bitfury_set_work_diff(struct cgpu_info *bitfury, double diff)
+{
+	struct bitfury_info *info = bitfury->device_data;
+
+	switch(info->ident) {
+		case IDENT_BXF:
+			bxf_set_work_diff(bitfury, info, diff);
+		case IDENT_BF1:
+		default:
+			break;
+	}
+}
+
 static void parse_bxf_temp(struct cgpu_info *bitfury, struct bitfury_info *info, char *buf)
 {
 	int decitemp;
@@ -518,12 +561,13 @@ static void *bxf_get_results(void *userdata)
 
 	snprintf(threadname, 24, "bxf_recv/%d", bitfury->device_id);
 
-	/* We operate the device at lowest diff since it's not a lot of results
-	 * to process and gives us a better indicator of the nonce return rate
-	 * and hardware errors. */
+	/* Start the device at lowest diff for the best indication of the
+	 * nonce return rate; set_work_diff raises the on-device filter once
+	 * the pool share difficulty is known. */
 	sprintf(buf, "target ffffffff\n");
 	if (!bxf_send_msg(bitfury, buf, C_BXF_TARGET))
 		goto out;
+	info->filter_diff = 1;
 
 	/* Read thread sends the first work item to get the device started
 	 * since it will roll ntime and make work itself from there on. */
@@ -609,6 +653,7 @@ static uint32_t decnonce(uint32_t in)
 #define BT_OFFSETS 3
 const uint32_t bf_offsets[] = {-0x800000, 0, -0x400000};
 
+#ifndef HAVE_SHA256D80_4WAY
 static bool bitfury_checkresults(struct thr_info *thr, struct work *work, uint32_t nonce)
 {
 	int i;
@@ -623,6 +668,74 @@ static bool bitfury_checkresults(struct thr_info *thr, struct work *work, uint32
 	}
 	return false;
 }
+#else
+/* More queued works than this cannot accumulate in the few seconds before
+ * they are aged out */
+#define BF1_MAX_WORKS 32
+
+/* As bitfury_checkresults but across a set of works: generate every
+ * work/offset transform of the candidate nonce up front and verify them
+ * four double hashes at a time, in the same order of likelihood as the
+ * scalar path tries them. */
+static bool bitfury_checkresults4(struct thr_info *thr, struct work **works,
+				  int nworks, uint32_t nonce)
+{
+	struct work *cwork[BF1_MAX_WORKS * BT_OFFSETS];
+	uint32_t cnonce[BF1_MAX_WORKS * BT_OFFSETS];
+	unsigned char flipped[4][80], hashes[4][32];
+	const unsigned char *head[4];
+	unsigned char *hash[4];
+	int n = 0, i, j, l;
+
+	for (i = 0; i < nworks; i++) {
+		for (j = 0; j < BT_OFFSETS; j++) {
+			cwork[n] = works[i];
+			cnonce[n++] = nonce + bf_offsets[j];
+		}
+	}
+
+	for (l = 0; l < 4; l++) {
+		head[l] = flipped[l];
+		hash[l] = hashes[l];
+	}
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		for (l = 0; l < 4; l++) {
+			struct work *work = cwork[i + l];
+			uint32_t *work_nonce = (uint32_t *)(work->data + 64 + 12);
+
+			*work_nonce = htole32(cnonce[i + l]);
+			flip80(flipped[l], work->data);
+		}
+
+		sha256d80_4way(head, hash);
+
+		for (l = 0; l < 4; l++) {
+			struct work *work = cwork[i + l];
+			uint32_t *work_nonce = (uint32_t *)(work->data + 64 + 12);
+			uint32_t *hash_32 = (uint32_t *)(work->hash + 28);
+
+			/* The same work appears in several lanes so restore
+			 * this lane's nonce and hash before judging it */
+			*work_nonce = htole32(cnonce[i + l]);
+			memcpy(work->hash, hashes[l], 32);
+			if (*hash_32 == 0) {
+				submit_tested_work(thr, work);
+				return true;
+			}
+		}
+	}
+
+	/* Tail that doesn't fill all four lanes */
+	for (; i < n; i++) {
+		if (test_nonce(cwork[i], cnonce[i])) {
+			submit_tested_work(thr, cwork[i]);
+			return true;
+		}
+	}
+	return false;
+}
+#endif
 
 static int64_t bitfury_rate(struct bitfury_info *info)
 {
@@ -711,6 +824,22 @@ out:
 		nonce = decnonce(nonce);
 
 		rd_lock(&bitfury->qlock);
+#ifdef HAVE_SHA256D80_4WAY
+		{
+			struct work *works[BF1_MAX_WORKS];
+			int nworks = 0;
+
+			HASH_ITER(hh, bitfury->queued_work, work, tmp) {
+				works[nworks++] = work;
+				if (nworks >= BF1_MAX_WORKS)
+					break;
+			}
+			if (bitfury_checkresults4(thr, works, nworks, nonce)) {
+				info->nonces++;
+				found = true;
+			}
+		}
+#else
 		HASH_ITER(hh, bitfury->queued_work, work, tmp) {
 			if (bitfury_checkresults(thr, work, nonce)) {
 				info->nonces++;
@@ -718,6 +847,7 @@ out:
 				break;
 			}
 		}
+#endif
 		rd_unlock(&bitfury->qlock);
 
 		if (!found) {
@@ -755,7 +885,9 @@ static int64_t bxf_scan(struct cgpu_info *bitfury, struct bitfury_info *info)
 	int aged;
 
 	bxf_update_work(bitfury, info);
-	cgsleep_ms(600);
+	/* Results arrive via the read thread; let the hash loop wait out the
+	 * rest of the cycle on the restart condition */
+	cgpu_set_deadline(bitfury, 600);
 
 	mutex_lock(&info->lock);
 	ret = bitfury_rate(info);
@@ -842,6 +974,7 @@ static void bitfury_flush_work(struct cgpu_info *bitfury)
 			bxf_send_flush(bitfury);
 			bxf_update_work(bitfury, info);
 			bxf_update_work(bitfury, info);
+			device_flushed(bitfury);
 		case IDENT_BF1:
 		default:
 			break;
@@ -992,6 +1125,8 @@ struct device_drv bitfury_drv = {
 	.scanwork = bitfury_scanwork,
 	.flush_work = bitfury_flush_work,
 	.update_work = bitfury_update_work,
+	.set_work_diff = bitfury_set_work_diff,
+	.max_diff = 64.0, // Cap the on-device filter so the rate estimate keeps enough samples
 	.get_api_stats = bitfury_api_stats,
 	.get_statline_before = bitfury_get_statline_before,
 	.reinit_device = bitfury_init,
@@ -58,6 +58,7 @@ struct bitfury_info {
 	int filtered_hw[2]; // Hardware errors we're told about but are filtered
 	int job[2]; // Completed jobs we're told about
 	int submits[2]; // Submitted responses
+	int filter_diff; // On-device result filter difficulty currently set
 };
 
 #endif /* BITFURY_H */
@@ -757,19 +757,22 @@ cleanup:
 	return successful_results;
 }
 
-static void drillbit_send_work_to_chip(struct thr_info *thr, struct drillbit_chip_info *chip)
+/* Get new work for a chip and write the work request without waiting for the
+   acknowledgement, so requests for several chips can be put on the wire
+   back to back. Returns the work sent, or NULL if nothing was sent. */
+static struct work *drillbit_chip_start_work(struct thr_info *thr, struct drillbit_chip_info *chip)
 {
 	struct cgpu_info *drillbit = thr->cgpu;
 	struct work *work;
 	char cmd;
 	char buf[SZ_SERIALISED_WORKREQUEST];
-	int amount, i;
+	int amount;
 
 	/* Get some new work for the chip */
 	work = get_queue_work(thr, drillbit, thr->id);
 	if (unlikely(thr->work_restart)) {
 		work_completed(drillbit, work);
-		return;
+		return NULL;
 	}
 
 	drvlog(LOG_DEBUG, "Sending work to chip_id %d", chip->chip_id);
@@ -780,6 +783,16 @@ static void drillbit_send_work_to_chip(struct thr_info *thr, struct drillbit_chi
 	usb_write_timeout(drillbit, &cmd, 1, &amount, TIMEOUT, C_BF_REQWORK);
 	usb_write_timeout(drillbit, buf, SZ_SERIALISED_WORKREQUEST, &amount, TIMEOUT, C_BF_REQWORK);
 
+	return work;
+}
+
+/* Collect the acknowledgement for a previously written work request and
+   record the work against the chip */
+static void drillbit_chip_finish_work(struct thr_info *thr, struct drillbit_chip_info *chip, struct work *work)
+{
+	struct cgpu_info *drillbit = thr->cgpu;
+	int i;
+
 	/* Expect a single 'W' byte as acknowledgement */
 	usb_read_simple_response(drillbit, 'W', C_BF_REQWORK);
 	if (chip->state == WORKING_NOQUEUED)
@@ -803,24 +816,56 @@ static void drillbit_send_work_to_chip(struct thr_info *thr, struct drillbit_chi
 	chip->work_sent_count++;
 }
 
+static void drillbit_send_work_to_chip(struct thr_info *thr, struct drillbit_chip_info *chip)
+{
+	struct work *work;
+
+	work = drillbit_chip_start_work(thr, chip);
+	if (work)
+		drillbit_chip_finish_work(thr, chip, work);
+}
+
 static int64_t drillbit_scanwork(struct thr_info *thr)
 {
 	struct cgpu_info *drillbit = thr->cgpu;
 	struct drillbit_info *info = drillbit->device_data;
 	struct drillbit_chip_info *chip;
+	struct drillbit_chip_info *pending_chip[256]; // num_chips is a uint8_t
+	struct work *pending_work[256];
+	struct work *work;
 	struct timeval tv_now;
-	int amount, i, j, ms_diff, result_count = 0;;
+	int amount, i, j, ms_diff, pending = 0, result_count = 0;;
 	char buf[200];
 
-	/* send work to an any chip without queued work */
+	/* send work to any chip without queued work - write all the requests
+	 * before collecting the acknowledgements so the board only pays one
+	 * usb turnaround for the lot rather than one per chip */
 	for (i = 0; i < info->num_chips; i++) {
 		if (info->chips[i].state != WORKING_QUEUED) {
-			drillbit_send_work_to_chip(thr, &info->chips[i]);
+			work = drillbit_chip_start_work(thr, &info->chips[i]);
+			if (!work) // work restart
+				break;
+			pending_chip[pending] = &info->chips[i];
+			pending_work[pending++] = work;
 		}
 		if (unlikely(thr->work_restart) || unlikely(drillbit->usbinfo.nodev))
+			break;
+	}
+
+	/* Collect the acks in order - the firmware answers commands in sequence */
+	for (i = 0; i < pending; i++) {
+		if (unlikely(thr->work_restart) || unlikely(drillbit->usbinfo.nodev)) {
+			/* The reset/shutdown path won't be coming back for these */
+			for (; i < pending; i++)
+				work_completed(drillbit, pending_work[i]);
 			goto cascade;
+		}
+		drillbit_chip_finish_work(thr, pending_chip[i], pending_work[i]);
 	}
 
+	if (unlikely(thr->work_restart) || unlikely(drillbit->usbinfo.nodev))
+		goto cascade;
+
 	/* check for any chips that have timed out on sending results */
 	cgtime(&tv_now);
 	for (i = 0; i < info->num_chips; i++) {
@@ -229,8 +229,10 @@ static bool hfa_reset(struct cgpu_info *hashfast, struct hashfast_info *info)
 	uint8_t hcrc;
 	bool ret;
 
-	/* Hash clock rate in Mhz */
-	info->hash_clock_rate = opt_hfa_hash_clock ? opt_hfa_hash_clock : 550;
+	/* Hash clock rate in Mhz, preserved across resets once set so a
+	 * governor chosen clock survives thermal and failure resets */
+	if (!info->hash_clock_rate)
+		info->hash_clock_rate = opt_hfa_hash_clock ? opt_hfa_hash_clock : 550;
 	info->group_ntime_roll = opt_hfa_ntime_roll ? opt_hfa_ntime_roll : 1;
 	info->core_ntime_roll = 1;
 
@@ -291,6 +293,7 @@ tryagain:
 	// Save device configuration
 	info->asic_count = h->chip_address;
 	info->core_count = h->core_address;
+	chip_stats_init(hashfast, info->asic_count);
 	info->device_type = (uint8_t)h->hdata;
 	info->ref_frequency = (uint8_t)(h->hdata >> 8);
 	info->hash_sequence_head = 0;
@@ -397,6 +400,13 @@ static bool hfa_detect_common(struct cgpu_info *hashfast)
 	if (!info->works)
 		quit(1, "Failed to calloc info works in hfa_detect_common");
 
+	/* Let the clock governor explore ten percent either side of the
+	 * configured clock */
+	hashfast->gov_min_clock = info->hash_clock_rate - info->hash_clock_rate / 10;
+	hashfast->gov_max_clock = info->hash_clock_rate + info->hash_clock_rate / 10;
+	hashfast->gov_step = 5;
+	hashfast->gov_clock = info->hash_clock_rate;
+
 	return true;
 }
 
@@ -474,6 +484,14 @@ static struct cgpu_info *hfa_detect_one(libusb_device *dev, struct usb_find_devi
 	return hashfast;
 }
 
+static void hfa_set_clock(struct cgpu_info *hashfast, int clock)
+{
+	struct hashfast_info *info = hashfast->device_data;
+
+	/* Picked up and applied by the scanwork thread */
+	info->new_clock_rate = clock;
+}
+
 static void hfa_detect(bool hotplug)
 {
 	/* Set up the CRC tables only once. */
@@ -636,6 +654,7 @@ static void hfa_parse_nonce(struct thr_info *thr, struct cgpu_info *hashfast,
 			if ((n->nonce & 0xffff0000) == 0x42420000)		// XXX REMOVE THIS
 				break;						// XXX PHONEY EMULATOR NONCE
 			submit_noffset_nonce(thr, work, n->nonce, n->ntime & HF_NTIME_MASK);	// XXX Return value from submit_nonce is error if set
+			chip_result(hashfast, h->chip_address);
 			if (unlikely(n->ntime & HF_NONCE_SEARCH)) {
 				/* This tells us there is another share in the
 				 * next 128 nonces */
@@ -826,6 +845,31 @@ static int hfa_jobs(struct hashfast_info *info)
 	return ret;
 }
 
+/* How many times the device may roll this work's ntime on its own. The
+ * core's per work roll budget (zero for work that must not be rolled) minus
+ * the work's age bounds the staleness, --hfa-ntime-roll acts as a ceiling
+ * when given (1 disables rolling entirely), and the nonce reply ntime field
+ * bounds what can be reported back. Block changes are already handled by
+ * OP_WORK_RESTART aborting whatever is rolling on the device. */
+static uint16_t hfa_ntime_roll(struct work *work)
+{
+	struct timeval now;
+	int roll;
+
+	if (opt_hfa_ntime_roll == 1)
+		return 0;
+	roll = work->drv_rolllimit;
+	cgtime(&now);
+	roll -= now.tv_sec - work->tv_staged.tv_sec;
+	if (roll < 0)
+		roll = 0;
+	if (opt_hfa_ntime_roll > 1 && roll > opt_hfa_ntime_roll)
+		roll = opt_hfa_ntime_roll;
+	if (roll > HF_NTIME_MASK)
+		roll = HF_NTIME_MASK;
+	return roll;
+}
+
 static int64_t hfa_scanwork(struct thr_info *thr)
 {
 	struct cgpu_info *hashfast = thr->cgpu;
@@ -839,6 +883,22 @@ static int64_t hfa_scanwork(struct thr_info *thr)
 		return -1;
 	}
 
+	/* Apply a pending governor clock change from the device's own
+	 * thread - the clock is programmed in the USB_INIT exchange so it
+	 * takes a reset to change */
+	if (unlikely(info->new_clock_rate)) {
+		info->hash_clock_rate = info->new_clock_rate;
+		info->new_clock_rate = 0;
+		applog(LOG_NOTICE, "HFA %d: Resetting for new hash clock %d Mhz",
+		       hashfast->device_id, info->hash_clock_rate);
+		hfa_send_shutdown(hashfast);
+		if (unlikely(!hfa_reset(hashfast, info))) {
+			applog(LOG_ERR, "HFA %d: Failed to reset for new clock, disabling",
+			       hashfast->device_id);
+			return -1;
+		}
+	}
+
 	if (unlikely(thr->work_restart)) {
 restart:
 		thr->work_restart = false;
@@ -851,6 +911,7 @@ restart:
 				return -1;
 			}
 		}
+		device_flushed(hashfast);
 	}
 
 	jobs = hfa_jobs(info);
@@ -885,7 +946,7 @@ restart:
 		op_hash_data.bits = *p++;
 		op_hash_data.starting_nonce = 0;
 		op_hash_data.nonce_loops = 0;
-		op_hash_data.ntime_loops = 0;
+		op_hash_data.ntime_loops = hfa_ntime_roll(work);
 
 		/* Set the number of leading zeroes to look for based on diff.
 		 * Diff 1 = 32, Diff 2 = 33, Diff 4 = 34 etc. */
@@ -1062,6 +1123,7 @@ struct device_drv hashfast_drv = {
 	.scanwork = hfa_scanwork,
 	.get_api_stats = hfa_api_stats,
 	.get_statline_before = hfa_statline_before,
+	.set_clock = hfa_set_clock,
 	.reinit_device = hfa_init,
 	.thread_shutdown = hfa_shutdown,
 };
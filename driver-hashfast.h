@@ -80,6 +80,7 @@ struct hashfast_info {
 	struct hf_long_statistics *die_statistics;  // Array of per-die error counters
 	struct hf_long_usb_stats1 stats1;
 	int hash_clock_rate;                        // Hash clock rate to use, in Mhz
+	int new_clock_rate;                         // Clock governor request, applied by a reset from the scanwork thread
 	struct hf_usb_init_base usb_init_base;      // USB Base information from USB_INIT
 	struct hf_config_data config_data;          // Configuration data used from USB_INIT
 	int core_bitmap_size;                       // in bytes
@@ -148,6 +148,14 @@ ASSERT1(sizeof(uint32_t) == 4);
 
 static struct timeval history_sec = { HISTORY_SEC, 0 };
 
+// Continuously adapting estimate of the seconds per hash:
+// the exponential smoothing weight, the minimum hashes in a sample for
+// it to be worth using, and how many samples before trusting it enough
+// to set the read timeout from it
+#define EWMA_WEIGHT 16.0
+#define EWMA_MIN_HASHES 0x08000000
+#define EWMA_MIN_VALUES 8
+
 // Store the last INFO_HISTORY data sets
 // [0] = current data, not yet ready to be included as an estimate
 // Each new data set throws the last old set off the end thus
@@ -198,6 +206,12 @@ struct ICARUS_INFO {
 	enum timing_mode timing_mode;
 	bool do_icarus_timing;
 
+	// Continuously adapting seconds per hash estimate - tracks the
+	// device if its clocking drifts or is changed while mining
+	double Hs_ewma;
+	uint32_t ewma_values;
+	bool ewma_timing;
+
 	double fullnonce;
 	int count;
 	double W;
@@ -512,38 +526,15 @@ static const char *timing_mode_str(enum timing_mode timing_mode)
 	}
 }
 
-static void set_timing_mode(int this_option_offset, struct cgpu_info *icarus)
+/* Apply a timing setting string (the same format as --icarus-timing takes
+ * per device) to a device. Called at startup and from pgaset so timing can
+ * be retuned live without a restart. */
+static void icarus_apply_timing(struct cgpu_info *icarus, const char *buf)
 {
 	struct ICARUS_INFO *info = (struct ICARUS_INFO *)(icarus->device_data);
 	enum sub_ident ident;
 	double Hs;
-	char buf[BUFSIZ+1];
-	char *ptr, *comma, *eq;
-	size_t max;
-	int i;
-
-	if (opt_icarus_timing == NULL)
-		buf[0] = '\0';
-	else {
-		ptr = opt_icarus_timing;
-		for (i = 0; i < this_option_offset; i++) {
-			comma = strchr(ptr, ',');
-			if (comma == NULL)
-				break;
-			ptr = comma + 1;
-		}
-
-		comma = strchr(ptr, ',');
-		if (comma == NULL)
-			max = strlen(ptr);
-		else
-			max = comma - ptr;
-
-		if (max > BUFSIZ)
-			max = BUFSIZ;
-		strncpy(buf, ptr, max);
-		buf[max] = '\0';
-	}
+	char *eq;
 
 	ident = usb_ident(icarus);
 	switch (ident) {
@@ -577,12 +568,14 @@ static void set_timing_mode(int this_option_offset, struct cgpu_info *icarus)
 
 		info->timing_mode = MODE_SHORT;
 		info->do_icarus_timing = true;
+		info->ewma_timing = true;
 	} else if (strncasecmp(buf, MODE_SHORT_STREQ, strlen(MODE_SHORT_STREQ)) == 0) {
 		// short=limit
 		info->read_time = ICARUS_READ_COUNT_TIMING;
 
 		info->timing_mode = MODE_SHORT;
 		info->do_icarus_timing = true;
+		info->ewma_timing = true;
 
 		info->read_time_limit = atoi(&buf[strlen(MODE_SHORT_STREQ)]);
 		if (info->read_time_limit < 0)
@@ -595,12 +588,14 @@ static void set_timing_mode(int this_option_offset, struct cgpu_info *icarus)
 
 		info->timing_mode = MODE_LONG;
 		info->do_icarus_timing = true;
+		info->ewma_timing = true;
 	} else if (strncasecmp(buf, MODE_LONG_STREQ, strlen(MODE_LONG_STREQ)) == 0) {
 		// long=limit
 		info->read_time = ICARUS_READ_COUNT_TIMING;
 
 		info->timing_mode = MODE_LONG;
 		info->do_icarus_timing = true;
+		info->ewma_timing = true;
 
 		info->read_time_limit = atoi(&buf[strlen(MODE_LONG_STREQ)]);
 		if (info->read_time_limit < 0)
@@ -623,6 +618,8 @@ static void set_timing_mode(int this_option_offset, struct cgpu_info *icarus)
 
 		info->timing_mode = MODE_VALUE;
 		info->do_icarus_timing = false;
+		// The user pinned the timing - don't adapt it
+		info->ewma_timing = false;
 	} else {
 		// Anything else in buf just uses DEFAULT mode
 
@@ -631,6 +628,9 @@ static void set_timing_mode(int this_option_offset, struct cgpu_info *icarus)
 		if ((eq = strchr(buf, '=')) != NULL)
 			info->read_time = atoi(eq+1) * ICARUS_WAIT_TIMEOUT;
 
+		// Adapt the timing unless an explicit read_time was given
+		info->ewma_timing = (info->read_time < ICARUS_READ_COUNT_MIN);
+
 		if (info->read_time < ICARUS_READ_COUNT_MIN)
 			info->read_time = SECTOMS(info->fullnonce) - ICARUS_READ_REDUCE;
 
@@ -643,6 +643,10 @@ static void set_timing_mode(int this_option_offset, struct cgpu_info *icarus)
 
 	info->min_data_count = MIN_DATA_COUNT;
 
+	/* Restart timing collection from scratch so samples gathered under
+	 * the previous mode cannot skew the new one */
+	memset(&info->history, 0, sizeof(info->history));
+
 	// All values are in multiples of ICARUS_WAIT_TIMEOUT
 	info->read_time_limit *= ICARUS_WAIT_TIMEOUT;
 
@@ -652,6 +656,39 @@ static void set_timing_mode(int this_option_offset, struct cgpu_info *icarus)
 			info->read_time, info->read_time_limit, info->Hs);
 }
 
+static void set_timing_mode(int this_option_offset, struct cgpu_info *icarus)
+{
+	char buf[BUFSIZ+1];
+	char *ptr, *comma;
+	size_t max;
+	int i;
+
+	if (opt_icarus_timing == NULL)
+		buf[0] = '\0';
+	else {
+		ptr = opt_icarus_timing;
+		for (i = 0; i < this_option_offset; i++) {
+			comma = strchr(ptr, ',');
+			if (comma == NULL)
+				break;
+			ptr = comma + 1;
+		}
+
+		comma = strchr(ptr, ',');
+		if (comma == NULL)
+			max = strlen(ptr);
+		else
+			max = comma - ptr;
+
+		if (max > BUFSIZ)
+			max = BUFSIZ;
+		strncpy(buf, ptr, max);
+		buf[max] = '\0';
+	}
+
+	icarus_apply_timing(icarus, buf);
+}
+
 static uint32_t mask(int work_division)
 {
 	uint32_t nonce_mask = 0x7fffffff;
@@ -1187,7 +1224,7 @@ static int64_t icarus_scanwork(struct thr_info *thr)
 	}
 #endif
 
-	if (opt_debug || info->do_icarus_timing)
+	if (opt_debug || info->do_icarus_timing || info->ewma_timing)
 		timersub(&tv_finish, &tv_start, &elapsed);
 
 	applog(LOG_DEBUG, "%s%d: nonce = 0x%08x = 0x%08lX hashes (%ld.%06lds)",
@@ -1195,6 +1232,42 @@ static int64_t icarus_scanwork(struct thr_info *thr)
 			nonce, (long unsigned int)hash_count,
 			elapsed.tv_sec, elapsed.tv_usec);
 
+	// Continuously track the observed seconds per hash so the read
+	// timeout follows the device if its clocking drifts or is changed
+	// while mining, even after (or without) the history based estimate
+	// settling. Samples from small nonce ranges are skipped as too noisy.
+	if (info->ewma_timing
+	&&  !was_hw_error
+	&&  ((nonce & info->nonce_mask) > END_CONDITION)
+	&&  ((nonce & info->nonce_mask) < (info->nonce_mask & ~END_CONDITION))
+	&&  hash_count >= EWMA_MIN_HASHES) {
+		double hs_sample = ((double)(elapsed.tv_sec)
+					+ ((double)(elapsed.tv_usec))/((double)1000000)
+					- ((double)ICARUS_READ_TIME(info->baud))
+					- info->W) / (double)hash_count;
+
+		if (hs_sample > 0) {
+			if (info->ewma_values++ == 0)
+				info->Hs_ewma = hs_sample;
+			else
+				info->Hs_ewma += (hs_sample - info->Hs_ewma) / EWMA_WEIGHT;
+
+			// Only drive the timing from the EWMA once it has
+			// enough samples and the history estimator isn't
+			// still converging
+			if (!info->do_icarus_timing && info->ewma_values >= EWMA_MIN_VALUES) {
+				fullnonce = info->W + info->Hs_ewma * (((double)0xffffffff) + 1);
+				read_time = SECTOMS(fullnonce) - ICARUS_READ_REDUCE;
+				if (info->read_time_limit > 0 && read_time > info->read_time_limit)
+					read_time = info->read_time_limit;
+				if (unlikely(read_time < ICARUS_READ_COUNT_MIN))
+					read_time = ICARUS_READ_COUNT_MIN;
+				info->Hs = info->Hs_ewma;
+				info->read_time = read_time;
+			}
+		}
+	}
+
 	// Ignore possible end condition values ... and hw errors
 	// TODO: set limitations on calculated values depending on the device
 	// to avoid crap values caused by CPU/Task Switching/Swapping/etc
@@ -1278,6 +1351,9 @@ static int64_t icarus_scanwork(struct thr_info *thr)
 
 			info->Hs = Hs;
 			info->read_time = read_time;
+			// Reseed the adaptive estimate from the better
+			// history based one
+			info->Hs_ewma = Hs;
 
 			info->fullnonce = fullnonce;
 			info->count = count;
@@ -1328,6 +1404,9 @@ static struct api_data *icarus_api_stats(struct cgpu_info *cgpu)
 	root = api_add_uint(root, "timing_values", &(info->history[0].values), false);
 	root = api_add_const(root, "timing_mode", timing_mode_str(info->timing_mode), false);
 	root = api_add_bool(root, "is_timing", &(info->do_icarus_timing), false);
+	root = api_add_hs(root, "Hs_ewma", &(info->Hs_ewma), false);
+	root = api_add_uint(root, "ewma_values", &(info->ewma_values), false);
+	root = api_add_bool(root, "ewma_timing", &(info->ewma_timing), false);
 	root = api_add_int(root, "baud", &(info->baud), false);
 	root = api_add_int(root, "work_division", &(info->work_division), false);
 	root = api_add_int(root, "fpga_count", &(info->fpga_count), false);
@@ -1365,14 +1444,27 @@ static char *icarus_set(struct cgpu_info *cgpu, char *option, char *setting, cha
 	struct ICARUS_INFO *info = (struct ICARUS_INFO *)(cgpu->device_data);
 	int val;
 
-	if (info->ident != IDENT_CMR2) {
-		strcpy(replybuf, "no set options available");
+	if (strcasecmp(option, "help") == 0) {
+		if (info->ident == IDENT_CMR2)
+			sprintf(replybuf, "clock: range %d-%d timing: default|short[=limit]|long[=limit]|<Hs ns>[=read_time]",
+					  ICARUS_CMR2_SPEED_MIN_INT, ICARUS_CMR2_SPEED_MAX_INT);
+		else
+			sprintf(replybuf, "timing: default|short[=limit]|long[=limit]|<Hs ns>[=read_time]");
 		return replybuf;
 	}
 
-	if (strcasecmp(option, "help") == 0) {
-		sprintf(replybuf, "clock: range %d-%d",
-				  ICARUS_CMR2_SPEED_MIN_INT, ICARUS_CMR2_SPEED_MAX_INT);
+	if (strcasecmp(option, "timing") == 0) {
+		if (!setting || !*setting) {
+			sprintf(replybuf, "missing timing setting");
+			return replybuf;
+		}
+
+		icarus_apply_timing(cgpu, setting);
+		return NULL;
+	}
+
+	if (info->ident != IDENT_CMR2) {
+		sprintf(replybuf, "Unknown option: %s", option);
 		return replybuf;
 	}
 
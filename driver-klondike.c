@@ -94,6 +94,12 @@ static const char *msg_reply = "Reply";
 // However give up after 8s
 #define LATE_UPDATE_NODEV_MS ((int)(8.0 * 1000))
 
+// Work replies carry the same status payload so explicit status polls
+// are skipped while they keep the telemetry fresh, and back off from
+// STATS_MIN_MS to STATS_MAX_MS while the values stay stable
+#define STATS_MIN_MS ((int)(2 * 1000))
+#define STATS_MAX_MS ((int)(30 * 1000))
+
 struct device_drv klondike_drv;
 
 typedef struct klondike_header {
@@ -249,6 +255,13 @@ struct klondike_info {
 	int wque_size;
 	int wque_cleared;
 
+	// Adaptive telemetry polling
+	struct timeval tv_last_stats;
+	int stats_interval_ms;
+	uint8_t last_temp;
+	uint8_t last_fanspeed;
+	uint8_t last_errorcount;
+
 	bool initialised;
 };
 
@@ -582,9 +595,11 @@ static KLIST *SendCmdGetReply(struct cgpu_info *klncgpu, KLINE *kline, int datal
 	return GetReply(klncgpu, kline->hd.cmd, kline->hd.dev);
 }
 
-static bool klondike_get_stats(struct cgpu_info *klncgpu)
+// Unconditionally poll every device for its status
+static bool klondike_poll_stats(struct cgpu_info *klncgpu)
 {
 	struct klondike_info *klninfo = (struct klondike_info *)(klncgpu->device_data);
+	uint8_t temp, fanspeed, errorcount;
 	KLIST *kitem;
 	KLINE kline;
 	int slaves, dev;
@@ -617,9 +632,63 @@ static bool klondike_get_stats(struct cgpu_info *klncgpu)
 					klncgpu->drv->name, klncgpu->device_id, dev);
 		}
 	}
+
+	// Back off the poll rate while the telemetry is stable so the bus
+	// time goes to work and nonces instead
+	rd_lock(&(klninfo->stat_lock));
+	temp = klninfo->status[0].kline.ws.temp;
+	fanspeed = klninfo->status[0].kline.ws.fanspeed;
+	errorcount = klninfo->status[0].kline.ws.errorcount;
+	rd_unlock(&(klninfo->stat_lock));
+	if (abs((int)temp - (int)(klninfo->last_temp)) <= 1 &&
+	    fanspeed == klninfo->last_fanspeed &&
+	    errorcount == klninfo->last_errorcount) {
+		klninfo->stats_interval_ms *= 2;
+		if (klninfo->stats_interval_ms > STATS_MAX_MS)
+			klninfo->stats_interval_ms = STATS_MAX_MS;
+	} else
+		klninfo->stats_interval_ms = STATS_MIN_MS;
+	klninfo->last_temp = temp;
+	klninfo->last_fanspeed = fanspeed;
+	klninfo->last_errorcount = errorcount;
+	cgtime(&(klninfo->tv_last_stats));
+
 	return true;
 }
 
+/* The watchdog calls this every few seconds but the work replies already
+ * carry the same status payload, so only spend bus time on an explicit poll
+ * when the replies have gone quiet and the adaptive interval has passed */
+static bool klondike_get_stats(struct cgpu_info *klncgpu)
+{
+	struct klondike_info *klninfo = (struct klondike_info *)(klncgpu->device_data);
+	struct timeval now;
+	int slaves, dev;
+	bool fresh;
+
+	if (klncgpu->usbinfo.nodev || klninfo->status == NULL)
+		return false;
+
+	cgtime(&now);
+	rd_lock(&(klninfo->stat_lock));
+	slaves = klninfo->status[0].kline.ws.slavecount;
+	fresh = true;
+	for (dev = 0; dev <= slaves; dev++)
+		if (ms_tdiff(&now, &(klninfo->jobque[dev].last_update)) > STATS_MIN_MS) {
+			fresh = false;
+			break;
+		}
+	rd_unlock(&(klninfo->stat_lock));
+
+	if (fresh)
+		return true;
+
+	if (ms_tdiff(&now, &(klninfo->tv_last_stats)) < klninfo->stats_interval_ms)
+		return true;
+
+	return klondike_poll_stats(klncgpu);
+}
+
 // TODO: this only enables the master (no slaves)
 static bool kln_enable(struct cgpu_info *klncgpu)
 {
@@ -735,7 +804,7 @@ static bool klondike_init(struct cgpu_info *klncgpu)
 			kitem = release_kitem(klncgpu, kitem);
 		}
 	}
-	klondike_get_stats(klncgpu);
+	klondike_poll_stats(klncgpu);
 	klninfo->initialised = true;
 	for (dev = 0; dev <= slaves; dev++) {
 		klninfo->devinfo[dev].rangesize = ((uint64_t)1<<32) / klninfo->status[dev].kline.ws.chipcount;
@@ -778,6 +847,7 @@ static struct cgpu_info *klondike_detect_one(struct libusb_device *dev, struct u
 	if (unlikely(!klninfo))
 		quit(1, "Failed to calloc klninfo in klondke_detect_one");
 	klncgpu->device_data = (void *)klninfo;
+	klninfo->stats_interval_ms = STATS_MIN_MS;
 
 	klninfo->free = new_klist_set(klncgpu);
 
@@ -948,6 +1018,8 @@ static void *klondike_get_replies(void *userdata)
 	int err, recd, slaves, dev, isc;
 	bool overheat, sent;
 
+	set_sched_prio(opt_rt_read_prio);
+
 	applog(LOG_DEBUG, "%s%i: listening for replies",
 			  klncgpu->drv->name, klncgpu->device_id);
 
@@ -1040,6 +1112,15 @@ static void *klondike_get_replies(void *userdata)
 						cgtime(&(klninfo->jobque[dev].last_update));
 						slaves = klninfo->status[0].kline.ws.slavecount;
 						overheat = klninfo->jobque[dev].overheat;
+						// The reply carries a full status
+						// payload - piggyback it so the
+						// telemetry stays fresh without
+						// explicit status polls, unless
+						// its slavecount looks like garbage
+						if (dev != 0 || kitem->kline.ws.slavecount == slaves)
+							memcpy((void *)(&(klninfo->status[dev])),
+								(void *)kitem,
+								sizeof(klninfo->status[dev]));
 						if (dev == 0) {
 							if (kitem->kline.ws.slavecount != slaves)
 								isc = ++klninfo->incorrect_slave_sequential;
@@ -1152,6 +1233,7 @@ static void klondike_flush_work(struct cgpu_info *klncgpu)
 				kitem = release_kitem(klncgpu, kitem);
 			}
 		}
+		device_flushed(klncgpu);
 	}
 }
 
@@ -1298,7 +1380,7 @@ static bool klondike_queue_full(struct cgpu_info *klncgpu)
 			if (seq < LATE_UPDATE_LIMIT) {
 				applog(LOG_DEBUG, "%s%i:%d late update",
 						klncgpu->drv->name, klncgpu->device_id, dev);
-				klondike_get_stats(klncgpu);
+				klondike_poll_stats(klncgpu);
 				goto que;
 			} else {
 				applog(LOG_WARNING, "%s%i:%d late update (%d) reached - attempting reset",
@@ -1306,7 +1388,7 @@ static bool klondike_queue_full(struct cgpu_info *klncgpu)
 						    dev, LATE_UPDATE_LIMIT);
 				control_init(klncgpu);
 				kln_enable(klncgpu);
-				klondike_get_stats(klncgpu);
+				klondike_poll_stats(klncgpu);
 				rd_lock(&(klninfo->stat_lock));
 				howlong = ms_tdiff(&now, &(klninfo->jobque[dev].last_update));
 				if (howlong > LATE_UPDATE_MS) {
@@ -1337,7 +1419,7 @@ tryagain:
 				if ((queued == MAX_WORK_COUNT-2) &&
 				    ms_tdiff(&now, &(klninfo->jobque[dev].last_update)) > (LATE_UPDATE_MS/2)) {
 					rd_unlock(&(klninfo->stat_lock));
-					klondike_get_stats(klncgpu);
+					klondike_poll_stats(klncgpu);
 					goto tryagain;
 				}
 				if (temp <= KLN_COOLED_DOWN) {
@@ -1383,7 +1465,9 @@ static int64_t klondike_scanwork(struct thr_info *thr)
 	if (klncgpu->usbinfo.nodev)
 		return -1;
 
-	restart_wait(thr, 200);
+	/* Pace the scan cycle via the hash loop rather than sleeping here,
+	 * so hash accounting below isn't delayed behind the wait */
+	cgpu_set_deadline(klncgpu, 200);
 	if (klninfo->status != NULL) {
 		rd_lock(&(klninfo->stat_lock));
 		slaves = klninfo->status[0].kline.ws.slavecount;
@@ -1534,6 +1618,7 @@ static struct api_data *klondike_api_stats(struct cgpu_info *klncgpu)
 
 	root = api_add_int(root, "WQue Size", &(klninfo->wque_size), true);
 	root = api_add_int(root, "WQue Cleared", &(klninfo->wque_cleared), true);
+	root = api_add_int(root, "Stats Interval ms", &(klninfo->stats_interval_ms), true);
 
 	rd_unlock(&(klninfo->stat_lock));
 
@@ -108,9 +108,11 @@ struct spi_response {
 				  sizeof(struct spi_request)	\
 				)
 
-static struct spi_request spi_txbuf[MAX_REQUESTS_IN_BATCH];
+/* Double buffered: the spi thread transfers one buffer while the scanwork
+ * thread processes the responses in the other */
+static struct spi_request spi_txbuf[2][MAX_REQUESTS_IN_BATCH];
 
-#define MAX_RESPONSES_IN_BATCH	( (sizeof(spi_txbuf) - 12) /	\
+#define MAX_RESPONSES_IN_BATCH	( (sizeof(spi_txbuf[0]) - 12) /	\
 				   sizeof(struct spi_response)	\
 				)
 
@@ -133,7 +135,12 @@ struct spi_rx_t {
 	struct spi_response responses[MAX_RESPONSES_IN_BATCH];
 };
 
-static struct spi_rx_t spi_rxbuf;
+static struct spi_rx_t spi_rxbuf[2];
+
+/* Flush commands get their own buffers so they can't trample a transfer
+ * the spi thread has in flight */
+static struct spi_request flush_txbuf;
+static struct spi_rx_t flush_rxbuf;
 
 struct active_work {
 	struct work *work;
@@ -180,6 +187,14 @@ struct knc_state {
 	unsigned int last_hour_shares_index[MAX_ASICS][256];
 	unsigned int last_hour_hwerrs_index[MAX_ASICS][256];
 
+	/* Double buffered SPI transfer engine */
+	pthread_t spi_thr;
+	cgsem_t spi_kick;
+	cgsem_t spi_done;
+	int spi_buf;		/* buffer the spi thread is transferring */
+	int spi_len;		/* length returned by that transfer */
+	bool spi_pending;	/* a kicked transfer not yet collected */
+
 	pthread_mutex_t lock;
 };
 
@@ -291,6 +306,9 @@ static void spi_free(struct spidev_context *ctx)
 	free(ctx);
 }
 
+/* Serialises bus access between the spi thread and the flush path */
+static pthread_mutex_t spi_bus_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int spi_transfer(struct spidev_context *ctx, uint8_t *txbuf,
 			uint8_t *rxbuf, int len)
 {
@@ -310,12 +328,34 @@ static int spi_transfer(struct spidev_context *ctx, uint8_t *txbuf,
 	xfr.cs_change = 0;
 	xfr.pad = 0;
 
+	mutex_lock(&spi_bus_lock);
 	if (1 > (ret = ioctl(ctx->fd, SPI_IOC_MESSAGE(1), &xfr)))
 		applog(LOG_ERR, "KnC spi xfer: ioctl error on SPI device: %m");
+	mutex_unlock(&spi_bus_lock);
 
 	return ret;
 }
 
+/* Runs the SPI transactions so the bus is busy while the scanwork thread
+ * is still processing the previous response buffer */
+static void *knc_spi_thread(void *arg)
+{
+	struct knc_state *knc = arg;
+
+	pthread_detach(pthread_self());
+
+	while (42) {
+		cgsem_wait(&knc->spi_kick);
+		knc->spi_len = spi_transfer(knc->ctx,
+					    (uint8_t *)spi_txbuf[knc->spi_buf],
+					    (uint8_t *)&spi_rxbuf[knc->spi_buf],
+					    sizeof(spi_txbuf[0]));
+		cgsem_post(&knc->spi_done);
+	}
+
+	return NULL;
+}
+
 static void stats_zero_data_if_curindex_updated(unsigned int *data, unsigned int *index, unsigned int cur_index)
 {
 	if (cur_index != *index) {
@@ -506,16 +546,14 @@ static void knc_work_from_queue_to_spi(struct knc_state *knc,
 		buf_to[i] = le32toh(buf_from[3 - i - 1]);
 }
 
-static int64_t knc_process_response(struct thr_info *thr, struct cgpu_info *cgpu,
-				    struct spi_rx_t *rxbuf)
+/* Account the works the FPGA accepted, moving them from queued_fifo to
+   active_fifo. Must run before the next request batch is marshalled so the
+   accepted works aren't resubmitted under stale work ids. */
+static void knc_absorb_accepted(struct knc_state *knc, struct spi_rx_t *rxbuf)
 {
-	struct knc_state *knc = cgpu->device_data;
-	int submitted, successful, i, num_sent;
-	int next_read_q, next_read_a;
+	int submitted, i, num_sent;
+	int next_read_q;
 	struct timeval now;
-	struct timespec ts_now;
-	struct work *work;
-	int64_t us;
 
 	num_sent = knc->write_q - knc->read_q - 1;
 	if (knc->write_q <= knc->read_q)
@@ -523,7 +561,6 @@ static int64_t knc_process_response(struct thr_info *thr, struct cgpu_info *cgpu
 
 	knc->next_work_id += rxbuf->works_accepted;
 
-	/* Actually process SPI response */
 	if (rxbuf->works_accepted) {
 		applog(LOG_DEBUG, "KnC spi: raw response %08X %08X",
 		       ((uint32_t *)rxbuf)[0], ((uint32_t *)rxbuf)[1]);
@@ -534,7 +571,6 @@ static int64_t knc_process_response(struct thr_info *thr, struct cgpu_info *cgpu
 	}
 	/* move works_accepted number of items from queued_fifo to active_fifo */
 	gettimeofday(&now, NULL);
-	clock_gettime(CLOCK_MONOTONIC, &ts_now);
 	submitted = 0;
 
 	for (i = 0; i < rxbuf->works_accepted; ++i) {
@@ -557,6 +593,20 @@ static int64_t knc_process_response(struct thr_info *thr, struct cgpu_info *cgpu
 		       "KnC: accepted by FPGA %u works, but only %d submitted",
 		       rxbuf->works_accepted, submitted);
 	}
+}
+
+static int64_t knc_process_response(struct thr_info *thr, struct cgpu_info *cgpu,
+				    struct spi_rx_t *rxbuf)
+{
+	struct knc_state *knc = cgpu->device_data;
+	int successful, i;
+	int next_read_a;
+	struct timeval now;
+	struct timespec ts_now;
+	struct work *work;
+	int64_t us;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts_now);
 
 	/* check for completed works and calculated nonces */
 	gettimeofday(&now, NULL);
@@ -677,10 +727,11 @@ static int _internal_knc_flush_fpga(struct knc_state *knc)
 {
 	int len;
 
-	spi_txbuf[0].cmd = CMD_FLUSH_QUEUE;
-	spi_txbuf[0].queue_id = 0; /* at the moment we have one and only queue #0 */
-	len = spi_transfer(knc->ctx, (uint8_t *)spi_txbuf,
-			   (uint8_t *)&spi_rxbuf, sizeof(struct spi_request));
+	memset(&flush_txbuf, 0, sizeof(flush_txbuf));
+	flush_txbuf.cmd = CMD_FLUSH_QUEUE;
+	flush_txbuf.queue_id = 0; /* at the moment we have one and only queue #0 */
+	len = spi_transfer(knc->ctx, (uint8_t *)&flush_txbuf,
+			   (uint8_t *)&flush_rxbuf, sizeof(struct spi_request));
 	if (len != sizeof(struct spi_request))
 		return -1;
 
@@ -725,11 +776,16 @@ static bool knc_detect_one(struct spidev_context *ctx)
 	knc->write_d = 1;
 	knc->salt = rand();
 	mutex_init(&knc->lock);
+	cgsem_init(&knc->spi_kick);
+	cgsem_init(&knc->spi_done);
 
 	memset(knc->hwerr_work_id, 0xFF, sizeof(knc->hwerr_work_id));
 
 	_internal_knc_flush_fpga(knc);
 
+	if (unlikely(pthread_create(&knc->spi_thr, NULL, knc_spi_thread, knc)))
+		quit(1, "Failed to create KnC spi thread");
+
 	cgpu->drv = &knc_drv;
 	cgpu->name = "KnCminer";
 	cgpu->threads = 1;	// .. perhaps our number of devices?
@@ -781,44 +837,60 @@ static int64_t knc_scanwork(struct thr_info *thr)
 {
 	struct cgpu_info *cgpu = thr->cgpu;
 	struct knc_state *knc = cgpu->device_data;
-	int len, num, next_read_q;
-	int64_t ret;
+	int num, next_read_q, buf, nbuf;
+	bool waited = false, response = false;
+	int64_t ret = 0;
 
 	applog(LOG_DEBUG, "KnC running scanwork");
 
 	knc_check_disabled_cores(knc);
 
+	/* Collect the transfer kicked off last cycle */
+	buf = knc->spi_buf;
+	if (knc->spi_pending) {
+		cgsem_wait(&knc->spi_done);
+		knc->spi_pending = false;
+		waited = true;
+		if (knc->spi_len == (int)sizeof(spi_rxbuf[buf]))
+			response = true;
+	}
+
 	num = 0;
 
 	mutex_lock(&knc->lock);
-	/* Prepare tx buffer */
-	memset(spi_txbuf, 0, sizeof(spi_txbuf));
+	/* Account the accepted works before marshalling the next batch so
+	 * they aren't resubmitted under stale work ids */
+	if (response)
+		knc_absorb_accepted(knc, &spi_rxbuf[buf]);
+
+	/* Prepare tx buffer in the other buffer and put it on the bus,
+	 * then process the previous responses while it is in flight */
+	nbuf = buf ^ 1;
+	memset(spi_txbuf[nbuf], 0, sizeof(spi_txbuf[nbuf]));
 	next_read_q = knc->read_q;
 	knc_queued_fifo_inc_idx(&next_read_q);
 
 	while (next_read_q != knc->write_q) {
 		knc_work_from_queue_to_spi(knc, &knc->queued_fifo[next_read_q],
-					   &spi_txbuf[num], knc->next_work_id + num);
+					   &spi_txbuf[nbuf][num], knc->next_work_id + num);
 		knc_queued_fifo_inc_idx(&next_read_q);
 		++num;
 	}
-	/* knc->read_q is advanced in knc_process_response, not here.
-	 * knc->next_work_id is advanced in knc_process_response as well,
+	/* knc->read_q is advanced in knc_absorb_accepted, not here.
+	 * knc->next_work_id is advanced in knc_absorb_accepted as well,
 	 *   because only after SPI response we know how many works were actually
 	 *   consumed by FPGA.
 	 */
-
-	len = spi_transfer(knc->ctx, (uint8_t *)spi_txbuf,
-			   (uint8_t *)&spi_rxbuf, sizeof(spi_txbuf));
-	if (len != sizeof(spi_rxbuf)) {
-		ret = -1;
-		goto out_unlock;
-	}
+	knc->spi_buf = nbuf;
+	knc->spi_pending = true;
+	cgsem_post(&knc->spi_kick);
 
 	applog(LOG_DEBUG, "KnC spi: %d works in request", num);
 
-	ret = knc_process_response(thr, cgpu, &spi_rxbuf);
-out_unlock:
+	if (response)
+		ret = knc_process_response(thr, cgpu, &spi_rxbuf[buf]);
+	else if (waited)
+		ret = -1; /* transfer failed */
 	mutex_unlock(&knc->lock);
 
 	return ret;
@@ -884,9 +956,12 @@ static void knc_flush_work(struct cgpu_info *cgpu)
 	}
 
 	len = _internal_knc_flush_fpga(knc);
-	if (len > 0)
-		knc_process_response(NULL, cgpu, &spi_rxbuf);
+	if (len > 0) {
+		knc_absorb_accepted(knc, &flush_rxbuf);
+		knc_process_response(NULL, cgpu, &flush_rxbuf);
+	}
 	mutex_unlock(&knc->lock);
+	device_flushed(cgpu);
 }
 
 struct device_drv knc_drv = {
@@ -328,17 +328,88 @@ static bool get_status(struct cgpu_info *modminer, char *msg, enum usb_cmds cmd)
 	return get_status_timeout(modminer, msg, USE_DEFAULT_TIMEOUT, cmd);
 }
 
-static bool modminer_fpga_upload_bitstream(struct cgpu_info *modminer)
+// It must be 32 bytes according to MCU legacy.c
+#define WRITE_SIZE 32
+// How many WRITE_SIZE chunks to stream before draining their status
+// replies - each chunk generates one status byte
+#define WRITE_BATCH 8
+
+// mutex must always be locked before calling
+// Read and verify the status bytes of count streamed program chunks
+static bool get_status_batch(struct cgpu_info *modminer, int count, char *msg, enum usb_cmds cmd)
+{
+	char buf[WRITE_BATCH];
+	int err, amount, i;
+
+	err = usb_read(modminer, buf, count, &amount, cmd);
+
+	if (err < 0 || amount != count) {
+		mutex_unlock(modminer->modminer_mutex);
+
+		applog(LOG_ERR, "%s%u: Error (%d:%d) getting %s replies",
+			modminer->drv->name, modminer->device_id, amount, err, msg);
+
+		return false;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (buf[i] != 1) {
+			mutex_unlock(modminer->modminer_mutex);
+
+			applog(LOG_ERR, "%s%u: Error, invalid %s reply %d (was %d should be 1)",
+				modminer->drv->name, modminer->device_id, msg, i, buf[i]);
+
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Bitstream uploads for separate devices already run concurrently since
+ * each runs in its own mining thread's init, but programming is the peak
+ * power draw of a ModMiner and a rig full of them starting at once can
+ * brown out a shared hub. Uploads on separate buses proceed fully in
+ * parallel; uploads sharing a bus are staggered to at most
+ * MODMINER_FLASH_PER_BUS at a time, the rest waiting here. */
+#define MODMINER_FLASH_PER_BUS 3
+
+static pthread_mutex_t flash_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flash_cond = PTHREAD_COND_INITIALIZER;
+static int flash_on_bus[256];
+
+static void flash_slot_get(struct cgpu_info *modminer)
+{
+	uint8_t bus = modminer->usbinfo.bus_number;
+
+	mutex_lock(&flash_lock);
+	while (flash_on_bus[bus] >= MODMINER_FLASH_PER_BUS)
+		pthread_cond_wait(&flash_cond, &flash_lock);
+	flash_on_bus[bus]++;
+	mutex_unlock(&flash_lock);
+}
+
+static void flash_slot_put(struct cgpu_info *modminer)
+{
+	mutex_lock(&flash_lock);
+	flash_on_bus[modminer->usbinfo.bus_number]--;
+	pthread_cond_broadcast(&flash_cond);
+	mutex_unlock(&flash_lock);
+}
+
+static bool modminer_fpga_upload_bitstream(struct cgpu_info *modminer, unsigned char *usercode)
 {
 	const char *bsfile = BITSTREAM_FILENAME;
 	char buf[0x100], *p;
 	char devmsg[64];
 	unsigned char *ubuf = (unsigned char *)buf;
-	unsigned long totlen, len;
-	size_t buflen, remaining;
+	unsigned long totlen, len, devcode;
+	size_t buflen, chunklen, left, remaining;
+	int pending;
 	float nextmsg, upto;
 	char fpgaid = FPGAID_ALL;
 	int err, amount, tries;
+	bool flashing = false;
 	char *ptr;
 
 	FILE *f = open_bitstream("modminer", bsfile);
@@ -418,6 +489,19 @@ static bool modminer_fpga_upload_bitstream(struct cgpu_info *modminer)
 
 	applog(LOG_DEBUG, " Version: %lu, build %lu", (fwusercode >> 8) & 0xff, fwusercode & 0xff);
 
+	devcode = (unsigned long)usercode[0] | ((unsigned long)usercode[1] << 8) |
+		  ((unsigned long)usercode[2] << 16) | ((unsigned long)usercode[3] << 24);
+
+	if (devcode == fwusercode) {
+		// The FPGA already runs this bitstream image so a reupload
+		// would just cost minutes of mining
+		applog(LOG_WARNING, "%s%u: FPGA is already programmed with %s (usercode %08lx), skipping upload",
+			modminer->drv->name, modminer->device_id, bsfile, fwusercode);
+
+		fclose(f);
+		return true;
+	}
+
 	if (!get_expect(modminer, f, 'b'))
 		goto undame;
 
@@ -462,6 +546,10 @@ static bool modminer_fpga_upload_bitstream(struct cgpu_info *modminer)
 	if (ptr)
 		*ptr = '\0';
 
+	flash_slot_get(modminer);
+	flashing = true;
+	modminer->flash_progress = 1;
+
 	applog(LOG_WARNING, "%s%u: Programming all FPGA on %s ... Mining will not start until complete",
 		modminer->drv->name, modminer->device_id, devmsg);
 
@@ -484,13 +572,12 @@ static bool modminer_fpga_upload_bitstream(struct cgpu_info *modminer)
 	if (!get_status(modminer, "initialise", C_STARTPROGRAMSTATUS))
 		goto undame;
 
-// It must be 32 bytes according to MCU legacy.c
-#define WRITE_SIZE 32
-
 	totlen = len;
 	nextmsg = 0.1;
 	while (len > 0) {
-		buflen = len < WRITE_SIZE ? len : WRITE_SIZE;
+		// Stream a batch of chunks then drain their status replies in
+		// one read, rather than a status round trip per chunk
+		buflen = len < (WRITE_SIZE * WRITE_BATCH) ? len : (WRITE_SIZE * WRITE_BATCH);
 		if (fread(buf, buflen, 1, f) != 1) {
 			mutex_unlock(modminer->modminer_mutex);
 
@@ -500,38 +587,51 @@ static bool modminer_fpga_upload_bitstream(struct cgpu_info *modminer)
 			goto dame;
 		}
 
-		tries = 0;
+		pending = 0;
 		ptr = buf;
-		remaining = buflen;
-		while ((err = usb_write(modminer, ptr, remaining, &amount, C_PROGRAM)) < 0 || amount != (int)remaining) {
-			if (err == LIBUSB_ERROR_TIMEOUT && amount > 0 && ++tries < 4) {
-				remaining -= amount;
-				ptr += amount;
-
-				if (opt_debug)
-					applog(LOG_DEBUG, "%s%u: Program timeout (%d:%d) sent %d tries %d",
-						modminer->drv->name, modminer->device_id,
-						amount, err, (int)remaining, tries);
-
-				if (!get_status(modminer, "write status", C_PROGRAMSTATUS2))
-					goto dame;
-
-			} else {
-				mutex_unlock(modminer->modminer_mutex);
+		left = buflen;
+		while (left > 0) {
+			chunklen = left < WRITE_SIZE ? left : WRITE_SIZE;
+			tries = 0;
+			remaining = chunklen;
+			while ((err = usb_write(modminer, ptr, remaining, &amount, C_PROGRAM)) < 0 || amount != (int)remaining) {
+				if (err == LIBUSB_ERROR_TIMEOUT && amount > 0 && ++tries < 4) {
+					remaining -= amount;
+					ptr += amount;
+
+					if (opt_debug)
+						applog(LOG_DEBUG, "%s%u: Program timeout (%d:%d) sent %d tries %d",
+							modminer->drv->name, modminer->device_id,
+							amount, err, (int)remaining, tries);
+
+					// Drain the statuses owed so far so the
+					// MCU can make progress
+					if (pending) {
+						if (!get_status_batch(modminer, pending, "write status", C_PROGRAMSTATUS2))
+							goto dame;
+						pending = 0;
+					}
+				} else {
+					mutex_unlock(modminer->modminer_mutex);
 
-				applog(LOG_ERR, "%s%u: Program failed (%d:%d) sent %d",
-					modminer->drv->name, modminer->device_id, amount, err, (int)remaining);
+					applog(LOG_ERR, "%s%u: Program failed (%d:%d) sent %d",
+						modminer->drv->name, modminer->device_id, amount, err, (int)remaining);
 
-				goto dame;
+					goto dame;
+				}
 			}
+			ptr += remaining;
+			left -= chunklen;
+			pending++;
 		}
 
-		if (!get_status(modminer, "write status", C_PROGRAMSTATUS))
+		if (!get_status_batch(modminer, pending, "write status", C_PROGRAMSTATUS))
 			goto dame;
 
 		len -= buflen;
 
 		upto = (float)(totlen - len) / (float)(totlen);
+		modminer->flash_progress = upto * 100;
 		if (upto >= nextmsg) {
 			applog(LOG_WARNING,
 				"%s%u: Programming %.1f%% (%lu out of %lu)",
@@ -547,6 +647,9 @@ static bool modminer_fpga_upload_bitstream(struct cgpu_info *modminer)
 	applog(LOG_WARNING, "%s%u: Programming completed for all FPGA on %s",
 		modminer->drv->name, modminer->device_id, devmsg);
 
+	modminer->flash_progress = 0;
+	flash_slot_put(modminer);
+
 	// Give it a 2/3s delay after programming
 	cgsleep_ms(666);
 
@@ -558,6 +661,10 @@ undame:
 	mutex_unlock(modminer->modminer_mutex);
 	;
 dame:
+	if (flashing) {
+		modminer->flash_progress = 0;
+		flash_slot_put(modminer);
+	}
 	fclose(f);
 	return false;
 }
@@ -710,10 +817,12 @@ static bool modminer_fpga_init(struct thr_info *thr)
 	}
 
 	if (memcmp(buf, BISTREAM_USER_ID, 4)) {
-		applog(LOG_ERR, "%s%u: FPGA not programmed",
+		applog(LOG_DEBUG, "%s%u: FPGA usercode doesn't match the shipped bitstream",
 			modminer->drv->name, modminer->device_id);
 
-		if (!modminer_fpga_upload_bitstream(modminer))
+		// The bitstream file knows its own usercode, so upload can
+		// still be skipped if the FPGA already runs the same image
+		if (!modminer_fpga_upload_bitstream(modminer, buf))
 			return false;
 
 		mutex_unlock(modminer->modminer_mutex);
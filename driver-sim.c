@@ -0,0 +1,222 @@
+/*
+ * Virtual ASIC simulator for load testing the work scheduling and share
+ * submission paths without racks of hardware. Each simulated device pulls
+ * real staged work, keeps a configurable queue of it, burns simulated time
+ * at a configurable hashrate with USB-like latency jitter and emits shares
+ * as a Poisson process at the statistically correct diff 1 rate, including
+ * a configurable fraction of hardware errors.
+ *
+ * The shares are not real solutions - finding one would cost the 2^32
+ * hashes being simulated - so only point this at a pool that does not
+ * mind, but they travel the full submission path with a hash drawn from
+ * the correct diff 1 distribution, so pool difficulty filtering, share
+ * diff accounting and the network paths all see realistic load.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "miner.h"
+
+int opt_sim_devices;
+int opt_sim_mhs = 1000;
+int opt_sim_latency = 50;
+int opt_sim_error = 1;
+int opt_sim_queue = 2;
+
+#define SIM_QUEUE_MAX 8
+
+struct sim_info {
+	struct work *works[SIM_QUEUE_MAX];
+	int nworks;
+	uint32_t rng;
+	/* Poisson arrival state, in units of expected shares */
+	double credit;
+	double next_gap;
+	/* Work consumed but not yet retired, in nonce ranges */
+	double work_debt;
+	struct timeval last;
+};
+
+static uint32_t sim_rand(struct sim_info *info)
+{
+	uint32_t x = info->rng;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	info->rng = x;
+	return x;
+}
+
+/* Uniform (0,1] double from the device rng */
+static double sim_drand(struct sim_info *info)
+{
+	return ((double)sim_rand(info) + 1.0) / 4294967296.0;
+}
+
+static void sim_detect(bool __maybe_unused hotplug)
+{
+	static bool detected;
+	int i;
+
+	if (detected || !opt_sim_devices)
+		return;
+	detected = true;
+
+	for (i = 0; i < opt_sim_devices; i++) {
+		struct cgpu_info *cgpu;
+
+		cgpu = calloc(1, sizeof(*cgpu));
+		if (unlikely(!cgpu))
+			quit(1, "Failed to calloc sim cgpu");
+		cgpu->drv = &sim_drv;
+		cgpu->deven = DEV_ENABLED;
+		cgpu->threads = 1;
+		if (!add_cgpu(cgpu))
+			quit(1, "Failed to add sim cgpu");
+	}
+	applog(LOG_NOTICE, "Created %d simulated device(s) at %d MH/s each",
+	       opt_sim_devices, opt_sim_mhs);
+}
+
+static bool sim_thread_init(struct thr_info *thr)
+{
+	struct cgpu_info *cgpu = thr->cgpu;
+	struct sim_info *info;
+
+	info = calloc(1, sizeof(*info));
+	if (unlikely(!info))
+		quit(1, "Failed to calloc sim info");
+	/* Distinct deterministic stream per device */
+	info->rng = 0x6d696e65 ^ ((uint32_t)cgpu->device_id * 2654435761u) ^ 1;
+	info->next_gap = -log(sim_drand(info));
+	cgpu->device_data = info;
+	return true;
+}
+
+static void sim_flush_queue(struct sim_info *info)
+{
+	while (info->nworks)
+		free_work(info->works[--info->nworks]);
+}
+
+/* Emit one share against a random queued work item. A valid share gets the
+ * nonce written into the work data and a hash drawn uniformly under the
+ * diff 1 target - the distribution real hardware produces - then runs the
+ * normal tested-work submission so pool difficulty filtering and share diff
+ * accounting behave as with real results. An error share goes through
+ * submit_nonce with a random nonce that fails the diff test, exercising the
+ * full hardware error path. */
+static void sim_share(struct thr_info *thr, struct sim_info *info)
+{
+	struct work *work = info->works[sim_rand(info) % info->nworks];
+	uint32_t nonce = sim_rand(info);
+	uint32_t *work_nonce;
+	int i;
+
+	if ((int)(sim_rand(info) % 100) < opt_sim_error) {
+		submit_nonce(thr, work, nonce);
+		return;
+	}
+
+	work_nonce = (uint32_t *)(work->data + 64 + 12);
+	*work_nonce = htole32(nonce);
+	for (i = 0; i < 28; i += 4)
+		*(uint32_t *)(work->hash + i) = sim_rand(info);
+	*(uint32_t *)(work->hash + 28) = 0;
+	submit_tested_work(thr, work);
+}
+
+static int64_t sim_scanwork(struct thr_info *thr)
+{
+	struct cgpu_info *cgpu = thr->cgpu;
+	struct sim_info *info = cgpu->device_data;
+	struct timeval now;
+	double dt, lambda;
+	int64_t hashes;
+	int queue;
+
+	/* A restart invalidates whatever the virtual device had queued */
+	if (thr->work_restart)
+		sim_flush_queue(info);
+
+	queue = opt_sim_queue;
+	if (queue > SIM_QUEUE_MAX)
+		queue = SIM_QUEUE_MAX;
+	if (queue < 1)
+		queue = 1;
+	while (info->nworks < queue)
+		info->works[info->nworks++] = get_work(thr, thr->id);
+
+	/* Next poll after USB-like latency, jittered +/-50% around the mean */
+	cgpu_set_deadline(cgpu, opt_sim_latency / 2 +
+			  sim_rand(info) % (opt_sim_latency | 1));
+
+	cgtime(&now);
+	if (!info->last.tv_sec)
+		copy_time(&info->last, &now);
+	dt = tdiff(&now, &info->last);
+	copy_time(&info->last, &now);
+	if (dt < 0)
+		dt = 0;
+
+	hashes = (double)opt_sim_mhs * 1000000.0 * dt;
+
+	/* Shares arrive as a Poisson process at the diff 1 rate of the
+	 * configured hashrate; arrivals carry over between polls so low
+	 * rates still average out correctly */
+	lambda = (double)hashes / 4294967296.0;
+	info->credit += lambda;
+	while (info->credit >= info->next_gap) {
+		info->credit -= info->next_gap;
+		info->next_gap = -log(sim_drand(info));
+		sim_share(thr, info);
+	}
+
+	/* Retire work at the rate nonce ranges are exhausted so get_work
+	 * sees the demand the simulated hashrate implies */
+	info->work_debt += lambda;
+	while (info->work_debt >= 1 && info->nworks) {
+		free_work(info->works[0]);
+		info->nworks--;
+		memmove(info->works, info->works + 1,
+			info->nworks * sizeof(info->works[0]));
+		info->work_debt -= 1;
+	}
+
+	return hashes;
+}
+
+static void sim_shutdown(struct thr_info *thr)
+{
+	struct cgpu_info *cgpu = thr->cgpu;
+	struct sim_info *info = cgpu->device_data;
+
+	if (info) {
+		sim_flush_queue(info);
+		free(info);
+		cgpu->device_data = NULL;
+	}
+}
+
+struct device_drv sim_drv = {
+	.drv_id = DRIVER_sim,
+	.dname = "Simulator",
+	.name = "SIM",
+	.drv_detect = sim_detect,
+	.thread_init = sim_thread_init,
+	.hash_work = &hash_driver_work,
+	.scanwork = sim_scanwork,
+	/* scanwork only blocks if get_work runs dry, so hundreds of
+	 * simulated devices can share a few executor threads */
+	.shared_thread = true,
+	.thread_shutdown = sim_shutdown,
+};
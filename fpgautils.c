@@ -24,6 +24,9 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #ifndef O_CLOEXEC
 #define O_CLOEXEC 0
 #endif
@@ -592,6 +595,371 @@ int get_serial_cts(int fd)
 	ioctl(fd, TIOCMGET, &flags);
 	return (flags & TIOCM_CTS) ? 1 : 0;
 }
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/* Asynchronous serial engine. The blocking helpers above cost a thread per
+ * device and quantize read timeouts to VTIME deciseconds. Ports registered
+ * here are multiplexed onto one epoll thread instead: received bytes land
+ * in a per-fd ring buffer and are handed to the driver's receive callback
+ * as they arrive, writes are queued in a ring and drained as the port
+ * accepts them, and a one-shot millisecond deadline callback replaces the
+ * VTIME timeout. Callbacks run on the engine thread and must not block. */
+
+#define SERIAL_RING_SIZ 4096
+
+struct serial_ring {
+	char data[SERIAL_RING_SIZ];
+	/* Free running, masked on access */
+	unsigned int head;
+	unsigned int tail;
+};
+
+struct serial_port {
+	int fd;
+	serial_recv_cb on_recv;
+	serial_deadline_cb on_deadline;
+	void *userdata;
+	struct serial_ring rx;
+	struct serial_ring tx;
+	/* Cleared when disarmed or fired */
+	struct timeval deadline;
+	bool want_out;
+	struct serial_port *next;
+};
+
+static pthread_mutex_t serial_engine_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct serial_port *serial_ports;
+static int serial_epfd = -1;
+static int serial_wakefd[2] = { -1, -1 };
+
+static unsigned int ring_len(const struct serial_ring *ring)
+{
+	return ring->tail - ring->head;
+}
+
+static unsigned int ring_space(const struct serial_ring *ring)
+{
+	return SERIAL_RING_SIZ - ring_len(ring);
+}
+
+static void ring_put(struct serial_ring *ring, const char *data, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		ring->data[ring->tail++ & (SERIAL_RING_SIZ - 1)] = data[i];
+}
+
+static struct serial_port *serial_port_find(int fd)
+{
+	struct serial_port *port;
+
+	for (port = serial_ports; port; port = port->next)
+		if (port->fd == fd)
+			break;
+	return port;
+}
+
+/* Kick the engine thread out of epoll_wait so it picks up new ports,
+ * queued writes and rearmed deadlines */
+static void serial_engine_wake(void)
+{
+	if (write(serial_wakefd[1], "W", 1))
+		;
+}
+
+/* Track EPOLLOUT interest only while the transmit ring has data, so an
+ * idle writable port doesn't spin the engine. Engine lock held. */
+static void serial_port_interest(struct serial_port *port)
+{
+	struct epoll_event ev;
+	bool want_out = ring_len(&port->tx) > 0;
+
+	if (want_out == port->want_out)
+		return;
+	port->want_out = want_out;
+	ev.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+	ev.data.fd = port->fd;
+	epoll_ctl(serial_epfd, EPOLL_CTL_MOD, port->fd, &ev);
+}
+
+/* Drain readable bytes into the receive ring and offer the buffered data
+ * to the driver callback, which tells us how much it consumed. A len of
+ * zero with the port readable means the port errored or hung up and the
+ * driver should remove and reopen it. Engine lock held; dropped around
+ * the callback. */
+static void serial_port_recv(struct serial_port *port)
+{
+	char linear[SERIAL_RING_SIZ];
+	struct serial_ring *rx = &port->rx;
+	serial_recv_cb cb = port->on_recv;
+	void *ud = port->userdata;
+	size_t consumed = 0;
+	bool error = false;
+	unsigned int len, i;
+	int fd = port->fd;
+
+	while (ring_space(rx)) {
+		char chunk[256];
+		unsigned int want = ring_space(rx);
+		ssize_t red;
+
+		if (want > sizeof(chunk))
+			want = sizeof(chunk);
+		red = read(fd, chunk, want);
+		if (red <= 0) {
+			if (red == 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+					 errno != EINTR))
+				error = true;
+			break;
+		}
+		ring_put(rx, chunk, red);
+		if ((unsigned int)red < want)
+			break;
+	}
+
+	len = ring_len(rx);
+	if (!len && !error)
+		return;
+	for (i = 0; i < len; i++)
+		linear[i] = rx->data[(rx->head + i) & (SERIAL_RING_SIZ - 1)];
+	mutex_unlock(&serial_engine_lock);
+	cb(fd, linear, len, &consumed, ud);
+	mutex_lock(&serial_engine_lock);
+	/* The callback may have removed the port */
+	port = serial_port_find(fd);
+	if (port) {
+		if (consumed > len)
+			consumed = len;
+		port->rx.head += consumed;
+	}
+}
+
+/* Push queued transmit data at the port. Engine lock held. */
+static void serial_port_send(struct serial_port *port)
+{
+	struct serial_ring *tx = &port->tx;
+
+	while (ring_len(tx)) {
+		char chunk[256];
+		unsigned int len = 0;
+		ssize_t wrote;
+
+		while (len < sizeof(chunk) && len < ring_len(tx)) {
+			chunk[len] = tx->data[(tx->head + len) & (SERIAL_RING_SIZ - 1)];
+			len++;
+		}
+		wrote = write(port->fd, chunk, len);
+		if (wrote <= 0)
+			break;
+		tx->head += wrote;
+		if ((unsigned int)wrote < len)
+			break;
+	}
+	serial_port_interest(port);
+}
+
+static void *serial_engine_thread(void __maybe_unused *userdata)
+{
+	struct epoll_event evs[8];
+
+	pthread_detach(pthread_self());
+	RenameThread("serial");
+
+	while (42) {
+		struct serial_port *port;
+		struct timeval now;
+		int timeout = -1, nev, i;
+
+		mutex_lock(&serial_engine_lock);
+		cgtime(&now);
+		for (port = serial_ports; port; port = port->next) {
+			int left;
+
+			if (!timerisset(&port->deadline))
+				continue;
+			left = ms_tdiff(&port->deadline, &now);
+			if (left < 0)
+				left = 0;
+			if (timeout < 0 || left < timeout)
+				timeout = left;
+		}
+		mutex_unlock(&serial_engine_lock);
+
+		nev = epoll_wait(serial_epfd, evs, 8, timeout);
+		for (i = 0; i < nev; i++) {
+			int fd = evs[i].data.fd;
+
+			if (fd == serial_wakefd[0]) {
+				char c[16];
+
+				while (read(fd, c, sizeof(c)) > 0)
+					;
+				continue;
+			}
+			mutex_lock(&serial_engine_lock);
+			port = serial_port_find(fd);
+			if (port && (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+				serial_port_recv(port);
+			/* recv drops the lock for its callback, revalidate */
+			port = serial_port_find(fd);
+			if (port && (evs[i].events & EPOLLOUT))
+				serial_port_send(port);
+			mutex_unlock(&serial_engine_lock);
+		}
+
+		cgtime(&now);
+		mutex_lock(&serial_engine_lock);
+		for (port = serial_ports; port; ) {
+			serial_deadline_cb cb = port->on_deadline;
+			void *ud = port->userdata;
+			int fd = port->fd;
+
+			if (!timerisset(&port->deadline) ||
+			    time_less(&now, &port->deadline)) {
+				port = port->next;
+				continue;
+			}
+			timerclear(&port->deadline);
+			mutex_unlock(&serial_engine_lock);
+			cb(fd, ud);
+			mutex_lock(&serial_engine_lock);
+			/* The callback may have changed the list, rescan -
+			 * fired deadlines are already cleared */
+			port = serial_ports;
+		}
+		mutex_unlock(&serial_engine_lock);
+	}
+	return NULL;
+}
+
+/* Engine lock held */
+static bool serial_engine_start(void)
+{
+	struct epoll_event ev;
+	pthread_t pth;
+
+	if (serial_epfd != -1)
+		return true;
+	serial_epfd = epoll_create(8);
+	if (serial_epfd == -1)
+		return false;
+	if (pipe(serial_wakefd)) {
+		close(serial_epfd);
+		serial_epfd = -1;
+		return false;
+	}
+	fcntl(serial_wakefd[0], F_SETFL, fcntl(serial_wakefd[0], F_GETFL) | O_NONBLOCK);
+	fcntl(serial_wakefd[1], F_SETFL, fcntl(serial_wakefd[1], F_GETFL) | O_NONBLOCK);
+	ev.events = EPOLLIN;
+	ev.data.fd = serial_wakefd[0];
+	epoll_ctl(serial_epfd, EPOLL_CTL_ADD, serial_wakefd[0], &ev);
+	if (pthread_create(&pth, NULL, serial_engine_thread, NULL))
+		quit(1, "Failed to create serial engine thread");
+	return true;
+}
+
+/* Register an open serial fd with the engine, starting it on first use.
+ * The fd is switched to non-blocking; use serial_engine_write rather than
+ * writing it directly from here on. */
+bool serial_engine_add(int fd, serial_recv_cb on_recv, serial_deadline_cb on_deadline, void *userdata)
+{
+	struct serial_port *port;
+	struct epoll_event ev;
+
+	mutex_lock(&serial_engine_lock);
+	if (!serial_engine_start() || serial_port_find(fd)) {
+		mutex_unlock(&serial_engine_lock);
+		return false;
+	}
+	port = calloc(1, sizeof(*port));
+	if (unlikely(!port))
+		quit(1, "Failed to calloc serial port");
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	port->fd = fd;
+	port->on_recv = on_recv;
+	port->on_deadline = on_deadline;
+	port->userdata = userdata;
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(serial_epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		free(port);
+		mutex_unlock(&serial_engine_lock);
+		return false;
+	}
+	port->next = serial_ports;
+	serial_ports = port;
+	mutex_unlock(&serial_engine_lock);
+	serial_engine_wake();
+	return true;
+}
+
+/* Detach an fd from the engine. The caller still owns and closes the fd.
+ * Safe from the port's own callbacks. */
+void serial_engine_remove(int fd)
+{
+	struct serial_port **pp, *port;
+
+	mutex_lock(&serial_engine_lock);
+	for (pp = &serial_ports; (port = *pp); pp = &port->next) {
+		if (port->fd == fd) {
+			*pp = port->next;
+			epoll_ctl(serial_epfd, EPOLL_CTL_DEL, fd, NULL);
+			free(port);
+			break;
+		}
+	}
+	mutex_unlock(&serial_engine_lock);
+}
+
+/* Queue data for transmission, false if the port is unknown or its
+ * transmit ring cannot hold the whole message */
+bool serial_engine_write(int fd, const void *data, size_t len)
+{
+	struct serial_port *port;
+	bool ret = false;
+
+	mutex_lock(&serial_engine_lock);
+	port = serial_port_find(fd);
+	if (port && ring_space(&port->tx) >= len) {
+		ring_put(&port->tx, data, len);
+		serial_port_interest(port);
+		ret = true;
+	}
+	mutex_unlock(&serial_engine_lock);
+	if (ret)
+		serial_engine_wake();
+	return ret;
+}
+
+/* Arm or refresh the port's one-shot deadline callback ms milliseconds
+ * from now; ms of zero or less disarms it */
+bool serial_engine_deadline(int fd, int ms)
+{
+	struct serial_port *port;
+	bool ret = false;
+
+	mutex_lock(&serial_engine_lock);
+	port = serial_port_find(fd);
+	if (port) {
+		if (ms > 0) {
+			struct timeval t;
+
+			cgtime(&port->deadline);
+			us_to_timeval(&t, (int64_t)ms * 1000);
+			addtime(&t, &port->deadline);
+		} else
+			timerclear(&port->deadline);
+		ret = true;
+	}
+	mutex_unlock(&serial_engine_lock);
+	if (ret)
+		serial_engine_wake();
+	return ret;
+}
+
+#endif // HAVE_SYS_EPOLL_H
 #else
 int get_serial_cts(const int fd)
 {
@@ -79,6 +79,21 @@ extern size_t _select_write(int fd, char *buf, size_t siz, struct timeval *timeo
 
 #define select_close(fd)  close(fd)
 
+#ifdef HAVE_SYS_EPOLL_H
+/* Asynchronous serial engine - see fpgautils.c. Received data is offered
+ * to on_recv from a per-fd ring buffer; *consumed tells the engine how
+ * many leading bytes the driver took, the rest stay buffered for the next
+ * callback. A zero len means the port errored or hung up. on_deadline is
+ * one shot and fires on the engine thread once the armed deadline passes. */
+typedef void (*serial_recv_cb)(int fd, char *buf, size_t len, size_t *consumed, void *userdata);
+typedef void (*serial_deadline_cb)(int fd, void *userdata);
+
+extern bool serial_engine_add(int fd, serial_recv_cb on_recv, serial_deadline_cb on_deadline, void *userdata);
+extern void serial_engine_remove(int fd);
+extern bool serial_engine_write(int fd, const void *data, size_t len);
+extern bool serial_engine_deadline(int fd, int ms);
+#endif // HAVE_SYS_EPOLL_H
+
 #endif // ! WIN32
 
 #endif
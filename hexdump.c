@@ -19,6 +19,10 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* Only tracing builds carry the dump machinery; elsewhere hexdump is an
+ * empty inline the compiler removes along with its arguments */
+#ifdef USE_TRACE
+
 #define hex_print(p) applog(LOG_DEBUG, "%s", p)
 
 static char nibble[] = {
@@ -75,3 +79,12 @@ void hexdump(const uint8_t *p, unsigned int len)
 		hex_print(line);
 	}
 }
+
+#else
+
+static inline void hexdump(__maybe_unused const uint8_t *p,
+			   __maybe_unused unsigned int len)
+{
+}
+
+#endif /* USE_TRACE */
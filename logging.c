@@ -17,6 +17,8 @@
 
 bool opt_debug = false;
 bool opt_log_output = false;
+bool opt_log_async = false;
+bool opt_log_dedup = false;
 
 /* per default priorities higher than LOG_NOTICE are logged */
 int opt_log_level = LOG_NOTICE;
@@ -34,7 +36,7 @@ static void my_log_curses(int prio, const char *datetime, const char *str, bool
 	}
 #ifdef HAVE_CURSES
 	extern bool use_curses;
-	if (use_curses && log_curses_only(prio, datetime, str))
+	if (use_curses && log_curses_only(prio, datetime, str, force))
 		;
 	else
 #endif
@@ -50,7 +52,7 @@ static void my_log_curses(int prio, const char *datetime, const char *str, bool
 /*
  * log function
  */
-void _applog(int prio, const char *str, bool force)
+static void log_direct(int prio, const char *str, bool force)
 {
 #ifdef HAVE_SYSLOG_H
 	if (use_syslog) {
@@ -86,3 +88,144 @@ void _applog(int prio, const char *str, bool force)
 		my_log_curses(prio, datetime, str, force);
 	}
 }
+
+/* Asynchronous logging. Records are already formatted by the applog macros
+ * so producers only timestamp at output time; they push onto a lock free
+ * queue drained by a dedicated writer thread and never touch console_lock,
+ * curses or syslog themselves. If the queue is full the record is dropped
+ * and counted rather than blocking the producer. */
+struct log_entry {
+	int prio;
+	char str[LOGBUFSIZ];
+};
+
+static struct mpsc_q *log_q;
+static unsigned int log_dropped;
+
+static void *log_writer_thread(void __maybe_unused *userdata)
+{
+	struct log_entry *entry;
+	unsigned int dropped;
+
+	pthread_detach(pthread_self());
+	RenameThread("LogWriter");
+
+	while (42) {
+		entry = mpscq_pop(log_q, -1);
+		if (unlikely(!entry))
+			continue;
+		log_direct(entry->prio, entry->str, false);
+		free(entry);
+
+		dropped = log_dropped;
+		if (unlikely(dropped) && __sync_bool_compare_and_swap(&log_dropped, dropped, 0)) {
+			char buf[64];
+
+			snprintf(buf, sizeof(buf), "Log overflowed, %u messages dropped", dropped);
+			log_direct(LOG_WARNING, buf, false);
+		}
+	}
+	return NULL;
+}
+
+/* Called once opt_log_async is parsed, before the mining threads start. If
+ * anything fails we silently stay in synchronous mode. */
+void applog_async_init(void)
+{
+	pthread_t pth;
+
+	log_q = mpscq_new(4096);
+	if (unlikely(!log_q))
+		return;
+	if (unlikely(pthread_create(&pth, NULL, log_writer_thread, NULL)))
+		log_q = NULL;
+}
+
+/* Rate limited deduplication of repeating log messages, keyed by the format
+ * string pointer so suppressed repeats skip formatting entirely. A given
+ * format is emitted at most once per LOG_DEDUP_MS; occurrences inside the
+ * window are counted and reported as a "repeated N times" summary when the
+ * window expires. Colliding formats simply evict each other which only
+ * costs us a missed suppression. */
+#define LOG_DEDUP_SLOTS 64
+#define LOG_DEDUP_MS 1000
+
+struct log_dedup {
+	const char *fmt;
+	struct timeval last;
+	unsigned int count;
+};
+
+static struct log_dedup log_dedup_tab[LOG_DEDUP_SLOTS];
+static pthread_mutex_t log_dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int log_dedup_suppressed;
+static unsigned int log_dedup_summaries;
+
+/* Called by the applog macros before formatting, returning false if this
+ * message should be suppressed */
+bool _applog_dedup(int prio, const char *fmt)
+{
+	struct log_dedup *d = &log_dedup_tab[((uintptr_t)fmt >> 2) % LOG_DEDUP_SLOTS];
+	unsigned int count = 0;
+	struct timeval now;
+
+	cgtime(&now);
+	mutex_lock(&log_dedup_lock);
+	if (d->fmt != fmt) {
+		d->fmt = fmt;
+		d->last = now;
+		d->count = 0;
+	} else if (ms_tdiff(&now, &d->last) < LOG_DEDUP_MS) {
+		d->count++;
+		log_dedup_suppressed++;
+		mutex_unlock(&log_dedup_lock);
+		return false;
+	} else {
+		count = d->count;
+		d->count = 0;
+		d->last = now;
+		if (count)
+			log_dedup_summaries++;
+	}
+	mutex_unlock(&log_dedup_lock);
+
+	if (count) {
+		char tmp[LOGBUFSIZ];
+
+		snprintf(tmp, sizeof(tmp), "Message \"%s\" repeated %u times", fmt, count);
+		_applog(prio, tmp, false);
+	}
+	return true;
+}
+
+/* Snapshot the suppression counters for the API notify report */
+unsigned int applog_dedup_counts(unsigned int *summaries)
+{
+	unsigned int suppressed;
+
+	mutex_lock(&log_dedup_lock);
+	suppressed = log_dedup_suppressed;
+	*summaries = log_dedup_summaries;
+	mutex_unlock(&log_dedup_lock);
+	return suppressed;
+}
+
+void _applog(int prio, const char *str, bool force)
+{
+	/* Forced messages come from the quit/forcelog paths and must hit the
+	 * output directly since the writer thread may never run again. */
+	if (log_q && !force) {
+		struct log_entry *entry = malloc(sizeof(*entry));
+
+		if (likely(entry)) {
+			entry->prio = prio;
+			snprintf(entry->str, sizeof(entry->str), "%s", str);
+			if (likely(mpscq_push(log_q, entry)))
+				return;
+			free(entry);
+		}
+		__sync_add_and_fetch(&log_dropped, 1);
+		return;
+	}
+	log_direct(prio, str, force);
+}
@@ -20,6 +20,8 @@ enum {
 /* debug flags */
 extern bool opt_debug;
 extern bool opt_log_output;
+extern bool opt_log_async;
+extern bool opt_log_dedup;
 extern bool opt_realquiet;
 extern bool want_per_device_stats;
 
@@ -29,15 +31,20 @@ extern int opt_log_level;
 #define LOGBUFSIZ 256
 
 extern void _applog(int prio, const char *str, bool force);
+extern void applog_async_init(void);
+extern bool _applog_dedup(int prio, const char *fmt);
+extern unsigned int applog_dedup_counts(unsigned int *summaries);
 
 #define IN_FMT_FFL " in %s %s():%d"
 
 #define applog(prio, fmt, ...) do { \
 	if (opt_debug || prio != LOG_DEBUG) { \
 		if (use_syslog || opt_log_output || prio <= opt_log_level) { \
-			char tmp42[LOGBUFSIZ]; \
-			snprintf(tmp42, sizeof(tmp42), fmt, ##__VA_ARGS__); \
-			_applog(prio, tmp42, false); \
+			if (!opt_log_dedup || _applog_dedup(prio, fmt)) { \
+				char tmp42[LOGBUFSIZ]; \
+				snprintf(tmp42, sizeof(tmp42), fmt, ##__VA_ARGS__); \
+				_applog(prio, tmp42, false); \
+			} \
 		} \
 	} \
 } while (0)
@@ -45,9 +52,11 @@ extern void _applog(int prio, const char *str, bool force);
 #define applogsiz(prio, _SIZ, fmt, ...) do { \
 	if (opt_debug || prio != LOG_DEBUG) { \
 		if (use_syslog || opt_log_output || prio <= opt_log_level) { \
-			char tmp42[_SIZ]; \
-			snprintf(tmp42, sizeof(tmp42), fmt, ##__VA_ARGS__); \
-			_applog(prio, tmp42, false); \
+			if (!opt_log_dedup || _applog_dedup(prio, fmt)) { \
+				char tmp42[_SIZ]; \
+				snprintf(tmp42, sizeof(tmp42), fmt, ##__VA_ARGS__); \
+				_applog(prio, tmp42, false); \
+			} \
 		} \
 	} \
 } while (0)
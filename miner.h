@@ -239,6 +239,7 @@ static inline int fsync (int fd)
 	DRIVER_ADD_COMMAND(knc) \
 	DRIVER_ADD_COMMAND(drillbit) \
 	DRIVER_ADD_COMMAND(bab) \
+	DRIVER_ADD_COMMAND(sim) \
 	DRIVER_ADD_COMMAND(avalon)
 
 #define DRIVER_PARSE_COMMANDS(DRIVER_ADD_COMMAND) \
@@ -320,6 +321,12 @@ struct device_drv {
 	int64_t (*scanhash)(struct thr_info *, struct work *, int64_t);
 	int64_t (*scanwork)(struct thr_info *);
 
+	/* Set by drivers whose scanwork does not block and that pace
+	 * themselves with cgpu_set_deadline: their devices are serviced by
+	 * the shared polling executor instead of getting a mostly sleeping
+	 * dedicated miner thread each. */
+	bool shared_thread;
+
 	/* Used to extract work from the hash table of queued work and tell
 	 * the main loop that it should not add any further work to the table.
 	 */
@@ -328,11 +335,20 @@ struct device_drv {
 	void (*flush_work)(struct cgpu_info *);
 	/* Tell the driver of an updated work template for eg. stratum */
 	void (*update_work)(struct cgpu_info *);
+	/* Tell the driver the current share difficulty, capped to max_diff,
+	 * so devices that filter results on their own hardware only return
+	 * host-relevant nonces */
+	void (*set_work_diff)(struct cgpu_info *, double diff);
 
 	void (*hw_error)(struct thr_info *);
 	void (*thread_shutdown)(struct thr_info *);
 	void (*thread_enable)(struct thr_info *);
 
+	/* Set the device clock in MHz, for the closed loop clock governor.
+	 * Drivers that support runtime clock changes fill in the cgpu gov_*
+	 * bounds at detection to opt their devices in. */
+	void (*set_clock)(struct cgpu_info *, int);
+
 	// Does it need to be free()d?
 	bool copy;
 
@@ -409,6 +425,48 @@ struct cgminer_pool_stats {
 	uint64_t net_bytes_received;
 };
 
+/* Fixed memory ring of per minute hash/share buckets covering the last
+ * hour, filled in by the watchdog stats pass and dumped raw by the API
+ * 'history' command, so short dips stay visible alongside the smoothed
+ * decay_time rolling averages. */
+#define HISTORY_MINUTES 60
+
+struct hash_bucket {
+	time_t minute;		/* time()/60 this bucket covers, 0 = empty */
+	double mhashes;		/* share diff accepted for pools */
+	int accepted;
+	int rejected;
+};
+
+struct hash_history {
+	struct hash_bucket buckets[HISTORY_MINUTES];
+	/* The stats pass cursors into the cumulative counters */
+	int acc_seen;
+	int rej_seen;
+	double diff_seen;
+};
+
+/* HDR style log linear histogram of latencies in microseconds. Each power of
+ * two range is split into equal width sub buckets giving a roughly constant
+ * 6% relative error. Adds are unlocked; the rare lost update under
+ * concurrent writers and torn reads are tolerated the same as the other
+ * pool statistics. */
+#define LATHIST_OCTAVES 28
+#define LATHIST_SUB 16
+#define LATHIST_BUCKETS (LATHIST_OCTAVES * LATHIST_SUB)
+
+struct lat_hist {
+	uint64_t count;
+	uint64_t sum_us;
+	uint64_t min_us;
+	uint64_t max_us;
+	uint64_t buckets[LATHIST_BUCKETS];
+};
+
+/* Per device cache of prefetched staged work in front of the staging
+ * locks, refilled in batches and stolen from by idle devices */
+#define WCACHE_MAX 8
+
 struct cgpu_info {
 	int cgminer_id;
 	struct device_drv *drv;
@@ -443,18 +501,64 @@ struct cgpu_info {
 	bool nonce_range;
 	bool polling;
 	bool flash_led;
+	struct work *prev_work;
 #endif /* USE_BITFORCE */
 #if defined(USE_BITFORCE) || defined(USE_BFLSC)
 	pthread_mutex_t device_mutex;
 #endif /* USE_BITFORCE || USE_BFLSC */
+	/* Deadline declared via cgpu_set_deadline, honoured by the hash
+	 * loop with a restart interruptible wait after the driver returns */
+	cgtimer_t pace_start;
+	int pace_ms;
+	bool pace_set;
 	enum dev_enable deven;
-	int accepted;
+
+	/* Clock governor bounds and step, filled in by drivers that support
+	 * runtime clock changes, and the governor's hill climbing state */
+	int gov_min_clock;
+	int gov_max_clock;
+	int gov_step;
+	int gov_clock;
+	int gov_dir;
+	double gov_rate;
+	double gov_accepted;
+	int gov_errors;
+	time_t gov_eval_time;
+
+	/* Hot per result accounting, bumped on every share and polled by the
+	 * stats and API paths. Started on a fresh cacheline and followed by
+	 * one so these stores never share a line with the cold configuration
+	 * around them. */
+	int accepted __attribute__((aligned(64)));
 	int rejected;
 	int hw_errors;
+	int diff1;
 	double rolling;
 	double total_mhashes;
 	double utility;
+	double diff_accepted;
+	double diff_rejected;
+	int last_share_pool;
+	time_t last_share_pool_time;
+	double last_share_diff;
+	time_t last_device_valid_work;
+	/* Heartbeat posted as a single word store whenever the device's
+	 * threads report in; read racily by the watchdog. */
+	time_t heartbeat;
+
+	/* Decayed average of work items this device consumes per second,
+	 * driving the adaptive staged work target */
+	double work_rate __attribute__((aligned(64)));
+	struct timeval tv_work_rate;
+	struct hash_history history;
+	struct work *wcache[WCACHE_MAX];
+	int wcache_count;
+	pthread_mutex_t wcache_lock;
 	enum alive status;
+	/* Watchdog deadline wheel linkage, only ever touched by the
+	 * watchdog thread. */
+	struct list_head health_node;
+	time_t health_due;
 	char init[40];
 	struct timeval last_message_tv;
 
@@ -470,14 +574,6 @@ struct cgpu_info {
 	float temp;
 	int cutofftemp;
 
-	int diff1;
-	double diff_accepted;
-	double diff_rejected;
-	int last_share_pool;
-	time_t last_share_pool_time;
-	double last_share_diff;
-	time_t last_device_valid_work;
-
 	time_t device_last_well;
 	time_t device_last_not_well;
 	enum dev_reason device_not_well_reason;
@@ -496,15 +592,42 @@ struct cgpu_info {
 
 	pthread_rwlock_t qlock;
 	struct work *queued_work;
+	/* Same works indexed by (midstate, merkle tail) for result matching */
+	struct work *queued_work_mid;
 	struct work *unqueued_work;
 	unsigned int queued_count;
 
+	/* Time-to-flush measurement: restart_threads stamps the request here
+	 * and the driver closes it via device_flushed() once the on-device
+	 * queue has actually been discarded */
+	struct timeval tv_flush_req;
+	bool flush_pending;
+	double last_flush_ms;
+	double total_flush_ms;
+	int flush_count;
+
+	/* Per chip good nonce counters registered by multichip drivers via
+	 * chip_stats_init, surfaced by the chipstats API command */
+	uint64_t *chip_results;
+	int chip_count;
+
+	/* Percent complete of an in-progress firmware/bitstream upload,
+	 * 0 when none is running */
+	int flash_progress;
+
+	/* Time from the driver reporting a nonce to the verified share being
+	 * handed to the submission queue - see submit_work_async() */
+	struct lat_hist verify_lat;
+
 	bool shutdown;
 
 	struct timeval dev_start_tv;
 };
 
 extern bool add_cgpu(struct cgpu_info*);
+extern void device_flushed(struct cgpu_info *cgpu);
+extern void chip_stats_init(struct cgpu_info *cgpu, int chips);
+extern void chip_result(struct cgpu_info *cgpu, int chip);
 
 struct thread_q {
 	struct list_head	q;
@@ -515,6 +638,53 @@ struct thread_q {
 	pthread_cond_t		cond;
 };
 
+/* Bounded lock free multi producer single consumer queue for hot paths such
+ * as share submission, avoiding the mutex and condvar round trip thread_q
+ * pays per entry. Producers claim a cell with a compare and swap on head and
+ * publish it by advancing the cell's sequence number; tail is only ever
+ * touched by the consumer. The semaphore is purely a wakeup hint - entry
+ * visibility is governed by the cell sequences alone. */
+struct mpsc_cell {
+	void *data;
+	volatile unsigned int seq;
+};
+
+struct mpsc_q {
+	struct mpsc_cell *cells;
+	unsigned int size;
+	unsigned int mask;
+	volatile unsigned int head;
+	unsigned int tail;
+	cgsem_t sem;
+};
+
+/* Optional tracing support built with --enable-trace. The TRACEn macros
+ * compile to USDT probes - attachable from perf, bpftrace or systemtap
+ * without stopping the miner - when sys/sdt.h is present, and to nothing
+ * otherwise. The opt_protocol dumps and hexdump sit under the same gate so
+ * production builds pay literally nothing for tracing until it's wanted. */
+#ifdef USE_TRACE
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE1(name, a) DTRACE_PROBE1(cgminer, name, a)
+#define TRACE2(name, a, b) DTRACE_PROBE2(cgminer, name, a, b)
+#define TRACE3(name, a, b, c) DTRACE_PROBE3(cgminer, name, a, b, c)
+#else
+#define TRACE1(name, a) do {} while (0)
+#define TRACE2(name, a, b) do {} while (0)
+#define TRACE3(name, a, b, c) do {} while (0)
+#endif
+#define PROTO_DUMP(...) do { \
+	if (opt_protocol) \
+		applog(LOG_DEBUG, __VA_ARGS__); \
+} while (0)
+#else
+#define TRACE1(name, a) do {} while (0)
+#define TRACE2(name, a, b) do {} while (0)
+#define TRACE3(name, a, b, c) do {} while (0)
+#define PROTO_DUMP(...) do {} while (0)
+#endif /* USE_TRACE */
+
 struct thr_info {
 	int		id;
 	int		device_thread;
@@ -532,8 +702,22 @@ struct thr_info {
 	bool	getwork;
 	double	rolling;
 
-	bool	work_restart;
+	/* Polled on every scanhash pass by the mining thread and written by
+	 * the control threads, so they live on their own cacheline (the
+	 * aligned stats block below closes it) away from the fields the
+	 * watchdog and getwork paths keep dirtying. */
+	bool	work_restart __attribute__((aligned(64)));
 	bool	work_update;
+
+	/* Hashes counted by this mining thread, bumped with plain stores and
+	 * aggregated into the global stats by the watchdog pass so mining
+	 * threads never touch hash_lock. Padded to its own cacheline to
+	 * avoid false sharing between threads. hashes_seen is the
+	 * aggregator's private cursor for computing deltas. */
+	struct {
+		uint64_t hashes_done;
+		uint64_t hashes_seen;
+	} stats __attribute__((aligned(64)));
 };
 
 struct string_elist {
@@ -863,10 +1047,25 @@ static inline void _cg_ilock(cglock_t *lock, const char *file, const char *func,
 	_mutex_lock(&lock->mutex, file, func, line);
 }
 
+/* Open and close the seqlock write section around a write hold, so
+ * cg_seq readers know the protected data may be inconsistent */
+static inline void __cg_seq_open(cglock_t *lock)
+{
+	lock->seq++;
+	__sync_synchronize();
+}
+
+static inline void __cg_seq_close(cglock_t *lock)
+{
+	__sync_synchronize();
+	lock->seq++;
+}
+
 /* Upgrade intermediate variant to a write lock */
 static inline void _cg_ulock(cglock_t *lock, const char *file, const char *func, const int line)
 {
 	_wr_lock(&lock->rwlock, file, func, line);
+	__cg_seq_open(lock);
 }
 
 /* Write lock variant of cglock */
@@ -874,11 +1073,13 @@ static inline void _cg_wlock(cglock_t *lock, const char *file, const char *func,
 {
 	_mutex_lock(&lock->mutex, file, func, line);
 	_wr_lock(&lock->rwlock, file, func, line);
+	__cg_seq_open(lock);
 }
 
 /* Downgrade write variant to a read lock */
 static inline void _cg_dwlock(cglock_t *lock, const char *file, const char *func, const int line)
 {
+	__cg_seq_close(lock);
 	_wr_unlock_noyield(&lock->rwlock, file, func, line);
 	_rd_lock(&lock->rwlock, file, func, line);
 	_mutex_unlock_noyield(&lock->mutex, file, func, line);
@@ -887,6 +1088,7 @@ static inline void _cg_dwlock(cglock_t *lock, const char *file, const char *func
 /* Demote a write variant to an intermediate variant */
 static inline void _cg_dwilock(cglock_t *lock, const char *file, const char *func, const int line)
 {
+	__cg_seq_close(lock);
 	_wr_unlock(&lock->rwlock, file, func, line);
 }
 
@@ -912,10 +1114,36 @@ static inline void _cg_ruwlock(cglock_t *lock, const char *file, const char *fun
 
 static inline void _cg_wunlock(cglock_t *lock, const char *file, const char *func, const int line)
 {
+	__cg_seq_close(lock);
 	_wr_unlock_noyield(&lock->rwlock, file, func, line);
 	_mutex_unlock(&lock->mutex, file, func, line);
 }
 
+/* Seqlock style read path for read-dominated data under a cglock, for
+ * readers that only copy a few fields out. Unlike cg_rlock this never
+ * writes the lock's cachelines, but the copied data must be treated as
+ * garbage and re-read whenever cg_seq_retry says so:
+ *	do {
+ *		seq = cg_seq_begin(&lock);
+ *		... copy fields out ...
+ *	} while (cg_seq_retry(&lock, seq));
+ * Do not follow pointers that a writer may free inside the loop. */
+static inline unsigned int cg_seq_begin(cglock_t *lock)
+{
+	unsigned int seq;
+
+	while (unlikely((seq = *(volatile unsigned int *)&lock->seq) & 1))
+		sched_yield();
+	__sync_synchronize();
+	return seq;
+}
+
+static inline bool cg_seq_retry(cglock_t *lock, unsigned int seq)
+{
+	__sync_synchronize();
+	return unlikely(*(volatile unsigned int *)&lock->seq != seq);
+}
+
 struct pool;
 
 #define API_MCAST_CODE "FTW"
@@ -929,6 +1157,7 @@ extern char *opt_socks_proxy;
 extern char *cgminer_path;
 extern bool opt_fail_only;
 extern bool opt_lowmem;
+extern bool mem_locked;
 extern bool opt_autofan;
 extern bool opt_autoengine;
 extern bool use_curses;
@@ -943,9 +1172,22 @@ extern char *opt_api_description;
 extern int opt_api_port;
 extern bool opt_api_listen;
 extern bool opt_api_network;
+extern bool opt_clock_gov;
 extern bool opt_delaynet;
+extern int opt_net_timeout;
 extern bool opt_restart;
 extern char *opt_icarus_options;
+#ifdef USE_SIM
+extern int opt_sim_devices;
+extern int opt_sim_mhs;
+extern int opt_sim_latency;
+extern int opt_sim_error;
+extern int opt_sim_queue;
+extern bool opt_bench_pool;
+extern int opt_bench_pool_latency;
+extern char *opt_bench_pool_notify;
+extern int bench_pool_start(void);
+#endif
 extern char *opt_icarus_timing;
 extern bool opt_worktime;
 #ifdef USE_AVALON
@@ -980,7 +1222,15 @@ extern const uint32_t sha256_init_state[];
 extern json_t *json_rpc_call(CURL *curl, const char *url, const char *userpass,
 			     const char *rpc_req, bool, bool, int *,
 			     struct pool *pool, bool);
+extern void json_rpc_start(CURL *curl, struct json_rpc_req *req, const char *url,
+			   const char *userpass, const char *rpc_req,
+			   bool probe, bool longpoll, struct pool *pool,
+			   bool share);
+extern json_t *json_rpc_result(CURL *curl, struct json_rpc_req *req, int perform_rc,
+			       int *rolltime, struct pool *pool);
+extern void curl_share_setup(void);
 #endif
+extern void json_alloc_setup(void);
 extern const char *proxytype(proxytypes_t proxytype);
 extern char *get_proxy(char *url, struct pool *pool);
 extern void __bin2hex(char *s, const unsigned char *p, size_t len);
@@ -996,10 +1246,15 @@ typedef bool (*sha256_func)(struct thr_info*, const unsigned char *pmidstate,
 	uint32_t nonce);
 
 extern bool fulltest(const unsigned char *hash, const unsigned char *target);
+extern bool fulltest_work(const struct work *work);
 
 extern int opt_queue;
 extern int opt_scantime;
 extern int opt_expiry;
+extern int opt_submit_conns;
+extern int opt_rt_read_prio;
+extern int opt_rt_send_prio;
+extern void set_sched_prio(int prio);
 
 extern cglock_t control_lock;
 extern pthread_mutex_t hash_lock;
@@ -1012,6 +1267,7 @@ extern pthread_mutex_t restart_lock;
 extern pthread_cond_t restart_cond;
 
 extern void clear_stratum_shares(struct pool *pool);
+extern void reactor_arm_tx(struct pool *pool, bool arm);
 extern void set_target(unsigned char *dest_target, double diff);
 extern int restart_wait(struct thr_info *thr, unsigned int mstime);
 
@@ -1020,6 +1276,7 @@ extern void kill_work(void);
 extern void reinit_device(struct cgpu_info *cgpu);
 
 extern void api(int thr_id);
+extern void api_event(const char *type, const char *details);
 
 extern struct pool *current_pool(void);
 extern int enabled_pools;
@@ -1053,6 +1310,7 @@ extern struct strategies strategies[];
 extern enum pool_strategy pool_strategy;
 extern int opt_rotate_period;
 extern double total_rolling;
+extern double suggested_share_diff(void);
 extern double total_mhashes_done;
 extern unsigned int new_blocks;
 extern unsigned int found_blocks;
@@ -1070,10 +1328,38 @@ extern uint64_t best_diff;
 extern struct timeval block_timeval;
 extern char *workpadding;
 
+/* Copy of the global stats published by hashmeter() each log interval so
+ * readers such as the API never need to take hash_lock */
+struct stats_snapshot {
+	double total_secs;
+	double total_mhashes_done;
+	double total_rolling;
+	unsigned int found_blocks;
+	int total_getworks;
+	int total_accepted;
+	int total_rejected;
+	int hw_errors;
+	int total_discarded;
+	int total_stale;
+	int total_diff1;
+	unsigned int total_go;
+	unsigned int local_work;
+	unsigned int total_ro;
+	unsigned int new_blocks;
+	double total_diff_accepted;
+	double total_diff_rejected;
+	double total_diff_stale;
+	uint64_t best_diff;
+};
+
+extern struct stats_snapshot *stats_snapshot(void);
+
 struct curl_ent {
 	CURL *curl;
 	struct list_head node;
 	struct timeval tv;
+	/* Preformatted getwork submit request, header hex patched in place */
+	char *gws_buf;
 };
 
 /* Disabled needs to be the lowest enum as a freshly calloced value will then
@@ -1084,24 +1370,75 @@ enum pool_enable {
 	POOL_REJECTING,
 };
 
+/* The few stratum fields that change outside of a notify, or that cheap
+ * checks want without pinning a whole job. The per-job template itself
+ * lives in the immutable struct stratum_job published via pool->sjob. */
 struct stratum_work {
 	char *job_id;
-	char *prev_hash;
-	unsigned char **merkle_bin;
-	char *bbversion;
-	char *nbit;
-	char *ntime;
 	bool clean;
+	/* Bumped with every notify so job identity can be compared without
+	 * touching the job_id string */
+	unsigned int job_seq;
 
+	double diff;
+};
+
+/* Reference counted constants shared by every work item generated from one
+ * mining.notify, so gen_stratum_work hands out references instead of
+ * strduping the same three strings for every work item. */
+/* Shared immutable portion of a work item. For stratum work it carries the
+ * job identity strings handed out by gen_stratum_work; for GBT work the
+ * workid and serialised coinbase. Copies of a work item take a reference
+ * instead of duplicating the strings. */
+struct stratum_job {
+	char *job_id;
+	char *nonce1;
+	char *ntime;
+	char *coinbase;
+	int refcount;
+
+	/* Immutable work generation template built by the notify parser
+	 * outside the data_lock and published with a pointer swap, so
+	 * gen_stratum_work reads a pinned consistent job without ever
+	 * contending with a notify rebuilding it */
+	unsigned char *cb_bin;
 	size_t cb_len;
-	size_t header_len;
+	int nonce2_offset;
+	int n2size;
+	unsigned char header_bin[128];
+	int merkle_offset;
+	/* merkles * 32 bytes, contiguous */
+	unsigned char *merkle_bin;
 	int merkles;
-	double diff;
 };
 
 #define RBUFSIZE 8192
 #define RECVSIZE (RBUFSIZE - 4)
 
+/* Maximum total stratum connections to one pool with --submit-conns */
+#define MAX_SUBMIT_CONNS 4
+
+/* One extra authenticated submit session to the same pool, resuming the
+ * primary session so shares built against it stay valid - see
+ * open_submit_conns() */
+struct submit_conn {
+	SOCKETTYPE sock;
+	char buf[4096];
+	int len;
+	bool active;
+};
+
+/* One outgoing stratum message waiting on the pool socket. The buffer is
+ * allocated with room for the newline the send path appends. */
+struct stratum_msg {
+	struct stratum_msg *next;
+	ssize_t len;
+	char s[];
+};
+
+struct stratum_share;
+struct txn_ent;
+
 struct pool {
 	int pool_no;
 	int prio;
@@ -1114,12 +1451,24 @@ struct pool {
 	int quota;
 	int quota_gcd;
 	int quota_used;
+	/* Configured quota scaled down by measured share conversion under
+	 * loadbalance; 0 means no measurement yet, use quota as is */
+	int quota_eff;
+	double quota_perf;
+	/* Snapshots for the per interval conversion measurements */
+	int qp_accepted;
+	int qp_rejected;
+	unsigned int qp_stale;
+	uint64_t qp_lat_count;
+	uint64_t qp_lat_sum;
 	int works;
 
 	double diff_accepted;
 	double diff_rejected;
 	double diff_stale;
 
+	struct hash_history history;
+
 	bool submit_fail;
 	bool idle;
 	bool lagging;
@@ -1155,9 +1504,10 @@ struct pool {
 	struct thread_q *submit_q;
 	struct thread_q *getwork_q;
 
-	pthread_t longpoll_thread;
 	pthread_t test_thread;
 	bool testing;
+	/* A watchpool dead pool probe is in flight */
+	bool retesting;
 
 	int curls;
 	pthread_cond_t cr_cond;
@@ -1180,6 +1530,9 @@ struct pool {
 	SOCKETTYPE sock;
 	char *sockbuf;
 	size_t sockbuf_size;
+	size_t sockbuf_len;   /* Bytes of received data buffered */
+	size_t sockbuf_begin; /* Start of data not yet consumed */
+	size_t sockbuf_scan;  /* How far we have searched for a newline */
 	char *sockaddr_url; /* stripped url used for sockaddr */
 	char *sockaddr_proxy_url;
 	char *sockaddr_proxy_port;
@@ -1190,23 +1543,73 @@ struct pool {
 	uint64_t nonce2;
 	int n2size;
 	char *sessionid;
+	/* BIP310 version rolling mask negotiated via mining.configure, zero
+	 * when the pool does not support it */
+	uint32_t vmask;
+	/* Socket inherited across an exec restart; initiate_stratum resumes
+	 * the session on it instead of reconnecting */
+	bool handoff_sock;
+	/* Pool url carried a #xnsub flag asking for extranonce updates */
+	bool extranonce_subscribe;
+	/* Request id of the pending mining.extranonce.subscribe */
+	int extranonce_id;
+	/* Share difficulty last suggested to the pool and the request id it
+	 * was sent with */
+	double suggested_diff;
+	int suggest_id;
 	bool has_stratum;
 	bool stratum_active;
 	bool stratum_init;
 	bool stratum_notify;
 	struct stratum_work swork;
+	struct stratum_job *sjob;
 	pthread_t stratum_sthread;
 	pthread_t stratum_rthread;
 	pthread_mutex_t stratum_lock;
-	struct thread_q *stratum_q;
+	struct mpsc_q *stratum_q;
+	/* Extra authenticated submit sessions opened with --submit-conns so
+	 * one stalled connection cannot hold up every pending share. Written
+	 * under stratum_lock; acks read by submit_rthread. */
+	struct submit_conn subconns[MAX_SUBMIT_CONNS - 1];
+	int subconn_count;
+	bool subconn_warned;
+	pthread_t submit_rthread;
+	/* Priority classed queue of outgoing messages in front of the pool
+	 * socket, drained shares first - see stratum_send_class(). Protected
+	 * by stratum_lock. */
+	struct stratum_msg *sendq_head[SMSG_CLASSES];
+	struct stratum_msg *sendq_tail[SMSG_CLASSES];
+	int sendq_len;
 	int sshares; /* stratum shares submitted waiting on response */
+	/* Per pool database of submitted shares awaiting responses, with a
+	 * small cache of spent entries for reuse. Protected by sshare_lock */
+	struct stratum_share *stratum_shares;
+	struct stratum_share *sshare_cache;
+	int sshare_cached;
+	pthread_mutex_t sshare_lock;
+	struct lat_hist sub_lat; /* share submit round trip latency */
+	/* Internal pipeline stage latencies feeding the poollat API command:
+	 * wait in stratum_q behind the send thread, and the socket write
+	 * itself including the outgoing priority queue handoff */
+	struct lat_hist queue_lat;
+	struct lat_hist send_lat;
+
+	/* Stratum reactor variables. last_msg_t is only ever touched by the
+	 * reactor thread while the socket is registered, and the recon
+	 * fields only under recon_lock. */
+	time_t last_msg_t;
+	bool reactor_reg;
+	bool recon_pending;
+	time_t recon_when;
+	/* Jittered exponential reconnect backoff state */
+	int backoff_secs;
+	int idle_wait;
 
 	/* GBT  variables */
 	bool has_gbt;
 	cglock_t gbt_lock;
 	unsigned char previousblockhash[32];
 	unsigned char gbt_target[32];
-	char *coinbasetxn;
 	char *longpollid;
 	char *gbt_workid;
 	int gbt_expires;
@@ -1215,6 +1618,14 @@ struct pool {
 	uint32_t gbt_bits;
 	unsigned char *txn_hashes;
 	int gbt_txns;
+	struct txn_ent *txn_cache;
+	unsigned char *merklebin;
+	int merkles;
+	char *submit_tmpl;
+	int submit_tmpl_len;
+	int submit_hdr_off;
+	int submit_cb_off;
+	int submit_cb_len;
 	int coinbase_len;
 
 	/* Shared by both stratum & GBT */
@@ -1237,6 +1648,9 @@ struct work {
 	unsigned char	data[128];
 	unsigned char	midstate[32];
 	unsigned char	target[32];
+	/* target pre swapped into big endian word order by calc_diff for
+	 * the branch free compare in fulltest_work */
+	uint64_t	target_be[4];
 	unsigned char	hash[32];
 
 	unsigned char	device_target[32];
@@ -1247,6 +1661,13 @@ struct work {
 	int		drv_rolllimit; /* How much the driver can roll ntime */
 	uint32_t	nonce; /* For devices that hash sole work */
 
+	/* Small open addressed table of recently submitted nonces, used by
+	 * submit_nonce to suppress duplicate reports from chips that
+	 * re-return the same nonce across adjacent polls */
+#define WORK_DUPE_CACHE 16
+	uint32_t	dupe_nonce[WORK_DUPE_CACHE];
+	uint8_t		dupe_state[WORK_DUPE_CACHE];
+
 	struct thr_info	*thr;
 	int		thr_id;
 	struct pool	*pool;
@@ -1268,6 +1689,16 @@ struct work {
 	char		*ntime;
 	double		sdiff;
 	char		*nonce1;
+	/* When set, job_id/nonce1/ntime are borrowed from this shared job
+	 * template and must not be freed individually */
+	struct stratum_job *sjob;
+	/* The pool's swork.job_seq when this work was generated */
+	unsigned int	job_seq;
+	/* BIP310 version rolling: the header version as the pool issued it
+	 * and the negotiated mask of bits a device may change, both host
+	 * order. A zero mask means no rolling was negotiated. */
+	uint32_t	base_version;
+	uint32_t	version_mask;
 
 	bool		gbt;
 	char		*coinbase;
@@ -1276,6 +1707,15 @@ struct work {
 	unsigned int	work_block;
 	int		id;
 	UT_hash_handle	hh;
+	/* Secondary queued_work index linkage, keyed on the midstate and
+	 * merkle tail bytes devices echo back with their results */
+	unsigned char	queued_key[44];
+	UT_hash_handle	hh_mid;
+	/* Lane linkage while sitting in the staged work lists */
+	struct list_head staged_node;
+	/* Expiry deadline and timer wheel linkage while staged */
+	struct list_head expiry_node;
+	time_t		expiry;
 
 	double		work_difficulty;
 
@@ -1290,8 +1730,14 @@ struct work {
 	struct timeval	tv_getwork_reply;
 	struct timeval	tv_cloned;
 	struct timeval	tv_work_start;
+	/* Stamped when the driver reports the nonce, before verification */
+	struct timeval	tv_nonce_found;
 	struct timeval	tv_work_found;
 	char		getwork_mode;
+
+	/* Links cached free work structs, only ever set while the work is
+	 * sitting in a per thread work cache */
+	struct work	*cache_next;
 };
 
 #ifdef USE_MODMINER 
@@ -1340,9 +1786,12 @@ extern bool test_nonce(struct work *work, uint32_t nonce);
 extern bool test_nonce_diff(struct work *work, uint32_t nonce, double diff);
 extern void submit_tested_work(struct thr_info *thr, struct work *work);
 extern bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce);
+extern int submit_nonces(struct thr_info *thr, struct work **works, uint32_t *nonces, int n);
+extern void submit_nonce_async(struct thr_info *thr, struct work *work, uint32_t nonce);
 extern bool submit_noffset_nonce(struct thr_info *thr, struct work *work, uint32_t nonce,
 			  int noffset);
 extern struct work *get_work(struct thr_info *thr, const int thr_id);
+extern int get_works(struct thr_info *thr, const int thr_id, struct work **works, int n);
 extern void __add_queued(struct cgpu_info *cgpu, struct work *work);
 extern struct work *get_queued(struct cgpu_info *cgpu);
 extern void add_queued(struct cgpu_info *cgpu, struct work *work);
@@ -1356,19 +1805,53 @@ extern void work_completed(struct cgpu_info *cgpu, struct work *work);
 extern struct work *take_queued_work_bymidstate(struct cgpu_info *cgpu, char *midstate, size_t midstatelen, char *data, int offset, size_t datalen);
 extern void hash_driver_work(struct thr_info *mythr);
 extern void hash_queued_work(struct thr_info *mythr);
+extern void cgpu_set_deadline(struct cgpu_info *cgpu, int ms);
+extern void pool_probe_now(struct pool *pool);
+extern struct stratum_job *sjob_new(const char *job_id, const char *nonce1,
+				    const char *ntime, char *coinbase);
+extern struct stratum_job *sjob_ref(struct stratum_job *sjob);
+extern void sjob_unref(struct stratum_job *sjob);
+/* Lightweight per-subsystem allocation accounting so RSS growth can be
+ * localized with an API poll instead of a debugger. Sites that allocate or
+ * release a tracked buffer apply the size delta with an atomic add; the
+ * running totals are reported by the memstats API command. */
+enum cg_memsys {
+	MEM_WORK,	/* work structs including the per thread caches */
+	MEM_SJOB,	/* published stratum job templates */
+	MEM_SOCKBUF,	/* per pool stratum receive buffers */
+	MEM_SSHARE,	/* submitted shares awaiting pool responses */
+	MEM_CURL,	/* curl connection entries and preformatted buffers */
+	MEM_JSON,	/* live jansson allocations */
+	MEM_APIIO,	/* API reply buffers */
+	MEM_MEMSYS
+};
+
+extern uint64_t memsys_bytes[MEM_MEMSYS];
+extern const char *memsys_names[MEM_MEMSYS];
+
+static inline void mem_account(enum cg_memsys sys, int64_t delta)
+{
+	__sync_fetch_and_add(&memsys_bytes[sys], (uint64_t)delta);
+}
+
+extern int opt_sproxy_port;
+extern void sproxy_start(void);
+extern bool sproxy_submit(struct pool *pool, const char *job_id,
+			  uint64_t nonce2, const char *ntime, uint32_t nonce);
 extern void _wlog(const char *str);
 extern void _wlogprint(const char *str);
 extern int curses_int(const char *query);
 extern char *curses_input(const char *query);
 extern void kill_work(void);
 extern void switch_pools(struct pool *selected);
+extern void update_device_diffs(struct pool *pool, double diff);
 extern void discard_work(struct work *work);
 extern void remove_pool(struct pool *pool);
 extern void write_config(FILE *fcfg);
 extern void zero_bestshare(void);
 extern void zero_stats(void);
 extern void default_save_file(char *filename);
-extern bool log_curses_only(int prio, const char *datetime, const char *str);
+extern bool log_curses_only(int prio, const char *datetime, const char *str, bool force);
 extern void clear_logwin(void);
 extern void logwin_update(void);
 extern bool pool_tclear(struct pool *pool, bool *var);
@@ -1376,8 +1859,14 @@ extern struct thread_q *tq_new(void);
 extern void tq_free(struct thread_q *tq);
 extern bool tq_push(struct thread_q *tq, void *data);
 extern void *tq_pop(struct thread_q *tq, const struct timespec *abstime);
+extern void *tq_pop_nowait(struct thread_q *tq);
 extern void tq_freeze(struct thread_q *tq);
 extern void tq_thaw(struct thread_q *tq);
+extern struct mpsc_q *mpscq_new(unsigned int size);
+extern bool mpscq_push(struct mpsc_q *q, void *data);
+extern void *mpscq_pop(struct mpsc_q *q, int ms);
+extern void lat_hist_add(struct lat_hist *h, uint64_t us);
+extern uint64_t lat_hist_pct(const struct lat_hist *h, double pct);
 extern bool successful_connect;
 extern void adl(void);
 extern void app_restart(void);
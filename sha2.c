@@ -80,6 +80,243 @@ uint32_t sha256_k[64] =
              0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
              0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
 
+/* Hardware SHA-256 compression kernels. The midstate, share verification
+ * and merkle paths funnel every block through sha256_transf, so use the
+ * dedicated SHA instructions where the CPU has them, selected once at
+ * runtime with the scalar rounds below as the universal fallback. */
+#if (defined(__x86_64__) || defined(__i386__)) && ((defined(__GNUC__) && __GNUC__ >= 8) || defined(__clang__))
+#define HAVE_SHA256_HW 1
+#include <immintrin.h>
+#include <cpuid.h>
+
+__attribute__((target("sha,sse4.1")))
+static void sha256_transf_shani(sha256_ctx *ctx, const unsigned char *message,
+                                unsigned int block_nb)
+{
+    const __m128i bswap_mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                              0x0405060700010203ULL);
+    __m128i state0, state1, tmp;
+    unsigned int i;
+    int j;
+
+    /* Repack the h[0..7] word order into the ABEF/CDGH lane layout the
+     * sha256rnds2 instruction works on */
+    tmp = _mm_loadu_si128((const __m128i *)&ctx->h[0]);
+    state1 = _mm_loadu_si128((const __m128i *)&ctx->h[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);
+    state1 = _mm_shuffle_epi32(state1, 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for (i = 0; i < block_nb; i++) {
+        const unsigned char *sub_block = message + (i << 6);
+        __m128i abef_save = state0, cdgh_save = state1;
+        __m128i m[4];
+
+        for (j = 0; j < 4; j++)
+            m[j] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(sub_block + (j << 4))),
+                                    bswap_mask);
+
+        /* Four rounds per iteration; each of the first twelve also
+         * schedules the message words sixteen rounds ahead in place */
+        for (j = 0; j < 16; j++) {
+            __m128i wk = _mm_add_epi32(m[j & 3],
+                                       _mm_loadu_si128((const __m128i *)&sha256_k[j << 2]));
+
+            state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+            wk = _mm_shuffle_epi32(wk, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+
+            if (j < 12) {
+                __m128i spill = _mm_alignr_epi8(m[(j + 3) & 3], m[(j + 2) & 3], 4);
+
+                m[j & 3] = _mm_sha256msg1_epu32(m[j & 3], m[(j + 1) & 3]);
+                m[j & 3] = _mm_add_epi32(m[j & 3], spill);
+                m[j & 3] = _mm_sha256msg2_epu32(m[j & 3], m[(j + 3) & 3]);
+            }
+        }
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+    }
+
+    /* Back to the canonical word order */
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i *)&ctx->h[0], state0);
+    _mm_storeu_si128((__m128i *)&ctx->h[4], state1);
+}
+#elif defined(__aarch64__) && defined(__linux__) && ((defined(__GNUC__) && __GNUC__ >= 6) || defined(__clang__))
+#define HAVE_SHA256_HW 1
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+
+__attribute__((target("+crypto")))
+static void sha256_transf_armv8(sha256_ctx *ctx, const unsigned char *message,
+                                unsigned int block_nb)
+{
+    uint32x4_t state0 = vld1q_u32(&ctx->h[0]);
+    uint32x4_t state1 = vld1q_u32(&ctx->h[4]);
+    unsigned int i;
+    int j;
+
+    for (i = 0; i < block_nb; i++) {
+        const unsigned char *sub_block = message + (i << 6);
+        uint32x4_t abcd = state0, efgh = state1;
+        uint32x4_t m[4];
+
+        for (j = 0; j < 4; j++)
+            m[j] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(sub_block + (j << 4))));
+
+        /* Four rounds per iteration; each of the first twelve also
+         * schedules the message words sixteen rounds ahead in place */
+        for (j = 0; j < 16; j++) {
+            uint32x4_t wk = vaddq_u32(m[j & 3], vld1q_u32(&sha256_k[j << 2]));
+            uint32x4_t abcd_save = abcd;
+
+            abcd = vsha256hq_u32(abcd, efgh, wk);
+            efgh = vsha256h2q_u32(efgh, abcd_save, wk);
+
+            if (j < 12) {
+                m[j & 3] = vsha256su0q_u32(m[j & 3], m[(j + 1) & 3]);
+                m[j & 3] = vsha256su1q_u32(m[j & 3], m[(j + 2) & 3],
+                                           m[(j + 3) & 3]);
+            }
+        }
+
+        state0 = vaddq_u32(state0, abcd);
+        state1 = vaddq_u32(state1, efgh);
+    }
+
+    vst1q_u32(&ctx->h[0], state0);
+    vst1q_u32(&ctx->h[4], state1);
+}
+#endif
+
+#ifdef HAVE_SHA256_HW
+static void (*sha256_transf_hw)(sha256_ctx *ctx, const unsigned char *message,
+                                unsigned int block_nb);
+static int sha256_hw_inited;
+
+static void sha256_hw_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1 << 29)))
+        sha256_transf_hw = sha256_transf_shani;
+#elif defined(__aarch64__)
+#ifdef HWCAP_SHA2
+    if (getauxval(AT_HWCAP) & HWCAP_SHA2)
+        sha256_transf_hw = sha256_transf_armv8;
+#endif
+#endif
+    sha256_hw_inited = 1;
+}
+#endif
+
+/* Four lane transposed SHA-256 for verifying batches of independent block
+ * headers, as returned in bursts by queue devices. Written with the GCC
+ * vector extensions so the same code compiles to SSE2 on x86 and NEON on
+ * ARM without separate kernels per instruction set. */
+#ifdef HAVE_SHA256D80_4WAY
+
+#define ROTR_V4(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define V4_SPLAT(x) ((v4su){(x), (x), (x), (x)})
+
+static void sha256_transf_4way(v4su h[8], const v4su win[16])
+{
+    v4su w[64];
+    v4su wv[8];
+    v4su t1, t2;
+    int j;
+
+    for (j = 0; j < 16; j++)
+        w[j] = win[j];
+
+    for (j = 16; j < 64; j++)
+        w[j] = (ROTR_V4(w[j - 2], 17) ^ ROTR_V4(w[j - 2], 19) ^ (w[j - 2] >> 10))
+             + w[j - 7]
+             + (ROTR_V4(w[j - 15], 7) ^ ROTR_V4(w[j - 15], 18) ^ (w[j - 15] >> 3))
+             + w[j - 16];
+
+    for (j = 0; j < 8; j++)
+        wv[j] = h[j];
+
+    for (j = 0; j < 64; j++) {
+        t1 = wv[7] + (ROTR_V4(wv[4], 6) ^ ROTR_V4(wv[4], 11) ^ ROTR_V4(wv[4], 25))
+           + ((wv[4] & wv[5]) ^ (~wv[4] & wv[6])) + sha256_k[j] + w[j];
+        t2 = (ROTR_V4(wv[0], 2) ^ ROTR_V4(wv[0], 13) ^ ROTR_V4(wv[0], 22))
+           + ((wv[0] & wv[1]) ^ (wv[0] & wv[2]) ^ (wv[1] & wv[2]));
+        wv[7] = wv[6];
+        wv[6] = wv[5];
+        wv[5] = wv[4];
+        wv[4] = wv[3] + t1;
+        wv[3] = wv[2];
+        wv[2] = wv[1];
+        wv[1] = wv[0];
+        wv[0] = t1 + t2;
+    }
+
+    for (j = 0; j < 8; j++)
+        h[j] += wv[j];
+}
+
+void sha256d80_4way(const unsigned char *const head[4],
+                    unsigned char *const hash[4])
+{
+    v4su h[8], h2[8], w[16];
+    uint32_t x;
+    int j, l;
+
+    for (j = 0; j < 8; j++)
+        h[j] = V4_SPLAT(sha256_h0[j]);
+
+    /* First 64 bytes of the headers */
+    for (j = 0; j < 16; j++) {
+        for (l = 0; l < 4; l++) {
+            PACK32(head[l] + (j << 2), &x);
+            w[j][l] = x;
+        }
+    }
+    sha256_transf_4way(h, w);
+
+    /* Remaining 16 bytes plus the padding of an 80 byte message */
+    for (j = 0; j < 4; j++) {
+        for (l = 0; l < 4; l++) {
+            PACK32(head[l] + 64 + (j << 2), &x);
+            w[j][l] = x;
+        }
+    }
+    w[4] = V4_SPLAT(0x80000000);
+    for (j = 5; j < 15; j++)
+        w[j] = V4_SPLAT(0);
+    w[15] = V4_SPLAT(640);
+    sha256_transf_4way(h, w);
+
+    /* Second hash over the 32 byte digests */
+    for (j = 0; j < 8; j++)
+        w[j] = h[j];
+    w[8] = V4_SPLAT(0x80000000);
+    for (j = 9; j < 15; j++)
+        w[j] = V4_SPLAT(0);
+    w[15] = V4_SPLAT(256);
+    for (j = 0; j < 8; j++)
+        h2[j] = V4_SPLAT(sha256_h0[j]);
+    sha256_transf_4way(h2, w);
+
+    for (j = 0; j < 8; j++) {
+        for (l = 0; l < 4; l++) {
+            x = h2[j][l];
+            UNPACK32(x, hash[l] + (j << 2));
+        }
+    }
+}
+#endif
+
 /* SHA-256 functions */
 
 void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
@@ -93,6 +330,15 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
 
     int j;
 
+#ifdef HAVE_SHA256_HW
+    if (!sha256_hw_inited)
+        sha256_hw_init();
+    if (sha256_transf_hw) {
+        sha256_transf_hw(ctx, message, block_nb);
+        return;
+    }
+#endif
+
     for (i = 0; i < (int) block_nb; i++) {
         sub_block = message + (i << 6);
 
@@ -67,4 +67,12 @@ void sha256_final(sha256_ctx *ctx, unsigned char *digest);
 void sha256(const unsigned char *message, unsigned int len,
             unsigned char *digest);
 
+#if defined(__GNUC__) || defined(__clang__)
+#define HAVE_SHA256D80_4WAY 1
+typedef uint32_t v4su __attribute__((vector_size(16)));
+
+void sha256d80_4way(const unsigned char *const head[4],
+                    unsigned char *const hash[4]);
+#endif
+
 #endif /* !SHA2_H */
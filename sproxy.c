@@ -0,0 +1,441 @@
+/*
+ * Built in stratum proxy. When started with --stratum-proxy <port> this
+ * instance serves mining.notify/submit to downstream cgminer rigs on the
+ * LAN while holding a single upstream pool session, collapsing N pool
+ * connections into one. Each downstream client is handed the upstream
+ * extranonce1 extended by one unique prefix byte, so the upstream nonce2
+ * space is partitioned between the local work generator (prefix zero,
+ * see gen_stratum_work) and up to 255 clients with no coordination.
+ * Shares coming back are rebuilt against the current job and fed through
+ * the normal upstream submission path by sproxy_submit. A downstream
+ * instance can itself run in proxy mode on its reduced nonce2 space, so
+ * larger farms aggregate hierarchically.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <jansson.h>
+
+#include "miner.h"
+#include "util.h"
+
+int opt_sproxy_port;
+
+#define SPROXY_BUFSIZ 8192
+/* One client per spare value of the nonce2 prefix byte */
+#define SPROXY_MAX_CLIENTS 255
+
+struct sproxy_client {
+	SOCKETTYPE fd;
+	char buf[SPROXY_BUFSIZ];
+	int len;
+	bool subscribed;
+	/* Client sent mining.extranonce.subscribe so upstream session
+	 * changes can be relayed as mining.set_extranonce instead of a
+	 * disconnect */
+	bool xnsub;
+};
+
+static SOCKETTYPE sproxy_listen = INVSOCK;
+static struct sproxy_client sproxy_clients[SPROXY_MAX_CLIENTS];
+
+/* Upstream session currently being relayed */
+static struct pool *sproxy_pool;
+static char *sproxy_n1;
+static int sproxy_n2size;
+static unsigned int sproxy_job_seq;
+static double sproxy_diff;
+
+static int sproxy_accepted, sproxy_stale;
+
+static void sproxy_drop(struct sproxy_client *client)
+{
+	CLOSESOCKET(client->fd);
+	client->fd = INVSOCK;
+	client->len = 0;
+	client->subscribed = false;
+	client->xnsub = false;
+}
+
+static void sproxy_send(struct sproxy_client *client, const char *fmt, ...)
+{
+	char buf[SPROXY_BUFSIZ];
+	int len, ofs = 0;
+	va_list ap;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
+	va_end(ap);
+	buf[len++] = '\n';
+
+	while (ofs < len) {
+		int sent = send(client->fd, buf + ofs, len - ofs, 0);
+
+		if (sent < 0) {
+			sproxy_drop(client);
+			return;
+		}
+		ofs += sent;
+	}
+}
+
+/* Reconstruct the upstream notify parameters from the published immutable
+ * job. The coinbase halves bracket the extranonce splice so the relayed
+ * coinb1 ends exactly where the client's extended extranonce1 begins.
+ * Returns a malloced notify line, or NULL if no job is published yet. */
+static char *sproxy_notify_line(struct pool *pool, bool clean)
+{
+	char *cb1, *cb2, *version, *prev_hash, *nbit, *line;
+	size_t n1_len, siz, len;
+	struct stratum_job *sjob;
+	int i;
+
+	cg_rlock(&pool->data_lock);
+	sjob = pool->sjob ? sjob_ref(pool->sjob) : NULL;
+	cg_runlock(&pool->data_lock);
+	if (!sjob)
+		return NULL;
+
+	n1_len = strlen(sjob->nonce1) / 2;
+	cb1 = bin2hex(sjob->cb_bin, sjob->nonce2_offset - n1_len);
+	cb2 = bin2hex(sjob->cb_bin + sjob->nonce2_offset + sjob->n2size,
+		      sjob->cb_len - sjob->nonce2_offset - sjob->n2size);
+	version = bin2hex(sjob->header_bin, 4);
+	prev_hash = bin2hex(sjob->header_bin + 4, 32);
+	nbit = bin2hex(sjob->header_bin + sjob->merkle_offset + 32 + 4, 4);
+
+	siz = strlen(cb1) + strlen(cb2) + sjob->merkles * 67 + 256;
+	line = malloc(siz);
+	if (unlikely(!line))
+		quit(1, "Failed to malloc sproxy notify line");
+	len = snprintf(line, siz,
+		       "{\"id\":null,\"method\":\"mining.notify\",\"params\":"
+		       "[\"%s\",\"%s\",\"%s\",\"%s\",[",
+		       sjob->job_id, prev_hash, cb1, cb2);
+	for (i = 0; i < sjob->merkles; i++) {
+		char *merkle = bin2hex(sjob->merkle_bin + 32 * i, 32);
+
+		len += snprintf(line + len, siz - len, "%s\"%s\"",
+				i ? "," : "", merkle);
+		free(merkle);
+	}
+	snprintf(line + len, siz - len, "],\"%s\",\"%s\",\"%s\",%s]}",
+		 version, nbit, sjob->ntime, clean ? "true" : "false");
+
+	free(cb1);
+	free(cb2);
+	free(version);
+	free(prev_hash);
+	free(nbit);
+	sjob_unref(sjob);
+	return line;
+}
+
+static void sproxy_send_diff(struct sproxy_client *client)
+{
+	sproxy_send(client, "{\"id\":null,\"method\":\"mining.set_difficulty\",\"params\":[%g]}",
+		    sproxy_diff);
+}
+
+static void sproxy_line(struct sproxy_client *client, int prefix, const char *line)
+{
+	json_t *val, *id_val, *method, *params;
+	const char *method_str;
+	json_error_t err;
+	int64_t id = 0;
+
+	val = JSON_LOADS(line, &err);
+	if (!val)
+		return;
+	id_val = json_object_get(val, "id");
+	if (id_val && json_is_integer(id_val))
+		id = json_integer_value(id_val);
+	method = json_object_get(val, "method");
+	method_str = method ? json_string_value(method) : NULL;
+	params = json_object_get(val, "params");
+	if (!method_str) {
+		json_decref(val);
+		return;
+	}
+
+	if (!strcasecmp(method_str, "mining.subscribe")) {
+		char *notify;
+
+		if (!sproxy_pool || !sproxy_n1 || sproxy_n2size < 3) {
+			sproxy_send(client, "{\"id\":%"PRId64",\"error\":[20,\"Upstream pool not ready\",null],\"result\":null}", id);
+			goto out;
+		}
+		sproxy_send(client, "{\"id\":%"PRId64",\"error\":null,\"result\":"
+			    "[[[\"mining.set_difficulty\",\"%02x\"],[\"mining.notify\",\"%02x\"]],\"%s%02x\",%d]}",
+			    id, prefix, prefix, sproxy_n1, prefix, sproxy_n2size - 1);
+		client->subscribed = true;
+		sproxy_send_diff(client);
+		notify = sproxy_notify_line(sproxy_pool, true);
+		if (notify) {
+			sproxy_send(client, "%s", notify);
+			free(notify);
+		}
+	} else if (!strcasecmp(method_str, "mining.submit")) {
+		const char *job_id, *n2hex, *ntime, *noncehex;
+		unsigned char bin[8];
+		uint64_t nonce2 = 0;
+		uint32_t nonce;
+		bool ok = false;
+
+		job_id = json_string_value(json_array_get(params, 1));
+		n2hex = json_string_value(json_array_get(params, 2));
+		ntime = json_string_value(json_array_get(params, 3));
+		noncehex = json_string_value(json_array_get(params, 4));
+		if (!job_id || !n2hex || !ntime || !noncehex || !sproxy_pool)
+			goto reject;
+		if (strlen(n2hex) != (size_t)(sproxy_n2size - 1) * 2 ||
+		    strlen(noncehex) != 8)
+			goto reject;
+		memset(bin, 0, sizeof(bin));
+		if (!hex2bin(bin, n2hex, sproxy_n2size - 1))
+			goto reject;
+		memcpy(&nonce2, bin, 8);
+		/* Splice the client's prefix byte back in below its
+		 * extranonce2 to recover the full upstream nonce2 */
+		nonce2 = (le64toh(nonce2) << 8) | prefix;
+		if (!hex2bin(bin, noncehex, 4))
+			goto reject;
+		memcpy(&nonce, bin, 4);
+		nonce = le32toh(nonce);
+		ok = sproxy_submit(sproxy_pool, job_id, nonce2, ntime, nonce);
+reject:
+		if (ok) {
+			sproxy_accepted++;
+			sproxy_send(client, "{\"id\":%"PRId64",\"error\":null,\"result\":true}", id);
+		} else {
+			sproxy_stale++;
+			sproxy_send(client, "{\"id\":%"PRId64",\"error\":[21,\"Stale or invalid\",null],\"result\":null}", id);
+		}
+	} else if (!strcasecmp(method_str, "mining.extranonce.subscribe")) {
+		client->xnsub = true;
+		sproxy_send(client, "{\"id\":%"PRId64",\"error\":null,\"result\":true}", id);
+	} else if (id_val && !json_is_null(id_val)) {
+		/* authorize and anything else that expects an answer just
+		 * succeeds - access control is running this on a LAN */
+		sproxy_send(client, "{\"id\":%"PRId64",\"error\":null,\"result\":true}", id);
+	}
+out:
+	json_decref(val);
+}
+
+static void sproxy_recv(struct sproxy_client *client, int prefix)
+{
+	int n;
+
+	n = recv(client->fd, client->buf + client->len,
+		 sizeof(client->buf) - 1 - client->len, 0);
+	if (n <= 0) {
+		sproxy_drop(client);
+		return;
+	}
+	client->len += n;
+	client->buf[client->len] = '\0';
+
+	while (client->fd != INVSOCK) {
+		char *eol = strchr(client->buf, '\n');
+		int linelen;
+
+		if (!eol)
+			break;
+		*eol = '\0';
+		linelen = eol - client->buf + 1;
+		sproxy_line(client, prefix, client->buf);
+		if (client->fd == INVSOCK)
+			return;
+		client->len -= linelen;
+		memmove(client->buf, eol + 1, client->len + 1);
+	}
+	if (client->len >= (int)sizeof(client->buf) - 1)
+		sproxy_drop(client);
+}
+
+static void sproxy_broadcast_job(bool clean)
+{
+	char *notify = sproxy_notify_line(sproxy_pool, clean);
+	int i;
+
+	if (!notify)
+		return;
+	for (i = 0; i < SPROXY_MAX_CLIENTS; i++) {
+		struct sproxy_client *client = &sproxy_clients[i];
+
+		if (client->fd != INVSOCK && client->subscribed)
+			sproxy_send(client, "%s", notify);
+	}
+	free(notify);
+}
+
+/* Pick up upstream session, job and difficulty changes from the current
+ * pool and relay them downstream. A new extranonce1 is relayed with
+ * mining.set_extranonce to clients that subscribed for it; the rest are
+ * dropped to resubscribe against the new session. */
+static void sproxy_update(void)
+{
+	struct pool *pool = current_pool();
+	unsigned int job_seq;
+	char *n1 = NULL;
+	double diff;
+	int n2size;
+	bool clean;
+	int i;
+
+	if (!pool->has_stratum || !pool->stratum_active)
+		return;
+
+	cg_rlock(&pool->data_lock);
+	if (pool->nonce1)
+		n1 = strdup(pool->nonce1);
+	n2size = pool->n2size;
+	job_seq = pool->swork.job_seq;
+	clean = pool->swork.clean;
+	diff = pool->swork.diff;
+	cg_runlock(&pool->data_lock);
+
+	if (!n1)
+		return;
+
+	if (pool != sproxy_pool || !sproxy_n1 || strcmp(n1, sproxy_n1) ||
+	    n2size != sproxy_n2size) {
+		if (sproxy_pool) {
+			applog(LOG_NOTICE, "Stratum proxy switching to pool %d session",
+			       pool->pool_no);
+		}
+		sproxy_pool = pool;
+		free(sproxy_n1);
+		sproxy_n1 = n1;
+		sproxy_n2size = n2size;
+		sproxy_diff = diff;
+		for (i = 0; i < SPROXY_MAX_CLIENTS; i++) {
+			struct sproxy_client *client = &sproxy_clients[i];
+
+			if (client->fd == INVSOCK || !client->subscribed)
+				continue;
+			if (!client->xnsub || n2size < 3) {
+				sproxy_drop(client);
+				continue;
+			}
+			sproxy_send(client, "{\"id\":null,\"method\":\"mining.set_extranonce\",\"params\":[\"%s%02x\",%d]}",
+				    sproxy_n1, i + 1, sproxy_n2size - 1);
+			if (client->fd != INVSOCK)
+				sproxy_send_diff(client);
+		}
+		sproxy_job_seq = job_seq;
+		sproxy_broadcast_job(true);
+		return;
+	}
+	free(n1);
+
+	if (diff != sproxy_diff) {
+		sproxy_diff = diff;
+		for (i = 0; i < SPROXY_MAX_CLIENTS; i++)
+			if (sproxy_clients[i].fd != INVSOCK &&
+			    sproxy_clients[i].subscribed)
+				sproxy_send_diff(&sproxy_clients[i]);
+	}
+	if (job_seq != sproxy_job_seq) {
+		sproxy_job_seq = job_seq;
+		sproxy_broadcast_job(clean);
+	}
+}
+
+static void *sproxy_thread(void __maybe_unused *userdata)
+{
+	pthread_detach(pthread_self());
+	RenameThread("sproxy");
+
+	while (42) {
+		struct timeval timeout = { 0, 100000 };
+		SOCKETTYPE maxfd = sproxy_listen;
+		fd_set rfds;
+		int i;
+
+		FD_ZERO(&rfds);
+		FD_SET(sproxy_listen, &rfds);
+		for (i = 0; i < SPROXY_MAX_CLIENTS; i++) {
+			struct sproxy_client *client = &sproxy_clients[i];
+
+			if (client->fd == INVSOCK)
+				continue;
+			FD_SET(client->fd, &rfds);
+			if (client->fd > maxfd)
+				maxfd = client->fd;
+		}
+
+		if (select(maxfd + 1, &rfds, NULL, NULL, &timeout) < 0)
+			continue;
+
+		if (FD_ISSET(sproxy_listen, &rfds)) {
+			SOCKETTYPE fd = accept(sproxy_listen, NULL, NULL);
+
+			if (fd != INVSOCK) {
+				for (i = 0; i < SPROXY_MAX_CLIENTS; i++)
+					if (sproxy_clients[i].fd == INVSOCK)
+						break;
+				if (i == SPROXY_MAX_CLIENTS) {
+					applog(LOG_WARNING, "Stratum proxy client limit reached, rejecting connection");
+					CLOSESOCKET(fd);
+				} else
+					sproxy_clients[i].fd = fd;
+			}
+		}
+
+		for (i = 0; i < SPROXY_MAX_CLIENTS; i++) {
+			struct sproxy_client *client = &sproxy_clients[i];
+
+			if (client->fd != INVSOCK && FD_ISSET(client->fd, &rfds))
+				sproxy_recv(client, i + 1);
+		}
+
+		sproxy_update();
+	}
+	return NULL;
+}
+
+void sproxy_start(void)
+{
+	struct sockaddr_in serv;
+	pthread_t pth;
+	int i, on = 1;
+
+	for (i = 0; i < SPROXY_MAX_CLIENTS; i++)
+		sproxy_clients[i].fd = INVSOCK;
+
+	sproxy_listen = socket(AF_INET, SOCK_STREAM, 0);
+	if (sproxy_listen == INVSOCK)
+		quit(1, "Failed to create stratum proxy socket");
+	setsockopt(sproxy_listen, SOL_SOCKET, SO_REUSEADDR,
+		   (void *)&on, sizeof(on));
+	memset(&serv, 0, sizeof(serv));
+	serv.sin_family = AF_INET;
+	serv.sin_addr.s_addr = htonl(INADDR_ANY);
+	serv.sin_port = htons(opt_sproxy_port);
+	if (bind(sproxy_listen, (struct sockaddr *)&serv, sizeof(serv)) < 0)
+		quit(1, "Failed to bind stratum proxy to port %d", opt_sproxy_port);
+	if (listen(sproxy_listen, SPROXY_MAX_CLIENTS) < 0)
+		quit(1, "Failed to listen on stratum proxy socket");
+
+	if (pthread_create(&pth, NULL, sproxy_thread, NULL))
+		quit(1, "Failed to create stratum proxy thread");
+
+	applog(LOG_NOTICE, "Stratum proxy serving downstream rigs on port %d",
+	       opt_sproxy_port);
+}
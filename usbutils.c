@@ -11,6 +11,7 @@
 #include "config.h"
 
 #include <ctype.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -100,6 +101,8 @@ static cgtimer_t usb11_cgt;
  * to find cancellable transfers. */
 static struct list_head ut_list;
 
+static void usb_ra_free(struct cg_usb_device *usbdev);
+
 #ifdef USE_BFLSC
 // N.B. transfer size is 512 with USB2.0, but only 64 with USB1.1
 static struct usb_epinfo bas_epinfos[] = {
@@ -658,14 +661,27 @@ struct cg_usb_stats_details {
 	struct cg_usb_stats_item item[CMD_ERROR+1];
 };
 
-// One for each device
+/* Fixed latency histogram buckets. Bucket N counts transfers that completed
+ * in under usb_lat_bound[N] ms, the last bucket everything slower. */
+#define USB_LAT_BUCKETS 12
+static const int usb_lat_bound[USB_LAT_BUCKETS - 1] = {
+	1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024
+};
+
+/* One for each device. Each is its own cacheline aligned allocation so
+ * devices never write to storage shared with another device - the registry
+ * below only holds pointers for aggregation. */
 struct cg_usb_stats {
 	char *name;
 	int device_id;
 	struct cg_usb_stats_details *details;
-};
+	uint64_t lat_read[USB_LAT_BUCKETS];
+	uint64_t lat_write[USB_LAT_BUCKETS];
+} __attribute__((aligned(64)));
 
-static struct cg_usb_stats *usb_stats = NULL;
+/* Registry of all stats blocks, only for the usbstats API command.
+ * Protected by cgusb_lock; the hot path uses cgpu->usbinfo.stats. */
+static struct cg_usb_stats **usb_stats = NULL;
 static int next_stat = USB_NOSTAT;
 
 #define SECTOMS(s) ((int)((s) * 1000))
@@ -1383,6 +1399,14 @@ static struct cg_usb_device *free_cgusb(struct cg_usb_device *cgusb)
 	if (cgusb->descriptor)
 		free(cgusb->descriptor);
 
+#ifdef WIN32
+	_aligned_free(cgusb->xferbuf[0]);
+	_aligned_free(cgusb->xferbuf[1]);
+#else
+	free(cgusb->xferbuf[0]);
+	free(cgusb->xferbuf[1]);
+#endif
+
 	free(cgusb->found);
 
 	free(cgusb);
@@ -1403,6 +1427,7 @@ static void _usb_uninit(struct cgpu_info *cgpu)
 			cgpu->drv->name, cgpu->device_id);
 
 	if (cgpu->usbdev->handle) {
+		usb_ra_free(cgpu->usbdev);
 		for (ifinfo = cgpu->usbdev->found->intinfo_count - 1; ifinfo >= 0; ifinfo--) {
 			libusb_release_interface(cgpu->usbdev->handle,
 						 THISIF(cgpu->usbdev->found, ifinfo));
@@ -1555,6 +1580,9 @@ struct cgpu_info *usb_free_cgpu(struct cgpu_info *cgpu)
 #define USB_INIT_OK 1
 #define USB_INIT_IGNORE 2
 
+struct usb_readahead;
+static struct usb_readahead *usb_ra_get(struct cg_usb_device *usbdev, int intinfo, int epinfo);
+
 static int _usb_init(struct cgpu_info *cgpu, struct libusb_device *dev, struct usb_find_devices *found)
 {
 	struct cg_usb_device *cgusb = NULL;
@@ -1851,6 +1879,23 @@ static int _usb_init(struct cgpu_info *cgpu, struct libusb_device *dev, struct u
 	cgpu->usbdev = cgusb;
 	cgpu->usbinfo.nodev = false;
 
+#ifndef WIN32
+	/* Interrupt IN endpoints carry urgent events like nonce ready
+	 * signals - arm them with preallocated read-ahead transfers from the
+	 * outset so their completions are already queued when the driver
+	 * asks, never waiting behind a bulk telemetry read */
+	if (!opt_lowmem) {
+		for (ifinfo = 0; ifinfo < found->intinfo_count; ifinfo++)
+			for (epinfo = 0; epinfo < found->intinfos[ifinfo].epinfo_count; epinfo++) {
+				struct usb_epinfo *ue = &found->intinfos[ifinfo].epinfos[epinfo];
+
+				if (ue->att == LIBUSB_TRANSFER_TYPE_INTERRUPT &&
+				    (ue->ep & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
+					usb_ra_get(cgusb, ifinfo, epinfo);
+			}
+	}
+#endif
+
 	libusb_free_config_descriptor(config);
 
 	// Allow a name change based on the idVendor+idProduct
@@ -2008,12 +2053,50 @@ static struct usb_find_devices *usb_check(__maybe_unused struct device_drv *drv,
 	return NULL;
 }
 
+/* A device that has been claimed and is waiting for its driver detect and
+ * initialisation to run in a worker thread */
+struct usb_detect_job {
+	struct cgpu_info *(*device_detect)(struct libusb_device *, struct usb_find_devices *);
+	struct device_drv *drv;
+	struct libusb_device *dev;
+	struct usb_find_devices *found;
+	pthread_t pth;
+	bool pth_valid;
+};
+
+static pthread_mutex_t usb_detect_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Devices claimed but not yet counted, so the total limit holds when
+ * several drivers detect concurrently */
+static int usb_detect_reserved;
+
+static void *usb_detect_worker(void *arg)
+{
+	struct usb_detect_job *job = (struct usb_detect_job *)arg;
+	struct cgpu_info *cgpu;
+
+	cgpu = job->device_detect(job->dev, job->found);
+	mutex_lock(&usb_detect_lock);
+	usb_detect_reserved--;
+	if (cgpu) {
+		total_count++;
+		drv_count[job->drv->drv_id].count++;
+	}
+	mutex_unlock(&usb_detect_lock);
+	if (!cgpu)
+		cgminer_usb_unlock(job->drv, job->dev);
+	else
+		cgpu->usbinfo.initialised = true;
+	free(job->found);
+	return NULL;
+}
+
 void usb_detect(struct device_drv *drv, struct cgpu_info *(*device_detect)(struct libusb_device *, struct usb_find_devices *))
 {
 	libusb_device **list;
 	ssize_t count, i;
 	struct usb_find_devices *found;
-	struct cgpu_info *cgpu;
+	struct usb_detect_job *jobs = NULL;
+	int njobs = 0, j;
 
 	applog(LOG_DEBUG, "USB scan devices: checking for %s devices", drv->name);
 
@@ -2041,12 +2124,7 @@ void usb_detect(struct device_drv *drv, struct cgpu_info *(*device_detect)(struc
 		cgsleep_ms(166);
 
 	for (i = 0; i < count; i++) {
-		if (total_count >= total_limit) {
-			applog(LOG_DEBUG, "USB scan devices2: total limit %d reached", total_limit);
-			break;
-		}
-
-		if (drv_count[drv->drv_id].count >= drv_count[drv->drv_id].limit) {
+		if (drv_count[drv->drv_id].count + njobs >= drv_count[drv->drv_id].limit) {
 			applog(LOG_DEBUG,
 				"USB scan devices2: %s limit %d reached",
 				drv->dname, drv_count[drv->drv_id].limit);
@@ -2058,19 +2136,54 @@ void usb_detect(struct device_drv *drv, struct cgpu_info *(*device_detect)(struc
 			if (is_in_use(list[i]) || cgminer_usb_lock(drv, list[i]) == false)
 				free(found);
 			else {
-				cgpu = device_detect(list[i], found);
-				if (!cgpu)
+				bool over;
+
+				/* Reserve a slot against the total limit -
+				 * authoritative, as other drivers may be
+				 * detecting at the same time */
+				mutex_lock(&usb_detect_lock);
+				over = total_count + usb_detect_reserved >= total_limit;
+				if (!over)
+					usb_detect_reserved++;
+				mutex_unlock(&usb_detect_lock);
+				if (over) {
+					applog(LOG_DEBUG, "USB scan devices2: total limit %d reached", total_limit);
 					cgminer_usb_unlock(drv, list[i]);
-				else {
-					cgpu->usbinfo.initialised = true;
-					total_count++;
-					drv_count[drv->drv_id].count++;
+					free(found);
+					break;
 				}
-				free(found);
+				jobs = realloc(jobs, sizeof(*jobs) * (njobs + 1));
+				if (unlikely(!jobs))
+					quit(1, "USB failed to realloc detect jobs");
+				jobs[njobs].device_detect = device_detect;
+				jobs[njobs].drv = drv;
+				jobs[njobs].dev = list[i];
+				jobs[njobs].found = found;
+				jobs[njobs].pth_valid = false;
+				njobs++;
 			}
 		}
 	}
 
+	/* Initialise the claimed devices in parallel so a hub full of
+	 * devices resetting together recovers in the time of the slowest
+	 * single device rather than the sum of all of them */
+	if (njobs == 1)
+		usb_detect_worker(&jobs[0]);
+	else if (njobs > 1) {
+		for (j = 0; j < njobs; j++) {
+			if (unlikely(pthread_create(&jobs[j].pth, NULL, usb_detect_worker, &jobs[j])))
+				usb_detect_worker(&jobs[j]);
+			else
+				jobs[j].pth_valid = true;
+		}
+		for (j = 0; j < njobs; j++) {
+			if (jobs[j].pth_valid)
+				pthread_join(jobs[j].pth, NULL);
+		}
+	}
+	free(jobs);
+
 	libusb_free_device_list(list, 1);
 }
 
@@ -2119,9 +2232,40 @@ static void modes_str(char *buf, uint32_t modes)
 // however that would require the stat() function to also lock and release
 // a mutex every time a usb read or write is called which would slow
 // things down more
+#if DO_USB_STATS
+/* Render a histogram as counts separated by '/' and return the upper bound in
+ * ms of the bucket holding the 99th percentile, or 0 with no samples */
+static double usb_lat_histogram(uint64_t *buckets, char *buf, size_t bufsiz)
+{
+	uint64_t total = 0, run = 0;
+	double p99 = 0.0;
+	size_t off = 0;
+	int i;
+
+	for (i = 0; i < USB_LAT_BUCKETS; i++)
+		total += buckets[i];
+
+	for (i = 0; i < USB_LAT_BUCKETS; i++) {
+		off += snprintf(buf + off, bufsiz - off, "%s%"PRIu64,
+				i ? "/" : "", buckets[i]);
+		run += buckets[i];
+		if (total && !p99 && run * 100 >= total * 99) {
+			if (i < USB_LAT_BUCKETS - 1)
+				p99 = usb_lat_bound[i];
+			else
+				p99 = usb_lat_bound[USB_LAT_BUCKETS - 2] * 2;
+		}
+	}
+
+	return p99;
+}
+#endif
+
 struct api_data *api_usb_stats(__maybe_unused int *count)
 {
 #if DO_USB_STATS
+	// Each device gets a slot per cmd/seq pair plus one latency record
+	const int slots = C_MAX * 2 + 1;
 	struct cg_usb_stats_details *details;
 	struct cg_usb_stats *sta;
 	struct api_data *root = NULL;
@@ -2132,13 +2276,38 @@ struct api_data *api_usb_stats(__maybe_unused int *count)
 	if (next_stat == USB_NOSTAT)
 		return NULL;
 
-	while (*count < next_stat * C_MAX * 2) {
-		device = *count / (C_MAX * 2);
-		cmdseq = *count % (C_MAX * 2);
+	while (*count < next_stat * slots) {
+		device = *count / slots;
+		cmdseq = *count % slots;
 
 		(*count)++;
 
-		sta = &(usb_stats[device]);
+		sta = usb_stats[device];
+
+		if (cmdseq == C_MAX * 2) {
+			char hist[USB_LAT_BUCKETS * 24];
+			double p99;
+			int i;
+			uint64_t tot = 0;
+
+			for (i = 0; i < USB_LAT_BUCKETS; i++)
+				tot += sta->lat_read[i] + sta->lat_write[i];
+			if (!tot)
+				continue;
+
+			root = api_add_string(root, "Name", sta->name, false);
+			root = api_add_int(root, "ID", &(sta->device_id), false);
+			root = api_add_const(root, "Stat", "Latency", false);
+			p99 = usb_lat_histogram(sta->lat_read, hist, sizeof(hist));
+			root = api_add_string(root, "Read Histogram", hist, true);
+			root = api_add_double(root, "Read P99 ms", &p99, true);
+			p99 = usb_lat_histogram(sta->lat_write, hist, sizeof(hist));
+			root = api_add_string(root, "Write Histogram", hist, true);
+			root = api_add_double(root, "Write P99 ms", &p99, true);
+
+			return root;
+		}
+
 		details = &(sta->details[cmdseq]);
 
 		// Only show stats that have results
@@ -2199,26 +2368,31 @@ struct api_data *api_usb_stats(__maybe_unused int *count)
 #if DO_USB_STATS
 static void newstats(struct cgpu_info *cgpu)
 {
+	struct cg_usb_stats *sta;
 	int i;
 
-	mutex_lock(&cgusb_lock);
+	sta = calloc(1, sizeof(*sta));
+	if (unlikely(!sta))
+		quit(1, "USB failed to calloc usb stats");
 
-	cgpu->usbinfo.usbstat = next_stat + 1;
+	sta->name = cgpu->drv->name;
+	sta->device_id = -1;
+	sta->details = calloc(2, sizeof(struct cg_usb_stats_details) * (C_MAX + 1));
+	if (unlikely(!sta->details))
+		quit(1, "USB failed to calloc stats details");
+
+	for (i = 1; i < C_MAX * 2; i += 2)
+		sta->details[i].seq = 1;
+
+	mutex_lock(&cgusb_lock);
 
 	usb_stats = realloc(usb_stats, sizeof(*usb_stats) * (next_stat+1));
 	if (unlikely(!usb_stats))
 		quit(1, "USB failed to realloc usb_stats %d", next_stat+1);
 
-	usb_stats[next_stat].name = cgpu->drv->name;
-	usb_stats[next_stat].device_id = -1;
-	usb_stats[next_stat].details = calloc(2, sizeof(struct cg_usb_stats_details) * (C_MAX + 1));
-	if (unlikely(!usb_stats[next_stat].details))
-		quit(1, "USB failed to calloc details for %d", next_stat+1);
-
-	for (i = 1; i < C_MAX * 2; i += 2)
-		usb_stats[next_stat].details[i].seq = 1;
-
-	next_stat++;
+	usb_stats[next_stat] = sta;
+	cgpu->usbinfo.usbstat = ++next_stat;
+	cgpu->usbinfo.stats = sta;
 
 	mutex_unlock(&cgusb_lock);
 }
@@ -2231,7 +2405,7 @@ void update_usb_stats(__maybe_unused struct cgpu_info *cgpu)
 		newstats(cgpu);
 
 	// we don't know the device_id until after add_cgpu()
-	usb_stats[cgpu->usbinfo.usbstat - 1].device_id = cgpu->device_id;
+	cgpu->usbinfo.stats->device_id = cgpu->device_id;
 #endif
 }
 
@@ -2275,11 +2449,20 @@ static void stats(struct cgpu_info *cgpu, struct timeval *tv_start, struct timev
 		}
 	}
 
-	details = &(usb_stats[cgpu->usbinfo.usbstat - 1].details[cmd * 2 + seq]);
+	details = &(cgpu->usbinfo.stats->details[cmd * 2 + seq]);
 	details->modes |= mode;
 
 	diff = tdiff(tv_finish, tv_start);
 
+	for (item = 0; item < USB_LAT_BUCKETS - 1; item++) {
+		if (SECTOMS(diff) < usb_lat_bound[item])
+			break;
+	}
+	if (mode & (MODE_BULK_READ | MODE_CTRL_READ))
+		cgpu->usbinfo.stats->lat_read[item]++;
+	else
+		cgpu->usbinfo.stats->lat_write[item]++;
+
 	switch (err) {
 		case LIBUSB_SUCCESS:
 			item = CMD_CMD;
@@ -2314,7 +2497,7 @@ static void rejected_inc(struct cgpu_info *cgpu, uint32_t mode)
 	if (cgpu->usbinfo.usbstat < 1)
 		newstats(cgpu);
 
-	details = &(usb_stats[cgpu->usbinfo.usbstat - 1].details[C_REJECTED * 2 + 0]);
+	details = &(cgpu->usbinfo.stats->details[C_REJECTED * 2 + 0]);
 	details->modes |= mode;
 	details->item[item].count++;
 }
@@ -2329,12 +2512,73 @@ struct usb_transfer {
 	struct list_head list;
 };
 
+/* Read-ahead engine: bulk IN endpoints keep several transfers submitted at
+ * all times so data the device sends is picked up by the usb polling thread
+ * the moment it arrives, instead of waiting for the driver thread to come
+ * back around and post the next read. Completed chunks are queued per
+ * endpoint and _usb_read() consumes them in order. */
+#define USB_RA_TRANSFERS 3
+#define USB_RA_QUEUE 8
+#define USB_RA_BUFSIZ 512
+
+struct usb_ra_chunk {
+	int len;
+	unsigned char buf[USB_RA_BUFSIZ];
+};
+
+struct usb_ra_xfer {
+	struct usb_readahead *ra;
+	struct libusb_transfer *transfer;
+	bool inflight;
+	unsigned char buf[USB_RA_BUFSIZ];
+};
+
+struct usb_readahead {
+	libusb_device_handle *handle;
+	unsigned char ep;
+	int intinfo;
+	int epinfo;
+	/* Priority class: interrupt endpoints carry urgent events, are armed
+	 * from device init and never wait behind bulk traffic since every
+	 * endpoint completes into its own queue */
+	bool interrupt;
+	bool active;
+	int error;
+	int inflight;
+	/* A reader blocked on the sem that may be aborted early by
+	 * cancel_usb_transfers() */
+	bool wait_cancellable;
+	bool cancelled;
+	struct usb_ra_xfer xfers[USB_RA_TRANSFERS];
+	struct usb_ra_chunk queue[USB_RA_QUEUE];
+	int qhead;
+	int qtail;
+	int qcount;
+	pthread_mutex_t lock;
+	cgsem_t sem;
+	struct list_head list;
+};
+
+/* Protected by cgusb_fd_lock like ut_list */
+static struct list_head ra_list;
+/* Set once at shutdown to stop any further submissions */
+static bool ra_shutdown;
+
 bool async_usb_transfers(void)
 {
+	struct usb_readahead *ra;
 	bool ret;
 
 	cg_rlock(&cgusb_fd_lock);
 	ret = !list_empty(&ut_list);
+	if (!ret) {
+		list_for_each_entry(ra, &ra_list, list) {
+			if (ra->inflight) {
+				ret = true;
+				break;
+			}
+		}
+	}
 	cg_runlock(&cgusb_fd_lock);
 
 	return ret;
@@ -2346,6 +2590,7 @@ bool async_usb_transfers(void)
  * driver wishes it be aborted if work restart message has been sent. */
 void cancel_usb_transfers(void)
 {
+	struct usb_readahead *ra;
 	struct usb_transfer *ut;
 	int cancellations = 0;
 
@@ -2357,6 +2602,18 @@ void cancel_usb_transfers(void)
 			cancellations++;
 		}
 	}
+	/* Read-ahead transfers stay submitted so don't touch them - wake any
+	 * reader that flagged its wait as cancellable instead */
+	list_for_each_entry(ra, &ra_list, list) {
+		mutex_lock(&ra->lock);
+		if (ra->wait_cancellable) {
+			ra->wait_cancellable = false;
+			ra->cancelled = true;
+			cgsem_post(&ra->sem);
+			cancellations++;
+		}
+		mutex_unlock(&ra->lock);
+	}
 	cg_wunlock(&cgusb_fd_lock);
 
 	if (cancellations)
@@ -2421,6 +2678,248 @@ static int usb_transfer_toerr(int ret)
 	return ret;
 }
 
+static void LIBUSB_CALL usb_ra_callback(struct libusb_transfer *transfer);
+
+/* Keep reads submitted on the endpoint, but never more than the completion
+ * queue has room to land. Called with the ra lock held. */
+static void usb_ra_topup(struct usb_readahead *ra)
+{
+	struct usb_ra_xfer *rx;
+	int i, err;
+
+	if (!ra->active || ra->error || ra_shutdown)
+		return;
+
+	for (i = 0; i < USB_RA_TRANSFERS; i++) {
+		rx = &ra->xfers[i];
+		if (rx->inflight)
+			continue;
+		if (ra->inflight + ra->qcount >= USB_RA_QUEUE)
+			break;
+		if (ra->interrupt)
+			libusb_fill_interrupt_transfer(rx->transfer, ra->handle,
+						       ra->ep, rx->buf,
+						       USB_RA_BUFSIZ,
+						       usb_ra_callback, rx, 0);
+		else
+			libusb_fill_bulk_transfer(rx->transfer, ra->handle, ra->ep,
+						  rx->buf, USB_RA_BUFSIZ,
+						  usb_ra_callback, rx, 0);
+		err = libusb_submit_transfer(rx->transfer);
+		if (err) {
+			ra->error = usb_transfer_toerr(err);
+			break;
+		}
+		rx->inflight = true;
+		ra->inflight++;
+	}
+}
+
+static void LIBUSB_CALL usb_ra_callback(struct libusb_transfer *transfer)
+{
+	struct usb_ra_xfer *rx = transfer->user_data;
+	struct usb_readahead *ra = rx->ra;
+	struct usb_ra_chunk *chunk;
+
+	mutex_lock(&ra->lock);
+	rx->inflight = false;
+	ra->inflight--;
+	switch (transfer->status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			/* topup() never submits more than the queue can land
+			 * so there is always room here */
+			chunk = &ra->queue[ra->qhead];
+			chunk->len = transfer->actual_length;
+			memcpy(chunk->buf, rx->buf, chunk->len);
+			ra->qhead = (ra->qhead + 1) % USB_RA_QUEUE;
+			ra->qcount++;
+			break;
+		case LIBUSB_TRANSFER_CANCELLED:
+			// Shutdown or device teardown - don't resubmit
+			break;
+		default:
+			ra->error = usb_transfer_toerr(transfer->status);
+			break;
+	}
+	usb_ra_topup(ra);
+	cgsem_post(&ra->sem);
+	mutex_unlock(&ra->lock);
+}
+
+/* Find or create the read-ahead state for an endpoint. Returns NULL if the
+ * endpoint isn't suitable, leaving the caller on the synchronous path. */
+static struct usb_readahead *usb_ra_get(struct cg_usb_device *usbdev, int intinfo, int epinfo)
+{
+	struct usb_epinfo *usb_epinfo = &(usbdev->found->intinfos[intinfo].epinfos[epinfo]);
+	struct usb_readahead *ra;
+	int i;
+
+	if (ra_shutdown)
+		return NULL;
+	if (usb_epinfo->att != LIBUSB_TRANSFER_TYPE_BULK &&
+	    usb_epinfo->att != LIBUSB_TRANSFER_TYPE_INTERRUPT)
+		return NULL;
+	if ((usb_epinfo->ep & LIBUSB_ENDPOINT_DIR_MASK) != LIBUSB_ENDPOINT_IN)
+		return NULL;
+
+	for (i = 0; i < USB_RA_ENDPOINTS; i++) {
+		ra = usbdev->readahead[i];
+		if (!ra)
+			break;
+		if (ra->intinfo == intinfo && ra->epinfo == epinfo)
+			return ra;
+	}
+	if (i == USB_RA_ENDPOINTS)
+		return NULL;
+
+	ra = calloc(1, sizeof(*ra));
+	if (unlikely(!ra))
+		quit(1, "Failed to calloc usb_readahead");
+	ra->handle = usbdev->handle;
+	ra->ep = usb_epinfo->ep;
+	ra->intinfo = intinfo;
+	ra->epinfo = epinfo;
+	ra->interrupt = (usb_epinfo->att == LIBUSB_TRANSFER_TYPE_INTERRUPT);
+	mutex_init(&ra->lock);
+	cgsem_init(&ra->sem);
+	for (i = 0; i < USB_RA_TRANSFERS; i++) {
+		ra->xfers[i].ra = ra;
+		ra->xfers[i].transfer = libusb_alloc_transfer(0);
+		if (unlikely(!ra->xfers[i].transfer))
+			quit(1, "Failed to libusb_alloc_transfer for read-ahead");
+	}
+	ra->active = true;
+
+	cg_wlock(&cgusb_fd_lock);
+	list_add(&ra->list, &ra_list);
+	cg_wunlock(&cgusb_fd_lock);
+
+	for (i = 0; i < USB_RA_ENDPOINTS; i++) {
+		if (!usbdev->readahead[i]) {
+			usbdev->readahead[i] = ra;
+			break;
+		}
+	}
+
+	mutex_lock(&ra->lock);
+	usb_ra_topup(ra);
+	mutex_unlock(&ra->lock);
+
+	return ra;
+}
+
+/* Take the next completed chunk off the endpoint queue, waiting up to timeout
+ * for one to land. Timeout semantics match usb_bulk_transfer(). */
+static int usb_ra_read(struct usb_readahead *ra, unsigned char *buf, int bufsiz,
+		       int *transferred, unsigned int timeout, bool cancellable)
+{
+	struct usb_ra_chunk *chunk;
+	int err, ret;
+
+	*transferred = 0;
+
+	mutex_lock(&ra->lock);
+	usb_ra_topup(ra);
+	while (!ra->qcount) {
+		if (ra->error) {
+			err = ra->error;
+			mutex_unlock(&ra->lock);
+			return err;
+		}
+		ra->wait_cancellable = cancellable;
+		ra->cancelled = false;
+		mutex_unlock(&ra->lock);
+		ret = cgsem_mswait(&ra->sem, timeout);
+		mutex_lock(&ra->lock);
+		ra->wait_cancellable = false;
+		if (ra->qcount)
+			break;
+		if (ret == ETIMEDOUT || ra->cancelled) {
+			mutex_unlock(&ra->lock);
+			return LIBUSB_ERROR_TIMEOUT;
+		}
+	}
+	chunk = &ra->queue[ra->qtail];
+	if (unlikely(chunk->len > bufsiz))
+		chunk->len = bufsiz;
+	memcpy(buf, chunk->buf, chunk->len);
+	*transferred = chunk->len;
+	ra->qtail = (ra->qtail + 1) % USB_RA_QUEUE;
+	ra->qcount--;
+	usb_ra_topup(ra);
+	mutex_unlock(&ra->lock);
+
+	return LIBUSB_SUCCESS;
+}
+
+/* Tear down all read-ahead state for a device before its handle is closed.
+ * Cancelled transfers complete in the usb polling thread so wait for them. */
+static void usb_ra_free(struct cg_usb_device *usbdev)
+{
+	struct usb_readahead *ra;
+	int i, j, limit;
+
+	for (i = 0; i < USB_RA_ENDPOINTS; i++) {
+		ra = usbdev->readahead[i];
+		if (!ra)
+			continue;
+		usbdev->readahead[i] = NULL;
+
+		mutex_lock(&ra->lock);
+		ra->active = false;
+		for (j = 0; j < USB_RA_TRANSFERS; j++) {
+			if (ra->xfers[j].inflight)
+				libusb_cancel_transfer(ra->xfers[j].transfer);
+		}
+		mutex_unlock(&ra->lock);
+
+		limit = 0;
+		while (++limit < 100) {
+			mutex_lock(&ra->lock);
+			j = ra->inflight;
+			mutex_unlock(&ra->lock);
+			if (!j)
+				break;
+			cgsleep_ms(10);
+		}
+		if (unlikely(j)) {
+			applog(LOG_ERR, "USB read-ahead gave up waiting for %d transfers", j);
+			continue;
+		}
+
+		cg_wlock(&cgusb_fd_lock);
+		list_del(&ra->list);
+		cg_wunlock(&cgusb_fd_lock);
+
+		for (j = 0; j < USB_RA_TRANSFERS; j++)
+			libusb_free_transfer(ra->xfers[j].transfer);
+		cgsem_destroy(&ra->sem);
+		free(ra);
+	}
+}
+
+/* Called once from the usb polling thread at shutdown, after which it keeps
+ * handling events until async_usb_transfers() reports all complete. */
+void usb_ra_shutdown_all(void)
+{
+	struct usb_readahead *ra;
+	int i;
+
+	ra_shutdown = true;
+
+	cg_wlock(&cgusb_fd_lock);
+	list_for_each_entry(ra, &ra_list, list) {
+		mutex_lock(&ra->lock);
+		ra->active = false;
+		for (i = 0; i < USB_RA_TRANSFERS; i++) {
+			if (ra->xfers[i].inflight)
+				libusb_cancel_transfer(ra->xfers[i].transfer);
+		}
+		mutex_unlock(&ra->lock);
+	}
+	cg_wunlock(&cgusb_fd_lock);
+}
+
 /* Wait for callback function to tell us it has finished the USB transfer, but
  * use our own timer to cancel the request if we go beyond the timeout. */
 static int callback_wait(struct usb_transfer *ut, int *transferred, unsigned int timeout)
@@ -2467,6 +2966,47 @@ static int usb_submit_transfer(struct usb_transfer *ut, struct libusb_transfer *
 	return err;
 }
 
+#define USB_XFERBUF_ALIGN 4096
+
+/* Claim the device's persistent transfer buffer for one direction, growing it
+ * if this transfer is larger than anything seen before. Returns NULL if the
+ * buffer is already claimed by a concurrent transfer. */
+static unsigned char *usb_xferbuf_get(struct cg_usb_device *usbdev, int dir, size_t len)
+{
+	if (__sync_lock_test_and_set(&usbdev->xferbuf_busy[dir], 1))
+		return NULL;
+
+	if (usbdev->xferbufsiz[dir] < len) {
+		size_t siz = USB_XFERBUF_ALIGN;
+		void *p;
+
+		while (siz < len)
+			siz <<= 1;
+#ifdef WIN32
+		_aligned_free(usbdev->xferbuf[dir]);
+		p = _aligned_malloc(siz, USB_XFERBUF_ALIGN);
+		if (unlikely(!p)) {
+#else
+		free(usbdev->xferbuf[dir]);
+		if (unlikely(posix_memalign(&p, USB_XFERBUF_ALIGN, siz))) {
+#endif
+			usbdev->xferbuf[dir] = NULL;
+			usbdev->xferbufsiz[dir] = 0;
+			__sync_lock_release(&usbdev->xferbuf_busy[dir]);
+			return NULL;
+		}
+		usbdev->xferbuf[dir] = p;
+		usbdev->xferbufsiz[dir] = siz;
+	}
+
+	return usbdev->xferbuf[dir];
+}
+
+static void usb_xferbuf_put(struct cg_usb_device *usbdev, int dir)
+{
+	__sync_lock_release(&usbdev->xferbuf_busy[dir]);
+}
+
 static int
 usb_bulk_transfer(struct cgpu_info *cgpu, struct cg_usb_device *usbdev, int intinfo,
 		  int epinfo, unsigned char *data, int length, int *transferred,
@@ -2482,7 +3022,9 @@ usb_bulk_transfer(struct cgpu_info *cgpu, struct cg_usb_device *usbdev, int inti
 #if DO_USB_STATS
 	struct timeval tv_start, tv_finish;
 #endif
-	unsigned char buf[512];
+	unsigned char stackbuf[512], *buf = stackbuf;
+	bool pooled = false;
+	int dir;
 #ifdef WIN32
 	/* On windows the callback_timeout is a safety mechanism only. */
 	bulk_timeout = timeout;
@@ -2500,6 +3042,19 @@ usb_bulk_transfer(struct cgpu_info *cgpu, struct cg_usb_device *usbdev, int inti
 	 * thread to be shut down after all existing transfers are complete */
 	if (opt_lowmem || cgpu->shutdown)
 		return libusb_bulk_transfer(dev_handle, endpoint, data, length, transferred, timeout);
+
+	/* Prefer the device's persistent page aligned buffer, falling back to
+	 * the stack, or the heap for batched writes that exceed it */
+	dir = ((endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT) ? 1 : 0;
+	buf = usb_xferbuf_get(usbdev, dir, length);
+	if (buf)
+		pooled = true;
+	else if (length > (int)sizeof(stackbuf)) {
+		buf = malloc(length);
+		if (unlikely(!buf))
+			quit(1, "Failed to malloc usb transfer buffer");
+	} else
+		buf = stackbuf;
 pipe_retry:
 	init_usb_transfer(&ut);
 
@@ -2562,24 +3117,261 @@ pipe_retry:
 	if ((endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
 		memcpy(data, buf, *transferred);
 
+	if (pooled)
+		usb_xferbuf_put(usbdev, dir);
+	else if (buf != stackbuf)
+		free(buf);
+
 	return err;
 }
 
+/* Append received bytes at the ring head, handling the wrap. The ring is
+ * sized so this cannot overflow while reads are capped at USB_MAX_READ. */
+static void usb_ring_append(struct cg_usb_device *usbdev, const unsigned char *data, uint32_t len)
+{
+	uint32_t off = usbdev->ring_in & USB_RINGMASK;
+	uint32_t seg = USB_RINGSIZE - off;
+
+	if (unlikely(len > USB_RINGSIZE - (usbdev->ring_in - usbdev->ring_out))) {
+		// Should be unreachable - drop the oldest data rather than the newest
+		usbdev->ring_out = usbdev->ring_in + len - USB_RINGSIZE;
+	}
+	if (seg > len)
+		seg = len;
+	memcpy(usbdev->ringbuf + off, data, seg);
+	if (len > seg)
+		memcpy(usbdev->ringbuf, data + seg, len - seg);
+	usbdev->ring_in += len;
+}
+
+/* Copy len buffered bytes out to dest and consume them */
+static void usb_ring_copy(struct cg_usb_device *usbdev, char *dest, uint32_t len)
+{
+	uint32_t off = usbdev->ring_out & USB_RINGMASK;
+	uint32_t seg = USB_RINGSIZE - off;
+
+	if (seg > len)
+		seg = len;
+	memcpy(dest, usbdev->ringbuf + off, seg);
+	if (len > seg)
+		memcpy(dest + seg, usbdev->ringbuf, len - seg);
+	usbdev->ring_out += len;
+}
+
+/* Search the buffered data for the end marker starting at absolute cursor
+ * position from. Returns the absolute position just past the marker, or -1 */
+static int64_t usb_ring_find(struct cg_usb_device *usbdev, const char *end, int endlen, uint32_t from)
+{
+	uint32_t pos, i;
+
+	if (usbdev->ring_in - from > usbdev->ring_in - usbdev->ring_out)
+		from = usbdev->ring_out;
+	for (pos = from; usbdev->ring_in - pos >= (uint32_t)endlen; pos++) {
+		for (i = 0; i < (uint32_t)endlen; i++) {
+			if (usbdev->ringbuf[(pos + i) & USB_RINGMASK] != end[i])
+				break;
+		}
+		if (i == (uint32_t)endlen)
+			return (int64_t)((uint32_t)(pos + endlen));
+	}
+	return -1;
+}
+
+/* Adaptive FTDI latency timer tuning. The static find_dev latency is one
+ * size fits all, but the timer adds up to its full value to every read
+ * that doesn't fill a 64 byte packet, which on result endpoints is pure
+ * added latency. Completed reads feed a running estimate of the device's
+ * message size and cadence; devices streaming full packets keep the table
+ * value since their packets flush on size, while devices exchanging small
+ * messages get the timer tightened to a small fraction of their measured
+ * cadence so the flush delay stops dominating result latency. Read
+ * chunking needs no equivalent tuning as bulk reads already complete on
+ * the short packet each flush produces. */
+
+/* Reconsider the timer every this many completed reads */
+#define FTDI_TUNE_MSGS 64
+/* Mean sizes at or above this are streaming full 64 byte packets */
+#define FTDI_TUNE_BULK_SIZ 64
+#define FTDI_TUNE_MIN_LATENCY 2
+/* Tuned timer is this fraction of the measured message cadence */
+#define FTDI_TUNE_GAP_DIV 32
+/* Gaps beyond this are idle time, not message cadence */
+#define FTDI_TUNE_MAX_GAP 5000.0
+
+/* Fold one completed read into the cadence estimate and return the newly
+ * wanted latency timer value, or 0 for no change. Called with the device
+ * read lock held. */
+static uint16_t usb_ftdi_sample(struct cg_usb_device *usbdev, int tot)
+{
+	struct timeval now;
+	uint16_t cur, want;
+
+	cgtime(&now);
+	if (usbdev->tune_last_msg.tv_sec) {
+		double gap = tdiff(&now, &usbdev->tune_last_msg) * 1000.0;
+
+		if (gap <= FTDI_TUNE_MAX_GAP) {
+			if (usbdev->tune_gap_ema)
+				usbdev->tune_gap_ema += (gap - usbdev->tune_gap_ema) / 8;
+			else
+				usbdev->tune_gap_ema = gap;
+			usbdev->tune_siz_ema += ((double)tot - usbdev->tune_siz_ema) / 8;
+			usbdev->tune_msgs++;
+		}
+	}
+	copy_time(&usbdev->tune_last_msg, &now);
+
+	if (usbdev->tune_msgs < FTDI_TUNE_MSGS)
+		return 0;
+	usbdev->tune_msgs = 0;
+
+	if (usbdev->tune_siz_ema >= FTDI_TUNE_BULK_SIZ)
+		want = usbdev->found->latency;
+	else {
+		want = usbdev->tune_gap_ema / FTDI_TUNE_GAP_DIV;
+		if (want < FTDI_TUNE_MIN_LATENCY)
+			want = FTDI_TUNE_MIN_LATENCY;
+		if (want > usbdev->found->latency)
+			want = usbdev->found->latency;
+	}
+	cur = usbdev->tuned_latency ? : usbdev->found->latency;
+	if (want == cur)
+		return 0;
+	return want;
+}
+
+static void usb_ftdi_apply_latency(struct cgpu_info *cgpu, int intinfo, uint16_t latency);
+
+/* Adaptive transfer timeouts. The static find_dev timeouts are one size
+ * fits all upper bounds, so a dying device blocks its read thread for the
+ * full table value on every poll while its healthy siblings on the same
+ * code paths wait behind it. Completed reads feed a per endpoint response
+ * time estimate, and default timeout waits are capped at that estimate
+ * plus a wide deviation margin. Expiry of a tightened timeout is never
+ * trusted as device death - the endpoint simply gets the full static
+ * timeout back until it responds again - and only repeated zero byte
+ * expiries of the full timeout on a previously responsive endpoint of a
+ * device that has gone silent everywhere escalate into the NODEV recovery
+ * path. Writes keep the static timeout as they already treat any timeout
+ * as unrecoverable. */
+
+/* Don't tighten below this many completed reads on the endpoint */
+#define USB_EPTIME_MIN_SAMPLES 16
+#define USB_EPTIME_EMA_DIV 8
+/* Tightened timeout is the estimate plus this many deviations */
+#define USB_EPTIME_DEV_MARGIN 8
+/* Floor in ms on any tightened timeout */
+#define USB_EPTIME_MIN_TMO 20
+/* Consecutive full timeout expiries before escalating */
+#define USB_EPTIME_HARD_FAILS 10
+/* Seconds without data on any endpoint before escalating */
+#define USB_EPTIME_DEAD_SECS 30
+
+static struct usb_eptime *usb_eptime_get(struct cg_usb_device *usbdev, int intinfo, int epinfo)
+{
+	struct usb_eptime *et;
+	int i;
+
+	for (i = 0; i < USB_EPTIME_SLOTS; i++) {
+		et = &usbdev->eptimes[i];
+		if (!et->used)
+			break;
+		if (et->intinfo == intinfo && et->epinfo == epinfo)
+			return et;
+	}
+	if (i == USB_EPTIME_SLOTS)
+		return NULL;
+
+	et->intinfo = intinfo;
+	et->epinfo = epinfo;
+	et->used = true;
+	return et;
+}
+
+/* Return the timeout to wait for on this endpoint, tightened from the
+ * response time estimate once it is established and trusted */
+static unsigned int usb_eptime_timeout(struct usb_eptime *et, unsigned int timeout)
+{
+	double want;
+
+	if (et->samples < USB_EPTIME_MIN_SAMPLES || et->soft_fails)
+		return timeout;
+	want = et->rt_ema + USB_EPTIME_DEV_MARGIN * et->rt_dev;
+	if (want < USB_EPTIME_MIN_TMO)
+		want = USB_EPTIME_MIN_TMO;
+	/* An estimate beyond the table value means the table value is the
+	 * one that is too tight - allow up to double it */
+	if (want > timeout * 2)
+		want = timeout * 2;
+	return want;
+}
+
+/* Fold one completed read into the endpoint's response time estimate, or
+ * account a timeout against it. Returns err, escalated to NO_DEVICE when
+ * a previously responsive endpoint has seen enough consecutive full
+ * timeout expiries on a device silent on all endpoints. Called with the
+ * device read lock held. */
+static int usb_eptime_sample(struct cgpu_info *cgpu, struct usb_eptime *et,
+			     int err, int tot, double elapsed_ms, bool tightened)
+{
+	struct cg_usb_device *usbdev = cgpu->usbdev;
+	struct timeval now;
+
+	if (tot > 0 && !err) {
+		if (!et->samples) {
+			et->rt_ema = elapsed_ms;
+			et->rt_dev = elapsed_ms / 2;
+		} else {
+			et->rt_dev += (fabs(elapsed_ms - et->rt_ema) - et->rt_dev) / USB_EPTIME_EMA_DIV;
+			et->rt_ema += (elapsed_ms - et->rt_ema) / USB_EPTIME_EMA_DIV;
+		}
+		if (et->samples < USB_EPTIME_MIN_SAMPLES)
+			et->samples++;
+		et->soft_fails = et->hard_fails = 0;
+		cgtime(&usbdev->eptime_last_data);
+		return err;
+	}
+
+	if (err != LIBUSB_ERROR_TIMEOUT || tot)
+		return err;
+
+	if (tightened) {
+		et->soft_fails++;
+		return err;
+	}
+	if (et->samples < USB_EPTIME_MIN_SAMPLES)
+		return err;
+	if (++et->hard_fails < USB_EPTIME_HARD_FAILS)
+		return err;
+	cgtime(&now);
+	if (usbdev->eptime_last_data.tv_sec &&
+	    tdiff(&now, &usbdev->eptime_last_data) < USB_EPTIME_DEAD_SECS)
+		return err;
+	applog(LOG_WARNING, "%s %i: unresponsive for %d full timeouts, releasing device",
+	       cgpu->drv->name, cgpu->device_id, et->hard_fails);
+	return LIBUSB_ERROR_NO_DEVICE;
+}
+
 int _usb_read(struct cgpu_info *cgpu, int intinfo, int epinfo, char *buf, size_t bufsiz, int *processed, int timeout, const char *end, enum usb_cmds cmd, bool readonce, bool cancellable)
 {
-	unsigned char *ptr, usbbuf[USB_READ_BUFSIZE];
+	unsigned char *ptr, *data, usbbuf[512 + 4];
 	struct timeval read_start, tv_finish;
-	int bufleft, err, got, tot, pstate;
 	const size_t usbbufread = 512; /* Always read full size */
+	struct usb_readahead *ra = NULL;
+	struct usb_eptime *et = NULL;
 	struct cg_usb_device *usbdev;
 	unsigned int initial_timeout;
+	int err, got, tot, pstate;
+	bool tightened = false;
+	int64_t eompos = -1;
+	uint16_t tune = 0;
 	bool first = true;
+	uint32_t avail;
 	int endlen = 0;
-	char *eom = NULL;
 	double done;
 	bool ftdi;
 
-	memset(usbbuf, 0, USB_READ_BUFSIZE);
+	memset(usbbuf, 0, sizeof(usbbuf));
 	memset(buf, 0, bufsiz);
 
 	if (end)
@@ -2603,26 +3395,42 @@ int _usb_read(struct cgpu_info *cgpu, int intinfo, int epinfo, char *buf, size_t
 	if (bufsiz > USB_MAX_READ)
 		quit(1, "%s USB read request %d too large (max=%d)", cgpu->drv->name, (int)bufsiz, USB_MAX_READ);
 
-	if (timeout == DEVTIMEOUT)
+	/* Only adapt the table timeout - explicit driver timeouts are
+	 * deliberate and respected as given */
+	if (timeout == DEVTIMEOUT) {
 		timeout = usbdev->found->timeout;
+		et = usb_eptime_get(usbdev, intinfo, epinfo);
+		if (et) {
+			unsigned int want = usb_eptime_timeout(et, timeout);
 
-	tot = usbdev->bufamt;
-	bufleft = bufsiz - tot;
-	if (tot)
-		memcpy(usbbuf, usbdev->buffer, tot);
-	ptr = usbbuf + tot;
-	usbdev->bufamt = 0;
+			tightened = (want < (unsigned int)timeout);
+			timeout = want;
+		}
+	}
+
+#ifndef WIN32
+	/* On windows the synchronous path's callback timeout safety nets are
+	 * still wanted, so only read ahead elsewhere */
+	if (!opt_lowmem && !cgpu->shutdown)
+		ra = usb_ra_get(usbdev, intinfo, epinfo);
+#endif
+
+	ptr = usbbuf;
 
 	err = LIBUSB_SUCCESS;
 	if (end != NULL)
-		eom = strstr((const char *)usbbuf, end);
+		eompos = usb_ring_find(usbdev, end, endlen, usbdev->ring_out);
 
 	initial_timeout = timeout;
 	cgtime(&read_start);
-	while (bufleft > 0 && !eom) {
-		err = usb_bulk_transfer(cgpu, usbdev, intinfo, epinfo, ptr, usbbufread,
-					&got, timeout, MODE_BULK_READ, cmd,
-					first ? SEQ0 : SEQ1, cancellable, false);
+	while (usbdev->ring_in - usbdev->ring_out < (uint32_t)bufsiz && eompos < 0) {
+		if (ra)
+			err = usb_ra_read(ra, ptr, usbbufread, &got, timeout,
+					  cancellable);
+		else
+			err = usb_bulk_transfer(cgpu, usbdev, intinfo, epinfo, ptr, usbbufread,
+						&got, timeout, MODE_BULK_READ, cmd,
+						first ? SEQ0 : SEQ1, cancellable, false);
 		cgtime(&tv_finish);
 		ptr[got] = '\0';
 
@@ -2630,20 +3438,26 @@ int _usb_read(struct cgpu_info *cgpu, int intinfo, int epinfo, char *buf, size_t
 
 		IOERR_CHECK(cgpu, err);
 
+		data = ptr;
 		if (ftdi) {
 			// first 2 bytes returned are an FTDI status
 			if (got > 2) {
+				data = ptr + 2;
 				got -= 2;
-				memmove(ptr, ptr+2, got+1);
-			} else {
+			} else
 				got = 0;
-				*ptr = '\0';
-			}
 		}
 
-		tot += got;
-		if (end != NULL)
-			eom = strstr((const char *)usbbuf, end);
+		if (got) {
+			/* Only scan the new data for the end marker, backing
+			 * up far enough to catch one split across reads */
+			uint32_t back = endlen ? (uint32_t)endlen - 1 : 0;
+
+			usb_ring_append(usbdev, data, got);
+			if (end != NULL)
+				eompos = usb_ring_find(usbdev, end, endlen,
+						       usbdev->ring_in - got - back);
+		}
 
 		/* Attempt a usb reset for an error that will otherwise cause
 		 * this device to drop out provided we know the device still
@@ -2660,9 +3474,6 @@ int _usb_read(struct cgpu_info *cgpu, int intinfo, int epinfo, char *buf, size_t
 		if (err || readonce)
 			break;
 
-		ptr += got;
-		bufleft -= got;
-
 		first = false;
 
 		done = tdiff(&tv_finish, &read_start);
@@ -2674,8 +3485,8 @@ int _usb_read(struct cgpu_info *cgpu, int intinfo, int epinfo, char *buf, size_t
 
 	/* If we found the end of message marker, just use that data and
 	 * return success. */
-	if (eom) {
-		size_t eomlen = (void *)eom - (void *)usbbuf + endlen;
+	if (eompos >= 0) {
+		size_t eomlen = (uint32_t)eompos - usbdev->ring_out;
 
 		if (eomlen < bufsiz) {
 			bufsiz = eomlen;
@@ -2683,18 +3494,33 @@ int _usb_read(struct cgpu_info *cgpu, int intinfo, int epinfo, char *buf, size_t
 		}
 	}
 
-	// N.B. usbdev->buffer was emptied before the while() loop
+	avail = usbdev->ring_in - usbdev->ring_out;
+	tot = avail;
 	if (tot > (int)bufsiz) {
-		usbdev->bufamt = tot - bufsiz;
-		memcpy(usbdev->buffer, usbbuf + bufsiz, usbdev->bufamt);
-		tot -= usbdev->bufamt;
-		usbbuf[tot] = '\0';
+		// Anything past the returned message just stays in the ring
+		tot = bufsiz;
 		applog(LOG_DEBUG, "USB: %s%i read1 buffering %d extra bytes",
-			cgpu->drv->name, cgpu->device_id, usbdev->bufamt);
+			cgpu->drv->name, cgpu->device_id, (int)(avail - tot));
 	}
 
+	usb_ring_copy(usbdev, (char *)buf, tot);
+	if (tot < (int)bufsiz)
+		buf[tot] = '\0';
+
 	*processed = tot;
-	memcpy((char *)buf, (const char *)usbbuf, (tot < (int)bufsiz) ? tot + 1 : (int)bufsiz);
+
+	if (et) {
+		struct timeval tv_now;
+
+		cgtime(&tv_now);
+		err = usb_eptime_sample(cgpu, et, err, tot,
+					tdiff(&tv_now, &read_start) * 1000.0,
+					tightened);
+	}
+
+	/* Feed completed reads to the latency timer tuner */
+	if (ftdi && tot > 0 && !err)
+		tune = usb_ftdi_sample(usbdev, tot);
 
 out_noerrmsg:
 	if (NODEV(err)) {
@@ -2704,6 +3530,9 @@ out_noerrmsg:
 	} else
 		DEVRUNLOCK(cgpu, pstate);
 
+	if (tune)
+		usb_ftdi_apply_latency(cgpu, intinfo, tune);
+
 	return err;
 }
 
@@ -2804,6 +3633,46 @@ out_noerrmsg:
 	return err;
 }
 
+/* Coalesce multiple pre-marshalled frames into a single bulk write so
+ * refilling a deep device queue isn't one bus round trip per work item.
+ * The caller declares its framing by how it splits the frames - the device
+ * just sees them back to back in one transfer. */
+int _usb_write_batch(struct cgpu_info *cgpu, int intinfo, int epinfo,
+		     const struct usb_batch_frame *frames, int nframes,
+		     int *processed, int timeout, enum usb_cmds cmd)
+{
+	char stackbuf[1024], *buf = stackbuf;
+	size_t tot = 0;
+	int i, err;
+
+	for (i = 0; i < nframes; i++)
+		tot += frames[i].len;
+
+	if (unlikely(!tot)) {
+		*processed = 0;
+		return LIBUSB_SUCCESS;
+	}
+
+	if (tot > sizeof(stackbuf)) {
+		buf = malloc(tot);
+		if (unlikely(!buf))
+			quit(1, "Failed to malloc usb batch buffer");
+	}
+
+	tot = 0;
+	for (i = 0; i < nframes; i++) {
+		memcpy(buf + tot, frames[i].buf, frames[i].len);
+		tot += frames[i].len;
+	}
+
+	err = _usb_write(cgpu, intinfo, epinfo, buf, tot, processed, timeout, cmd);
+
+	if (buf != stackbuf)
+		free(buf);
+
+	return err;
+}
+
 /* As we do for bulk reads, emulate a sync function for control transfers using
  * our own timeouts that takes the same parameters as libusb_control_transfer.
  */
@@ -2995,6 +3864,31 @@ int usb_ftdi_cts(struct cgpu_info *cgpu)
 	return (ret & FTDI_RS0_CTS);
 }
 
+/* Program a tuned latency timer value arrived at by usb_ftdi_sample() */
+static void usb_ftdi_apply_latency(struct cgpu_info *cgpu, int intinfo, uint16_t latency)
+{
+	int err, pstate;
+
+	DEVWLOCK(cgpu, pstate);
+
+	if (cgpu->usbdev && cgpu->usbdev->usb_type == USB_TYPE_FTDI &&
+	    cgpu->usbdev->found->latency != LATENCY_UNUSED) {
+		err = __usb_transfer(cgpu, FTDI_TYPE_OUT, FTDI_REQUEST_LATENCY,
+					latency, USBIF(cgpu->usbdev, intinfo),
+					NULL, 0, DEVTIMEOUT, C_LATENCY);
+		if (!err) {
+			cgpu->usbdev->tuned_latency = latency;
+			applog(LOG_INFO, "%s %d: tuned FTDI latency timer to %ums"
+			       " (mean msg %.0f bytes every %.0fms)",
+			       cgpu->drv->name, cgpu->device_id, latency,
+			       cgpu->usbdev->tune_siz_ema,
+			       cgpu->usbdev->tune_gap_ema);
+		}
+	}
+
+	DEVWUNLOCK(cgpu, pstate);
+}
+
 int _usb_ftdi_set_latency(struct cgpu_info *cgpu, int intinfo)
 {
 	int err = 0;
@@ -3018,6 +3912,12 @@ int _usb_ftdi_set_latency(struct cgpu_info *cgpu, int intinfo)
 						cgpu->usbdev->found->latency,
 						USBIF(cgpu->usbdev, intinfo),
 						NULL, 0, DEVTIMEOUT, C_LATENCY);
+
+		/* Back to the table value; restart the adaptive tuner */
+		if (!err) {
+			cgpu->usbdev->tuned_latency = 0;
+			cgpu->usbdev->tune_msgs = 0;
+		}
 	}
 
 	DEVWUNLOCK(cgpu, pstate);
@@ -3036,7 +3936,7 @@ void usb_buffer_clear(struct cgpu_info *cgpu)
 	DEVWLOCK(cgpu, pstate);
 
 	if (cgpu->usbdev)
-		cgpu->usbdev->bufamt = 0;
+		cgpu->usbdev->ring_out = cgpu->usbdev->ring_in;
 
 	DEVWUNLOCK(cgpu, pstate);
 }
@@ -3049,7 +3949,7 @@ uint32_t usb_buffer_size(struct cgpu_info *cgpu)
 	DEVRLOCK(cgpu, pstate);
 
 	if (cgpu->usbdev)
-		ret = cgpu->usbdev->bufamt;
+		ret = cgpu->usbdev->ring_in - cgpu->usbdev->ring_out;
 
 	DEVRUNLOCK(cgpu, pstate);
 
@@ -3121,18 +4021,24 @@ void usb_set_dev_start(struct cgpu_info *cgpu)
 	DEVWUNLOCK(cgpu, pstate);
 }
 
-void usb_cleanup(void)
-{
-	struct cgpu_info *cgpu;
-	int count, pstate;
-	int i;
+/* Devices release independently under their own locks, so shutdown fans
+ * the releases out over a few transient workers rather than walking a
+ * rig's worth of devices one at a time */
+#define USB_RELEASE_WORKERS 8
 
-	hotplug_time = 0;
+struct usb_release_arg {
+	int worker;
+	int nworkers;
+	int count;
+};
 
-	cgsleep_ms(10);
+static void *usb_release_worker(void *arg)
+{
+	struct usb_release_arg *ra = (struct usb_release_arg *)arg;
+	struct cgpu_info *cgpu;
+	int i, pstate;
 
-	count = 0;
-	for (i = 0; i < total_devices; i++) {
+	for (i = ra->worker; i < total_devices; i += ra->nworkers) {
 		cgpu = devices[i];
 		switch (cgpu->drv->drv_id) {
 			case DRIVER_bflsc:
@@ -3147,12 +4053,45 @@ void usb_cleanup(void)
 				DEVWLOCK(cgpu, pstate);
 				release_cgpu(cgpu);
 				DEVWUNLOCK(cgpu, pstate);
-				count++;
+				ra->count++;
 				break;
 			default:
 				break;
 		}
 	}
+	return NULL;
+}
+
+void usb_cleanup(void)
+{
+	struct usb_release_arg args[USB_RELEASE_WORKERS];
+	pthread_t workers[USB_RELEASE_WORKERS];
+	int count, nworkers;
+	int i;
+
+	hotplug_time = 0;
+
+	cgsleep_ms(10);
+
+	nworkers = total_devices;
+	if (nworkers > USB_RELEASE_WORKERS)
+		nworkers = USB_RELEASE_WORKERS;
+	count = 0;
+	for (i = 0; i < nworkers; i++) {
+		args[i].worker = i;
+		args[i].nworkers = nworkers;
+		args[i].count = 0;
+		/* Cover the slot inline if a worker cannot be spawned */
+		if (unlikely(pthread_create(&workers[i], NULL, usb_release_worker, &args[i]))) {
+			workers[i] = 0;
+			usb_release_worker(&args[i]);
+		}
+	}
+	for (i = 0; i < nworkers; i++) {
+		if (workers[i])
+			pthread_join(workers[i], NULL);
+		count += args[i].count;
+	}
 
 	/*
 	 * Must attempt to wait for the resource thread to release coz
@@ -3196,6 +4135,7 @@ void usb_initialise(void)
 	bool found;
 
 	INIT_LIST_HEAD(&ut_list);
+	INIT_LIST_HEAD(&ra_list);
 
 	for (i = 0; i < DRIVER_MAX; i++) {
 		drv_count[i].count = 0;
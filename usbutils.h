@@ -183,12 +183,32 @@ enum usb_types {
 };
 
 #define USB_MAX_READ 8192
-/*
- * We add 4: 1 for null, 2 for FTDI status and 1 to round to 4 bytes
- * If a single device ever has multiple end points then it will need
- * multiple of these
- */
-#define USB_READ_BUFSIZE (USB_MAX_READ + 4)
+
+/* Power of two receive ring per device. Reads are capped at USB_MAX_READ so
+ * with one extra transfer of slack the ring can never overflow */
+#define USB_RINGSIZE 16384
+#define USB_RINGMASK (USB_RINGSIZE - 1)
+
+// Read-ahead endpoints per device - no current device reads on more than one
+#define USB_RA_ENDPOINTS 3
+
+// Endpoints tracked for adaptive transfer timeouts
+#define USB_EPTIME_SLOTS 4
+
+/* Per endpoint response time estimate feeding adaptive transfer timeouts -
+ * see usb_eptime_sample() */
+struct usb_eptime {
+	int intinfo;
+	int epinfo;
+	bool used;
+	double rt_ema;	// Response time EWMA in ms
+	double rt_dev;	// Mean absolute deviation EWMA in ms
+	int samples;
+	int soft_fails;	// Consecutive expiries of a tightened timeout
+	int hard_fails;	// Consecutive zero byte expiries of the full timeout
+};
+
+struct usb_readahead;
 
 struct cg_usb_device {
 	struct usb_find_devices *found;
@@ -203,9 +223,31 @@ struct cg_usb_device {
 	char *serial_string;
 	unsigned char fwVersion;	// ??
 	unsigned char interfaceVersion;	// ??
-	char buffer[USB_MAX_READ];
-	uint32_t bufsiz;
-	uint32_t bufamt;
+	/* Receive ring holding data read off the device but not yet consumed.
+	 * The cursors count total bytes and are masked on access, so the
+	 * buffered amount is always ring_in - ring_out. */
+	char ringbuf[USB_RINGSIZE];
+	uint32_t ring_in;
+	uint32_t ring_out;
+	struct usb_readahead *readahead[USB_RA_ENDPOINTS];
+	/* Persistent page aligned transfer buffers reused across transfers,
+	 * one per direction, lazily allocated and grown. Claimed lock-free so
+	 * a concurrent transfer falls back to a transient buffer instead of
+	 * serializing against this one. */
+	unsigned char *xferbuf[2];
+	size_t xferbufsiz[2];
+	volatile int xferbuf_busy[2];
+	/* Adaptive FTDI latency timer state, fed from completed reads and
+	 * reconsidered periodically - see usb_ftdi_sample() */
+	uint16_t tuned_latency;
+	struct timeval tune_last_msg;
+	double tune_gap_ema;
+	double tune_siz_ema;
+	int tune_msgs;
+	/* Adaptive transfer timeout state, fed from completed reads - see
+	 * usb_eptime_sample() */
+	struct usb_eptime eptimes[USB_EPTIME_SLOTS];
+	struct timeval eptime_last_data;
 };
 
 #define USB_NOSTAT 0
@@ -223,10 +265,15 @@ struct cg_usb_tmo {
 	uint64_t total_tmo;
 };
 
+struct cg_usb_stats;
+
 struct cg_usb_info {
 	uint8_t bus_number;
 	uint8_t device_address;
 	int usbstat;
+	/* This device's own stats block - updated without any global lock and
+	 * only aggregated when the usbstats API command runs */
+	struct cg_usb_stats *stats;
 	bool nodev;
 	bool initialised;
 	int nodev_count;
@@ -398,6 +445,7 @@ struct cgpu_info;
 
 bool async_usb_transfers(void);
 void cancel_usb_transfers(void);
+void usb_ra_shutdown_all(void);
 void usb_all(int level);
 const char *usb_cmdname(enum usb_cmds cmd);
 void usb_applog(struct cgpu_info *cgpu, enum usb_cmds cmd, char *msg, int amount, int err);
@@ -412,6 +460,14 @@ struct api_data *api_usb_stats(int *count);
 void update_usb_stats(struct cgpu_info *cgpu);
 int _usb_read(struct cgpu_info *cgpu, int intinfo, int epinfo, char *buf, size_t bufsiz, int *processed, int timeout, const char *end, enum usb_cmds cmd, bool readonce, bool cancellable);
 int _usb_write(struct cgpu_info *cgpu, int intinfo, int epinfo, char *buf, size_t bufsiz, int *processed, int timeout, enum usb_cmds);
+
+// One pre-marshalled frame of a coalesced multi-frame write
+struct usb_batch_frame {
+	const char *buf;
+	size_t len;
+};
+
+int _usb_write_batch(struct cgpu_info *cgpu, int intinfo, int epinfo, const struct usb_batch_frame *frames, int nframes, int *processed, int timeout, enum usb_cmds cmd);
 int _usb_transfer(struct cgpu_info *cgpu, uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint32_t *data, int siz, unsigned int timeout, enum usb_cmds cmd);
 int _usb_transfer_read(struct cgpu_info *cgpu, uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, char *buf, int bufsiz, int *amount, unsigned int timeout, enum usb_cmds cmd);
 int usb_ftdi_cts(struct cgpu_info *cgpu);
@@ -497,6 +553,12 @@ void initialise_usblocks(void);
 #define usb_write_ep_timeout(cgpu, ep, buf, bufsiz, wrote, timeout, cmd) \
 	_usb_write(cgpu, DEFAULT_INTINFO, ep, buf, bufsiz, wrote, timeout, cmd)
 
+#define usb_write_batch(cgpu, frames, nframes, wrote, cmd) \
+	_usb_write_batch(cgpu, DEFAULT_INTINFO, DEFAULT_EP_OUT, frames, nframes, wrote, DEVTIMEOUT, cmd)
+
+#define usb_write_batch_ep(cgpu, ep, frames, nframes, wrote, cmd) \
+	_usb_write_batch(cgpu, DEFAULT_INTINFO, ep, frames, nframes, wrote, DEVTIMEOUT, cmd)
+
 #define usb_transfer(cgpu, typ, req, val, idx, cmd) \
 	_usb_transfer(cgpu, typ, req, val, idx, NULL, 0, DEVTIMEOUT, cmd)
 
@@ -27,6 +27,7 @@
 #include <fcntl.h>
 # ifdef __linux
 #  include <sys/prctl.h>
+#  include <sched.h>
 # endif
 # include <sys/socket.h>
 # include <netinet/in.h>
@@ -84,28 +85,148 @@ struct tq_ent {
 	struct list_head	q_node;
 };
 
+/* Small object recycler for jansson, which makes hundreds to thousands of
+ * individual allocations for tokens, strings and hashtable buckets per
+ * parsed stratum line or GBT template. Freed blocks are cached on per
+ * thread freelists binned by size class and handed straight back to the
+ * next parse, so steady state JSON parsing stops touching the general
+ * purpose allocator. Each block keeps its bin in a leading header word so
+ * the free side knows where to cache it. */
+#define JSON_ALLOC_BINS		6	/* 16 through 512 byte classes */
+#define JSON_ALLOC_MAX_CACHED	256	/* Per thread, per bin */
+
+struct json_alloc_cache {
+	void *freelist[JSON_ALLOC_BINS];
+	int freecount[JSON_ALLOC_BINS];
+	bool registered;
+};
+
+static __thread struct json_alloc_cache json_cache;
+static pthread_key_t json_alloc_key;
+
+static int json_alloc_bin(size_t size)
+{
+	size_t cls = 16;
+	int bin = 0;
+
+	while (cls < size && bin < JSON_ALLOC_BINS) {
+		cls <<= 1;
+		bin++;
+	}
+	return bin < JSON_ALLOC_BINS ? bin : -1;
+}
+
+static void *json_cache_malloc(size_t size)
+{
+	int bin = json_alloc_bin(size);
+	size_t *blk;
+
+	if (unlikely(!json_cache.registered)) {
+		json_cache.registered = true;
+		pthread_setspecific(json_alloc_key, &json_cache);
+	}
+	if (bin >= 0 && json_cache.freelist[bin]) {
+		blk = json_cache.freelist[bin];
+		json_cache.freelist[bin] = *(void **)(blk + 1);
+		json_cache.freecount[bin]--;
+	} else {
+		size_t siz = sizeof(size_t) + (bin >= 0 ? (size_t)16 << bin : size);
+
+		blk = malloc(siz);
+		if (unlikely(!blk))
+			return NULL;
+		/* Oversize blocks record their size so the accounting can
+		 * balance on free, binned sizes are implicit */
+		blk[0] = bin >= 0 ? (size_t)bin : JSON_ALLOC_BINS + size;
+		mem_account(MEM_JSON, siz);
+	}
+	return blk + 1;
+}
+
+static void json_cache_free(void *ptr)
+{
+	size_t *blk = (size_t *)ptr - 1;
+	int bin = blk[0] < JSON_ALLOC_BINS ? (int)blk[0] : -1;
+
+	if (bin < 0 || json_cache.freecount[bin] >= JSON_ALLOC_MAX_CACHED) {
+		mem_account(MEM_JSON, -(int64_t)(sizeof(size_t) + (bin >= 0 ?
+			    (size_t)16 << bin : blk[0] - JSON_ALLOC_BINS)));
+		free(blk);
+		return;
+	}
+	*(void **)ptr = json_cache.freelist[bin];
+	json_cache.freelist[bin] = blk;
+	json_cache.freecount[bin]++;
+}
+
+/* Transient threads drain their caches on exit so repeatedly spawned
+ * workers cannot strand cached blocks */
+static void json_alloc_drain(void *arg)
+{
+	struct json_alloc_cache *cache = arg;
+	int bin;
+
+	for (bin = 0; bin < JSON_ALLOC_BINS; bin++) {
+		while (cache->freelist[bin]) {
+			void *blk = cache->freelist[bin];
+
+			cache->freelist[bin] = *(void **)((size_t *)blk + 1);
+			mem_account(MEM_JSON, -(int64_t)(sizeof(size_t) +
+				    ((size_t)16 << bin)));
+			free(blk);
+		}
+		cache->freecount[bin] = 0;
+	}
+	cache->registered = false;
+}
+
+/* Called once from main before anything parses JSON */
+void json_alloc_setup(void)
+{
+	if (unlikely(pthread_key_create(&json_alloc_key, json_alloc_drain)))
+		quit(1, "Failed to pthread_key_create json_alloc_key");
+	json_set_alloc_funcs(json_cache_malloc, json_cache_free);
+}
+
 #ifdef HAVE_LIBCURL
 struct timeval nettime;
 
-struct data_buffer {
-	void		*buf;
-	size_t		len;
-};
+/* One curl share handle common to every easy handle so all HTTP pools reuse
+ * one DNS cache and SSL session cache instead of each handle resolving and
+ * negotiating from scratch. Sharing the connection cache is also requested
+ * for the curl versions that support it. */
+static CURLSH *curl_share_handle;
+static pthread_mutex_t curl_share_locks[CURL_LOCK_DATA_LAST];
 
-struct upload_buffer {
-	const void	*buf;
-	size_t		len;
-};
+static void curl_share_lock_cb(CURL __maybe_unused *handle, curl_lock_data data,
+			       curl_lock_access __maybe_unused access,
+			       void __maybe_unused *userptr)
+{
+	mutex_lock(&curl_share_locks[data]);
+}
 
-struct header_info {
-	char		*lp_path;
-	int		rolltime;
-	char		*reason;
-	char		*stratum_url;
-	bool		hadrolltime;
-	bool		canroll;
-	bool		hadexpire;
-};
+static void curl_share_unlock_cb(CURL __maybe_unused *handle, curl_lock_data data,
+				 void __maybe_unused *userptr)
+{
+	mutex_unlock(&curl_share_locks[data]);
+}
+
+/* Called once from main after curl_global_init */
+void curl_share_setup(void)
+{
+	int i;
+
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		mutex_init(&curl_share_locks[i]);
+	curl_share_handle = curl_share_init();
+	if (unlikely(!curl_share_handle))
+		quit(1, "Failed to curl_share_init");
+	curl_share_setopt(curl_share_handle, CURLSHOPT_LOCKFUNC, curl_share_lock_cb);
+	curl_share_setopt(curl_share_handle, CURLSHOPT_UNLOCKFUNC, curl_share_unlock_cb);
+	curl_share_setopt(curl_share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(curl_share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	curl_share_setopt(curl_share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+}
 
 static void databuf_free(struct data_buffer *db)
 {
@@ -195,8 +316,7 @@ static size_t resp_hdr_cb(void *ptr, size_t size, size_t nmemb, void *user_data)
 	if (!*val)			/* skip blank value */
 		goto out;
 
-	if (opt_protocol)
-		applog(LOG_DEBUG, "HTTP hdr(%s): %s", key, val);
+	PROTO_DUMP("HTTP hdr(%s): %s", key, val);
 
 	if (!strcasecmp("X-Roll-Ntime", key)) {
 		hi->hadrolltime = true;
@@ -296,30 +416,34 @@ static int curl_debug_cb(__maybe_unused CURL *handle, curl_infotype type,
 	return 0;
 }
 
-json_t *json_rpc_call(CURL *curl, const char *url,
-		      const char *userpass, const char *rpc_req,
-		      bool probe, bool longpoll, int *rolltime,
-		      struct pool *pool, bool share)
+/* Set up all the curl options, headers and buffers for one json rpc request
+ * on 'curl'. The caller owns 'req' and 'rpc_req', both of which must stay
+ * valid until the transfer has completed and json_rpc_result has been
+ * called. It is assumed that 'curl' is freshly [re]initialized at this pt. */
+void json_rpc_start(CURL *curl, struct json_rpc_req *req, const char *url,
+		    const char *userpass, const char *rpc_req,
+		    bool probe, bool longpoll, struct pool *pool, bool share)
 {
 	long timeout = longpoll ? (60 * 60) : 60;
-	struct data_buffer all_data = {NULL, 0};
-	struct header_info hi = {NULL, 0, NULL, NULL, false, false, false};
 	char len_hdr[64], user_agent_hdr[128];
-	char curl_err_str[CURL_ERROR_SIZE];
 	struct curl_slist *headers = NULL;
-	struct upload_buffer upload_data;
-	json_t *val, *err_val, *res_val;
-	bool probing = false;
-	double byte_count;
-	json_error_t err;
-	int rc;
-
-	memset(&err, 0, sizeof(err));
-
-	/* it is assumed that 'curl' is freshly [re]initialized at this pt */
+	char *bound = NULL;
 
+	memset(req, 0, sizeof(*req));
 	if (probe)
-		probing = !pool->probed;
+		req->probing = !pool->probed;
+	if (share)
+		req->keep_pool = pool;
+
+	/* A share handle left configured for this pool only needs its per
+	 * request buffers and headers set - all the constant options
+	 * survive from the previous submit */
+	curl_easy_getinfo(curl, CURLINFO_PRIVATE, &bound);
+	if (share && (struct pool *)bound == pool)
+		goto per_request;
+	if (bound)
+		curl_easy_reset(curl);
+
 	curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
 
 	// CURLOPT_VERBOSE won't write to stderr if we use CURLOPT_DEBUGFUNCTION
@@ -331,19 +455,19 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	curl_easy_setopt(curl, CURLOPT_URL, url);
 	curl_easy_setopt(curl, CURLOPT_ENCODING, "");
 	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1);
+	if (curl_share_handle) {
+		curl_easy_setopt(curl, CURLOPT_SHARE, curl_share_handle);
+		curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 300);
+	}
 
 	/* Shares are staggered already and delays in submission can be costly
 	 * so do not delay them */
 	if (!opt_delaynet || share)
 		curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1);
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, all_data_cb);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &all_data);
 	curl_easy_setopt(curl, CURLOPT_READFUNCTION, upload_data_cb);
-	curl_easy_setopt(curl, CURLOPT_READDATA, &upload_data);
-	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_err_str);
 	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
 	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, resp_hdr_cb);
-	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &hi);
 	curl_easy_setopt(curl, CURLOPT_USE_SSL, CURLUSESSL_TRY);
 	if (pool->rpc_proxy) {
 		curl_easy_setopt(curl, CURLOPT_PROXY, pool->rpc_proxy);
@@ -360,13 +484,19 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 		keep_curlalive(curl);
 	curl_easy_setopt(curl, CURLOPT_POST, 1);
 
-	if (opt_protocol)
-		applog(LOG_DEBUG, "JSON protocol request:\n%s", rpc_req);
+per_request:
+	/* These point into 'req' and must be rebound every call */
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->all_data);
+	curl_easy_setopt(curl, CURLOPT_READDATA, &req->upload_data);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, req->curl_err_str);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &req->hi);
 
-	upload_data.buf = rpc_req;
-	upload_data.len = strlen(rpc_req);
+	PROTO_DUMP("JSON protocol request:\n%s", rpc_req);
+
+	req->upload_data.buf = rpc_req;
+	req->upload_data.len = strlen(rpc_req);
 	sprintf(len_hdr, "Content-Length: %lu",
-		(unsigned long) upload_data.len);
+		(unsigned long) req->upload_data.len);
 	sprintf(user_agent_hdr, "User-Agent: %s", PACKAGE_STRING);
 
 	headers = curl_slist_append(headers,
@@ -386,37 +516,28 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	headers = curl_slist_append(headers, "Expect:"); /* disable Expect hdr*/
 
 	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	req->headers = headers;
+}
 
-	if (opt_delaynet) {
-		/* Don't delay share submission, but still track the nettime */
-		if (!share) {
-			long long now_msecs, last_msecs;
-			struct timeval now, last;
-
-			cgtime(&now);
-			last_nettime(&last);
-			now_msecs = (long long)now.tv_sec * 1000;
-			now_msecs += now.tv_usec / 1000;
-			last_msecs = (long long)last.tv_sec * 1000;
-			last_msecs += last.tv_usec / 1000;
-			if (now_msecs > last_msecs && now_msecs - last_msecs < 250) {
-				struct timespec rgtp;
+/* Parse the response to a request set up with json_rpc_start once the
+ * transfer has finished with result 'perform_rc', freeing the request state
+ * and resetting 'curl' ready for its next use. Returns the decoded json
+ * value or NULL on any failure. */
+json_t *json_rpc_result(CURL *curl, struct json_rpc_req *req, int perform_rc,
+			int *rolltime, struct pool *pool)
+{
+	json_t *val, *err_val, *res_val;
+	double byte_count;
+	json_error_t err;
 
-				rgtp.tv_sec = 0;
-				rgtp.tv_nsec = (250 - (now_msecs - last_msecs)) * 1000000;
-				nanosleep(&rgtp, NULL);
-			}
-		}
-		set_nettime();
-	}
+	memset(&err, 0, sizeof(err));
 
-	rc = curl_easy_perform(curl);
-	if (rc) {
-		applog(LOG_INFO, "HTTP request failed: %s", curl_err_str);
+	if (perform_rc) {
+		applog(LOG_INFO, "HTTP request failed: %s", req->curl_err_str);
 		goto err_out;
 	}
 
-	if (!all_data.buf) {
+	if (!req->all_data.buf) {
 		applog(LOG_DEBUG, "Empty data received in json_rpc_call.");
 		goto err_out;
 	}
@@ -428,52 +549,53 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	if (curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD, &byte_count) == CURLE_OK)
 		pool->cgminer_pool_stats.bytes_received += byte_count;
 
-	if (probing) {
+	if (req->probing) {
 		pool->probed = true;
 		/* If X-Long-Polling was found, activate long polling */
-		if (hi.lp_path) {
+		if (req->hi.lp_path) {
 			if (pool->hdr_path != NULL)
 				free(pool->hdr_path);
-			pool->hdr_path = hi.lp_path;
+			pool->hdr_path = req->hi.lp_path;
 		} else
 			pool->hdr_path = NULL;
-		if (hi.stratum_url) {
-			pool->stratum_url = hi.stratum_url;
-			hi.stratum_url = NULL;
+		if (req->hi.stratum_url) {
+			pool->stratum_url = req->hi.stratum_url;
+			req->hi.stratum_url = NULL;
 		}
 	} else {
-		if (hi.lp_path) {
-			free(hi.lp_path);
-			hi.lp_path = NULL;
+		if (req->hi.lp_path) {
+			free(req->hi.lp_path);
+			req->hi.lp_path = NULL;
 		}
-		if (hi.stratum_url) {
-			free(hi.stratum_url);
-			hi.stratum_url = NULL;
+		if (req->hi.stratum_url) {
+			free(req->hi.stratum_url);
+			req->hi.stratum_url = NULL;
 		}
 	}
 
-	*rolltime = hi.rolltime;
-	pool->cgminer_pool_stats.rolltime = hi.rolltime;
-	pool->cgminer_pool_stats.hadrolltime = hi.hadrolltime;
-	pool->cgminer_pool_stats.canroll = hi.canroll;
-	pool->cgminer_pool_stats.hadexpire = hi.hadexpire;
+	*rolltime = req->hi.rolltime;
+	pool->cgminer_pool_stats.rolltime = req->hi.rolltime;
+	pool->cgminer_pool_stats.hadrolltime = req->hi.hadrolltime;
+	pool->cgminer_pool_stats.canroll = req->hi.canroll;
+	pool->cgminer_pool_stats.hadexpire = req->hi.hadexpire;
 
-	val = JSON_LOADS(all_data.buf, &err);
+	val = JSON_LOADS(req->all_data.buf, &err);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
 
-		if (opt_protocol)
-			applog(LOG_DEBUG, "JSON protocol response:\n%s", (char *)(all_data.buf));
+		PROTO_DUMP("JSON protocol response:\n%s", (char *)(req->all_data.buf));
 
 		goto err_out;
 	}
 
+#ifdef USE_TRACE
 	if (opt_protocol) {
 		char *s = json_dumps(val, JSON_INDENT(3));
 
 		applog(LOG_DEBUG, "JSON protocol response:\n%s", s);
 		free(s);
 	}
+#endif
 
 	/* JSON-RPC valid response returns a non-null 'result',
 	 * and a null 'error'.
@@ -493,29 +615,74 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 
 		free(s);
 
+		json_decref(val);
 		goto err_out;
 	}
 
-	if (hi.reason) {
-		json_object_set_new(val, "reject-reason", json_string(hi.reason));
-		free(hi.reason);
-		hi.reason = NULL;
+	if (req->hi.reason) {
+		json_object_set_new(val, "reject-reason", json_string(req->hi.reason));
+		free(req->hi.reason);
+		req->hi.reason = NULL;
 	}
 	successful_connect = true;
-	databuf_free(&all_data);
-	curl_slist_free_all(headers);
-	curl_easy_reset(curl);
+	databuf_free(&req->all_data);
+	curl_slist_free_all(req->headers);
+	/* Mark a successful share handle as still configured for its pool
+	 * instead of resetting it, so the next submit on it skips the
+	 * constant option setup */
+	if (req->keep_pool)
+		curl_easy_setopt(curl, CURLOPT_PRIVATE, req->keep_pool);
+	else
+		curl_easy_reset(curl);
 	return val;
 
 err_out:
-	databuf_free(&all_data);
-	curl_slist_free_all(headers);
+	databuf_free(&req->all_data);
+	curl_slist_free_all(req->headers);
 	curl_easy_reset(curl);
 	if (!successful_connect)
 		applog(LOG_DEBUG, "Failed to connect in json_rpc_call");
 	curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1);
 	return NULL;
 }
+
+json_t *json_rpc_call(CURL *curl, const char *url,
+		      const char *userpass, const char *rpc_req,
+		      bool probe, bool longpoll, int *rolltime,
+		      struct pool *pool, bool share)
+{
+	struct json_rpc_req req;
+	int rc;
+
+	json_rpc_start(curl, &req, url, userpass, rpc_req, probe, longpoll, pool, share);
+
+	if (opt_delaynet) {
+		/* Don't delay share submission, but still track the nettime */
+		if (!share) {
+			long long now_msecs, last_msecs;
+			struct timeval now, last;
+
+			cgtime(&now);
+			last_nettime(&last);
+			now_msecs = (long long)now.tv_sec * 1000;
+			now_msecs += now.tv_usec / 1000;
+			last_msecs = (long long)last.tv_sec * 1000;
+			last_msecs += last.tv_usec / 1000;
+			if (now_msecs > last_msecs && now_msecs - last_msecs < 250) {
+				struct timespec rgtp;
+
+				rgtp.tv_sec = 0;
+				rgtp.tv_nsec = (250 - (now_msecs - last_msecs)) * 1000000;
+				nanosleep(&rgtp, NULL);
+			}
+		}
+		set_nettime();
+	}
+
+	rc = curl_easy_perform(curl);
+
+	return json_rpc_result(curl, &req, rc, rolltime, pool);
+}
 #define PROXY_HTTP	CURLPROXY_HTTP
 #define PROXY_HTTP_1_0	CURLPROXY_HTTP_1_0
 #define PROXY_SOCKS4	CURLPROXY_SOCKS4
@@ -585,16 +752,232 @@ char *get_proxy(char *url, struct pool *pool)
 }
 
 /* Adequate size s==len*2 + 1 must be alloced to use this variant */
+/* Vectorised hex codec kernels. The stratum hot paths round trip entire
+ * coinbases and headers through bin2hex/hex2bin for every job and share, so
+ * encode and decode in 16 or 32 byte blocks where the CPU allows it, keeping
+ * the scalar loops for tails and as the universal fallback. Each kernel
+ * returns how many binary bytes it handled, stopping early at anything it
+ * cannot classify so the scalar code can do the error reporting. */
+#if (defined(__x86_64__) || defined(__i386__)) && ((defined(__GNUC__) && __GNUC__ >= 5) || defined(__clang__))
+#define HAVE_HEX_SIMD 1
+#include <immintrin.h>
+
+static const char hexchar_tbl[16] = "0123456789abcdef";
+
+__attribute__((target("ssse3")))
+static size_t bin2hex_ssse3(char *s, const unsigned char *p, size_t len)
+{
+	const __m128i lut = _mm_loadu_si128((const __m128i *)hexchar_tbl);
+	const __m128i mask = _mm_set1_epi8(0xF);
+	size_t done = 0;
+
+	while (len - done >= 16) {
+		__m128i in = _mm_loadu_si128((const __m128i *)(p + done));
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(in, 4), mask);
+		__m128i lo = _mm_and_si128(in, mask);
+		__m128i chi = _mm_shuffle_epi8(lut, hi);
+		__m128i clo = _mm_shuffle_epi8(lut, lo);
+
+		_mm_storeu_si128((__m128i *)(s + done * 2),
+				 _mm_unpacklo_epi8(chi, clo));
+		_mm_storeu_si128((__m128i *)(s + done * 2 + 16),
+				 _mm_unpackhi_epi8(chi, clo));
+		done += 16;
+	}
+	return done;
+}
+
+__attribute__((target("avx2")))
+static size_t bin2hex_avx2(char *s, const unsigned char *p, size_t len)
+{
+	const __m256i lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hexchar_tbl));
+	const __m256i mask = _mm256_set1_epi8(0xF);
+	size_t done = 0;
+
+	while (len - done >= 32) {
+		__m256i in = _mm256_loadu_si256((const __m256i *)(p + done));
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(in, 4), mask);
+		__m256i lo = _mm256_and_si256(in, mask);
+		__m256i chi = _mm256_shuffle_epi8(lut, hi);
+		__m256i clo = _mm256_shuffle_epi8(lut, lo);
+		__m256i even = _mm256_unpacklo_epi8(chi, clo);
+		__m256i odd = _mm256_unpackhi_epi8(chi, clo);
+
+		/* The unpacks interleave within 128 bit lanes so glue the
+		 * lanes back into sequential order */
+		_mm256_storeu_si256((__m256i *)(s + done * 2),
+				    _mm256_permute2x128_si256(even, odd, 0x20));
+		_mm256_storeu_si256((__m256i *)(s + done * 2 + 32),
+				    _mm256_permute2x128_si256(even, odd, 0x31));
+		done += 32;
+	}
+	return done;
+}
+
+__attribute__((target("ssse3")))
+static size_t hex2bin_ssse3(unsigned char *p, const char *hexstr, size_t len)
+{
+	const __m128i ascii0 = _mm_set1_epi8('0');
+	const __m128i lcbit = _mm_set1_epi8(0x20);
+	const __m128i asciia = _mm_set1_epi8('a');
+	const __m128i ten = _mm_set1_epi8(10);
+	const __m128i six = _mm_set1_epi8(6);
+	const __m128i mul = _mm_set1_epi16(0x0110);
+	size_t done = 0;
+
+	while (len - done >= 8) {
+		__m128i in = _mm_loadu_si128((const __m128i *)(hexstr + done * 2));
+		__m128i d = _mm_sub_epi8(in, ascii0);
+		__m128i a = _mm_sub_epi8(_mm_or_si128(in, lcbit), asciia);
+		__m128i is_digit = _mm_andnot_si128(_mm_cmplt_epi8(d, _mm_setzero_si128()),
+						    _mm_cmplt_epi8(d, ten));
+		__m128i is_alpha = _mm_andnot_si128(_mm_cmplt_epi8(a, _mm_setzero_si128()),
+						    _mm_cmplt_epi8(a, six));
+		__m128i val, pair;
+
+		if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) != 0xFFFF)
+			break;
+		val = _mm_or_si128(_mm_and_si128(is_digit, d),
+				   _mm_and_si128(is_alpha, _mm_add_epi8(a, ten)));
+		/* high nibble * 16 + low nibble per character pair */
+		pair = _mm_maddubs_epi16(val, mul);
+		_mm_storel_epi64((__m128i *)(p + done),
+				 _mm_packus_epi16(pair, pair));
+		done += 8;
+	}
+	return done;
+}
+
+__attribute__((target("avx2")))
+static size_t hex2bin_avx2(unsigned char *p, const char *hexstr, size_t len)
+{
+	const __m256i ascii0 = _mm256_set1_epi8('0');
+	const __m256i lcbit = _mm256_set1_epi8(0x20);
+	const __m256i asciia = _mm256_set1_epi8('a');
+	const __m256i ten = _mm256_set1_epi8(10);
+	const __m256i six = _mm256_set1_epi8(6);
+	const __m256i mul = _mm256_set1_epi16(0x0110);
+	size_t done = 0;
+
+	while (len - done >= 16) {
+		__m256i in = _mm256_loadu_si256((const __m256i *)(hexstr + done * 2));
+		__m256i d = _mm256_sub_epi8(in, ascii0);
+		__m256i a = _mm256_sub_epi8(_mm256_or_si256(in, lcbit), asciia);
+		__m256i is_digit = _mm256_andnot_si256(_mm256_cmpgt_epi8(_mm256_setzero_si256(), d),
+						       _mm256_cmpgt_epi8(ten, d));
+		__m256i is_alpha = _mm256_andnot_si256(_mm256_cmpgt_epi8(_mm256_setzero_si256(), a),
+						       _mm256_cmpgt_epi8(six, a));
+		__m256i val, pair;
+
+		if ((unsigned int)_mm256_movemask_epi8(_mm256_or_si256(is_digit, is_alpha)) != 0xFFFFFFFF)
+			break;
+		val = _mm256_or_si256(_mm256_and_si256(is_digit, d),
+				      _mm256_and_si256(is_alpha, _mm256_add_epi8(a, ten)));
+		pair = _mm256_maddubs_epi16(val, mul);
+		/* packus interleaves within 128 bit lanes, pick the two low
+		 * qwords back out in order */
+		_mm_storeu_si128((__m128i *)(p + done),
+				 _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(pair, pair), 0x08)));
+		done += 16;
+	}
+	return done;
+}
+#elif defined(__aarch64__)
+#define HAVE_HEX_SIMD 1
+#include <arm_neon.h>
+
+static const char hexchar_tbl[16] = "0123456789abcdef";
+
+static size_t bin2hex_neon(char *s, const unsigned char *p, size_t len)
+{
+	const uint8x16_t lut = vld1q_u8((const uint8_t *)hexchar_tbl);
+	const uint8x16_t mask = vdupq_n_u8(0xF);
+	size_t done = 0;
+
+	while (len - done >= 16) {
+		uint8x16_t in = vld1q_u8(p + done);
+		uint8x16x2_t out;
+
+		out.val[0] = vqtbl1q_u8(lut, vshrq_n_u8(in, 4));
+		out.val[1] = vqtbl1q_u8(lut, vandq_u8(in, mask));
+		vst2q_u8((uint8_t *)(s + done * 2), out);
+		done += 16;
+	}
+	return done;
+}
+
+static uint8x8_t hex2bin_classify_neon(uint8x8_t in, uint8x8_t *validp)
+{
+	uint8x8_t d = vsub_u8(in, vdup_n_u8('0'));
+	uint8x8_t a = vsub_u8(vorr_u8(in, vdup_n_u8(0x20)), vdup_n_u8('a'));
+	uint8x8_t is_digit = vclt_u8(d, vdup_n_u8(10));
+	uint8x8_t is_alpha = vclt_u8(a, vdup_n_u8(6));
+
+	*validp = vand_u8(*validp, vorr_u8(is_digit, is_alpha));
+	return vorr_u8(vand_u8(is_digit, d),
+		       vand_u8(is_alpha, vadd_u8(a, vdup_n_u8(10))));
+}
+
+static size_t hex2bin_neon(unsigned char *p, const char *hexstr, size_t len)
+{
+	size_t done = 0;
+
+	while (len - done >= 8) {
+		/* Deinterleaved load puts the high nibble characters in
+		 * val[0] and the low nibble ones in val[1] */
+		uint8x8x2_t in = vld2_u8((const uint8_t *)(hexstr + done * 2));
+		uint8x8_t valid = vdup_n_u8(0xFF);
+		uint8x8_t hi = hex2bin_classify_neon(in.val[0], &valid);
+		uint8x8_t lo = hex2bin_classify_neon(in.val[1], &valid);
+
+		if (vminv_u8(valid) != 0xFF)
+			break;
+		vst1_u8(p + done, vorr_u8(vshl_n_u8(hi, 4), lo));
+		done += 8;
+	}
+	return done;
+}
+#endif
+
+#ifdef HAVE_HEX_SIMD
+static size_t (*bin2hex_block)(char *s, const unsigned char *p, size_t len);
+static size_t (*hex2bin_block)(unsigned char *p, const char *hexstr, size_t len);
+static bool hex_codec_inited;
+
+static void hex_codec_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("avx2")) {
+		bin2hex_block = bin2hex_avx2;
+		hex2bin_block = hex2bin_avx2;
+	} else if (__builtin_cpu_supports("ssse3")) {
+		bin2hex_block = bin2hex_ssse3;
+		hex2bin_block = hex2bin_ssse3;
+	}
+#elif defined(__aarch64__)
+	bin2hex_block = bin2hex_neon;
+	hex2bin_block = hex2bin_neon;
+#endif
+	hex_codec_inited = true;
+}
+#endif
+
 void __bin2hex(char *s, const unsigned char *p, size_t len)
 {
-	int i;
+	size_t i = 0;
 	static const char hex[16] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
 
-	for (i = 0; i < (int)len; i++) {
-		*s++ = hex[p[i] >> 4];
-		*s++ = hex[p[i] & 0xF];
+#ifdef HAVE_HEX_SIMD
+	if (unlikely(!hex_codec_inited))
+		hex_codec_init();
+	if (bin2hex_block)
+		i = bin2hex_block(s, p, len);
+#endif
+	for (; i < len; i++) {
+		s[i * 2] = hex[p[i] >> 4];
+		s[i * 2 + 1] = hex[p[i] & 0xF];
 	}
-	*s++ = '\0';
+	s[len * 2] = '\0';
 }
 
 /* Returns a malloced array string of a binary value of arbitrary length. The
@@ -642,6 +1025,22 @@ bool hex2bin(unsigned char *p, const char *hexstr, size_t len)
 	unsigned char idx;
 	bool ret = false;
 
+#ifdef HAVE_HEX_SIMD
+	if (unlikely(!hex_codec_inited))
+		hex_codec_init();
+	if (hex2bin_block && len >= 8) {
+		/* The block decoders read 16 characters at a time so may only
+		 * cover input we know is really there */
+		size_t done, limit = strlen(hexstr) / 16 * 8;
+
+		if (limit > len)
+			limit = len;
+		done = hex2bin_block(p, hexstr, limit);
+		p += done;
+		hexstr += done * 2;
+		len -= done;
+	}
+#endif
 	while (*hexstr && len) {
 		if (unlikely(!hexstr[1])) {
 			applog(LOG_ERR, "hex2bin str truncated");
@@ -667,45 +1066,71 @@ bool hex2bin(unsigned char *p, const char *hexstr, size_t len)
 	return ret;
 }
 
-bool fulltest(const unsigned char *hash, const unsigned char *target)
+/* Branch free little endian 256 bit hash <= target compare against a
+ * target already swapped into big endian 64 bit word order, most
+ * significant word first */
+static bool le256_lte(const unsigned char *hash, const uint64_t *target_be)
 {
-	uint32_t *hash32 = (uint32_t *)hash;
-	uint32_t *target32 = (uint32_t *)target;
-	bool rc = true;
+	const uint64_t *hash64 = (const uint64_t *)hash;
+	unsigned int gt = 0, eq = 1;
 	int i;
 
-	for (i = 28 / 4; i >= 0; i--) {
-		uint32_t h32tmp = le32toh(hash32[i]);
-		uint32_t t32tmp = le32toh(target32[i]);
+	for (i = 0; i < 4; i++) {
+		uint64_t h = le64toh(hash64[3 - i]);
+		uint64_t t = target_be[i];
 
-		if (h32tmp > t32tmp) {
-			rc = false;
-			break;
-		}
-		if (h32tmp < t32tmp) {
-			rc = true;
-			break;
-		}
+		gt |= eq & (h > t);
+		eq &= (h == t);
 	}
+	return !gt;
+}
+
+static void fulltest_debug(const unsigned char *hash, const unsigned char *target, bool rc)
+{
+	unsigned char hash_swap[32], target_swap[32];
+	char *hash_str, *target_str;
+
+	swab256(hash_swap, hash);
+	swab256(target_swap, target);
+	hash_str = bin2hex(hash_swap, 32);
+	target_str = bin2hex(target_swap, 32);
+
+	applog(LOG_DEBUG, " Proof: %s\nTarget: %s\nTrgVal? %s",
+		hash_str,
+		target_str,
+		rc ? "YES (hash <= target)" :
+		     "no (false positive; hash > target)");
+
+	free(hash_str);
+	free(target_str);
+}
 
-	if (opt_debug) {
-		unsigned char hash_swap[32], target_swap[32];
-		char *hash_str, *target_str;
+bool fulltest(const unsigned char *hash, const unsigned char *target)
+{
+	const uint64_t *target64 = (const uint64_t *)target;
+	uint64_t target_be[4];
+	bool rc;
+	int i;
 
-		swab256(hash_swap, hash);
-		swab256(target_swap, target);
-		hash_str = bin2hex(hash_swap, 32);
-		target_str = bin2hex(target_swap, 32);
+	for (i = 0; i < 4; i++)
+		target_be[i] = le64toh(target64[3 - i]);
+	rc = le256_lte(hash, target_be);
 
-		applog(LOG_DEBUG, " Proof: %s\nTarget: %s\nTrgVal? %s",
-			hash_str,
-			target_str,
-			rc ? "YES (hash <= target)" :
-			     "no (false positive; hash > target)");
+	if (opt_debug)
+		fulltest_debug(hash, target, rc);
 
-		free(hash_str);
-		free(target_str);
-	}
+	return rc;
+}
+
+/* As fulltest but compares against the target the work was issued with,
+ * cached pre swapped by calc_diff, sparing the per call target swap in
+ * the share path that runs for every nonce off every device */
+bool fulltest_work(const struct work *work)
+{
+	bool rc = le256_lte(work->hash, work->target_be);
+
+	if (opt_debug)
+		fulltest_debug(work->hash, work->target, rc);
 
 	return rc;
 }
@@ -817,6 +1242,167 @@ out:
 	return rval;
 }
 
+/* Pops an entry if one is immediately available, without waiting */
+void *tq_pop_nowait(struct thread_q *tq)
+{
+	struct tq_ent *ent;
+	void *rval = NULL;
+
+	mutex_lock(&tq->mutex);
+	if (!list_empty(&tq->q)) {
+		ent = list_entry(tq->q.next, struct tq_ent, q_node);
+		rval = ent->data;
+		list_del(&ent->q_node);
+		free(ent);
+	}
+	mutex_unlock(&tq->mutex);
+
+	return rval;
+}
+
+/* Bounded lock free MPSC queue. Cell sequence numbers follow the classic
+ * scheme where a cell is free for producers when seq equals its position and
+ * holds data for the consumer when seq is position + 1, cells being recycled
+ * by adding size on consumption. Size is rounded up to a power of two for
+ * mask based indexing. */
+struct mpsc_q *mpscq_new(unsigned int size)
+{
+	unsigned int rsize = 4, i;
+	struct mpsc_q *q;
+
+	while (rsize < size)
+		rsize <<= 1;
+
+	q = calloc(1, sizeof(*q));
+	if (!q)
+		return NULL;
+	q->cells = calloc(rsize, sizeof(*q->cells));
+	if (!q->cells) {
+		free(q);
+		return NULL;
+	}
+	q->size = rsize;
+	q->mask = rsize - 1;
+	for (i = 0; i < rsize; i++)
+		q->cells[i].seq = i;
+	cgsem_init(&q->sem);
+
+	return q;
+}
+
+/* Returns false without blocking if the queue is full */
+bool mpscq_push(struct mpsc_q *q, void *data)
+{
+	unsigned int pos = q->head;
+	struct mpsc_cell *cell;
+
+	while (42) {
+		int dif;
+
+		cell = &q->cells[pos & q->mask];
+		dif = (int)(cell->seq - pos);
+		if (!dif) {
+			if (__sync_bool_compare_and_swap(&q->head, pos, pos + 1))
+				break;
+			pos = q->head;
+		} else if (dif < 0)
+			return false;
+		else
+			pos = q->head;
+	}
+	cell->data = data;
+	/* Publish the cell to the consumer */
+	__sync_synchronize();
+	cell->seq = pos + 1;
+	cgsem_post(&q->sem);
+
+	return true;
+}
+
+/* Single consumer only. Waits up to ms milliseconds for an entry, blocking
+ * indefinitely if ms is negative, and returns NULL on timeout. */
+void *mpscq_pop(struct mpsc_q *q, int ms)
+{
+	struct mpsc_cell *cell = &q->cells[q->tail & q->mask];
+	void *data;
+
+	while ((int)(cell->seq - (q->tail + 1)) < 0) {
+		/* The semaphore can hold stale posts for entries that were
+		 * consumed without waiting; they simply loop back here and
+		 * are drained harmlessly */
+		if (ms < 0)
+			cgsem_wait(&q->sem);
+		else if (cgsem_mswait(&q->sem, ms))
+			return NULL;
+	}
+	__sync_synchronize();
+	data = cell->data;
+	/* Recycle the cell for the producers one lap ahead */
+	cell->seq = q->tail + q->size;
+	q->tail++;
+
+	return data;
+}
+
+/* Log linear latency histogram. Values below LATHIST_SUB map directly to the
+ * first sub buckets, larger values index by their top log2(LATHIST_SUB) + 1
+ * bits, with anything beyond the covered range clamped into the last
+ * bucket. */
+static int lat_hist_bucket(uint64_t us)
+{
+	int octave, sub;
+
+	if (us < LATHIST_SUB)
+		return us;
+	octave = 63 - __builtin_clzll(us);
+	sub = (us >> (octave - 4)) & (LATHIST_SUB - 1);
+	octave -= 3;
+	if (octave >= LATHIST_OCTAVES)
+		return LATHIST_BUCKETS - 1;
+	return octave * LATHIST_SUB + sub;
+}
+
+/* Lower bound of the value range a bucket covers */
+static uint64_t lat_hist_val(int bucket)
+{
+	int octave = bucket / LATHIST_SUB, sub = bucket % LATHIST_SUB;
+
+	if (!octave)
+		return sub;
+	return (uint64_t)(LATHIST_SUB + sub) << (octave - 1);
+}
+
+void lat_hist_add(struct lat_hist *h, uint64_t us)
+{
+	h->buckets[lat_hist_bucket(us)]++;
+	h->sum_us += us;
+	if (!h->count || us < h->min_us)
+		h->min_us = us;
+	if (us > h->max_us)
+		h->max_us = us;
+	h->count++;
+}
+
+/* Returns the latency in microseconds at the given percentile, 0 with no
+ * samples recorded */
+uint64_t lat_hist_pct(const struct lat_hist *h, double pct)
+{
+	uint64_t count = h->count, rank, cum = 0;
+	int i;
+
+	if (!count)
+		return 0;
+	rank = count * pct / 100.0;
+	if (rank >= count)
+		rank = count - 1;
+	for (i = 0; i < LATHIST_BUCKETS; i++) {
+		cum += h->buckets[i];
+		if (cum > rank)
+			return lat_hist_val(i);
+	}
+	return h->max_us;
+}
+
 int thr_info_create(struct thr_info *thr, pthread_attr_t *attr, void *(*start) (void *), void *arg)
 {
 	cgsem_init(&thr->sem);
@@ -1247,9 +1833,8 @@ enum send_ret {
 
 /* Send a single command across a socket, appending \n to it. This should all
  * be done under stratum lock except when first establishing the socket */
-static enum send_ret __stratum_send(struct pool *pool, char *s, ssize_t len)
+static enum send_ret __stratum_send_sock(SOCKETTYPE sock, char *s, ssize_t len)
 {
-	SOCKETTYPE sock = pool->sock;
 	ssize_t ssent = 0;
 
 	strcat(s, "\n");
@@ -1265,11 +1850,11 @@ static enum send_ret __stratum_send(struct pool *pool, char *s, ssize_t len)
 		if (select(sock + 1, NULL, &wd, NULL, &timeout) < 1)
 			return SEND_SELECTFAIL;
 #ifdef __APPLE__
-		sent = send(pool->sock, s + ssent, len, SO_NOSIGPIPE);
+		sent = send(sock, s + ssent, len, SO_NOSIGPIPE);
 #elif WIN32
-		sent = send(pool->sock, s + ssent, len, 0);
+		sent = send(sock, s + ssent, len, 0);
 #else
-		sent = send(pool->sock, s + ssent, len, MSG_NOSIGNAL);
+		sent = send(sock, s + ssent, len, MSG_NOSIGNAL);
 #endif
 		if (sent < 0) {
 			if (!sock_blocks())
@@ -1279,26 +1864,118 @@ static enum send_ret __stratum_send(struct pool *pool, char *s, ssize_t len)
 		ssent += sent;
 		len -= sent;
 	}
-
-	pool->cgminer_pool_stats.times_sent++;
-	pool->cgminer_pool_stats.bytes_sent += ssent;
-	pool->cgminer_pool_stats.net_bytes_sent += ssent;
 	return SEND_OK;
 }
 
-bool stratum_send(struct pool *pool, char *s, ssize_t len)
+static enum send_ret __stratum_send(struct pool *pool, char *s, ssize_t len)
 {
-	enum send_ret ret = SEND_INACTIVE;
+	enum send_ret ret;
 
-	if (opt_protocol)
-		applog(LOG_DEBUG, "SEND: %s", s);
+	TRACE2(stratum_send, pool->pool_no, len);
 
-	mutex_lock(&pool->stratum_lock);
-	if (pool->stratum_active)
-		ret = __stratum_send(pool, s, len);
-	mutex_unlock(&pool->stratum_lock);
+	ret = __stratum_send_sock(pool->sock, s, len);
+	if (ret == SEND_OK) {
+		ssize_t ssent = strlen(s);
 
-	/* This is to avoid doing applog under stratum_lock */
+		pool->cgminer_pool_stats.times_sent++;
+		pool->cgminer_pool_stats.bytes_sent += ssent;
+		pool->cgminer_pool_stats.net_bytes_sent += ssent;
+	}
+	return ret;
+}
+
+/* Append a copy of s to the pool's queue for its class. Must be called with
+ * stratum_lock held; the copy leaves room for the newline __stratum_send
+ * appends. */
+static void stratum_sendq_push(struct pool *pool, enum smsg_class cls, char *s, ssize_t len)
+{
+	struct stratum_msg *msg = malloc(sizeof(*msg) + len + 2);
+
+	if (unlikely(!msg))
+		quit(1, "Failed to malloc msg in stratum_sendq_push");
+	msg->next = NULL;
+	msg->len = len;
+	memcpy(msg->s, s, len + 1);
+	if (pool->sendq_tail[cls])
+		pool->sendq_tail[cls]->next = msg;
+	else
+		pool->sendq_head[cls] = msg;
+	pool->sendq_tail[cls] = msg;
+	pool->sendq_len++;
+}
+
+/* Pop and send everything queued towards the pool socket, highest priority
+ * class first, stopping at the first failure. Must be called with
+ * stratum_lock held. */
+static enum send_ret __stratum_drain_sendq(struct pool *pool)
+{
+	enum send_ret ret = SEND_OK;
+
+	while (ret == SEND_OK) {
+		struct stratum_msg *msg = NULL;
+		int cls;
+
+		for (cls = 0; cls < SMSG_CLASSES; cls++) {
+			if ((msg = pool->sendq_head[cls]))
+				break;
+		}
+		if (!msg)
+			break;
+		pool->sendq_head[cls] = msg->next;
+		if (!msg->next)
+			pool->sendq_tail[cls] = NULL;
+		pool->sendq_len--;
+		ret = __stratum_send(pool, msg->s, msg->len);
+		free(msg);
+	}
+	return ret;
+}
+
+/* Discard anything still queued towards a socket that is going away. Must be
+ * called with stratum_lock held. */
+static void clear_stratum_sendq(struct pool *pool)
+{
+	int cls;
+
+	for (cls = 0; cls < SMSG_CLASSES; cls++) {
+		while (pool->sendq_head[cls]) {
+			struct stratum_msg *msg = pool->sendq_head[cls];
+
+			pool->sendq_head[cls] = msg->next;
+			free(msg);
+		}
+		pool->sendq_tail[cls] = NULL;
+	}
+	pool->sendq_len = 0;
+}
+
+/* Queue one message towards the pool socket in its priority class. While the
+ * reactor services the socket the queue is drained asynchronously by its
+ * write ready handler and success means queued; everywhere else - session
+ * setup before registration, or builds without the reactor - the queue is
+ * drained in line and failures suspend the pool as they always have. */
+bool stratum_send_class(struct pool *pool, char *s, ssize_t len, enum smsg_class cls)
+{
+	enum send_ret ret = SEND_INACTIVE;
+	bool queued = false;
+
+	PROTO_DUMP("SEND: %s", s);
+
+	mutex_lock(&pool->stratum_lock);
+	if (pool->stratum_active) {
+		stratum_sendq_push(pool, cls, s, len);
+		if (pool->reactor_reg) {
+			reactor_arm_tx(pool, true);
+			queued = true;
+		} else
+			ret = __stratum_drain_sendq(pool);
+	}
+	mutex_unlock(&pool->stratum_lock);
+
+	if (queued)
+		return true;
+
+	/* This is to avoid doing applog under stratum_lock */
 	switch (ret) {
 		default:
 		case SEND_OK:
@@ -1318,6 +1995,30 @@ bool stratum_send(struct pool *pool, char *s, ssize_t len)
 	return (ret == SEND_OK);
 }
 
+bool stratum_send(struct pool *pool, char *s, ssize_t len)
+{
+	return stratum_send_class(pool, s, len, SMSG_CTRL);
+}
+
+/* Drain the pool's send queue on behalf of the reactor's write ready handler,
+ * disarming write readiness once nothing is left. Returns false when the
+ * socket failed and the connection should be dropped. */
+bool stratum_flush_sendq(struct pool *pool)
+{
+	enum send_ret ret = SEND_OK;
+
+	mutex_lock(&pool->stratum_lock);
+	if (pool->stratum_active)
+		ret = __stratum_drain_sendq(pool);
+	if (!pool->sendq_len && pool->reactor_reg)
+		reactor_arm_tx(pool, false);
+	mutex_unlock(&pool->stratum_lock);
+
+	if (ret != SEND_OK)
+		applog(LOG_DEBUG, "Failed to flush send queue on pool %d sock", pool->pool_no);
+	return (ret == SEND_OK);
+}
+
 static bool socket_full(struct pool *pool, int wait)
 {
 	SOCKETTYPE sock = pool->sock;
@@ -1338,7 +2039,7 @@ static bool socket_full(struct pool *pool, int wait)
 /* Check to see if Santa's been good to you */
 bool sock_full(struct pool *pool)
 {
-	if (strlen(pool->sockbuf))
+	if (pool->sockbuf_len > pool->sockbuf_begin)
 		return true;
 
 	return (socket_full(pool, 0));
@@ -1346,7 +2047,7 @@ bool sock_full(struct pool *pool)
 
 static void clear_sockbuf(struct pool *pool)
 {
-	strcpy(pool->sockbuf, "");
+	pool->sockbuf_len = pool->sockbuf_begin = pool->sockbuf_scan = 0;
 }
 
 static void clear_sock(struct pool *pool)
@@ -1365,99 +2066,137 @@ static void clear_sock(struct pool *pool)
 	clear_sockbuf(pool);
 }
 
-/* Make sure the pool sockbuf is large enough to cope with any coinbase size
- * by reallocing it to a large enough size rounded up to a multiple of RBUFSIZE
- * and zeroing the new memory */
-static void recalloc_sock(struct pool *pool, size_t len)
+/* In lowmem mode the sockbuf may not grow past this, so a runaway or
+ * hostile notify can't balloon it on a small controller */
+#define LOWMEM_SOCKBUF_MAX (16 * RBUFSIZE)
+
+/* Make sure the pool sockbuf is large enough to receive len more bytes plus
+ * a terminator by reallocing it to a large enough size rounded up to a
+ * multiple of RBUFSIZE. Returns false if the lowmem cap forbids the growth,
+ * in which case the caller should treat the connection as failed. */
+static bool recalloc_sock(struct pool *pool, size_t len)
 {
-	size_t old, new;
+	size_t new;
 
-	old = strlen(pool->sockbuf);
-	new = old + len + 1;
+	new = pool->sockbuf_len + len + 1;
 	if (new < pool->sockbuf_size)
-		return;
+		return true;
 	new = new + (RBUFSIZE - (new % RBUFSIZE));
+	if (opt_lowmem && new > LOWMEM_SOCKBUF_MAX)
+		return false;
 	// Avoid potentially recursive locking
 	// applog(LOG_DEBUG, "Recallocing pool sockbuf to %d", new);
 	pool->sockbuf = realloc(pool->sockbuf, new);
 	if (!pool->sockbuf)
 		quithere(1, "Failed to realloc pool sockbuf");
-	memset(pool->sockbuf + old, 0, new - old);
+	mem_account(MEM_SOCKBUF, (int64_t)new - (int64_t)pool->sockbuf_size);
 	pool->sockbuf_size = new;
+	return true;
 }
 
-/* Peeks at a socket to find the first end of line and then reads just that
- * from the socket and returns that as a malloced char */
-char *recv_line(struct pool *pool)
+/* Returns the next newline terminated line received on the pool socket,
+ * waiting up to sockwait seconds for one to arrive. Data is received directly
+ * into the pool sockbuf and the returned string is a zero copy view into it,
+ * remaining valid until the next call for this pool - it must not be freed.
+ * The span of data handed out by the previous call is only reclaimed on
+ * entry, so there is exactly one bounded memmove of the unconsumed remainder
+ * per line rather than the per-recv copying a string buffer would cost. */
+char *recv_line_to(struct pool *pool, int sockwait)
 {
-	char *tok, *sret = NULL;
-	ssize_t len, buflen;
+	char *nl, *sret = NULL;
+	struct timeval rstart, now;
+	ssize_t len;
 	int waited = 0;
 
-	if (!strstr(pool->sockbuf, "\n")) {
-		struct timeval rstart, now;
+	/* Reclaim the line handed out by the previous call */
+	if (pool->sockbuf_begin) {
+		pool->sockbuf_len -= pool->sockbuf_begin;
+		pool->sockbuf_scan -= pool->sockbuf_begin;
+		memmove(pool->sockbuf, pool->sockbuf + pool->sockbuf_begin,
+			pool->sockbuf_len);
+		pool->sockbuf_begin = 0;
+	}
+
+	/* In lowmem mode hand back a buffer that grew for a burst once its
+	 * contents fit the base allocation again */
+	if (opt_lowmem && pool->sockbuf_size > RBUFSIZE &&
+	    pool->sockbuf_len + 1 < RBUFSIZE) {
+		pool->sockbuf = realloc(pool->sockbuf, RBUFSIZE);
+		if (!pool->sockbuf)
+			quithere(1, "Failed to shrink pool sockbuf");
+		mem_account(MEM_SOCKBUF, (int64_t)RBUFSIZE -
+			    (int64_t)pool->sockbuf_size);
+		pool->sockbuf_size = RBUFSIZE;
+	}
+
+	cgtime(&rstart);
+	while (42) {
+		ssize_t n;
+
+		/* Only the data received since the last search can contain
+		 * the newline we're looking for */
+		nl = memchr(pool->sockbuf + pool->sockbuf_scan, '\n',
+			    pool->sockbuf_len - pool->sockbuf_scan);
+		if (nl)
+			break;
+		pool->sockbuf_scan = pool->sockbuf_len;
 
-		cgtime(&rstart);
-		if (!socket_full(pool, DEFAULT_SOCKWAIT)) {
+		if (waited >= sockwait || !socket_full(pool, sockwait - waited)) {
 			applog(LOG_DEBUG, "Timed out waiting for data on socket_full");
 			goto out;
 		}
 
-		do {
-			char s[RBUFSIZE];
-			size_t slen;
-			ssize_t n;
-
-			memset(s, 0, RBUFSIZE);
-			n = recv(pool->sock, s, RECVSIZE, 0);
-			if (!n) {
-				applog(LOG_DEBUG, "Socket closed waiting in recv_line");
+		if (!recalloc_sock(pool, RECVSIZE)) {
+			applog(LOG_WARNING, "Pool %d stratum message exceeds lowmem sockbuf cap, discarding",
+			       pool->pool_no);
+			clear_sockbuf(pool);
+			suspend_stratum(pool);
+			goto out;
+		}
+		n = recv(pool->sock, pool->sockbuf + pool->sockbuf_len,
+			 pool->sockbuf_size - pool->sockbuf_len - 1, 0);
+		if (!n) {
+			applog(LOG_DEBUG, "Socket closed waiting in recv_line");
+			suspend_stratum(pool);
+			goto out;
+		}
+		if (n < 0) {
+			if (!sock_blocks()) {
+				applog(LOG_DEBUG, "Failed to recv sock in recv_line");
 				suspend_stratum(pool);
-				break;
+				goto out;
 			}
-			cgtime(&now);
-			waited = tdiff(&now, &rstart);
-			if (n < 0) {
-				if (!sock_blocks() || !socket_full(pool, DEFAULT_SOCKWAIT - waited)) {
-					applog(LOG_DEBUG, "Failed to recv sock in recv_line");
-					suspend_stratum(pool);
-					break;
-				}
-			} else {
-				slen = strlen(s);
-				recalloc_sock(pool, slen);
-				strcat(pool->sockbuf, s);
-			}
-		} while (waited < DEFAULT_SOCKWAIT && !strstr(pool->sockbuf, "\n"));
-	}
-
-	buflen = strlen(pool->sockbuf);
-	tok = strtok(pool->sockbuf, "\n");
-	if (!tok) {
-		applog(LOG_DEBUG, "Failed to parse a \\n terminated string in recv_line");
-		goto out;
+		} else
+			pool->sockbuf_len += n;
+		cgtime(&now);
+		waited = tdiff(&now, &rstart);
 	}
-	sret = strdup(tok);
-	len = strlen(sret);
 
-	/* Copy what's left in the buffer after the \n, including the
-	 * terminating \0 */
-	if (buflen > len + 1)
-		memmove(pool->sockbuf, pool->sockbuf + len + 1, buflen - len + 1);
-	else
-		strcpy(pool->sockbuf, "");
+	*nl = '\0';
+	sret = pool->sockbuf + pool->sockbuf_begin;
+	len = nl - sret;
+	pool->sockbuf_begin = pool->sockbuf_scan = nl + 1 - pool->sockbuf;
 
 	pool->cgminer_pool_stats.times_received++;
 	pool->cgminer_pool_stats.bytes_received += len;
 	pool->cgminer_pool_stats.net_bytes_received += len;
 out:
-	if (!sret)
-		clear_sock(pool);
-	else if (opt_protocol)
-		applog(LOG_DEBUG, "RECVD: %s", sret);
+	if (!sret) {
+		/* Leave a partially received line buffered for callers that
+		 * poll with short timeouts and will retry once the remainder
+		 * arrives */
+		if (sockwait >= DEFAULT_SOCKWAIT || !pool->stratum_active)
+			clear_sock(pool);
+	} else
+		PROTO_DUMP("RECVD: %s", sret);
 	return sret;
 }
 
+char *recv_line(struct pool *pool)
+{
+	return recv_line_to(pool, DEFAULT_SOCKWAIT);
+}
+
 /* Extracts a string value from a json array with error checking. To be used
  * when the value of the string returned is only examined and not to be stored.
  * See json_array_string below */
@@ -1490,12 +2229,110 @@ static char *json_array_string(json_t *val, unsigned int entry)
 
 static char *blank_merkel = "0000000000000000000000000000000000000000000000000000000000000000";
 
+/* The core of mining.notify handling, operating on borrowed strings so the
+ * in-situ line parser can feed it views straight out of the receive buffer.
+ * Hex fields are decoded directly into the pool's binary swork fields. */
+static bool parse_notify_strs(struct pool *pool, const char *job_id,
+			      const char *prev_hash, const char *coinbase1,
+			      const char *coinbase2, const char *bbversion,
+			      const char *nbit, const char *ntime, bool clean,
+			      char * const *merkle_strs, int merkles)
+{
+	size_t cb1_len, cb2_len, alloc_len, header_len;
+	struct stratum_job *sjob;
+	char *header;
+	int i;
+
+	/* Build the whole job into a fresh immutable object, holding only a
+	 * read lock over the session fields the coinbase splices in, so the
+	 * expensive rebuild never blocks work generation */
+	cg_rlock(&pool->data_lock);
+	sjob = sjob_new(job_id, pool->nonce1, ntime, NULL);
+	sjob->n2size = pool->n2size;
+	cb1_len = strlen(coinbase1) / 2;
+	cb2_len = strlen(coinbase2) / 2;
+	sjob->nonce2_offset = cb1_len + pool->n1_len;
+	alloc_len = sjob->cb_len = cb1_len + pool->n1_len + pool->n2size + cb2_len;
+	align_len(&alloc_len);
+	sjob->cb_bin = calloc(alloc_len, 1);
+	if (unlikely(!sjob->cb_bin))
+		quit(1, "Failed to calloc sjob coinbase in parse_notify");
+	mem_account(MEM_SJOB, sjob->cb_len);
+	hex2bin(sjob->cb_bin, coinbase1, cb1_len);
+	memcpy(sjob->cb_bin + cb1_len, pool->nonce1bin, pool->n1_len);
+	hex2bin(sjob->cb_bin + cb1_len + pool->n1_len + pool->n2size,
+		coinbase2, cb2_len);
+	cg_runlock(&pool->data_lock);
+
+	if (merkles) {
+		sjob->merkle_bin = malloc(32 * merkles);
+		if (unlikely(!sjob->merkle_bin))
+			quit(1, "Failed to malloc sjob merkle_bin");
+		mem_account(MEM_SJOB, 32 * merkles);
+		for (i = 0; i < merkles; i++)
+			hex2bin(sjob->merkle_bin + 32 * i, merkle_strs[i], 32);
+	}
+	sjob->merkles = merkles;
+
+	sjob->merkle_offset = (strlen(bbversion) + strlen(prev_hash)) / 2;
+	header_len =		 strlen(bbversion) +
+				 strlen(prev_hash) +
+	/* merkle_hash */	 32 +
+				 strlen(ntime) +
+				 strlen(nbit) +
+	/* nonce */		 8 +
+	/* workpadding */	 96;
+	header_len = header_len * 2 + 1;
+	align_len(&header_len);
+	header = alloca(header_len);
+	snprintf(header, header_len,
+		"%s%s%s%s%s%s%s",
+		bbversion,
+		prev_hash,
+		blank_merkel,
+		ntime,
+		nbit,
+		"00000000", /* nonce */
+		workpadding);
+	if (unlikely(!hex2bin(sjob->header_bin, header, 128)))
+		quit(1, "Failed to convert header to header_bin in parse_notify");
+
+	/* Publish with a pointer swap - work already generated keeps its
+	 * reference to the old job until it is retired */
+	cg_wlock(&pool->data_lock);
+	free(pool->swork.job_id);
+	pool->swork.job_id = strdup(job_id);
+	pool->swork.job_seq++;
+	pool->swork.clean = clean;
+	if (clean)
+		pool->nonce2 = 0;
+	sjob_unref(pool->sjob);
+	pool->sjob = sjob;
+	cg_wunlock(&pool->data_lock);
+
+	TRACE2(stratum_notify, pool->pool_no, job_id);
+
+	PROTO_DUMP("job_id: %s", job_id);
+	PROTO_DUMP("prev_hash: %s", prev_hash);
+	PROTO_DUMP("coinbase1: %s", coinbase1);
+	PROTO_DUMP("coinbase2: %s", coinbase2);
+	PROTO_DUMP("bbversion: %s", bbversion);
+	PROTO_DUMP("nbit: %s", nbit);
+	PROTO_DUMP("ntime: %s", ntime);
+	PROTO_DUMP("clean: %s", clean ? "yes" : "no");
+
+	/* A notify message is the closest stratum gets to a getwork */
+	pool->getwork_requested++;
+	total_getworks++;
+	if (pool == current_pool())
+		opt_work_update = true;
+	return true;
+}
+
 static bool parse_notify(struct pool *pool, json_t *val)
 {
 	char *job_id, *prev_hash, *coinbase1, *coinbase2, *bbversion, *nbit,
-	     *ntime, *header;
-	size_t cb1_len, cb2_len, alloc_len;
-	unsigned char *cb1, *cb2;
+	     *ntime, **merkle_strs = NULL;
 	bool clean, ret = false;
 	int merkles, i;
 	json_t *arr;
@@ -1515,132 +2352,45 @@ static bool parse_notify(struct pool *pool, json_t *val)
 	ntime = json_array_string(val, 7);
 	clean = json_is_true(json_array_get(val, 8));
 
-	if (!job_id || !prev_hash || !coinbase1 || !coinbase2 || !bbversion || !nbit || !ntime) {
-		/* Annoying but we must not leak memory */
-		if (job_id)
-			free(job_id);
-		if (prev_hash)
-			free(prev_hash);
-		if (coinbase1)
-			free(coinbase1);
-		if (coinbase2)
-			free(coinbase2);
-		if (bbversion)
-			free(bbversion);
-		if (nbit)
-			free(nbit);
-		if (ntime)
-			free(ntime);
-		goto out;
-	}
+	if (!job_id || !prev_hash || !coinbase1 || !coinbase2 || !bbversion || !nbit || !ntime)
+		goto out_free;
 
-	cg_wlock(&pool->data_lock);
-	free(pool->swork.job_id);
-	free(pool->swork.prev_hash);
-	free(pool->swork.bbversion);
-	free(pool->swork.nbit);
-	free(pool->swork.ntime);
-	pool->swork.job_id = job_id;
-	pool->swork.prev_hash = prev_hash;
-	cb1_len = strlen(coinbase1) / 2;
-	cb2_len = strlen(coinbase2) / 2;
-	pool->swork.bbversion = bbversion;
-	pool->swork.nbit = nbit;
-	pool->swork.ntime = ntime;
-	pool->swork.clean = clean;
-	alloc_len = pool->swork.cb_len = cb1_len + pool->n1_len + pool->n2size + cb2_len;
-	pool->nonce2_offset = cb1_len + pool->n1_len;
-
-	for (i = 0; i < pool->swork.merkles; i++)
-		free(pool->swork.merkle_bin[i]);
 	if (merkles) {
-		pool->swork.merkle_bin = realloc(pool->swork.merkle_bin,
-						 sizeof(char *) * merkles + 1);
+		merkle_strs = calloc(merkles, sizeof(char *));
+		if (unlikely(!merkle_strs))
+			quithere(1, "Failed to calloc merkle_strs in parse_notify");
 		for (i = 0; i < merkles; i++) {
-			char *merkle = json_array_string(arr, i);
-
-			pool->swork.merkle_bin[i] = malloc(32);
-			if (unlikely(!pool->swork.merkle_bin[i]))
-				quit(1, "Failed to malloc pool swork merkle_bin");
-			hex2bin(pool->swork.merkle_bin[i], merkle, 32);
-			free(merkle);
+			merkle_strs[i] = json_array_string(arr, i);
+			if (unlikely(!merkle_strs[i]))
+				goto out_free;
 		}
 	}
-	pool->swork.merkles = merkles;
-	if (clean)
-		pool->nonce2 = 0;
-	pool->merkle_offset = strlen(pool->swork.bbversion) +
-			      strlen(pool->swork.prev_hash);
-	pool->swork.header_len = pool->merkle_offset +
-	/* merkle_hash */	 32 +
-				 strlen(pool->swork.ntime) +
-				 strlen(pool->swork.nbit) +
-	/* nonce */		 8 +
-	/* workpadding */	 96;
-	pool->merkle_offset /= 2;
-	pool->swork.header_len = pool->swork.header_len * 2 + 1;
-	align_len(&pool->swork.header_len);
-	header = alloca(pool->swork.header_len);
-	snprintf(header, pool->swork.header_len,
-		"%s%s%s%s%s%s%s",
-		pool->swork.bbversion,
-		pool->swork.prev_hash,
-		blank_merkel,
-		pool->swork.ntime,
-		pool->swork.nbit,
-		"00000000", /* nonce */
-		workpadding);
-	if (unlikely(!hex2bin(pool->header_bin, header, 128)))
-		quit(1, "Failed to convert header to header_bin in parse_notify");
-
-	cb1 = calloc(cb1_len, 1);
-	if (unlikely(!cb1))
-		quithere(1, "Failed to calloc cb1 in parse_notify");
-	hex2bin(cb1, coinbase1, cb1_len);
-	cb2 = calloc(cb2_len, 1);
-	if (unlikely(!cb2))
-		quithere(1, "Failed to calloc cb2 in parse_notify");
-	hex2bin(cb2, coinbase2, cb2_len);
-	free(pool->coinbase);
-	align_len(&alloc_len);
-	pool->coinbase = calloc(alloc_len, 1);
-	if (unlikely(!pool->coinbase))
-		quit(1, "Failed to calloc pool coinbase in parse_notify");
-	memcpy(pool->coinbase, cb1, cb1_len);
-	memcpy(pool->coinbase + cb1_len, pool->nonce1bin, pool->n1_len);
-	memcpy(pool->coinbase + cb1_len + pool->n1_len + pool->n2size, cb2, cb2_len);
-	cg_wunlock(&pool->data_lock);
 
-	if (opt_protocol) {
-		applog(LOG_DEBUG, "job_id: %s", job_id);
-		applog(LOG_DEBUG, "prev_hash: %s", prev_hash);
-		applog(LOG_DEBUG, "coinbase1: %s", coinbase1);
-		applog(LOG_DEBUG, "coinbase2: %s", coinbase2);
-		applog(LOG_DEBUG, "bbversion: %s", bbversion);
-		applog(LOG_DEBUG, "nbit: %s", nbit);
-		applog(LOG_DEBUG, "ntime: %s", ntime);
-		applog(LOG_DEBUG, "clean: %s", clean ? "yes" : "no");
-	}
+	ret = parse_notify_strs(pool, job_id, prev_hash, coinbase1, coinbase2,
+				bbversion, nbit, ntime, clean, merkle_strs,
+				merkles);
+out_free:
+	/* Annoying but we must not leak memory */
+	free(job_id);
+	free(prev_hash);
 	free(coinbase1);
 	free(coinbase2);
-	free(cb1);
-	free(cb2);
-
-	/* A notify message is the closest stratum gets to a getwork */
-	pool->getwork_requested++;
-	total_getworks++;
-	ret = true;
-	if (pool == current_pool())
-		opt_work_update = true;
+	free(bbversion);
+	free(nbit);
+	free(ntime);
+	if (merkle_strs) {
+		for (i = 0; i < merkles; i++)
+			free(merkle_strs[i]);
+		free(merkle_strs);
+	}
 out:
 	return ret;
 }
 
-static bool parse_diff(struct pool *pool, json_t *val)
+static bool set_pool_diff(struct pool *pool, double diff)
 {
-	double old_diff, diff;
+	double old_diff;
 
-	diff = json_number_value(json_array_get(val, 0));
 	if (diff == 0)
 		return false;
 
@@ -1658,6 +2408,7 @@ static bool parse_diff(struct pool *pool, json_t *val)
 		else
 			applog(LOG_NOTICE, "Pool %d difficulty changed to %f",
 			       pool->pool_no, diff);
+		update_device_diffs(pool, diff);
 	} else
 		applog(LOG_DEBUG, "Pool %d difficulty set to %f", pool->pool_no,
 		       diff);
@@ -1665,6 +2416,48 @@ static bool parse_diff(struct pool *pool, json_t *val)
 	return true;
 }
 
+static bool parse_diff(struct pool *pool, json_t *val)
+{
+	return set_pool_diff(pool, json_number_value(json_array_get(val, 0)));
+}
+
+/* Live extranonce update from a pool supporting mining.set_extranonce,
+ * typically sent instead of disconnecting us when our extranonce space
+ * collides after an upstream change. */
+static bool parse_extranonce(struct pool *pool, json_t *val)
+{
+	char *nonce1;
+	int n2size;
+
+	nonce1 = json_array_string(val, 0);
+	if (!nonce1) {
+		applog(LOG_INFO, "Failed to get nonce1 in parse_extranonce");
+		return false;
+	}
+	n2size = json_integer_value(json_array_get(val, 1));
+	if (!n2size) {
+		applog(LOG_INFO, "Failed to get n2size in parse_extranonce");
+		free(nonce1);
+		return false;
+	}
+
+	cg_wlock(&pool->data_lock);
+	free(pool->nonce1);
+	pool->nonce1 = nonce1;
+	pool->n1_len = strlen(nonce1) / 2;
+	free(pool->nonce1bin);
+	pool->nonce1bin = calloc(pool->n1_len, 1);
+	if (unlikely(!pool->nonce1bin))
+		quithere(1, "Failed to calloc pool->nonce1bin");
+	hex2bin(pool->nonce1bin, pool->nonce1, pool->n1_len);
+	pool->n2size = n2size;
+	cg_wunlock(&pool->data_lock);
+
+	applog(LOG_NOTICE, "Pool %d extranonce change requested", pool->pool_no);
+
+	return true;
+}
+
 static bool parse_reconnect(struct pool *pool, json_t *val)
 {
 	char *url, *port, address[256];
@@ -1721,6 +2514,254 @@ static bool show_message(struct pool *pool, json_t *val)
 	return true;
 }
 
+/* In-situ tokenizer for the fixed shape stratum notification messages. The
+ * high rate methods (mining.notify, mining.set_difficulty) are scanned
+ * directly in the receive buffer and their hex fields decoded in place,
+ * avoiding a full jansson tree build plus re-strduping of multi-hundred-KB
+ * coinbases and every merkle branch for every job. Anything unexpected -
+ * escapes, nested objects, other methods - leaves the line untouched and
+ * falls back to the jansson path. */
+
+struct insitu_span {
+	char *ptr;
+	size_t len;
+};
+
+#define INSITU_PARAMS 12
+#define INSITU_MERKLES 64
+
+struct stratum_insitu {
+	struct insitu_span method;
+	struct insitu_span params[INSITU_PARAMS];
+	int nparams;
+	struct insitu_span merkles[INSITU_MERKLES];
+	int nmerkles;
+	int merkle_param;
+	bool has_error;
+};
+
+static char *insitu_skipspace(char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+		p++;
+	return p;
+}
+
+/* Scan a JSON string containing no escapes, recording its span and returning
+ * the position past the closing quote, or NULL to make the caller bail */
+static char *insitu_scan_string(char *p, struct insitu_span *span)
+{
+	if (*p != '"')
+		return NULL;
+	span->ptr = ++p;
+	while (*p && *p != '"' && *p != '\\')
+		p++;
+	if (*p != '"')
+		return NULL;
+	span->len = p - span->ptr;
+	return p + 1;
+}
+
+/* Scan a number, boolean or null token as raw text */
+static char *insitu_scan_scalar(char *p, struct insitu_span *span)
+{
+	span->ptr = p;
+	while (*p && *p != ',' && *p != ']' && *p != '}' &&
+	       *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+		p++;
+	if (p == span->ptr)
+		return NULL;
+	span->len = p - span->ptr;
+	return p;
+}
+
+/* Skip over an arbitrary JSON value we have no interest in, returning the
+ * position of the delimiter that follows it */
+static char *insitu_skip_value(char *p)
+{
+	int depth = 0;
+
+	while (*p) {
+		if (*p == '"') {
+			p++;
+			while (*p && *p != '"') {
+				if (*p == '\\' && p[1])
+					p++;
+				p++;
+			}
+			if (!*p)
+				return NULL;
+		} else if (*p == '[' || *p == '{')
+			depth++;
+		else if (*p == ']' || *p == '}') {
+			if (!depth)
+				return p;
+			depth--;
+		} else if (!depth && *p == ',')
+			return p;
+		p++;
+	}
+	return NULL;
+}
+
+static char *insitu_scan_params(char *p, struct stratum_insitu *msg)
+{
+	if (*p != '[')
+		return NULL;
+	p = insitu_skipspace(p + 1);
+	if (*p == ']')
+		return p + 1;
+	while (42) {
+		if (msg->nparams >= INSITU_PARAMS)
+			return NULL;
+		if (*p == '"')
+			p = insitu_scan_string(p, &msg->params[msg->nparams]);
+		else if (*p == '[') {
+			/* One nested array of strings - the merkle branches */
+			if (msg->merkle_param >= 0)
+				return NULL;
+			msg->merkle_param = msg->nparams;
+			p = insitu_skipspace(p + 1);
+			if (*p != ']') {
+				while (42) {
+					if (msg->nmerkles >= INSITU_MERKLES)
+						return NULL;
+					p = insitu_scan_string(p, &msg->merkles[msg->nmerkles]);
+					if (!p)
+						return NULL;
+					msg->nmerkles++;
+					p = insitu_skipspace(p);
+					if (*p == ']')
+						break;
+					if (*p != ',')
+						return NULL;
+					p = insitu_skipspace(p + 1);
+				}
+			}
+			p++;
+		} else if (*p == '{')
+			return NULL;
+		else
+			p = insitu_scan_scalar(p, &msg->params[msg->nparams]);
+		if (!p)
+			return NULL;
+		msg->nparams++;
+		p = insitu_skipspace(p);
+		if (*p == ']')
+			return p + 1;
+		if (*p != ',')
+			return NULL;
+		p = insitu_skipspace(p + 1);
+	}
+}
+
+static bool insitu_scan(char *s, struct stratum_insitu *msg)
+{
+	char *p = insitu_skipspace(s);
+
+	memset(msg, 0, sizeof(*msg));
+	msg->merkle_param = -1;
+
+	if (*p != '{')
+		return false;
+	p = insitu_skipspace(p + 1);
+	if (*p == '}')
+		return false;
+	while (42) {
+		struct insitu_span key;
+
+		p = insitu_scan_string(p, &key);
+		if (!p)
+			return false;
+		p = insitu_skipspace(p);
+		if (*p != ':')
+			return false;
+		p = insitu_skipspace(p + 1);
+		if (key.len == 6 && !strncmp(key.ptr, "method", 6)) {
+			p = insitu_scan_string(p, &msg->method);
+			if (!p)
+				return false;
+		} else if (key.len == 6 && !strncmp(key.ptr, "params", 6)) {
+			p = insitu_scan_params(p, msg);
+			if (!p)
+				return false;
+		} else {
+			if (key.len == 5 && !strncmp(key.ptr, "error", 5) &&
+			    strncmp(p, "null", 4))
+				msg->has_error = true;
+			p = insitu_skip_value(p);
+			if (!p)
+				return false;
+		}
+		p = insitu_skipspace(p);
+		if (*p == '}')
+			return true;
+		if (*p != ',')
+			return false;
+		p = insitu_skipspace(p + 1);
+	}
+}
+
+/* NUL terminate every recorded span. Only done once we have committed to
+ * handling the message in place, as it destroys the line for jansson. */
+static void insitu_terminate(struct stratum_insitu *msg)
+{
+	int i;
+
+	msg->method.ptr[msg->method.len] = '\0';
+	for (i = 0; i < msg->nparams; i++) {
+		if (msg->params[i].ptr)
+			msg->params[i].ptr[msg->params[i].len] = '\0';
+	}
+	for (i = 0; i < msg->nmerkles; i++)
+		msg->merkles[i].ptr[msg->merkles[i].len] = '\0';
+}
+
+/* Try to handle a stratum line without building a jansson tree. Returns
+ * true with *ret set if the message was recognised and dispatched, false to
+ * fall back to the tree based path with s unmodified. */
+static bool parse_method_insitu(struct pool *pool, char *s, bool *ret)
+{
+	char *merkle_strs[INSITU_MERKLES];
+	struct stratum_insitu msg;
+	int i;
+
+	if (!insitu_scan(s, &msg) || msg.has_error || !msg.method.ptr)
+		return false;
+
+	if (msg.method.len >= 13 &&
+	    !strncasecmp(msg.method.ptr, "mining.notify", 13)) {
+		if (msg.nparams < 9 || msg.merkle_param != 4)
+			return false;
+		for (i = 0; i < 9; i++) {
+			if (i != 4 && !msg.params[i].ptr)
+				return false;
+		}
+		insitu_terminate(&msg);
+		for (i = 0; i < msg.nmerkles; i++)
+			merkle_strs[i] = msg.merkles[i].ptr;
+		pool->stratum_notify = *ret =
+			parse_notify_strs(pool, msg.params[0].ptr,
+					  msg.params[1].ptr, msg.params[2].ptr,
+					  msg.params[3].ptr, msg.params[5].ptr,
+					  msg.params[6].ptr, msg.params[7].ptr,
+					  !strncmp(msg.params[8].ptr, "true", 4),
+					  merkle_strs, msg.nmerkles);
+		return true;
+	}
+
+	if (msg.method.len >= 21 &&
+	    !strncasecmp(msg.method.ptr, "mining.set_difficulty", 21)) {
+		if (msg.nparams < 1 || !msg.params[0].ptr)
+			return false;
+		insitu_terminate(&msg);
+		*ret = set_pool_diff(pool, atof(msg.params[0].ptr));
+		return true;
+	}
+
+	return false;
+}
+
 bool parse_method(struct pool *pool, char *s)
 {
 	json_t *val = NULL, *method, *err_val, *params;
@@ -1731,6 +2772,9 @@ bool parse_method(struct pool *pool, char *s)
 	if (!s)
 		return ret;
 
+	if (parse_method_insitu(pool, s, &ret))
+		return ret;
+
 	val = JSON_LOADS(s, &err);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
@@ -1782,6 +2826,12 @@ bool parse_method(struct pool *pool, char *s)
 		return ret;
 	}
 
+	if (!strncasecmp(buf, "mining.set_extranonce", 21) && parse_extranonce(pool, params)) {
+		ret = true;
+		json_decref(val);
+		return ret;
+	}
+
 	if (!strncasecmp(buf, "client.reconnect", 16) && parse_reconnect(pool, params)) {
 		ret = true;
 		json_decref(val);
@@ -1803,15 +2853,46 @@ bool parse_method(struct pool *pool, char *s)
 	return ret;
 }
 
+/* Ask the pool for a share difficulty matched to our hashrate so low pool
+ * defaults do not drown the controller in share verification and submission
+ * overhead. Pools that do not honour mining.suggest_difficulty ignore it or
+ * answer false; either way the share diff they actually set via
+ * mining.set_difficulty remains authoritative. */
+void suggest_difficulty(struct pool *pool, double diff)
+{
+	char s[RBUFSIZE];
+
+	pool->suggest_id = __sync_fetch_and_add(&swork_id, 1);
+	pool->suggested_diff = diff;
+	snprintf(s, sizeof(s), "{\"id\": %d, \"method\": \"mining.suggest_difficulty\", \"params\": [%.0f]}",
+		 pool->suggest_id, diff);
+	applog(LOG_DEBUG, "Pool %d suggesting share diff %.0f", pool->pool_no, diff);
+	stratum_send_class(pool, s, strlen(s), SMSG_TELEM);
+}
+
+/* Ask the pool to push mining.set_extranonce updates for this session. The
+ * response arrives asynchronously and is matched by extranonce_id and
+ * swallowed in parse_stratum_response. */
+static void subscribe_extranonce(struct pool *pool)
+{
+	char s[RBUFSIZE];
+
+	pool->extranonce_id = __sync_fetch_and_add(&swork_id, 1);
+	sprintf(s, "{\"id\": %d, \"method\": \"mining.extranonce.subscribe\", \"params\": []}",
+		pool->extranonce_id);
+	stratum_send(pool, s, strlen(s));
+}
+
 bool auth_stratum(struct pool *pool)
 {
 	json_t *val = NULL, *res_val, *err_val;
 	char s[RBUFSIZE], *sret = NULL;
 	json_error_t err;
 	bool ret = false;
+	double sdiff;
 
 	sprintf(s, "{\"id\": %d, \"method\": \"mining.authorize\", \"params\": [\"%s\", \"%s\"]}",
-		swork_id++, pool->rpc_user, pool->rpc_pass);
+		__sync_fetch_and_add(&swork_id, 1), pool->rpc_user, pool->rpc_pass);
 
 	if (!stratum_send(pool, s, strlen(s)))
 		return ret;
@@ -1821,14 +2902,11 @@ bool auth_stratum(struct pool *pool)
 		sret = recv_line(pool);
 		if (!sret)
 			return ret;
-		if (parse_method(pool, sret))
-			free(sret);
-		else
+		if (!parse_method(pool, sret))
 			break;
 	}
 
 	val = JSON_LOADS(sret, &err);
-	free(sret);
 	res_val = json_object_get(val, "result");
 	err_val = json_object_get(val, "error");
 
@@ -1849,6 +2927,12 @@ bool auth_stratum(struct pool *pool)
 	applog(LOG_INFO, "Stratum authorisation success for pool %d", pool->pool_no);
 	pool->probed = true;
 	successful_connect = true;
+	if (pool->extranonce_subscribe)
+		subscribe_extranonce(pool);
+	sdiff = suggested_share_diff();
+	if (sdiff >= 1)
+		suggest_difficulty(pool, sdiff);
+	open_submit_conns(pool);
 
 out:
 	json_decref(val);
@@ -2091,19 +3175,115 @@ static bool sock_connecting(void)
 	return WSAGetLastError() == WSAEWOULDBLOCK;
 #endif
 }
-static bool setup_stratum_socket(struct pool *pool)
+struct resolve_args {
+	char *node;
+	char *service;
+	struct addrinfo hints;
+	struct addrinfo *res;
+	int rc;
+	bool done;
+	bool abandoned;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *resolve_thread(void *arg)
+{
+	struct resolve_args *ra = arg;
+	struct addrinfo *res = NULL;
+	int rc;
+
+	pthread_detach(pthread_self());
+	RenameThread("Resolver");
+
+	rc = getaddrinfo(ra->node, ra->service, &ra->hints, &res);
+
+	mutex_lock(&ra->lock);
+	if (ra->abandoned) {
+		/* The caller gave up on us, clean up after ourselves */
+		mutex_unlock(&ra->lock);
+		if (!rc)
+			freeaddrinfo(res);
+		free(ra->node);
+		free(ra->service);
+		free(ra);
+		return NULL;
+	}
+	ra->rc = rc;
+	ra->res = res;
+	ra->done = true;
+	pthread_cond_signal(&ra->cond);
+	mutex_unlock(&ra->lock);
+	return NULL;
+}
+
+/* getaddrinfo with a deadline. Resolution runs in a detached helper thread
+ * so a dead or slow resolver can never stall the calling thread - and with
+ * it pool recovery - beyond timeout seconds. An abandoned lookup frees its
+ * own state whenever the library call eventually returns. */
+static int getaddrinfo_timeout(const char *node, const char *service,
+			       const struct addrinfo *hints,
+			       struct addrinfo **res, int timeout)
+{
+	struct resolve_args *ra;
+	struct timespec abstime;
+	struct timeval now;
+	pthread_t pth;
+	int rc;
+
+	ra = calloc(1, sizeof(*ra));
+	if (unlikely(!ra))
+		quithere(1, "Failed to calloc resolve_args");
+	ra->node = strdup(node);
+	ra->service = strdup(service);
+	ra->hints = *hints;
+	mutex_init(&ra->lock);
+	if (unlikely(pthread_cond_init(&ra->cond, NULL)))
+		quit(1, "Failed to pthread_cond_init resolve cond");
+
+	if (unlikely(pthread_create(&pth, NULL, resolve_thread, ra))) {
+		/* Fall back to a direct blocking lookup */
+		free(ra->node);
+		free(ra->service);
+		free(ra);
+		return getaddrinfo(node, service, hints, res);
+	}
+
+	cgtime(&now);
+	abstime.tv_sec = now.tv_sec + timeout;
+	abstime.tv_nsec = now.tv_usec * 1000;
+
+	mutex_lock(&ra->lock);
+	while (!ra->done) {
+		if (pthread_cond_timedwait(&ra->cond, &ra->lock, &abstime))
+			break;
+	}
+	if (!ra->done) {
+		ra->abandoned = true;
+		mutex_unlock(&ra->lock);
+		return EAI_AGAIN;
+	}
+	rc = ra->rc;
+	*res = ra->res;
+	mutex_unlock(&ra->lock);
+	free(ra->node);
+	free(ra->service);
+	free(ra);
+	return rc;
+}
+
+/* How many addresses from one lookup we will race connects against */
+#define STRATUM_CONNECT_PARALLEL 8
+
+/* Resolve and connect a fresh socket to the pool (through its proxy if one
+ * is configured), returning the connected socket or -1. Shared by the main
+ * stratum connection and the extra submit connections. */
+static int stratum_connect_sock(struct pool *pool)
 {
 	struct addrinfo servinfobase, *servinfo, *hints, *p;
 	char *sockaddr_url, *sockaddr_port;
 	int sockd;
 
-	mutex_lock(&pool->stratum_lock);
-	pool->stratum_active = false;
-	if (pool->sock)
-		CLOSESOCKET(pool->sock);
-	pool->sock = 0;
-	mutex_unlock(&pool->stratum_lock);
-
 	hints = &pool->stratum_hints;
 	memset(hints, 0, sizeof(struct addrinfo));
 	hints->ai_family = AF_UNSPEC;
@@ -2123,7 +3303,8 @@ static bool setup_stratum_socket(struct pool *pool)
 		sockaddr_url = pool->sockaddr_url;
 		sockaddr_port = pool->stratum_port;
 	}
-	if (getaddrinfo(sockaddr_url, sockaddr_port, hints, &servinfo) != 0) {
+	if (getaddrinfo_timeout(sockaddr_url, sockaddr_port, hints, &servinfo,
+				opt_net_timeout) != 0) {
 		if (!pool->probed) {
 			applog(LOG_WARNING, "Failed to resolve (?wrong URL) %s:%s",
 			       sockaddr_url, sockaddr_port);
@@ -2132,102 +3313,155 @@ static bool setup_stratum_socket(struct pool *pool)
 			applog(LOG_INFO, "Failed to getaddrinfo for %s:%s",
 			       sockaddr_url, sockaddr_port);
 		}
-		return false;
+		return -1;
 	}
 
-	for (p = servinfo; p != NULL; p = p->ai_next) {
-		sockd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-		if (sockd == -1) {
-			applog(LOG_DEBUG, "Failed socket");
-			continue;
-		}
-
-		/* Iterate non blocking over entries returned by getaddrinfo
-		 * to cope with round robin DNS entries, finding the first one
-		 * we can connect to quickly. */
-		noblock_socket(sockd);
-		if (connect(sockd, p->ai_addr, p->ai_addrlen) == -1) {
-			struct timeval tv_timeout = {1, 0};
-			int selret;
-			fd_set rw;
-
+	/* Race non blocking connects to all returned addresses in parallel
+	 * happy-eyeballs style and keep the first to succeed, rather than
+	 * paying up to a second in sequence for every dead round robin DNS
+	 * entry before reaching a live one. */
+	{
+		int socks[STRATUM_CONNECT_PARALLEL];
+		struct timeval tv_start, tv_now;
+		int nsocks = 0, i;
+
+		sockd = -1;
+		for (p = servinfo; p && nsocks < STRATUM_CONNECT_PARALLEL; p = p->ai_next) {
+			int cand = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+
+			if (cand == -1) {
+				applog(LOG_DEBUG, "Failed socket");
+				continue;
+			}
+			noblock_socket(cand);
+			if (!connect(cand, p->ai_addr, p->ai_addrlen)) {
+				applog(LOG_DEBUG, "Succeeded immediate connect");
+				sockd = cand;
+				break;
+			}
 			if (!sock_connecting()) {
-				CLOSESOCKET(sockd);
+				CLOSESOCKET(cand);
 				applog(LOG_DEBUG, "Failed sock connect");
 				continue;
 			}
-			FD_ZERO(&rw);
-			FD_SET(sockd, &rw);
-			selret = select(sockd + 1, NULL, &rw, NULL, &tv_timeout);
-			if  (selret > 0 && FD_ISSET(sockd, &rw)) {
+			socks[nsocks++] = cand;
+		}
+
+		cgtime(&tv_start);
+		while (sockd == -1 && nsocks) {
+			struct timeval tv_timeout;
+			double elapsed;
+			fd_set wd;
+			int maxfd = 0, selret;
+
+			cgtime(&tv_now);
+			elapsed = tdiff(&tv_now, &tv_start);
+			if (elapsed >= opt_net_timeout)
+				break;
+			tv_timeout.tv_sec = opt_net_timeout - elapsed;
+			tv_timeout.tv_usec = 0;
+
+			FD_ZERO(&wd);
+			for (i = 0; i < nsocks; i++) {
+				FD_SET(socks[i], &wd);
+				if (socks[i] > maxfd)
+					maxfd = socks[i];
+			}
+			selret = select(maxfd + 1, NULL, &wd, NULL, &tv_timeout);
+			if (selret < 1)
+				break;
+			for (i = 0; i < nsocks; i++) {
 				socklen_t len;
 				int err, n;
 
+				if (!FD_ISSET(socks[i], &wd))
+					continue;
 				len = sizeof(err);
-				n = getsockopt(sockd, SOL_SOCKET, SO_ERROR, (void *)&err, &len);
+				n = getsockopt(socks[i], SOL_SOCKET, SO_ERROR, (void *)&err, &len);
 				if (!n && !err) {
 					applog(LOG_DEBUG, "Succeeded delayed connect");
-					block_socket(sockd);
+					sockd = socks[i];
 					break;
 				}
+				/* Drop the failed candidate from the race */
+				CLOSESOCKET(socks[i]);
+				socks[i--] = socks[--nsocks];
 			}
-			CLOSESOCKET(sockd);
-			applog(LOG_DEBUG, "Select timeout/failed connect");
-			continue;
 		}
-		applog(LOG_WARNING, "Succeeded immediate connect");
-		block_socket(sockd);
-
-		break;
+		/* Close whatever didn't win the race */
+		for (i = 0; i < nsocks; i++) {
+			if (socks[i] != sockd)
+				CLOSESOCKET(socks[i]);
+		}
 	}
-	if (p == NULL) {
+	if (sockd == -1) {
 		applog(LOG_INFO, "Failed to connect to stratum on %s:%s",
 		       sockaddr_url, sockaddr_port);
 		freeaddrinfo(servinfo);
-		return false;
+		return -1;
 	}
+	block_socket(sockd);
 	freeaddrinfo(servinfo);
 
 	if (pool->rpc_proxy) {
+		bool negotiated = false;
+
 		switch (pool->rpc_proxytype) {
 			case PROXY_HTTP_1_0:
-				if (!http_negotiate(pool, sockd, true))
-					return false;
+				negotiated = http_negotiate(pool, sockd, true);
 				break;
 			case PROXY_HTTP:
-				if (!http_negotiate(pool, sockd, false))
-					return false;
+				negotiated = http_negotiate(pool, sockd, false);
 				break;
 			case PROXY_SOCKS5:
 			case PROXY_SOCKS5H:
-				if (!socks5_negotiate(pool, sockd))
-					return false;
+				negotiated = socks5_negotiate(pool, sockd);
 				break;
 			case PROXY_SOCKS4:
-				if (!socks4_negotiate(pool, sockd, false))
-					return false;
+				negotiated = socks4_negotiate(pool, sockd, false);
 				break;
 			case PROXY_SOCKS4A:
-				if (!socks4_negotiate(pool, sockd, true))
-					return false;
+				negotiated = socks4_negotiate(pool, sockd, true);
 				break;
 			default:
 				applog(LOG_WARNING, "Unsupported proxy type for %s:%s",
 				       pool->sockaddr_proxy_url, pool->sockaddr_proxy_port);
-				return false;
 				break;
 		}
+		if (!negotiated) {
+			CLOSESOCKET(sockd);
+			return -1;
+		}
 	}
 
+	keep_sockalive(sockd);
+	return sockd;
+}
+
+static bool setup_stratum_socket(struct pool *pool)
+{
+	int sockd;
+
+	mutex_lock(&pool->stratum_lock);
+	pool->stratum_active = false;
+	if (pool->sock)
+		CLOSESOCKET(pool->sock);
+	pool->sock = 0;
+	mutex_unlock(&pool->stratum_lock);
+
+	sockd = stratum_connect_sock(pool);
+	if (sockd == -1)
+		return false;
+
 	if (!pool->sockbuf) {
 		pool->sockbuf = calloc(RBUFSIZE, 1);
 		if (!pool->sockbuf)
 			quithere(1, "Failed to calloc pool sockbuf");
+		mem_account(MEM_SOCKBUF, RBUFSIZE);
 		pool->sockbuf_size = RBUFSIZE;
 	}
 
 	pool->sock = sockd;
-	keep_sockalive(sockd);
 	return true;
 }
 
@@ -2261,42 +3495,116 @@ out:
 
 void suspend_stratum(struct pool *pool)
 {
+	close_submit_conns(pool);
 	clear_sockbuf(pool);
 	applog(LOG_INFO, "Closing socket for stratum pool %d", pool->pool_no);
 
 	mutex_lock(&pool->stratum_lock);
 	pool->stratum_active = pool->stratum_notify = false;
+	clear_stratum_sendq(pool);
 	if (pool->sock)
 		CLOSESOCKET(pool->sock);
 	pool->sock = 0;
 	mutex_unlock(&pool->stratum_lock);
 }
 
+/* The BIP320 general purpose version bits miners may use freely */
+#define VERSION_ROLL_MASK 0x1fffe000
+
+/* Negotiate BIP310 version rolling. Sent as the first request of the session
+ * before mining.subscribe; pools that do not understand mining.configure
+ * reply with an error or nothing at all and we proceed without rolling. The
+ * negotiated mask lands in pool->vmask and is carried into each work item so
+ * devices know which header version bits they may roll. */
+static void configure_stratum(struct pool *pool)
+{
+	json_t *val = NULL, *res_val, *mask_val;
+	char s[RBUFSIZE], *sret;
+	uint32_t mask = 0;
+	json_error_t err;
+
+	sprintf(s, "{\"id\": %d, \"method\": \"mining.configure\", \"params\": "
+		"[[\"version-rolling\"], {\"version-rolling.mask\": \"%08x\", "
+		"\"version-rolling.min-bit-count\": 2}]}",
+		__sync_fetch_and_add(&swork_id, 1), VERSION_ROLL_MASK);
+	if (__stratum_send(pool, s, strlen(s)) != SEND_OK) {
+		applog(LOG_DEBUG, "Failed to send mining.configure");
+		goto out;
+	}
+	if (!socket_full(pool, DEFAULT_SOCKWAIT)) {
+		applog(LOG_DEBUG, "Pool %d timed out waiting for mining.configure response",
+		       pool->pool_no);
+		goto out;
+	}
+	sret = recv_line(pool);
+	if (!sret)
+		goto out;
+	val = JSON_LOADS(sret, &err);
+	if (!val) {
+		applog(LOG_INFO, "JSON decode of mining.configure failed(%d): %s",
+		       err.line, err.text);
+		goto out;
+	}
+	res_val = json_object_get(val, "result");
+	if (res_val && json_is_true(json_object_get(res_val, "version-rolling"))) {
+		mask_val = json_object_get(res_val, "version-rolling.mask");
+		if (json_is_string(mask_val))
+			mask = strtoul(json_string_value(mask_val), NULL, 16);
+	}
+out:
+	/* Only bits we asked for are ever rolled even if the pool offers
+	 * more */
+	mask &= VERSION_ROLL_MASK;
+	cg_wlock(&pool->data_lock);
+	pool->vmask = mask;
+	cg_wunlock(&pool->data_lock);
+	if (mask)
+		applog(LOG_INFO, "Pool %d supports version rolling with mask %08x",
+		       pool->pool_no, mask);
+	if (val)
+		json_decref(val);
+}
+
 bool initiate_stratum(struct pool *pool)
 {
 	bool ret = false, recvd = false, noresume = false, sockd = false;
+	bool resuming = false, resumed = false, adopted = false;
 	char s[RBUFSIZE], *sret = NULL, *nonce1, *sessionid;
 	json_t *val = NULL, *res_val, *err_val;
 	json_error_t err;
 	int n2size;
 
 resend:
-	if (!setup_stratum_socket(pool)) {
+	adopted = false;
+	if (pool->handoff_sock) {
+		/* Socket adopted from a previous process across an exec
+		 * restart; resume the session on the live connection. Any
+		 * failure falls through to an ordinary reconnect as the
+		 * flag only stands for the first attempt. */
+		pool->handoff_sock = false;
+		adopted = true;
+	} else if (!setup_stratum_socket(pool)) {
 		sockd = false;
 		goto out;
 	}
 
 	sockd = true;
 
+	/* An adopted socket is mid-session so cannot renegotiate */
+	if (!adopted)
+		configure_stratum(pool);
+
 	if (recvd) {
 		/* Get rid of any crap lying around if we're resending */
 		clear_sock(pool);
-		sprintf(s, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": []}", swork_id++);
+		resuming = false;
+		sprintf(s, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": []}", __sync_fetch_and_add(&swork_id, 1));
 	} else {
-		if (pool->sessionid)
-			sprintf(s, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": [\""PACKAGE"/"VERSION"\", \"%s\"]}", swork_id++, pool->sessionid);
-		else
-			sprintf(s, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": [\""PACKAGE"/"VERSION"\"]}", swork_id++);
+		if (pool->sessionid) {
+			resuming = true;
+			sprintf(s, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": [\""PACKAGE"/"VERSION"\", \"%s\"]}", __sync_fetch_and_add(&swork_id, 1), pool->sessionid);
+		} else
+			sprintf(s, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": [\""PACKAGE"/"VERSION"\"]}", __sync_fetch_and_add(&swork_id, 1));
 	}
 
 	if (__stratum_send(pool, s, strlen(s)) != SEND_OK) {
@@ -2316,7 +3624,6 @@ resend:
 	recvd = true;
 
 	val = JSON_LOADS(sret, &err);
-	free(sret);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
 		goto out;
@@ -2359,7 +3666,20 @@ resend:
 	}
 
 	cg_wlock(&pool->data_lock);
-	pool->sessionid = sessionid;
+	/* A successful resume echoes the same session and extranonce, which
+	 * means every job issued before the drop is still valid */
+	if (resuming && pool->nonce1 && !strcmp(nonce1, pool->nonce1) &&
+	    n2size == pool->n2size &&
+	    (!sessionid || (pool->sessionid && !strcmp(sessionid, pool->sessionid))))
+		resumed = true;
+	if (sessionid) {
+		free(pool->sessionid);
+		pool->sessionid = sessionid;
+	} else if (!resumed) {
+		free(pool->sessionid);
+		pool->sessionid = NULL;
+	}
+	free(pool->nonce1);
 	pool->nonce1 = nonce1;
 	pool->n1_len = strlen(nonce1) / 2;
 	free(pool->nonce1bin);
@@ -2379,11 +3699,16 @@ out:
 		if (!pool->stratum_url)
 			pool->stratum_url = pool->sockaddr_url;
 		pool->stratum_active = true;
-		pool->swork.diff = 1;
-		if (opt_protocol) {
-			applog(LOG_DEBUG, "Pool %d confirmed mining.subscribe with extranonce1 %s extran2size %d",
-			       pool->pool_no, pool->nonce1, pool->n2size);
-		}
+		if (resumed && pool->swork.job_id) {
+			/* Carry on hashing the cached job and diff straight
+			 * away instead of idling until the next notify */
+			pool->stratum_notify = true;
+			applog(LOG_INFO, "Pool %d resumed stratum session on cached job",
+			       pool->pool_no);
+		} else
+			pool->swork.diff = 1;
+		PROTO_DUMP("Pool %d confirmed mining.subscribe with extranonce1 %s extran2size %d",
+			   pool->pool_no, pool->nonce1, pool->n2size);
 	} else {
 		if (recvd && !noresume) {
 			/* Reset the sessionid used for stratum resuming in case the pool
@@ -2420,6 +3745,234 @@ bool restart_stratum(struct pool *pool)
 	return true;
 }
 
+/* Receive one newline terminated line from a submit connection, waiting up
+ * to wait_secs for data. Returns a malloced line without its newline, or
+ * NULL when none completes in time; the connection is marked inactive on
+ * any receive failure. */
+char *submit_conn_recv_line(struct submit_conn *sc, int wait_secs)
+{
+	char *nl, *ret;
+	ssize_t n;
+
+	while (42) {
+		nl = memchr(sc->buf, '\n', sc->len);
+		if (nl) {
+			int linelen = nl - sc->buf;
+
+			ret = malloc(linelen + 1);
+			if (unlikely(!ret))
+				quithere(1, "Failed to malloc submit conn line");
+			memcpy(ret, sc->buf, linelen);
+			ret[linelen] = '\0';
+			sc->len -= linelen + 1;
+			memmove(sc->buf, nl + 1, sc->len);
+			return ret;
+		}
+		if (sc->len == sizeof(sc->buf)) {
+			/* An overlong line can only be garbage */
+			applog(LOG_INFO, "Overlong line on submit connection");
+			break;
+		}
+		{
+			struct timeval timeout = {wait_secs, 0};
+			fd_set rd;
+
+			FD_ZERO(&rd);
+			FD_SET(sc->sock, &rd);
+			if (select(sc->sock + 1, &rd, NULL, NULL, &timeout) < 1)
+				return NULL;
+		}
+		n = recv(sc->sock, sc->buf + sc->len, sizeof(sc->buf) - sc->len, 0);
+		if (n < 1) {
+			if (n < 0 && sock_blocks())
+				continue;
+			break;
+		}
+		sc->len += n;
+	}
+	sc->active = false;
+	return NULL;
+}
+
+void close_submit_conns(struct pool *pool)
+{
+	int i;
+
+	mutex_lock(&pool->stratum_lock);
+	for (i = 0; i < MAX_SUBMIT_CONNS - 1; i++) {
+		struct submit_conn *sc = &pool->subconns[i];
+
+		if (sc->sock)
+			CLOSESOCKET(sc->sock);
+		sc->sock = 0;
+		sc->len = 0;
+		sc->active = false;
+	}
+	pool->subconn_count = 0;
+	mutex_unlock(&pool->stratum_lock);
+}
+
+/* Open the extra authenticated submit sessions for --submit-conns. Each
+ * resumes the primary session via its sessionid so the pool hands back the
+ * same extranonce1 and shares built against the primary session are valid
+ * submitted on any of them; a pool without session resume gets no extra
+ * connections since its shares would be judged against the wrong
+ * extranonce. Called after each successful authorisation; the lot is closed
+ * again whenever the primary connection is suspended. */
+void open_submit_conns(struct pool *pool)
+{
+	char s[RBUFSIZE], *sret;
+	int i, opened = 0;
+
+	if (opt_submit_conns <= 1 || pool->removed)
+		return;
+
+	close_submit_conns(pool);
+
+	cg_rlock(&pool->data_lock);
+	if (!pool->sessionid) {
+		cg_runlock(&pool->data_lock);
+		if (!pool->subconn_warned) {
+			applog(LOG_NOTICE, "Pool %d does not support session resume, cannot open extra submit connections",
+			       pool->pool_no);
+			pool->subconn_warned = true;
+		}
+		return;
+	}
+	cg_runlock(&pool->data_lock);
+
+	for (i = 0; i < opt_submit_conns - 1; i++) {
+		struct submit_conn *sc = &pool->subconns[i];
+		json_error_t err;
+		bool ok = false;
+		char *nonce1;
+		json_t *val;
+		int sockd;
+
+		sockd = stratum_connect_sock(pool);
+		if (sockd == -1)
+			break;
+		sc->sock = sockd;
+		sc->len = 0;
+		sc->active = true;
+
+		cg_rlock(&pool->data_lock);
+		snprintf(s, sizeof(s) - 1, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": [\""PACKAGE"/"VERSION"\", \"%s\"]}",
+			 __sync_fetch_and_add(&swork_id, 1), pool->sessionid);
+		cg_runlock(&pool->data_lock);
+		if (__stratum_send_sock(sockd, s, strlen(s)) != SEND_OK)
+			goto out_close;
+		sret = submit_conn_recv_line(sc, DEFAULT_SOCKWAIT);
+		if (!sret)
+			goto out_close;
+		val = JSON_LOADS(sret, &err);
+		free(sret);
+		if (!val)
+			goto out_close;
+		nonce1 = json_array_string(json_object_get(val, "result"), 1);
+		cg_rlock(&pool->data_lock);
+		if (nonce1 && pool->nonce1 && !strcmp(nonce1, pool->nonce1))
+			ok = true;
+		cg_runlock(&pool->data_lock);
+		free(nonce1);
+		json_decref(val);
+		if (!ok) {
+			if (!pool->subconn_warned) {
+				applog(LOG_NOTICE, "Pool %d did not resume our session on an extra connection, disabling extra submit connections",
+				       pool->pool_no);
+				pool->subconn_warned = true;
+			}
+			goto out_close;
+		}
+
+		/* Authorise the session - shares are only credited on an
+		 * authorised connection */
+		ok = false;
+		snprintf(s, sizeof(s) - 1, "{\"id\": %d, \"method\": \"mining.authorize\", \"params\": [\"%s\", \"%s\"]}",
+			 __sync_fetch_and_add(&swork_id, 1), pool->rpc_user, pool->rpc_pass);
+		if (__stratum_send_sock(sockd, s, strlen(s)) != SEND_OK)
+			goto out_close;
+		/* Skip any notifications the resumed session pushes first */
+		while ((sret = submit_conn_recv_line(sc, DEFAULT_SOCKWAIT))) {
+			bool method = strstr(sret, "\"method\"") != NULL;
+
+			if (method) {
+				free(sret);
+				continue;
+			}
+			val = JSON_LOADS(sret, &err);
+			free(sret);
+			if (val) {
+				json_t *res_val = json_object_get(val, "result");
+
+				ok = res_val && !json_is_false(res_val) &&
+				     !json_is_null(res_val);
+				json_decref(val);
+			}
+			break;
+		}
+out_close:
+		if (!ok) {
+			CLOSESOCKET(sc->sock);
+			sc->sock = 0;
+			sc->active = false;
+			break;
+		}
+		opened++;
+	}
+
+	mutex_lock(&pool->stratum_lock);
+	pool->subconn_count = opened;
+	mutex_unlock(&pool->stratum_lock);
+	if (opened)
+		applog(LOG_NOTICE, "Pool %d opened %d extra submit connection%s",
+		       pool->pool_no, opened, opened > 1 ? "s" : "");
+}
+
+/* Send a submit batch on one of the pool's stratum connections, sharded by
+ * share id so a TCP stall on any one connection only delays its own shard.
+ * Anything that cannot go out on an extra connection falls back to the
+ * primary, so a lost connection only costs its parallelism. */
+bool stratum_send_shard(struct pool *pool, char *s, ssize_t len, int id)
+{
+	enum send_ret ret = SEND_INACTIVE;
+	struct submit_conn *sc = NULL;
+	int slot, nconns;
+
+	mutex_lock(&pool->stratum_lock);
+	nconns = pool->subconn_count;
+	if (nconns && pool->stratum_active) {
+		slot = id % (nconns + 1);
+		if (slot && pool->subconns[slot - 1].active)
+			sc = &pool->subconns[slot - 1];
+	}
+	if (sc) {
+		ret = __stratum_send_sock(sc->sock, s, len);
+		if (ret == SEND_OK) {
+			ssize_t ssent = strlen(s);
+
+			pool->cgminer_pool_stats.times_sent++;
+			pool->cgminer_pool_stats.bytes_sent += ssent;
+			pool->cgminer_pool_stats.net_bytes_sent += ssent;
+		} else {
+			/* Drop the failed connection; it is reopened with
+			 * the next authorisation */
+			CLOSESOCKET(sc->sock);
+			sc->sock = 0;
+			sc->active = false;
+		}
+	}
+	mutex_unlock(&pool->stratum_lock);
+	if (ret == SEND_OK) {
+		PROTO_DUMP("SEND: %s", s);
+		return true;
+	}
+	if (sc)
+		applog(LOG_INFO, "Pool %d extra submit connection failed, falling back to primary",
+		       pool->pool_no);
+	return stratum_send_class(pool, s, len, SMSG_SHARE);
+}
+
 void dev_error(struct cgpu_info *dev, enum dev_reason reason)
 {
 	dev->device_last_not_well = time(NULL);
@@ -2529,6 +4082,39 @@ void RenameThread(const char* name)
 #endif
 }
 
+/* Pin the calling thread to the taskset style hex cpu mask given, silently
+ * doing nothing when no mask was configured. Called at the top of a thread
+ * before it allocates its buffers so first-touch page placement keeps them
+ * local to the node the thread is pinned to. */
+void bind_affinity(const char *mask)
+{
+#ifdef __linux
+	cpu_set_t set;
+	unsigned long long bits;
+	char *endp;
+	int cpu;
+
+	if (!mask)
+		return;
+	bits = strtoull(mask, &endp, 16);
+	if (endp == mask || *endp || !bits) {
+		applog(LOG_WARNING, "Invalid cpu affinity mask \"%s\" ignored", mask);
+		return;
+	}
+	CPU_ZERO(&set);
+	for (cpu = 0; cpu < 64; cpu++) {
+		if (bits & (1ULL << cpu))
+			CPU_SET(cpu, &set);
+	}
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+		applog(LOG_WARNING, "Failed to bind thread to cpu mask %s", mask);
+	else
+		applog(LOG_DEBUG, "Bound thread to cpu mask %s", mask);
+#else
+	(void)mask;
+#endif
+}
+
 /* cgminer specific wrappers for true unnamed semaphore usage on platforms
  * that support them and for apple which does not. We use a single byte across
  * a pipe to emulate semaphore behaviour there. */
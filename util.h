@@ -63,6 +63,41 @@
 #ifdef HAVE_LIBCURL
 #include <curl/curl.h>
 typedef curl_proxytype proxytypes_t;
+
+struct data_buffer {
+	void		*buf;
+	size_t		len;
+};
+
+struct upload_buffer {
+	const void	*buf;
+	size_t		len;
+};
+
+struct header_info {
+	char		*lp_path;
+	int		rolltime;
+	char		*reason;
+	char		*stratum_url;
+	bool		hadrolltime;
+	bool		canroll;
+	bool		hadexpire;
+};
+
+/* Per-request state of a json rpc call, held by the caller so that requests
+ * can be driven asynchronously off a curl multi handle as well as by the
+ * blocking json_rpc_call. */
+struct json_rpc_req {
+	struct data_buffer all_data;
+	struct upload_buffer upload_data;
+	struct header_info hi;
+	struct curl_slist *headers;
+	char curl_err_str[CURL_ERROR_SIZE];
+	bool probing;
+	/* Leave the handle configured for this pool on success so the next
+	 * share on it skips the constant option setup */
+	struct pool *keep_pool;
+};
 #else
 typedef int proxytypes_t;
 #endif /* HAVE_LIBCURL */
@@ -71,6 +106,10 @@ typedef int proxytypes_t;
 struct cglock {
 	pthread_mutex_t mutex;
 	pthread_rwlock_t rwlock;
+	/* Bumped to odd on write lock and even on write unlock, giving
+	 * readers of read-mostly data a seqlock retry path via
+	 * cg_seq_begin/cg_seq_retry that never writes the lock */
+	unsigned int seq;
 };
 
 typedef struct cglock cglock_t;
@@ -121,19 +160,38 @@ void cgtimer_sub(cgtimer_t *a, cgtimer_t *b, cgtimer_t *res);
 double us_tdiff(struct timeval *end, struct timeval *start);
 int ms_tdiff(struct timeval *end, struct timeval *start);
 double tdiff(struct timeval *end, struct timeval *start);
+/* Classes of outgoing stratum traffic, in drain order. Share submits must
+ * never wait behind protocol control or telemetry on the same socket. */
+enum smsg_class {
+	SMSG_SHARE = 0,
+	SMSG_CTRL,
+	SMSG_TELEM,
+	SMSG_CLASSES
+};
+
+struct submit_conn;
 bool stratum_send(struct pool *pool, char *s, ssize_t len);
+bool stratum_send_class(struct pool *pool, char *s, ssize_t len, enum smsg_class cls);
+bool stratum_flush_sendq(struct pool *pool);
+bool stratum_send_shard(struct pool *pool, char *s, ssize_t len, int id);
+void open_submit_conns(struct pool *pool);
+void close_submit_conns(struct pool *pool);
+char *submit_conn_recv_line(struct submit_conn *sc, int wait_secs);
 bool sock_full(struct pool *pool);
 char *recv_line(struct pool *pool);
+char *recv_line_to(struct pool *pool, int sockwait);
 bool parse_method(struct pool *pool, char *s);
 bool extract_sockaddr(char *url, char **sockaddr_url, char **sockaddr_port);
 bool auth_stratum(struct pool *pool);
 bool initiate_stratum(struct pool *pool);
 bool restart_stratum(struct pool *pool);
+void suggest_difficulty(struct pool *pool, double diff);
 void suspend_stratum(struct pool *pool);
 void dev_error(struct cgpu_info *dev, enum dev_reason reason);
 void *realloc_strcat(char *ptr, char *s);
 void *str_text(char *ptr);
 void RenameThread(const char* name);
+void bind_affinity(const char *mask);
 void _cgsem_init(cgsem_t *cgsem, const char *file, const char *func, const int line);
 void _cgsem_post(cgsem_t *cgsem, const char *file, const char *func, const int line);
 void _cgsem_wait(cgsem_t *cgsem, const char *file, const char *func, const int line);